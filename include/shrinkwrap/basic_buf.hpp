@@ -0,0 +1,293 @@
+#ifndef SHRINKWRAP_BASIC_BUF_HPP
+#define SHRINKWRAP_BASIC_BUF_HPP
+
+#include <cstdint>
+#include <stdio.h>
+#include <streambuf>
+#include <utility>
+
+#include "memory.hpp"
+
+namespace shrinkwrap
+{
+  namespace detail
+  {
+    // Block from a memory_resource whose size is a compile-time constant. Moving
+    // it hands over the memory, so get and put area pointers into it stay valid.
+    template <std::size_t N>
+    class fixed_buffer
+    {
+    public:
+      fixed_buffer(memory_resource* resource = nullptr)
+        :
+        resource_(resource ? resource : new_delete_resource()),
+        data_(N ? static_cast<std::uint8_t*>(resource_->allocate(N)) : nullptr)
+      {
+        if (N && !data_)
+          throw std::bad_alloc();
+      }
+
+      fixed_buffer(const fixed_buffer&) = delete;
+      fixed_buffer& operator=(const fixed_buffer&) = delete;
+
+      fixed_buffer(fixed_buffer&& src)
+        :
+        resource_(src.resource_),
+        data_(src.data_)
+      {
+        src.data_ = nullptr;
+      }
+
+      fixed_buffer& operator=(fixed_buffer&& src)
+      {
+        if (&src != this)
+        {
+          release();
+          resource_ = src.resource_;
+          data_ = src.data_;
+          src.data_ = nullptr;
+        }
+        return *this;
+      }
+
+      ~fixed_buffer()
+      {
+        release();
+      }
+
+      std::uint8_t* data() { return data_; }
+      const std::uint8_t* data() const { return data_; }
+      static constexpr std::size_t size() { return N; }
+      std::uint8_t& operator[](std::size_t i) { return data_[i]; }
+
+    private:
+      void release()
+      {
+        if (data_)
+          resource_->deallocate(data_, N);
+        data_ = nullptr;
+      }
+
+      memory_resource* resource_;
+      std::uint8_t* data_;
+    };
+  }
+
+  // Get area, file and buffer handling shared by the decompressing stream
+  // buffers. Codec is the derived class (CRTP) and must provide:
+  //
+  //   bool decodable();     // more output may follow
+  //   std::size_t decode(); // decodes into decompressed_buffer_, returns the byte count
+  //   bool good() const;    // no decoding error so far
+  //
+  // The calls are resolved at compile time and inline into underflow(). The
+  // codec releases its own state in its destructor; the file is closed here.
+  // Both buffers come from the given memory_resource, or the heap if null.
+  template <typename Codec, std::size_t CompressedSize, std::size_t DecompressedSize>
+  class basic_ibuf : public std::streambuf
+  {
+  public:
+    virtual ~basic_ibuf()
+    {
+      if (fp_)
+        fclose(fp_);
+    }
+
+  protected:
+    basic_ibuf(FILE* fp, memory_resource* resource = nullptr)
+      :
+      compressed_buffer_(resource),
+      decompressed_buffer_(resource),
+      fp_(fp),
+      discard_amount_(0)
+    {
+      reset_get_area();
+    }
+
+#if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
+    basic_ibuf(basic_ibuf&& src)
+      :
+      std::streambuf(std::move(src)),
+      compressed_buffer_(std::move(src.compressed_buffer_)),
+      decompressed_buffer_(std::move(src.decompressed_buffer_)),
+      fp_(src.fp_),
+      discard_amount_(src.discard_amount_)
+    {
+      src.fp_ = nullptr;
+    }
+
+    // The codec releases its own state before calling this.
+    basic_ibuf& operator=(basic_ibuf&& src)
+    {
+      std::streambuf::operator=(std::move(src));
+      if (fp_)
+        fclose(fp_);
+      compressed_buffer_ = std::move(src.compressed_buffer_);
+      decompressed_buffer_ = std::move(src.decompressed_buffer_);
+      fp_ = src.fp_;
+      src.fp_ = nullptr;
+      discard_amount_ = src.discard_amount_;
+      return *this;
+    }
+#endif
+
+    // Drops what is left of the get area, e.g. after seeking.
+    void reset_get_area()
+    {
+      char* end = egptr();
+      if (!end)
+        end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
+      setg(end, end, end);
+    }
+
+    virtual std::streambuf::int_type underflow()
+    {
+      if (!fp_)
+        return traits_type::eof();
+      if (gptr() < egptr()) // buffer not exhausted
+        return traits_type::to_int_type(*gptr());
+
+      Codec& codec = static_cast<Codec&>(*this);
+      while (gptr() >= egptr() && codec.decodable())
+      {
+        char* start = ((char*) decompressed_buffer_.data());
+        setg(start, start, start + codec.decode());
+
+        if (discard_amount_ > 0)
+        {
+          std::uint64_t advance_amount = discard_amount_;
+          if (std::uint64_t(egptr() - gptr()) < advance_amount)
+            advance_amount = (egptr() - gptr());
+          setg(start, gptr() + advance_amount, egptr());
+          discard_amount_ -= advance_amount;
+        }
+      }
+
+      if (!codec.good() || gptr() >= egptr())
+        return traits_type::eof();
+
+      return traits_type::to_int_type(*gptr());
+    }
+
+  protected:
+    detail::fixed_buffer<CompressedSize> compressed_buffer_;
+    detail::fixed_buffer<DecompressedSize> decompressed_buffer_;
+    FILE* fp_;
+    std::uint64_t discard_amount_; // decoded bytes to drop before the get area, set by seeks.
+  };
+
+  // Put area, file and buffer handling shared by the compressing stream
+  // buffers. Codec is the derived class (CRTP) and must provide:
+  //
+  //   bool encode(std::uint8_t* data, std::size_t size, bool flush);
+  //
+  // which compresses and writes size bytes of decompressed_buffer_. flush is
+  // set by sync() and clear when the put area filled; codecs map the two onto
+  // their on_flush and on_buffer_full flush_mode options. The codec finishes
+  // its stream and closes the file in its own destructor; the file is only
+  // closed here if the codec has not done so.
+  // Both buffers come from the given memory_resource, or the heap if null.
+  template <typename Codec, std::size_t CompressedSize, std::size_t DecompressedSize>
+  class basic_obuf : public std::streambuf
+  {
+  public:
+    virtual ~basic_obuf()
+    {
+      if (fp_)
+        fclose(fp_);
+    }
+
+  protected:
+    basic_obuf(FILE* fp, memory_resource* resource = nullptr)
+      :
+      compressed_buffer_(resource),
+      decompressed_buffer_(resource),
+      fp_(fp)
+    {
+      if (fp_)
+      {
+        reset_put_area();
+      }
+      else
+      {
+        char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
+        setp(end, end);
+      }
+    }
+
+#if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
+    basic_obuf(basic_obuf&& src)
+      :
+      std::streambuf(std::move(src)),
+      compressed_buffer_(std::move(src.compressed_buffer_)),
+      decompressed_buffer_(std::move(src.decompressed_buffer_)),
+      fp_(src.fp_)
+    {
+      src.fp_ = nullptr;
+    }
+
+    // The codec finishes its own stream before calling this.
+    basic_obuf& operator=(basic_obuf&& src)
+    {
+      std::streambuf::operator=(std::move(src));
+      if (fp_)
+        fclose(fp_);
+      compressed_buffer_ = std::move(src.compressed_buffer_);
+      decompressed_buffer_ = std::move(src.decompressed_buffer_);
+      fp_ = src.fp_;
+      src.fp_ = nullptr;
+      return *this;
+    }
+#endif
+
+    // Bytes written to the put area but not yet handed to the codec.
+    std::size_t pending() const
+    {
+      return static_cast<std::size_t>(pptr() - (const char*) decompressed_buffer_.data());
+    }
+
+    void reset_put_area()
+    {
+      setp((char*) decompressed_buffer_.data(), (char*) decompressed_buffer_.data() + decompressed_buffer_.size());
+    }
+
+    virtual int overflow(int c)
+    {
+      if (!fp_)
+        return traits_type::eof();
+
+      if (!static_cast<Codec&>(*this).encode(decompressed_buffer_.data(), pending(), false))
+        return traits_type::eof();
+
+      reset_put_area();
+      if (!traits_type::eq_int_type(c, traits_type::eof()))
+      {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+      }
+      return traits_type::not_eof(c);
+    }
+
+    virtual int sync()
+    {
+      if (!fp_)
+        return -1;
+
+      if (pending())
+      {
+        if (!static_cast<Codec&>(*this).encode(decompressed_buffer_.data(), pending(), true))
+          return -1;
+        reset_put_area();
+      }
+
+      return fflush(fp_) == 0 ? 0 : -1;
+    }
+
+  protected:
+    detail::fixed_buffer<CompressedSize> compressed_buffer_;
+    detail::fixed_buffer<DecompressedSize> decompressed_buffer_;
+    FILE* fp_;
+  };
+}
+
+#endif //SHRINKWRAP_BASIC_BUF_HPP
@@ -0,0 +1,362 @@
+#ifndef SHRINKWRAP_BATCH_HPP
+#define SHRINKWRAP_BATCH_HPP
+
+#include "istream.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdio.h>
+
+namespace shrinkwrap
+{
+  struct buffer_ref
+  {
+    buffer_ref() : data(nullptr), size(0) {}
+    buffer_ref(const void* d, std::size_t s) : data(d), size(s) {}
+    const void* data;
+    std::size_t size;
+  };
+
+  struct batch_options : parallel_options
+  {
+  };
+
+  namespace detail
+  {
+    // Decodes whole in-memory gz, xz or zstd objects. One instance lives on each
+    // worker so that codec state is reset between items rather than reallocated.
+    class buffer_decoder
+    {
+    public:
+      buffer_decoder()
+        :
+        zstrm_(),
+        zlib_initialized_(false),
+        zstd_dctx_(nullptr),
+        lzma_strm_(LZMA_STREAM_INIT)
+      {
+      }
+
+      buffer_decoder(const buffer_decoder&) = delete;
+      buffer_decoder& operator=(const buffer_decoder&) = delete;
+
+      ~buffer_decoder()
+      {
+        if (zlib_initialized_)
+          inflateEnd(&zstrm_);
+        if (zstd_dctx_)
+          ZSTD_freeDCtx(zstd_dctx_);
+        lzma_end(&lzma_strm_);
+      }
+
+      // Output is written to out, which is resized to the decoded length. Existing
+      // capacity is reused.
+      bool decode(const std::uint8_t* data, std::size_t size, std::vector<char>& out)
+      {
+        out.clear();
+        switch (detect_format(data, size))
+        {
+          case format::gz:
+            return decode_gz(data, size, out);
+          case format::xz:
+            return decode_xz(data, size, out);
+          case format::zstd:
+            return decode_zstd(data, size, out);
+          default:
+            return false;
+        }
+      }
+
+    private:
+      static void grow(std::vector<char>& out, std::size_t used, std::size_t hint)
+      {
+        std::size_t new_size = std::max<std::size_t>(std::max(hint, out.size() * 2), used + min_growth);
+        out.resize(new_size);
+      }
+
+      bool decode_gz(const std::uint8_t* data, std::size_t size, std::vector<char>& out)
+      {
+        int res = Z_OK;
+        if (!zlib_initialized_)
+        {
+          res = inflateInit2(&zstrm_, 15 + 16);
+          if (res != Z_OK)
+            return false;
+          zlib_initialized_ = true;
+        }
+        else
+        {
+          res = inflateReset(&zstrm_);
+        }
+
+        // ISIZE of the last member is a good guess for single member files. It
+        // is capped by deflate's maximum ratio in case the trailer is missing.
+        std::size_t hint = size;
+        if (size >= 18)
+        {
+          hint = std::size_t(data[size - 4]) | (std::size_t(data[size - 3]) << 8) | (std::size_t(data[size - 2]) << 16) | (std::size_t(data[size - 1]) << 24);
+          hint = std::min(hint, size * 1032);
+        }
+
+        std::size_t used = 0;
+        grow(out, used, hint);
+
+        // avail_in is 32 bits wide, so larger inputs are fed in pieces.
+        zstrm_.next_in = const_cast<std::uint8_t*>(data);
+        zstrm_.avail_in = 0;
+        std::size_t remaining = size;
+        while (res == Z_OK)
+        {
+          if (zstrm_.avail_in == 0 && remaining > 0)
+          {
+            zstrm_.avail_in = static_cast<std::uint32_t>(std::min<std::size_t>(remaining, std::numeric_limits<std::uint32_t>::max()));
+            remaining -= zstrm_.avail_in;
+          }
+          if (used == out.size())
+            grow(out, used, 0);
+          zstrm_.next_out = reinterpret_cast<std::uint8_t*>(&out[used]);
+          zstrm_.avail_out = static_cast<std::uint32_t>(std::min<std::size_t>(out.size() - used, std::numeric_limits<std::uint32_t>::max()));
+          std::uint32_t avail_out = zstrm_.avail_out;
+
+          res = inflate(&zstrm_, Z_NO_FLUSH);
+          used += avail_out - zstrm_.avail_out;
+
+          if (res == Z_STREAM_END && (zstrm_.avail_in > 0 || remaining > 0))
+            res = inflateReset(&zstrm_); // next member
+          else if (res == Z_OK && zstrm_.avail_in == 0 && remaining == 0 && zstrm_.avail_out > 0)
+            break; // truncated input
+        }
+
+        out.resize(used);
+        return res == Z_STREAM_END;
+      }
+
+      bool decode_xz(const std::uint8_t* data, std::size_t size, std::vector<char>& out)
+      {
+        // Re-initializing an existing lzma_stream reuses its coder memory.
+        if (lzma_stream_decoder(&lzma_strm_, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+          return false;
+
+        std::size_t used = 0;
+        grow(out, used, size * 4);
+
+        lzma_strm_.next_in = data;
+        lzma_strm_.avail_in = size;
+        lzma_ret res = LZMA_OK;
+        while (res == LZMA_OK)
+        {
+          if (used == out.size())
+            grow(out, used, 0);
+          lzma_strm_.next_out = reinterpret_cast<std::uint8_t*>(&out[used]);
+          lzma_strm_.avail_out = out.size() - used;
+          std::size_t avail_out = lzma_strm_.avail_out;
+
+          res = lzma_code(&lzma_strm_, LZMA_FINISH);
+          used += avail_out - lzma_strm_.avail_out;
+        }
+
+        out.resize(used);
+        return res == LZMA_STREAM_END;
+      }
+
+      bool decode_zstd(const std::uint8_t* data, std::size_t size, std::vector<char>& out)
+      {
+        if (!zstd_dctx_)
+        {
+          zstd_dctx_ = ZSTD_createDCtx();
+          if (!zstd_dctx_)
+            return false;
+        }
+
+        // The content size of the first frame is a good guess, but it is capped
+        // by what the frame's blocks can hold in case the header is corrupt.
+        ZSTD_frameHeader frame_header;
+        std::size_t hint = size * 4;
+        if (ZSTD_getFrameHeader(&frame_header, data, size) == 0 && frame_header.frameContentSize != ZSTD_CONTENTSIZE_UNKNOWN)
+          hint = static_cast<std::size_t>(std::min<std::uint64_t>(frame_header.frameContentSize, detail::zstd_frame_block_bound(data, size, frame_header)));
+
+        std::size_t used = 0;
+        grow(out, used, hint);
+
+        ZSTD_inBuffer input = {data, size, 0};
+        std::size_t res = 0;
+        while (res != 0 || input.pos < input.size)
+        {
+          if (res == 0)
+          {
+            res = ZSTD_initDStream(zstd_dctx_); // start of next frame
+            if (ZSTD_isError(res))
+              return false;
+          }
+
+          if (used == out.size())
+            grow(out, used, 0);
+          ZSTD_outBuffer output = {&out[used], out.size() - used, 0};
+          res = ZSTD_decompressStream(zstd_dctx_, &output, &input);
+          if (ZSTD_isError(res))
+            return false;
+          used += output.pos;
+
+          if (res != 0 && input.pos == input.size && output.pos < output.size)
+            break; // truncated input
+        }
+
+        out.resize(used);
+        return res == 0;
+      }
+
+    private:
+      static const std::size_t min_growth = 64 * 1024;
+      z_stream zstrm_;
+      bool zlib_initialized_;
+      ZSTD_DCtx* zstd_dctx_;
+      lzma_stream lzma_strm_;
+    };
+
+    inline bool read_file(const std::string& file_path, std::vector<std::uint8_t>& dest)
+    {
+      FILE* fp = fopen(file_path.c_str(), "rb");
+      if (!fp)
+        return false;
+
+      bool ret = false;
+      if (fseek(fp, 0, SEEK_END) == 0)
+      {
+        long file_size = ftell(fp);
+        if (file_size >= 0 && fseek(fp, 0, SEEK_SET) == 0)
+        {
+          dest.resize(static_cast<std::size_t>(file_size));
+          ret = (file_size == 0 || fread(dest.data(), dest.size(), 1, fp) == 1);
+        }
+      }
+
+      fclose(fp);
+      return ret;
+    }
+
+    struct batch_worker
+    {
+      buffer_decoder decoder;
+      std::vector<std::uint8_t> file_contents;
+      std::vector<char> scratch;
+    };
+
+    template <typename LoadFn, typename DoneFn>
+    void run_batch(std::size_t item_count, LoadFn load, DoneFn& done, const batch_options& opts)
+    {
+      parallel_for_each<batch_worker>(item_count, opts, [&load, &done](batch_worker& w, std::size_t i)
+      {
+        buffer_ref input;
+        bool ok = load(i, w.file_contents, input);
+        std::vector<char>& dest = done.output(i, w.scratch);
+        ok = ok && w.decoder.decode(static_cast<const std::uint8_t*>(input.data), input.size, dest);
+        done(i, dest, ok);
+      });
+    }
+
+    class path_loader
+    {
+    public:
+      path_loader(const std::vector<std::string>& paths) : paths_(paths) {}
+      bool operator()(std::size_t i, std::vector<std::uint8_t>& file_contents, buffer_ref& dest) const
+      {
+        bool ret = read_file(paths_[i], file_contents);
+        dest = buffer_ref(file_contents.data(), ret ? file_contents.size() : 0);
+        return ret;
+      }
+    private:
+      const std::vector<std::string>& paths_;
+    };
+
+    class buffer_loader
+    {
+    public:
+      buffer_loader(const std::vector<buffer_ref>& buffers) : buffers_(buffers) {}
+      bool operator()(std::size_t i, std::vector<std::uint8_t>&, buffer_ref& dest) const
+      {
+        dest = buffers_[i];
+        return true;
+      }
+    private:
+      const std::vector<buffer_ref>& buffers_;
+    };
+
+    template <typename Callback>
+    class callback_sink
+    {
+    public:
+      callback_sink(Callback& cb) : cb_(cb) {}
+      std::vector<char>& output(std::size_t, std::vector<char>& scratch) { return scratch; }
+      void operator()(std::size_t i, const std::vector<char>& decoded, bool ok)
+      {
+        cb_(i, decoded.data(), decoded.size(), ok);
+      }
+    private:
+      Callback& cb_;
+    };
+
+    class vector_sink
+    {
+    public:
+      vector_sink(std::vector<std::vector<char>>& outputs, std::vector<std::size_t>& failures)
+        : outputs_(outputs), failures_(failures) {}
+      std::vector<char>& output(std::size_t i, std::vector<char>&) { return outputs_[i]; }
+      void operator()(std::size_t i, std::vector<char>& decoded, bool ok)
+      {
+        if (!ok)
+        {
+          decoded.clear();
+          std::unique_lock<std::mutex> lk(mutex_);
+          failures_.push_back(i);
+        }
+      }
+    private:
+      std::vector<std::vector<char>>& outputs_;
+      std::vector<std::size_t>& failures_;
+      std::mutex mutex_;
+    };
+  }
+
+  // Decompresses every file concurrently. cb(index, data, size, success) is invoked
+  // from worker threads, possibly concurrently and out of order. The data pointer
+  // is only valid for the duration of the call.
+  template <typename Callback>
+  void batch_decompress(const std::vector<std::string>& file_paths, Callback cb, const batch_options& opts = batch_options())
+  {
+    detail::callback_sink<Callback> sink(cb);
+    detail::run_batch(file_paths.size(), detail::path_loader(file_paths), sink, opts);
+  }
+
+  template <typename Callback>
+  void batch_decompress(const std::vector<buffer_ref>& buffers, Callback cb, const batch_options& opts = batch_options())
+  {
+    detail::callback_sink<Callback> sink(cb);
+    detail::run_batch(buffers.size(), detail::buffer_loader(buffers), sink, opts);
+  }
+
+  // Decompresses into outputs[i], reusing the capacity already reserved there.
+  // Returns the sorted indices of items that failed to decode.
+  inline std::vector<std::size_t> batch_decompress(const std::vector<std::string>& file_paths, std::vector<std::vector<char>>& outputs, const batch_options& opts = batch_options())
+  {
+    std::vector<std::size_t> failures;
+    outputs.resize(file_paths.size());
+    detail::vector_sink sink(outputs, failures);
+    detail::run_batch(file_paths.size(), detail::path_loader(file_paths), sink, opts);
+    std::sort(failures.begin(), failures.end());
+    return failures;
+  }
+
+  inline std::vector<std::size_t> batch_decompress(const std::vector<buffer_ref>& buffers, std::vector<std::vector<char>>& outputs, const batch_options& opts = batch_options())
+  {
+    std::vector<std::size_t> failures;
+    outputs.resize(buffers.size());
+    detail::vector_sink sink(outputs, failures);
+    detail::run_batch(buffers.size(), detail::buffer_loader(buffers), sink, opts);
+    std::sort(failures.begin(), failures.end());
+    return failures;
+  }
+}
+
+#endif //SHRINKWRAP_BATCH_HPP
@@ -0,0 +1,198 @@
+#ifndef SHRINKWRAP_BLOCK_DECODER_HPP
+#define SHRINKWRAP_BLOCK_DECODER_HPP
+
+#include "xz.hpp"
+#include "gz.hpp"
+#include "zstd.hpp"
+
+#include <stdlib.h>
+
+namespace shrinkwrap
+{
+  namespace detail
+  {
+    // The decoders below inflate a single independently decodable unit that is
+    // fully loaded in memory. Decoded data is handed to sink(const char*, std::size_t)
+    // in pieces no larger than the decoder's scratch buffer. Codec state is kept
+    // between calls so that a decoder can be reused for many units.
+
+    class bgzf_block_decoder
+    {
+    public:
+      bgzf_block_decoder(bool ignore_checks = false)
+        :
+        zstrm_(),
+        decompressed_buffer_(bgzf_max_block_size),
+        zlib_res_(inflateInit2(&zstrm_, -15)),
+        ignore_checks_(ignore_checks)
+      {
+      }
+
+      bgzf_block_decoder(const bgzf_block_decoder&) = delete;
+      bgzf_block_decoder& operator=(const bgzf_block_decoder&) = delete;
+
+      ~bgzf_block_decoder()
+      {
+        if (zlib_res_ == Z_OK)
+          inflateEnd(&zstrm_);
+      }
+
+      template <typename Sink>
+      bool decode(const std::uint8_t* data, std::size_t size, Sink& sink)
+      {
+        if (zlib_res_ != Z_OK || size < 18 + 8)
+          return false;
+
+        std::size_t header_size = 12 + (std::size_t(data[10]) | (std::size_t(data[11]) << 8));
+        if (header_size + 8 > size || inflateReset(&zstrm_) != Z_OK)
+          return false;
+
+        zstrm_.next_in = const_cast<std::uint8_t*>(data + header_size);
+        zstrm_.avail_in = static_cast<std::uint32_t>(size - header_size - 8);
+        zstrm_.next_out = decompressed_buffer_.data();
+        zstrm_.avail_out = static_cast<std::uint32_t>(decompressed_buffer_.size());
+        if (inflate(&zstrm_, Z_FINISH) != Z_STREAM_END)
+          return false;
+
+        const std::uint8_t* footer = data + size - 8;
+        std::uint32_t expected_crc = std::uint32_t(footer[0]) | (std::uint32_t(footer[1]) << 8) | (std::uint32_t(footer[2]) << 16) | (std::uint32_t(footer[3]) << 24);
+        std::uint32_t expected_size = std::uint32_t(footer[4]) | (std::uint32_t(footer[5]) << 8) | (std::uint32_t(footer[6]) << 16) | (std::uint32_t(footer[7]) << 24);
+        std::uint32_t decoded_size = static_cast<std::uint32_t>(decompressed_buffer_.size() - zstrm_.avail_out);
+        if (decoded_size != expected_size)
+          return false;
+
+        if (!ignore_checks_ && std::uint32_t(crc32(crc32(0L, Z_NULL, 0), decompressed_buffer_.data(), decoded_size)) != expected_crc)
+          return false;
+
+        sink((const char*) decompressed_buffer_.data(), std::size_t(decoded_size));
+        return true;
+      }
+
+    private:
+      static const std::size_t bgzf_max_block_size = 0x10000;
+      z_stream zstrm_;
+      std::vector<std::uint8_t> decompressed_buffer_;
+      int zlib_res_;
+      bool ignore_checks_;
+    };
+
+    class xz_block_decoder
+    {
+    public:
+      xz_block_decoder(bool ignore_checks = false)
+        :
+        strm_(LZMA_STREAM_INIT),
+        decompressed_buffer_(64 * 1024),
+        ignore_checks_(ignore_checks)
+      {
+      }
+
+      xz_block_decoder(const xz_block_decoder&) = delete;
+      xz_block_decoder& operator=(const xz_block_decoder&) = delete;
+
+      ~xz_block_decoder()
+      {
+        lzma_end(&strm_);
+      }
+
+      // data spans the block header, compressed data, padding and check.
+      template <typename Sink>
+      bool decode(const std::uint8_t* data, std::size_t size, lzma_check check, Sink& sink)
+      {
+        if (size == 0 || data[0] == 0x00)
+          return false;
+
+        lzma_block block;
+        block.version = 1;
+        block.check = check;
+        block.filters = filters_.data();
+        block.header_size = lzma_block_header_size_decode(data[0]);
+        const lzma_allocator* header_allocator = header_scratch_.allocator(nullptr);
+        if (block.header_size > size || lzma_block_header_decode(&block, header_allocator, data) != LZMA_OK)
+          return false;
+        block.ignore_check = ignore_checks_;
+
+        lzma_ret res = lzma_block_decoder(&strm_, &block);
+        for (std::size_t i = 0; filters_[i].id != LZMA_VLI_UNKNOWN; ++i)
+          xz::detail::free_with(header_allocator, filters_[i].options); // copied by the decoder.
+        if (res != LZMA_OK)
+          return false;
+
+        strm_.next_in = data + block.header_size;
+        strm_.avail_in = size - block.header_size;
+        while (res == LZMA_OK)
+        {
+          strm_.next_out = decompressed_buffer_.data();
+          strm_.avail_out = decompressed_buffer_.size();
+          res = lzma_code(&strm_, LZMA_RUN);
+          std::size_t decoded_size = decompressed_buffer_.size() - strm_.avail_out;
+          if (decoded_size)
+            sink((const char*) decompressed_buffer_.data(), decoded_size);
+          else if (res == LZMA_OK && strm_.avail_in == 0)
+            return false; // truncated block
+        }
+
+        return res == LZMA_STREAM_END;
+      }
+
+    private:
+      lzma_stream strm_;
+      std::array<lzma_filter, LZMA_FILTERS_MAX + 1> filters_;
+      xz::detail::header_scratch header_scratch_;
+      std::vector<std::uint8_t> decompressed_buffer_;
+      bool ignore_checks_;
+    };
+
+    class zstd_frame_decoder
+    {
+    public:
+      zstd_frame_decoder(bool ignore_checks = false)
+        :
+        dctx_(ZSTD_createDCtx()),
+        decompressed_buffer_(ZSTD_DStreamOutSize())
+      {
+#ifdef ZSTD_d_forceIgnoreChecksum
+        if (dctx_ && ignore_checks)
+          ZSTD_DCtx_setParameter(dctx_, ZSTD_d_forceIgnoreChecksum, ZSTD_d_ignoreChecksum);
+#endif
+      }
+
+      zstd_frame_decoder(const zstd_frame_decoder&) = delete;
+      zstd_frame_decoder& operator=(const zstd_frame_decoder&) = delete;
+
+      ~zstd_frame_decoder()
+      {
+        ZSTD_freeDCtx(dctx_);
+      }
+
+      template <typename Sink>
+      bool decode(const std::uint8_t* data, std::size_t size, Sink& sink)
+      {
+        if (!dctx_ || ZSTD_isError(ZSTD_initDStream(dctx_)))
+          return false;
+
+        ZSTD_inBuffer input = {data, size, 0};
+        std::size_t res = 1;
+        while (res != 0)
+        {
+          ZSTD_outBuffer output = {decompressed_buffer_.data(), decompressed_buffer_.size(), 0};
+          res = ZSTD_decompressStream(dctx_, &output, &input);
+          if (ZSTD_isError(res))
+            return false;
+          if (output.pos)
+            sink((const char*) decompressed_buffer_.data(), output.pos);
+          else if (res != 0 && input.pos == input.size)
+            return false; // truncated frame
+        }
+
+        return input.pos == input.size;
+      }
+
+    private:
+      ZSTD_DCtx* dctx_;
+      std::vector<std::uint8_t> decompressed_buffer_;
+    };
+  }
+}
+
+#endif //SHRINKWRAP_BLOCK_DECODER_HPP
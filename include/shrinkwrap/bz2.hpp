@@ -0,0 +1,671 @@
+#ifndef SHRINKWRAP_BZ2_HPP
+#define SHRINKWRAP_BZ2_HPP
+
+#include <bzlib.h>
+
+#include <streambuf>
+#include <istream>
+#include <ostream>
+#include <stdio.h>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <algorithm>
+
+#include "memory.hpp"
+#include "thread_pool.hpp"
+
+namespace shrinkwrap
+{
+  namespace detail
+  {
+    // Compressed blocks and the end of stream mark start with these 48-bit
+    // magics, which are not byte aligned.
+    static const std::uint64_t bz2_block_magic = 0x314159265359ULL;
+    static const std::uint64_t bz2_end_magic = 0x177245385090ULL;
+
+    inline void* bz2_allocate(void* opaque, int n, int m)
+    {
+      return codec_allocate(static_cast<memory_resource*>(opaque), std::size_t(n) * std::size_t(m));
+    }
+
+    inline void bz2_deallocate(void* opaque, void* address)
+    {
+      codec_deallocate(static_cast<memory_resource*>(opaque), address);
+    }
+
+    // A null resource keeps libbz2's malloc.
+    inline void bz2_init_stream(bz_stream& strm, memory_resource* resource)
+    {
+      std::memset(&strm, 0, sizeof(strm));
+      if (resource)
+      {
+        strm.bzalloc = bz2_allocate;
+        strm.bzfree = bz2_deallocate;
+        strm.opaque = resource;
+      }
+    }
+
+    // Reads count (<= 57) bits starting at bit_pos, most significant first.
+    inline std::uint64_t bz2_read_bits(const std::uint8_t* data, std::uint64_t bit_pos, unsigned count)
+    {
+      std::uint64_t ret = 0;
+      for (unsigned i = 0; i < count; ++i, ++bit_pos)
+        ret = (ret << 1) | ((data[bit_pos / 8] >> (7 - bit_pos % 8)) & 1);
+      return ret;
+    }
+
+    // Writes count bits of value at bit_pos of a zero filled buffer.
+    inline void bz2_write_bits(std::uint8_t* data, std::uint64_t& bit_pos, std::uint64_t value, unsigned count)
+    {
+      for (unsigned i = count; i > 0; --i, ++bit_pos)
+      {
+        if ((value >> (i - 1)) & 1)
+          data[bit_pos / 8] |= std::uint8_t(0x80 >> (bit_pos % 8));
+      }
+    }
+
+    // Finds the first block or end of stream magic that starts at or after
+    // bit_pos. On failure bit_pos is moved to the first position that could not
+    // be checked, so that the search resumes there once more data is read.
+    inline bool bz2_find_magic(const std::uint8_t* data, std::size_t size, std::uint64_t& bit_pos, bool& is_block)
+    {
+      static const std::uint64_t mask = (std::uint64_t(1) << 48) - 1;
+      std::size_t first = std::size_t(bit_pos / 8);
+      std::uint64_t window = 0;
+      for (std::size_t i = first; i < size; ++i)
+      {
+        window = (window << 8) | data[i];
+        if (i < first + 5)
+          continue;
+
+        // The 48 bits ending shift bits before the end of byte i.
+        for (int shift = 7; shift >= 0; --shift)
+        {
+          std::uint64_t pos = std::uint64_t(i) * 8 - 40 - shift;
+          if (pos < bit_pos)
+            continue;
+          std::uint64_t bits = (window >> shift) & mask;
+          if (bits == bz2_block_magic || bits == bz2_end_magic)
+          {
+            bit_pos = pos;
+            is_block = bits == bz2_block_magic;
+            return true;
+          }
+        }
+      }
+
+      if (std::uint64_t(size) * 8 >= 48)
+        bit_pos = std::max(bit_pos, std::uint64_t(size) * 8 - 47);
+      return false;
+    }
+
+    // Appends bits [begin, end) of data to the bit_count bits held in dest. dest
+    // is kept zero filled past bit_count, with at least one spare byte.
+    inline void bz2_append_bits(std::vector<std::uint8_t>& dest, std::uint64_t& bit_count, const std::uint8_t* data, std::uint64_t begin, std::uint64_t end)
+    {
+      std::uint64_t count = end - begin;
+      std::size_t byte_count = std::size_t((count + 7) / 8);
+      std::size_t first = std::size_t(bit_count / 8);
+      unsigned dest_shift = unsigned(bit_count % 8);
+      dest.resize(first + byte_count + 2, 0);
+
+      const std::uint8_t* src = data + begin / 8;
+      unsigned shift = unsigned(begin % 8);
+      for (std::size_t i = 0; i < byte_count; ++i)
+      {
+        std::uint8_t b = src[i];
+        if (shift)
+        {
+          b = std::uint8_t(b << shift);
+          if (std::uint64_t(i) * 8 + 8 - shift < count) // src[i + 1] holds bits of the range.
+            b |= std::uint8_t(src[i + 1] >> (8 - shift));
+        }
+        if (i + 1 == byte_count && count % 8)
+          b &= std::uint8_t(0xFF << (8 - count % 8));
+        dest[first + i] |= std::uint8_t(b >> dest_shift);
+        if (dest_shift)
+          dest[first + i + 1] |= std::uint8_t(b << (8 - dest_shift));
+      }
+
+      bit_count += count;
+      dest.resize(std::size_t((bit_count + 7) / 8) + 1);
+    }
+
+    // Copies the block in bits [begin, end) of data into a stream of its own, so
+    // that libbz2 can decode it independently of the blocks around it. A stream
+    // of one block has that block's CRC as its combined CRC.
+    inline void bz2_wrap_block(const std::uint8_t* data, std::uint64_t begin, std::uint64_t end, char level, std::vector<std::uint8_t>& dest)
+    {
+      std::uint64_t bit_count = end - begin;
+      std::size_t byte_count = std::size_t((bit_count + 7) / 8);
+      dest.assign(4 + byte_count + 11, 0); // header, block, end of stream magic and CRC with padding.
+      dest[0] = 'B';
+      dest[1] = 'Z';
+      dest[2] = 'h';
+      dest[3] = std::uint8_t(level);
+
+      const std::uint8_t* src = data + begin / 8;
+      unsigned shift = unsigned(begin % 8);
+      for (std::size_t i = 0; i < byte_count; ++i)
+        dest[4 + i] = shift ? std::uint8_t((src[i] << shift) | (src[i + 1] >> (8 - shift))) : src[i]; // the magic after the block keeps src[i + 1] in range.
+      if (bit_count % 8)
+        dest[4 + byte_count - 1] &= std::uint8_t(0xFF << (8 - bit_count % 8));
+
+      std::uint64_t bit_pos = 32 + bit_count;
+      bz2_write_bits(dest.data(), bit_pos, bz2_end_magic, 48);
+      bz2_write_bits(dest.data(), bit_pos, bz2_read_bits(data, begin + 48, 32), 32);
+      dest.resize(std::size_t((bit_pos + 7) / 8));
+    }
+  }
+
+  namespace bz2
+  {
+    // A resource is shared by the decoders of all workers, so it must be thread
+    // safe. Block buffers stay on the heap.
+    struct ibuf_options : parallel_options
+    {
+      // Blocks decoded ahead of the reader. 0 uses twice the worker count.
+      std::size_t max_blocks_in_flight = 0;
+      memory_resource* resource = nullptr;
+    };
+
+    // Reads bzip2 files, including concatenated streams (pbzip2, obuf), by
+    // decoding up to max_blocks_in_flight blocks concurrently and handing them
+    // out in order. Blocks are found by scanning for their bit aligned magic and
+    // each one is decoded as a stream of its own; a block that fails to decode
+    // is joined with the next in case the magic was a chance match. Block CRCs
+    // are checked by libbz2 and the combined CRC of every stream is checked here.
+    class ibuf : public std::streambuf
+    {
+    public:
+      ibuf(FILE* fp, const ibuf_options& opts = ibuf_options())
+        :
+        fp_(fp),
+        search_pos_(0),
+        segment_start_(0),
+        in_segment_(false),
+        segment_is_block_(false),
+        level_('9'),
+        combined_crc_(0),
+        pool_(opts.pool),
+        resource_(opts.resource),
+        failed_(false)
+      {
+        if (!pool_)
+        {
+          owned_pool_.reset(new thread_pool(std::max<std::size_t>(1, opts.thread_count)));
+          pool_ = owned_pool_.get();
+        }
+        window_ = opts.max_blocks_in_flight ? opts.max_blocks_in_flight : 2 * pool_->size();
+
+        char* end = current_block_.data() + current_block_.size();
+        setg(end, end, end);
+      }
+
+      ibuf(const std::string& file_path, const ibuf_options& opts = ibuf_options()) : ibuf(fopen(file_path.c_str(), "rb"), opts) {}
+
+      ibuf(const ibuf&) = delete;
+      ibuf& operator=(const ibuf&) = delete;
+
+      virtual ~ibuf()
+      {
+        cancel();
+        if (fp_)
+          fclose(fp_);
+      }
+
+      // True if a block failed to decode, a stream CRC did not match or the file
+      // was truncated. The stream ends at the last good block.
+      bool failed() const { return failed_; }
+
+    private:
+      // The bits from one magic up to the next, or to the end of the file,
+      // shifted to start at bit 0.
+      struct block
+      {
+        std::vector<std::uint8_t> bits;
+        std::uint64_t bit_count = 0;
+        bool is_block = false; // false for an end of stream mark, which is not decoded.
+        bool truncated = false; // a block cut short by the end of the file.
+        char level = '9';
+        std::vector<char> decompressed;
+      };
+
+      // Drops the bytes before the current segment, or before the search
+      // position between streams.
+      void discard_read_buffer()
+      {
+        std::uint64_t keep = in_segment_ ? segment_start_ : search_pos_;
+        std::size_t discard_bytes = std::size_t(keep / 8);
+        read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin() + discard_bytes);
+        search_pos_ -= discard_bytes * 8;
+        if (in_segment_)
+          segment_start_ -= discard_bytes * 8;
+      }
+
+      // Copies the next segment of the file, reading more as needed. A segment
+      // ends where the next block or end of stream magic starts.
+      bool read_segment(block& dest)
+      {
+        while (true)
+        {
+          std::uint64_t bit_size = std::uint64_t(read_buffer_.size()) * 8;
+          std::uint64_t pos = search_pos_;
+          bool is_block = false;
+          bool found = detail::bz2_find_magic(read_buffer_.data(), read_buffer_.size(), pos, is_block) && pos + 48 + 32 <= bit_size;
+          search_pos_ = pos;
+          if (!found && !feof(fp_) && !ferror(fp_))
+          {
+            std::size_t used = read_buffer_.size();
+            read_buffer_.resize(used + read_size);
+            read_buffer_.resize(used + fread(read_buffer_.data() + used, 1, read_size, fp_));
+            continue;
+          }
+
+          bool ret = in_segment_;
+          if (in_segment_)
+          {
+            std::uint64_t end = found ? pos : bit_size;
+            detail::bz2_append_bits(dest.bits, dest.bit_count, read_buffer_.data(), segment_start_, end);
+            dest.is_block = segment_is_block_;
+            dest.truncated = segment_is_block_ && !found;
+            dest.level = level_;
+            in_segment_ = false;
+          }
+
+          if (!found)
+          {
+            if (ferror(fp_))
+              failed_ = true;
+            return ret;
+          }
+
+          // The first block of a stream directly follows its byte aligned "BZh1" to "BZh9" header.
+          if (is_block && pos % 8 == 0 && pos >= 32)
+          {
+            const std::uint8_t* header = read_buffer_.data() + pos / 8 - 4;
+            if (std::memcmp(header, "BZh", 3) == 0 && header[3] >= '1' && header[3] <= '9')
+              level_ = char(header[3]);
+          }
+          segment_start_ = pos;
+          segment_is_block_ = is_block;
+          in_segment_ = true;
+          search_pos_ = pos + 48;
+          discard_read_buffer();
+          if (ret)
+            return true;
+        }
+      }
+
+      // Decodes a block segment as a stream of its own.
+      bool decode_block(block& b)
+      {
+        if (!b.is_block)
+          return true;
+        if (b.truncated)
+          return false;
+
+        std::vector<std::uint8_t> compressed;
+        detail::bz2_wrap_block(b.bits.data(), 0, b.bit_count, b.level, compressed);
+
+        bz_stream strm;
+        detail::bz2_init_stream(strm, resource_);
+        if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK)
+          return false;
+
+        strm.next_in = reinterpret_cast<char*>(compressed.data());
+        strm.avail_in = unsigned(compressed.size());
+        std::size_t used = 0;
+        int res = BZ_OK;
+        while (res == BZ_OK)
+        {
+          if (used == b.decompressed.size())
+            b.decompressed.resize(std::max<std::size_t>(b.decompressed.size() * 2, 1024 * 1024));
+          strm.next_out = b.decompressed.data() + used;
+          strm.avail_out = unsigned(b.decompressed.size() - used);
+          res = BZ2_bzDecompress(&strm);
+          used = b.decompressed.size() - strm.avail_out;
+          if (res == BZ_OK && strm.avail_in == 0 && strm.avail_out != 0)
+            res = BZ_UNEXPECTED_EOF;
+        }
+        BZ2_bzDecompressEnd(&strm);
+        b.decompressed.resize(used);
+        return res == BZ_STREAM_END;
+      }
+
+      void fill_window()
+      {
+        while (in_flight_.size() < window_ && !failed_)
+        {
+          std::shared_ptr<block> b(new block());
+          if (!read_segment(*b))
+            break;
+
+          std::future<bool> decoded = pool_->submit([this, b]()
+          {
+            return decode_block(*b);
+          });
+          in_flight_.push_back(std::make_pair(b, std::move(decoded)));
+        }
+      }
+
+      // The block magic can occur by chance inside compressed data, splitting a
+      // block into segments that don't decode on their own. Joins a segment that
+      // failed with the ones after it until it decodes, as lbzip2 does, up to
+      // the largest compressed block size.
+      bool join_next(block& b)
+      {
+        while (b.bits.size() < max_block_bytes)
+        {
+          fill_window();
+          if (in_flight_.empty())
+            return false;
+
+          std::shared_ptr<block> next = in_flight_.front().first;
+          in_flight_.front().second.wait();
+          in_flight_.pop_front();
+          detail::bz2_append_bits(b.bits, b.bit_count, next->bits.data(), 0, next->bit_count);
+          b.truncated = next->truncated;
+          if (decode_block(b))
+            return true;
+        }
+        return false;
+      }
+
+      // Waits for outstanding blocks, which reference this object.
+      void cancel()
+      {
+        for (auto it = in_flight_.begin(); it != in_flight_.end(); ++it)
+          it->second.wait();
+        in_flight_.clear();
+      }
+
+    protected:
+      virtual std::streambuf::int_type underflow()
+      {
+        if (!fp_)
+          return traits_type::eof();
+        if (gptr() < egptr()) // buffer not exhausted
+          return traits_type::to_int_type(*gptr());
+
+        while (true)
+        {
+          fill_window();
+          if (in_flight_.empty())
+            return traits_type::eof();
+
+          std::shared_ptr<block> b = in_flight_.front().first;
+          bool ok = in_flight_.front().second.get();
+          in_flight_.pop_front();
+          if (!ok && !join_next(*b))
+          {
+            failed_ = true;
+            cancel();
+            return traits_type::eof();
+          }
+
+          std::uint32_t crc = std::uint32_t(detail::bz2_read_bits(b->bits.data(), 48, 32));
+          if (!b->is_block)
+          {
+            if (crc != combined_crc_)
+            {
+              failed_ = true;
+              cancel();
+              return traits_type::eof();
+            }
+            combined_crc_ = 0;
+            continue;
+          }
+
+          combined_crc_ = ((combined_crc_ << 1) | (combined_crc_ >> 31)) ^ crc;
+          current_block_.swap(b->decompressed);
+          if (!current_block_.empty())
+          {
+            setg(current_block_.data(), current_block_.data(), current_block_.data() + current_block_.size());
+            return traits_type::to_int_type(*gptr());
+          }
+        }
+      }
+
+    private:
+      static const std::size_t read_size = 1024 * 1024;
+      static const std::size_t max_block_bytes = 900000 * 20 / 8 + 1024; // 900k symbols of at most 20 bits, and the tables.
+
+      FILE* fp_;
+      std::vector<std::uint8_t> read_buffer_;
+      std::uint64_t search_pos_; // bit offsets into read_buffer_
+      std::uint64_t segment_start_;
+      bool in_segment_;
+      bool segment_is_block_;
+      char level_;
+      std::uint32_t combined_crc_;
+      std::vector<char> current_block_;
+      std::unique_ptr<thread_pool> owned_pool_;
+      thread_pool* pool_;
+      std::size_t window_;
+      std::deque<std::pair<std::shared_ptr<block>, std::future<bool>>> in_flight_;
+      memory_resource* resource_;
+      bool failed_;
+    };
+
+    // As for ibuf, a resource is shared by the encoders of all workers.
+    struct obuf_options : parallel_options
+    {
+      // Block size in units of 100k, 1 to 9.
+      int block_size = 9;
+      // Chunks compressed ahead of the writer. 0 uses twice the worker count.
+      std::size_t max_blocks_in_flight = 0;
+      memory_resource* resource = nullptr;
+    };
+
+    // Compresses chunks of block_size * 100k bytes concurrently, each into a
+    // stream of its own, and writes the streams in order, like pbzip2. Any
+    // bzip2 decoder reads the concatenation. sync() compresses the partial chunk
+    // and waits until everything before it is written.
+    class obuf : public std::streambuf
+    {
+    public:
+      obuf(FILE* fp, const obuf_options& opts = obuf_options())
+        :
+        fp_(fp),
+        pool_(opts.pool),
+        resource_(opts.resource),
+        block_size_(std::max(1, std::min(9, opts.block_size))),
+        stream_count_(0),
+        failed_(false)
+      {
+        if (!pool_)
+        {
+          owned_pool_.reset(new thread_pool(std::max<std::size_t>(1, opts.thread_count)));
+          pool_ = owned_pool_.get();
+        }
+        window_ = opts.max_blocks_in_flight ? opts.max_blocks_in_flight : 2 * pool_->size();
+        next_chunk();
+      }
+
+      obuf(const std::string& file_path, const obuf_options& opts = obuf_options()) : obuf(fopen(file_path.c_str(), "wb"), opts) {}
+
+      obuf(const obuf&) = delete;
+      obuf& operator=(const obuf&) = delete;
+
+      virtual ~obuf()
+      {
+        if (fp_)
+        {
+          sync();
+          if (!stream_count_) // an empty file is not a valid bzip2 file.
+          {
+            submit_chunk(0);
+            drain(0);
+          }
+          fclose(fp_);
+        }
+        cancel();
+      }
+
+      // True if a chunk failed to compress or write.
+      bool failed() const { return failed_; }
+
+    private:
+      struct chunk
+      {
+        std::vector<char> input;
+        std::vector<char> output;
+        std::size_t input_size;
+        std::size_t output_size;
+      };
+
+      void next_chunk()
+      {
+        if (idle_chunks_.empty())
+        {
+          current_.reset(new chunk());
+          current_->input.resize(std::size_t(block_size_) * 100000);
+        }
+        else
+        {
+          current_ = idle_chunks_.back();
+          idle_chunks_.pop_back();
+        }
+        setp(current_->input.data(), current_->input.data() + current_->input.size());
+      }
+
+      bool compress_chunk(chunk& c)
+      {
+        std::size_t bound = c.input_size + c.input_size / 100 + 600; // bzip2's documented worst case.
+        if (c.output.size() < bound)
+          c.output.resize(bound);
+
+        bz_stream strm;
+        detail::bz2_init_stream(strm, resource_);
+        if (BZ2_bzCompressInit(&strm, block_size_, 0, 0) != BZ_OK)
+          return false;
+
+        strm.next_in = c.input.data();
+        strm.avail_in = unsigned(c.input_size);
+        strm.next_out = c.output.data();
+        strm.avail_out = unsigned(c.output.size());
+        int res = BZ_FINISH_OK;
+        while (res == BZ_FINISH_OK && strm.avail_out)
+          res = BZ2_bzCompress(&strm, BZ_FINISH);
+        c.output_size = c.output.size() - strm.avail_out;
+        BZ2_bzCompressEnd(&strm);
+        return res == BZ_STREAM_END;
+      }
+
+      void submit_chunk(std::size_t size)
+      {
+        std::shared_ptr<chunk> c = current_;
+        c->input_size = size;
+        std::future<bool> compressed = pool_->submit([this, c]()
+        {
+          return compress_chunk(*c);
+        });
+        in_flight_.push_back(std::make_pair(c, std::move(compressed)));
+        ++stream_count_;
+        next_chunk();
+      }
+
+      // Writes finished chunks until at most max_in_flight remain.
+      void drain(std::size_t max_in_flight)
+      {
+        while (in_flight_.size() > max_in_flight)
+        {
+          std::shared_ptr<chunk> c = in_flight_.front().first;
+          bool ok = in_flight_.front().second.get();
+          in_flight_.pop_front();
+          if (!ok || failed_ || (c->output_size && !fwrite(c->output.data(), c->output_size, 1, fp_)))
+          {
+            // TODO: handle error.
+            failed_ = true;
+          }
+          idle_chunks_.push_back(c);
+        }
+      }
+
+      // Waits for outstanding chunks, which reference this object.
+      void cancel()
+      {
+        for (auto it = in_flight_.begin(); it != in_flight_.end(); ++it)
+          it->second.wait();
+        in_flight_.clear();
+      }
+
+    protected:
+      virtual std::streambuf::int_type overflow(std::streambuf::int_type c)
+      {
+        if (!fp_ || failed_)
+          return traits_type::eof();
+
+        submit_chunk(std::size_t(pptr() - pbase()));
+        drain(window_ - 1);
+        if (failed_)
+          return traits_type::eof();
+
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+          *pptr() = traits_type::to_char_type(c);
+          pbump(1);
+        }
+        return traits_type::not_eof(c);
+      }
+
+      virtual int sync()
+      {
+        if (!fp_)
+          return -1;
+
+        if (pptr() > pbase())
+          submit_chunk(std::size_t(pptr() - pbase()));
+        drain(0);
+        return failed_ ? -1 : 0;
+      }
+
+    private:
+      FILE* fp_;
+      std::shared_ptr<chunk> current_;
+      std::vector<std::shared_ptr<chunk>> idle_chunks_;
+      std::unique_ptr<thread_pool> owned_pool_;
+      thread_pool* pool_;
+      std::size_t window_;
+      std::deque<std::pair<std::shared_ptr<chunk>, std::future<bool>>> in_flight_;
+      memory_resource* resource_;
+      int block_size_;
+      std::uint64_t stream_count_;
+      bool failed_;
+    };
+
+    class istream : public std::istream
+    {
+    public:
+      istream(const std::string& file_path, const ibuf_options& opts = ibuf_options())
+        :
+        std::istream(&sbuf_),
+        sbuf_(file_path, opts)
+      {
+      }
+
+      bool failed() const { return sbuf_.failed(); }
+    private:
+      ::shrinkwrap::bz2::ibuf sbuf_;
+    };
+
+    class ostream : public std::ostream
+    {
+    public:
+      ostream(const std::string& file_path, const obuf_options& opts = obuf_options())
+        :
+        std::ostream(&sbuf_),
+        sbuf_(file_path, opts)
+      {
+      }
+
+      bool failed() const { return sbuf_.failed(); }
+    private:
+      ::shrinkwrap::bz2::obuf sbuf_;
+    };
+  }
+}
+
+#endif //SHRINKWRAP_BZ2_HPP
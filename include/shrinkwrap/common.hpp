@@ -0,0 +1,284 @@
+#ifndef SHRINKWRAP_COMMON_HPP
+#define SHRINKWRAP_COMMON_HPP
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+namespace shrinkwrap
+{
+  // An independently decodable unit of a compressed file (BGZF block, xz block
+  // or zstd frame).
+  struct block_info
+  {
+    static const std::uint64_t unknown_size = std::numeric_limits<std::uint64_t>::max();
+
+    block_info(std::uint64_t c_off = 0, std::uint64_t c_size = 0, std::uint64_t u_off = unknown_size, std::uint64_t u_size = unknown_size)
+      :
+      compressed_offset(c_off),
+      compressed_size(c_size),
+      uncompressed_offset(u_off),
+      uncompressed_size(u_size)
+    {
+    }
+
+    std::uint64_t compressed_offset;
+    std::uint64_t compressed_size;
+    std::uint64_t uncompressed_offset; // unknown_size if not recorded in the file.
+    std::uint64_t uncompressed_size; // unknown_size if not recorded in the file.
+  };
+
+  // What an output stream does to its compressed data at a flush point: on an
+  // explicit flush() or when its put area fills. Codecs without a distinct
+  // action use the next stronger one.
+  enum class flush_mode
+  {
+    none, // keeps compressing; output appears as the codec's own buffers fill.
+    sync, // emits everything so far, byte aligned, keeping the history (Z_SYNC_FLUSH, LZMA_SYNC_FLUSH, ZSTD_e_flush, LZ4F_flush).
+    full, // as sync, and resets the history so decoding can restart here (Z_FULL_FLUSH).
+    end_block // ends the gzip member, xz block, zstd frame or lz4 frame: the units readers seek to and decode in parallel.
+  };
+
+  // Makes a writer end its block (gzip member, xz block, zstd frame) on its
+  // own, so that seekability doesn't depend on where the application flushes.
+  struct seek_point_options
+  {
+    // Uncompressed bytes between seek points, counted from the last one or
+    // from an end_block flush. 0 leaves block boundaries to flushes.
+    std::uint64_t seek_point_interval = 0;
+    // If set, e.g. to '\n', seek points move to just after the first
+    // delimiter past the interval, so that every block holds whole records.
+    int seek_point_delimiter = -1;
+  };
+
+  namespace detail
+  {
+    // Picks a compression level for output buffers with adaptive levels enabled.
+    // Time is split into three phases: the caller filling the put area (idle),
+    // compressing and writing. When compression takes longer than the other two
+    // combined it is what holds the caller back, so the level is lowered. When it
+    // takes less than a third of the cycle, there is room for a better ratio and
+    // the level is raised. Levels move one step per update, which obufs call on
+    // frame or block boundaries once enough time has been sampled.
+    class level_controller
+    {
+    public:
+      typedef std::chrono::steady_clock clock;
+
+      explicit level_controller(int level = 0, int min_level = 0, int max_level = 0, bool enabled = false)
+        :
+        level_(enabled ? std::max(min_level, std::min(level, max_level)) : level),
+        min_level_(min_level),
+        max_level_(max_level),
+        enabled_(enabled),
+        idle_(0),
+        compress_(0),
+        write_(0),
+        mark_(clock::now())
+      {
+      }
+
+      bool enabled() const { return enabled_; }
+      int level() const { return level_; }
+
+      // Marks the end of an idle phase.
+      void begin_work()
+      {
+        if (enabled_)
+          idle_ += lap();
+      }
+
+      // Marks the end of a compression phase.
+      void end_compress()
+      {
+        if (enabled_)
+          compress_ += lap();
+      }
+
+      // Marks the end of a write phase.
+      void end_write()
+      {
+        if (enabled_)
+          write_ += lap();
+      }
+
+      // Returns true if the level changed.
+      bool update()
+      {
+        if (!enabled_ || idle_ + compress_ + write_ < sample_window())
+          return false;
+        return update(idle_, compress_, write_);
+      }
+
+      bool update(clock::duration idle, clock::duration compress, clock::duration write)
+      {
+        idle_ = compress_ = write_ = clock::duration(0);
+        if (!enabled_)
+          return false;
+
+        int prev_level = level_;
+        if (compress > idle + write)
+          level_ = std::max(min_level_, level_ - 1);
+        else if (compress * 2 < idle + write)
+          level_ = std::min(max_level_, level_ + 1);
+        return level_ != prev_level;
+      }
+
+    private:
+      static clock::duration sample_window() { return std::chrono::milliseconds(10); }
+
+      clock::duration lap()
+      {
+        clock::time_point now = clock::now();
+        clock::duration ret = now - mark_;
+        mark_ = now;
+        return ret;
+      }
+
+    private:
+      int level_;
+      int min_level_;
+      int max_level_;
+      bool enabled_;
+      clock::duration idle_;
+      clock::duration compress_;
+      clock::duration write_;
+      clock::time_point mark_;
+    };
+
+    // Cuts the data handed to a codec at the seek points of seek_point_options.
+    class seek_point_splitter
+    {
+    public:
+      explicit seek_point_splitter(const seek_point_options& opts = seek_point_options())
+        :
+        interval_(opts.seek_point_interval),
+        delimiter_(opts.seek_point_delimiter),
+        since_seek_point_(0)
+      {
+      }
+
+      // Calls encode(data, size, mode) on the pieces of data, with end_block
+      // for each one that ends at a seek point and mode for the rest. A seek
+      // point at the very end stands in for mode, as ending the block already
+      // flushes.
+      template <typename Encode>
+      bool split(std::uint8_t* data, std::size_t size, flush_mode mode, Encode encode)
+      {
+        std::size_t length;
+        while (size && (length = next(data, size)) != 0)
+        {
+          if (!encode(data, length, flush_mode::end_block))
+            return false;
+          data += length;
+          size -= length;
+          if (!size)
+            return true;
+        }
+
+        if (mode == flush_mode::end_block)
+          since_seek_point_ = 0;
+        return encode(data, size, mode);
+      }
+
+    private:
+      // Length of the prefix of data that ends at the next seek point, or 0 if
+      // the point lies beyond data.
+      std::size_t next(const std::uint8_t* data, std::size_t size)
+      {
+        if (!interval_)
+          return 0;
+
+        std::size_t pos = 0;
+        if (since_seek_point_ < interval_)
+        {
+          std::uint64_t left = interval_ - since_seek_point_;
+          if (left > size)
+          {
+            since_seek_point_ += size;
+            return 0;
+          }
+          pos = std::size_t(left);
+        }
+
+        if (delimiter_ >= 0)
+        {
+          const void* found = pos < size ? std::memchr(data + pos, delimiter_, size - pos) : nullptr;
+          if (!found)
+          {
+            since_seek_point_ += size;
+            return 0;
+          }
+          pos = std::size_t(static_cast<const std::uint8_t*>(found) - data) + 1;
+        }
+
+        since_seek_point_ = 0;
+        return pos;
+      }
+
+      std::uint64_t interval_;
+      int delimiter_;
+      std::uint64_t since_seek_point_;
+    };
+
+    // Guesses from a sample whether deflate or zstd would fail to shrink data,
+    // e.g. images, archives or encrypted payloads, in a few microseconds per
+    // 64 KiB. Such data has near uniform byte frequencies and no repeated 4-byte
+    // sequences within the sample. Buffers under 1 KiB are never reported.
+    inline bool looks_incompressible(const std::uint8_t* data, std::size_t size)
+    {
+      static const std::size_t min_size = 1024;
+      static const std::size_t slice_count = 16;
+      static const std::size_t max_slice_size = 256;
+      if (size < min_size)
+        return false;
+
+      std::array<std::uint32_t, 256> counts = {};
+      std::array<std::uint32_t, 4096> last_seen = {}; // 4-byte sequences by hash
+      std::size_t stride = size / slice_count;
+      std::size_t slice_size = std::min(max_slice_size, stride);
+      std::size_t sample_size = slice_count * slice_size;
+      std::size_t repeats = 0;
+      for (std::size_t s = 0; s < slice_count; ++s)
+      {
+        const std::uint8_t* slice = data + s * stride;
+        for (std::size_t i = 0; i < slice_size; ++i)
+        {
+          ++counts[slice[i]];
+          if (i + 4 <= slice_size)
+          {
+            std::uint32_t sequence;
+            std::memcpy(&sequence, slice + i, sizeof(sequence));
+            std::uint32_t& entry = last_seen[(sequence * 2654435761u) >> 20];
+            if (entry == sequence)
+              ++repeats;
+            entry = sequence;
+          }
+        }
+      }
+
+      if (repeats * 32 > sample_size)
+        return false;
+
+      double entropy = 0.;
+      for (std::size_t i = 0; i < counts.size(); ++i)
+      {
+        if (counts[i])
+        {
+          double p = double(counts[i]) / double(sample_size);
+          entropy -= p * std::log2(p);
+        }
+      }
+
+      // Uniformly random bytes measure about 8 - 255 / (2 n ln 2) bits over n samples.
+      double random_entropy = 8. - 255. / (2. * double(sample_size) * std::log(2.));
+      return entropy > random_entropy - 0.15;
+    }
+  }
+}
+
+#endif //SHRINKWRAP_COMMON_HPP
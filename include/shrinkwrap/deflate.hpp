@@ -0,0 +1,841 @@
+#ifndef SHRINKWRAP_DEFLATE_HPP
+#define SHRINKWRAP_DEFLATE_HPP
+
+#include <stdio.h>
+#include <zlib.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "memory.hpp"
+#include "thread_pool.hpp"
+
+namespace shrinkwrap
+{
+  namespace detail
+  {
+    inline voidpf zlib_allocate(voidpf opaque, uInt items, uInt size)
+    {
+      return codec_allocate(static_cast<memory_resource*>(opaque), std::size_t(items) * size);
+    }
+
+    inline void zlib_deallocate(voidpf opaque, voidpf address)
+    {
+      codec_deallocate(static_cast<memory_resource*>(opaque), address);
+    }
+
+    // Routes the allocations of a z_stream to resource. Must be called before
+    // the init function; null keeps zlib's malloc.
+    inline void use_resource(z_stream& zs, memory_resource* resource)
+    {
+      if (resource)
+      {
+        zs.zalloc = zlib_allocate;
+        zs.zfree = zlib_deallocate;
+        zs.opaque = resource;
+      }
+    }
+
+    // crc32() takes a uInt length, so larger buffers are fed in pieces.
+    inline std::uint32_t crc32_update(std::uint32_t crc, const void* data, std::size_t size)
+    {
+      const Bytef* p = static_cast<const Bytef*>(data);
+      do
+      {
+        std::size_t piece = std::min<std::size_t>(size, std::numeric_limits<uInt>::max());
+        crc = std::uint32_t(crc32(crc, p, uInt(piece)));
+        p += piece;
+        size -= piece;
+      } while (size);
+      return crc;
+    }
+
+    // Reads a deflate stream from memory, least significant bit first. Bits
+    // past the end read as zero and make overrun() true.
+    class deflate_bit_reader
+    {
+    public:
+      deflate_bit_reader(const std::uint8_t* data, std::size_t size, std::uint64_t bit_position)
+        :
+        data_(data),
+        size_(size),
+        next_byte_(std::size_t(bit_position / 8)),
+        bits_(0),
+        count_(0)
+      {
+        refill();
+        skip(unsigned(bit_position % 8));
+      }
+
+      std::uint32_t peek(unsigned n)
+      {
+        if (count_ < n)
+          refill();
+        return std::uint32_t(bits_ & ((std::uint64_t(1) << n) - 1));
+      }
+
+      void skip(unsigned n)
+      {
+        bits_ >>= n;
+        count_ -= n;
+      }
+
+      std::uint32_t get(unsigned n)
+      {
+        std::uint32_t ret = peek(n);
+        skip(n);
+        return ret;
+      }
+
+      void align()
+      {
+        skip(count_ % 8);
+      }
+
+      std::uint64_t position() const
+      {
+        return std::uint64_t(next_byte_) * 8 - count_;
+      }
+
+      bool overrun() const
+      {
+        return position() > std::uint64_t(size_) * 8;
+      }
+
+    private:
+      void refill()
+      {
+        while (count_ <= 56)
+        {
+          std::uint64_t byte = next_byte_ < size_ ? data_[next_byte_] : 0;
+          bits_ |= byte << count_;
+          ++next_byte_;
+          count_ += 8;
+        }
+      }
+
+      const std::uint8_t* data_;
+      std::size_t size_;
+      std::size_t next_byte_;
+      std::uint64_t bits_;
+      unsigned count_;
+    };
+
+    // Canonical Huffman code decoded with one table indexed by the next
+    // max_length bits. Entries are (symbol << 4) | length, 0 for unused codes.
+    class deflate_huffman
+    {
+    public:
+      deflate_huffman(memory_resource* resource = nullptr) : entries_(resource) {}
+
+      // Returns false for over-subscribed codes, and for incomplete ones
+      // unless allow_incomplete and the longest code has one bit, as zlib does.
+      bool build(const std::uint8_t* lengths, std::size_t count, bool allow_incomplete)
+      {
+        std::array<std::uint16_t, 16> length_count = {};
+        for (std::size_t i = 0; i < count; ++i)
+          ++length_count[lengths[i]];
+        length_count[0] = 0;
+
+        max_length_ = 0;
+        for (unsigned length = 15; length > 0 && !max_length_; --length)
+        {
+          if (length_count[length])
+            max_length_ = length;
+        }
+
+        if (!max_length_) // no codes; any symbol is an error.
+        {
+          max_length_ = 1;
+          entries_.assign(2, 0);
+          return true;
+        }
+
+        int left = 1;
+        for (unsigned length = 1; length < 16; ++length)
+        {
+          left = (left << 1) - length_count[length];
+          if (left < 0)
+            return false;
+        }
+        if (left > 0 && (!allow_incomplete || max_length_ != 1))
+          return false;
+
+        std::array<std::uint16_t, 16> next_code = {};
+        std::uint16_t code = 0;
+        for (unsigned length = 1; length < 16; ++length)
+        {
+          code = std::uint16_t((code + length_count[length - 1]) << 1);
+          next_code[length] = code;
+        }
+
+        entries_.assign(std::size_t(1) << max_length_, 0);
+        for (std::size_t symbol = 0; symbol < count; ++symbol)
+        {
+          unsigned length = lengths[symbol];
+          if (!length)
+            continue;
+
+          std::uint32_t reversed = 0;
+          for (unsigned c = next_code[length]++, i = 0; i < length; ++i, c >>= 1)
+            reversed = (reversed << 1) | (c & 1);
+          for (std::size_t i = reversed; i < entries_.size(); i += std::size_t(1) << length)
+            entries_[i] = std::uint16_t((symbol << 4) | length);
+        }
+        return true;
+      }
+
+      // Next symbol, or -1 for a code that is not in the table.
+      int decode(deflate_bit_reader& reader) const
+      {
+        std::uint16_t entry = entries_[reader.peek(max_length_)];
+        if (!(entry & 15))
+          return -1;
+        reader.skip(entry & 15);
+        return entry >> 4;
+      }
+
+    private:
+      resource_vector<std::uint16_t> entries_;
+      unsigned max_length_ = 0;
+    };
+
+    // Inflates deflate blocks without the data that precedes them. Output is
+    // 16-bit symbols: values below 256 are bytes, and 256 + i stands for byte i
+    // of the unknown 32 KiB window before the first block, which is what a
+    // back-reference reaching past the start copies.
+    class marker_inflater
+    {
+    public:
+      enum result
+      {
+        block_end,
+        final_block_end,
+        invalid,
+        out_of_input,
+        output_limit // out grew past max_size.
+      };
+
+      static const std::uint16_t window_size = 32768;
+
+      marker_inflater(memory_resource* resource = nullptr)
+        :
+        fixed_literals_(resource),
+        fixed_distances_(resource),
+        code_lengths_(resource),
+        literals_(resource),
+        distances_(resource)
+      {
+        std::array<std::uint8_t, 288> lengths;
+        std::fill(lengths.begin(), lengths.begin() + 144, std::uint8_t(8));
+        std::fill(lengths.begin() + 144, lengths.begin() + 256, std::uint8_t(9));
+        std::fill(lengths.begin() + 256, lengths.begin() + 280, std::uint8_t(7));
+        std::fill(lengths.begin() + 280, lengths.end(), std::uint8_t(8));
+        fixed_literals_.build(lengths.data(), lengths.size(), false);
+        std::fill(lengths.begin(), lengths.begin() + 32, std::uint8_t(5)); // 30 and 31 are invalid but complete the code.
+        fixed_distances_.build(lengths.data(), 32, false);
+      }
+
+      // Inflates the block at the reader's position, appending to out. Stops
+      // early once out holds more than max_size symbols.
+      result decode_block(deflate_bit_reader& reader, resource_vector<std::uint16_t>& out, std::size_t max_size)
+      {
+        std::uint32_t header = reader.get(3);
+        result ret;
+        switch (header >> 1)
+        {
+        case 0:
+          ret = decode_stored(reader, out);
+          break;
+        case 1:
+          ret = decode_codes(reader, fixed_literals_, fixed_distances_, out, max_size);
+          break;
+        case 2:
+          ret = read_tables(reader) ? decode_codes(reader, literals_, distances_, out, max_size) : invalid;
+          break;
+        default:
+          ret = invalid;
+        }
+
+        if (reader.overrun())
+          return out_of_input;
+        if (ret == block_end && out.size() > max_size)
+          return output_limit;
+        if (ret == block_end && (header & 1))
+          return final_block_end;
+        return ret;
+      }
+
+    private:
+      result decode_stored(deflate_bit_reader& reader, resource_vector<std::uint16_t>& out)
+      {
+        reader.align();
+        std::uint32_t length = reader.get(16);
+        if (length != (~reader.get(16) & 0xffff))
+          return invalid;
+        for (std::uint32_t i = 0; i < length && !reader.overrun(); ++i)
+          out.push_back(std::uint16_t(reader.get(8)));
+        return block_end;
+      }
+
+      bool read_tables(deflate_bit_reader& reader)
+      {
+        static const std::uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+        unsigned literal_count = reader.get(5) + 257;
+        unsigned distance_count = reader.get(5) + 1;
+        unsigned code_length_count = reader.get(4) + 4;
+        if (literal_count > 286 || distance_count > 30)
+          return false;
+
+        std::array<std::uint8_t, 19> code_lengths = {};
+        for (unsigned i = 0; i < code_length_count; ++i)
+          code_lengths[order[i]] = std::uint8_t(reader.get(3));
+        if (!code_lengths_.build(code_lengths.data(), code_lengths.size(), false))
+          return false;
+
+        std::array<std::uint8_t, 286 + 30> lengths;
+        unsigned total = literal_count + distance_count;
+        for (unsigned n = 0; n < total;)
+        {
+          int symbol = code_lengths_.decode(reader);
+          if (symbol < 0 || reader.overrun())
+            return false;
+          if (symbol < 16)
+          {
+            lengths[n++] = std::uint8_t(symbol);
+            continue;
+          }
+
+          std::uint8_t value = 0;
+          unsigned repeat;
+          if (symbol == 16)
+          {
+            if (n == 0)
+              return false;
+            value = lengths[n - 1];
+            repeat = 3 + reader.get(2);
+          }
+          else if (symbol == 17)
+          {
+            repeat = 3 + reader.get(3);
+          }
+          else
+          {
+            repeat = 11 + reader.get(7);
+          }
+          if (n + repeat > total)
+            return false;
+          std::fill(lengths.begin() + n, lengths.begin() + n + repeat, value);
+          n += repeat;
+        }
+
+        if (lengths[256] == 0) // no end of block code.
+          return false;
+        return literals_.build(lengths.data(), literal_count, true) && distances_.build(lengths.data() + literal_count, distance_count, true);
+      }
+
+      result decode_codes(deflate_bit_reader& reader, const deflate_huffman& literals, const deflate_huffman& distances, resource_vector<std::uint16_t>& out, std::size_t max_size)
+      {
+        static const std::uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const std::uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const std::uint16_t distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+        static const std::uint8_t distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+        while (!reader.overrun())
+        {
+          int symbol = literals.decode(reader);
+          if (symbol < 0)
+            return invalid;
+          if (symbol < 256)
+          {
+            out.push_back(std::uint16_t(symbol));
+            continue;
+          }
+          if (symbol == 256)
+            return block_end;
+
+          symbol -= 257;
+          if (symbol >= 29)
+            return invalid;
+          std::size_t length = length_base[symbol] + reader.get(length_extra[symbol]);
+
+          int distance_symbol = distances.decode(reader);
+          if (distance_symbol < 0 || distance_symbol >= 30)
+            return invalid;
+          std::size_t distance = distance_base[distance_symbol] + reader.get(distance_extra[distance_symbol]);
+
+          std::size_t size = out.size();
+          if (distance > size + window_size)
+            return invalid;
+          if (size + length > max_size)
+            return output_limit;
+          out.resize(size + length);
+          for (std::size_t i = size; i < size + length; ++i)
+            out[i] = i >= distance ? out[i - distance] : std::uint16_t(256 + window_size - (distance - i));
+        }
+        return out_of_input;
+      }
+
+      deflate_huffman fixed_literals_;
+      deflate_huffman fixed_distances_;
+      deflate_huffman code_lengths_;
+      deflate_huffman literals_;
+      deflate_huffman distances_;
+    };
+
+    // A stretch of a deflate stream inflated from a guessed block boundary.
+    struct speculative_chunk
+    {
+      explicit speculative_chunk(memory_resource* resource) : data(resource), head(resource), bytes(resource) {}
+
+      resource_vector<std::uint8_t> data; // compressed bytes from data_offset
+      std::uint64_t data_offset = 0;
+      std::uint64_t search_end = 0; // bit offset in data; boundaries are searched before it
+      std::size_t max_output = 0; // symbols kept before the chunk is given up
+      std::atomic<bool> cancelled{false};
+
+      bool ok = false;
+      std::uint64_t start_bit = 0; // absolute bit offset of the first block
+      std::uint64_t end_bit = 0; // absolute bit offset after the last block
+      bool final = false;
+      resource_vector<std::uint16_t> head; // symbols up to the last window marker
+      resource_vector<char> bytes; // output; the first head.size() bytes are filled on resolution
+      std::uint32_t tail_crc = 0; // CRC32 of bytes past the head
+
+      // Looks for the first offset before search_end at which a non-final
+      // stored or dynamic block decodes, and inflates from there up to the first
+      // block boundary at or past search_end, or the final block. Fixed Huffman
+      // blocks are not searched for: almost any bits parse as one. A chunk that
+      // inflates to more than max_output is given up, and zlib inflates it.
+      void decode(bool compute_crc)
+      {
+        marker_inflater inflater(data.get_allocator().resource());
+        resource_vector<std::uint16_t> out(data.get_allocator());
+        for (std::uint64_t position = 0; position < search_end && !cancelled; ++position)
+        {
+          deflate_bit_reader reader(data.data(), data.size(), position);
+          std::uint32_t header = reader.peek(3);
+          if (header != 0 && header != 4) // BFINAL clear, BTYPE stored or dynamic.
+            continue;
+
+          out.clear();
+          marker_inflater::result res;
+          do
+          {
+            res = inflater.decode_block(reader, out, max_output);
+          } while (res == marker_inflater::block_end && reader.position() < search_end && !cancelled);
+
+          if (res == marker_inflater::invalid)
+            continue;
+          if (res == marker_inflater::out_of_input || res == marker_inflater::output_limit || cancelled)
+            return;
+
+          start_bit = data_offset * 8 + position;
+          end_bit = data_offset * 8 + reader.position();
+          final = res == marker_inflater::final_block_end;
+          resolve_tail(out, compute_crc);
+          ok = true;
+          return;
+        }
+      }
+
+    private:
+      void resolve_tail(const resource_vector<std::uint16_t>& out, bool compute_crc)
+      {
+        std::size_t head_size = out.size();
+        while (head_size && out[head_size - 1] < 256)
+          --head_size;
+        head.assign(out.begin(), out.begin() + head_size);
+
+        bytes.resize(out.size());
+        for (std::size_t i = head_size; i < out.size(); ++i)
+          bytes[i] = char(out[i]);
+        if (compute_crc)
+          tail_crc = crc32_update(0, bytes.data() + head_size, bytes.size() - head_size);
+      }
+    };
+
+    // Inflates the members of a gzip file with worker threads, after
+    // rapidgzip. The deflate data is cut into chunks; workers inflate each
+    // chunk but the first from a guessed block boundary, leaving markers for
+    // the bytes of the unknown window. The reader inflates the first chunk
+    // itself with zlib. At every block boundary it reaches inside the next
+    // chunk it checks whether that chunk's guess starts there: if so the
+    // chunk's markers are filled from the last 32 KiB of output and its result
+    // is used, otherwise the guess is dropped and zlib carries on. Output is
+    // that of a serial inflate, and each member's CRC32 and ISIZE are checked.
+    // Reading starts at the file's position and needs it to be seekable.
+    // Chunks, buffers and zlib's state come from resource, which the workers
+    // share, or the heap if null. A chunk that inflates to more than
+    // max_chunk_output bytes is left to zlib; 0 uses 8 times chunk_size.
+    class speculative_inflater
+    {
+    public:
+      speculative_inflater(FILE* fp, std::size_t thread_count, std::size_t chunk_size, bool ignore_checks, memory_resource* resource = nullptr, std::size_t max_chunk_output = 0)
+        :
+        fp_(fp),
+        file_size_(0),
+        chunk_size_(chunk_size ? chunk_size : 1),
+        max_chunk_output_(max_chunk_output ? max_chunk_output : 8 * chunk_size_),
+        ignore_checks_(ignore_checks),
+        resource_(resource),
+        pool_(new thread_pool(thread_count)),
+        window_(2 * pool_->size()),
+        zstrm_(),
+        zstrm_initialized_(false),
+        input_(resource),
+        piece_(resource),
+        window_bytes_(resource),
+        failed_(false),
+        done_(false)
+      {
+        use_resource(zstrm_, resource_);
+        input_.resize(64 * 1024);
+        long start = fp_ ? ftell(fp_) : -1;
+        long size = start < 0 || fseek(fp_, 0, SEEK_END) ? -1 : ftell(fp_);
+        if (start < 0 || size < start)
+        {
+          failed_ = true;
+          return;
+        }
+        file_size_ = std::uint64_t(size);
+        begin_member(std::uint64_t(start));
+      }
+
+      speculative_inflater(const speculative_inflater&) = delete;
+      speculative_inflater& operator=(const speculative_inflater&) = delete;
+
+      ~speculative_inflater()
+      {
+        cancel();
+        if (zstrm_initialized_)
+          inflateEnd(&zstrm_);
+      }
+
+      // Copies up to size decoded bytes to dest. 0 at the end of the file or
+      // after an error.
+      std::size_t read(char* dest, std::size_t size)
+      {
+        while (piece_position_ == piece_.size())
+        {
+          if (done_ || failed_)
+            return 0;
+          piece_.clear();
+          piece_position_ = 0;
+          if (serial_)
+            inflate_serially();
+          else if (!accept_chunk(position_bit_))
+            start_serial(position_bit_);
+        }
+
+        std::size_t ret = std::min(size, piece_.size() - piece_position_);
+        std::memcpy(dest, piece_.data() + piece_position_, ret);
+        piece_position_ += ret;
+        return ret;
+      }
+
+      // The first member header is invalid, the file is not seekable, or
+      // decoding failed.
+      bool failed() const { return failed_; }
+      // Chunks whose speculative output was used rather than inflated again.
+      std::size_t accepted_chunks() const { return accepted_chunks_; }
+      // Every member was checked and read.
+      bool done() const { return done_ && piece_position_ == piece_.size(); }
+      // Set if the first member could not be started; nothing was decoded.
+      bool unusable() const { return failed_ && !started_; }
+
+    private:
+      // Parses the gzip header at offset and starts inflating the member after it.
+      void begin_member(std::uint64_t offset)
+      {
+        cancel();
+        resource_vector<std::uint8_t> header(std::size_t(std::min<std::uint64_t>(64 * 1024, file_size_ - offset)), 0, resource_);
+        if (!read_at(offset, header.data(), header.size()) || header.size() < 18 || header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || (header[3] & 0xe0))
+        {
+          failed_ = true;
+          return;
+        }
+
+        std::uint8_t flags = header[3];
+        std::size_t position = 10;
+        if (flags & 4) // FEXTRA
+          position += 2 + (header[10] | (std::size_t(header[11]) << 8));
+        for (std::uint8_t flag = 8; flag <= 16; flag <<= 1) // FNAME, FCOMMENT
+        {
+          if (flags & flag)
+          {
+            while (position < header.size() && header[position])
+              ++position;
+            ++position;
+          }
+        }
+        if (flags & 2) // FHCRC
+          position += 2;
+        if (position >= header.size())
+        {
+          failed_ = true;
+          return;
+        }
+
+        member_start_ = offset + position;
+        next_chunk_start_ = member_start_ + chunk_size_;
+        crc_ = 0;
+        total_ = 0;
+        window_bytes_.clear();
+        start_serial(member_start_ * 8);
+        started_ = true;
+      }
+
+      // Checks the trailer at offset and moves on to the next member, if any.
+      void end_member(std::uint64_t offset)
+      {
+        std::uint8_t trailer[8];
+        if (!read_at(offset, trailer, sizeof(trailer)))
+        {
+          failed_ = true;
+          return;
+        }
+
+        std::uint32_t crc = std::uint32_t(trailer[0]) | (std::uint32_t(trailer[1]) << 8) | (std::uint32_t(trailer[2]) << 16) | (std::uint32_t(trailer[3]) << 24);
+        std::uint32_t isize = std::uint32_t(trailer[4]) | (std::uint32_t(trailer[5]) << 8) | (std::uint32_t(trailer[6]) << 16) | (std::uint32_t(trailer[7]) << 24);
+        if (!ignore_checks_ && (crc != crc_ || isize != std::uint32_t(total_)))
+        {
+          failed_ = true;
+          return;
+        }
+
+        if (offset + 8 == file_size_)
+        {
+          cancel();
+          done_ = true;
+        }
+        else
+        {
+          begin_member(offset + 8);
+        }
+      }
+
+      bool read_at(std::uint64_t offset, std::uint8_t* dest, std::size_t size)
+      {
+        return fseek(fp_, long(offset), SEEK_SET) == 0 && fread(dest, 1, size, fp_) == size;
+      }
+
+      // Resets zlib to inflate raw deflate data from bit, after the window.
+      void start_serial(std::uint64_t bit)
+      {
+        int res = zstrm_initialized_ ? inflateReset(&zstrm_) : inflateInit2(&zstrm_, -15);
+        zstrm_initialized_ = true;
+        if (res == Z_OK && !window_bytes_.empty())
+          res = inflateSetDictionary(&zstrm_, reinterpret_cast<const Bytef*>(window_bytes_.data()), uInt(window_bytes_.size()));
+
+        input_offset_ = bit / 8;
+        zstrm_.avail_in = 0;
+        if (res == Z_OK && bit % 8)
+        {
+          std::uint8_t byte;
+          if (!read_at(input_offset_, &byte, 1))
+            res = Z_DATA_ERROR;
+          else
+            res = inflatePrime(&zstrm_, int(8 - bit % 8), byte >> (bit % 8));
+          ++input_offset_;
+        }
+
+        failed_ = failed_ || res != Z_OK;
+        serial_ = true;
+      }
+
+      // Inflates up to the next block boundary with zlib, then tries to hand
+      // over to the chunk that starts there.
+      void inflate_serially()
+      {
+        if (zstrm_.avail_in == 0)
+        {
+          std::size_t size = std::size_t(std::min<std::uint64_t>(input_.size(), file_size_ - std::min(file_size_, input_offset_)));
+          if (!size || !read_at(input_offset_, input_.data(), size))
+          {
+            failed_ = true; // truncated
+            return;
+          }
+          input_offset_ += size;
+          zstrm_.next_in = input_.data();
+          zstrm_.avail_in = uInt(size);
+        }
+
+        piece_.resize(256 * 1024);
+        zstrm_.next_out = reinterpret_cast<Bytef*>(&piece_[0]);
+        zstrm_.avail_out = uInt(piece_.size());
+        int res = inflate(&zstrm_, Z_BLOCK);
+        piece_.resize(piece_.size() - zstrm_.avail_out);
+        append(piece_.data(), piece_.size());
+
+        if (res == Z_STREAM_END)
+        {
+          end_member(input_offset_ - zstrm_.avail_in);
+          return;
+        }
+        if (res != Z_OK && res != Z_BUF_ERROR)
+        {
+          failed_ = true;
+          return;
+        }
+
+        if ((zstrm_.data_type & 128) && !(zstrm_.data_type & 64))
+          accept_chunk((input_offset_ - zstrm_.avail_in) * 8 - (zstrm_.data_type & 7));
+      }
+
+      // Uses the next chunk if its guessed start is boundary, dropping the ones
+      // whose guess cannot match anymore.
+      bool accept_chunk(std::uint64_t boundary)
+      {
+        fill_window();
+        while (!in_flight_.empty())
+        {
+          speculative_chunk& front = *in_flight_.front().first;
+          if (boundary < front.data_offset * 8)
+            return false;
+
+          in_flight_.front().second.wait();
+          if (front.ok && front.start_bit == boundary)
+          {
+            std::shared_ptr<speculative_chunk> chunk = in_flight_.front().first;
+            in_flight_.pop_front();
+            fill_window();
+            return use_chunk(*chunk);
+          }
+          if (front.ok && front.start_bit > boundary)
+            return false;
+
+          in_flight_.pop_front();
+          fill_window();
+        }
+        return false;
+      }
+
+      // Fills the chunk's markers from the window and appends its output to piece_.
+      bool use_chunk(speculative_chunk& chunk)
+      {
+        std::size_t missing = marker_inflater::window_size - window_bytes_.size();
+        for (std::size_t i = 0; i < chunk.head.size(); ++i)
+        {
+          std::uint16_t symbol = chunk.head[i];
+          if (symbol < 256)
+          {
+            chunk.bytes[i] = char(symbol);
+            continue;
+          }
+          std::size_t index = symbol - 256;
+          if (index < missing)
+            return false; // reaches before the member; zlib reports the error.
+          chunk.bytes[i] = window_bytes_[index - missing];
+        }
+
+        if (!ignore_checks_)
+        {
+          std::size_t head_size = chunk.head.size();
+          crc_ = crc32_update(crc_, chunk.bytes.data(), head_size);
+          crc_ = std::uint32_t(crc32_combine(crc_, chunk.tail_crc, z_off_t(chunk.bytes.size() - head_size)));
+        }
+        total_ += chunk.bytes.size();
+        update_window(chunk.bytes.data(), chunk.bytes.size());
+        if (piece_.empty())
+          piece_.swap(chunk.bytes);
+        else
+          piece_.insert(piece_.end(), chunk.bytes.begin(), chunk.bytes.end());
+
+        ++accepted_chunks_;
+        serial_ = false;
+        position_bit_ = chunk.end_bit;
+        if (chunk.final)
+          end_member((chunk.end_bit + 7) / 8);
+        return true;
+      }
+
+      void append(const char* data, std::size_t size)
+      {
+        if (!ignore_checks_)
+          crc_ = crc32_update(crc_, data, size);
+        total_ += size;
+        update_window(data, size);
+      }
+
+      void update_window(const char* data, std::size_t size)
+      {
+        if (size >= marker_inflater::window_size)
+        {
+          window_bytes_.assign(data + size - marker_inflater::window_size, data + size);
+          return;
+        }
+        window_bytes_.insert(window_bytes_.end(), data, data + size);
+        if (window_bytes_.size() > marker_inflater::window_size)
+          window_bytes_.erase(window_bytes_.begin(), window_bytes_.end() - marker_inflater::window_size);
+      }
+
+      void fill_window()
+      {
+        while (in_flight_.size() < window_ && next_chunk_start_ < file_size_)
+        {
+          std::shared_ptr<speculative_chunk> chunk = std::allocate_shared<speculative_chunk>(resource_allocator<speculative_chunk>(resource_), resource_);
+          chunk->data_offset = next_chunk_start_;
+          chunk->data.resize(std::size_t(std::min<std::uint64_t>(2 * chunk_size_, file_size_ - next_chunk_start_)));
+          chunk->search_end = std::min<std::uint64_t>(chunk_size_, chunk->data.size()) * 8;
+          chunk->max_output = max_chunk_output_;
+          next_chunk_start_ += chunk_size_;
+          if (!read_at(chunk->data_offset, chunk->data.data(), chunk->data.size()))
+            break;
+
+          bool compute_crc = !ignore_checks_;
+          in_flight_.emplace_back(chunk, pool_->submit([chunk, compute_crc]() { chunk->decode(compute_crc); }));
+        }
+      }
+
+      void cancel()
+      {
+        for (auto it = in_flight_.begin(); it != in_flight_.end(); ++it)
+          it->first->cancelled = true;
+        for (auto it = in_flight_.begin(); it != in_flight_.end(); ++it)
+          it->second.wait();
+        in_flight_.clear();
+      }
+
+      FILE* fp_;
+      std::uint64_t file_size_;
+      std::size_t chunk_size_;
+      std::size_t max_chunk_output_;
+      bool ignore_checks_;
+      memory_resource* resource_;
+      std::unique_ptr<thread_pool> pool_;
+      std::size_t window_;
+      std::deque<std::pair<std::shared_ptr<speculative_chunk>, std::future<void>>> in_flight_;
+      std::uint64_t member_start_ = 0;
+      std::uint64_t next_chunk_start_ = 0;
+
+      z_stream zstrm_;
+      bool zstrm_initialized_;
+      bool serial_ = true;
+      resource_vector<std::uint8_t> input_;
+      std::uint64_t input_offset_ = 0;
+      std::uint64_t position_bit_ = 0;
+
+      resource_vector<char> piece_;
+      std::size_t piece_position_ = 0;
+      resource_vector<char> window_bytes_;
+      std::uint32_t crc_ = 0;
+      std::uint64_t total_ = 0;
+      bool failed_;
+      bool done_;
+      bool started_ = false;
+      std::size_t accepted_chunks_ = 0;
+    };
+  }
+}
+
+#endif //SHRINKWRAP_DEFLATE_HPP
@@ -10,43 +10,112 @@
 #include <iostream>
 #include <limits>
 #include <cstring>
+#include <string>
+#include <utility>
+#include <deque>
+#include <future>
+#include <memory>
+
+#include "common.hpp"
+#include "basic_buf.hpp"
+#include "thread_pool.hpp"
+#include "deflate.hpp"
 
 namespace shrinkwrap
 {
+  namespace detail
+  {
+    // Offset of the first gzip member header at or after from whose ten fixed
+    // bytes lie within size, or size if there is none. Only the magic, method,
+    // reserved flag bits, XFL and OS are checked, so deflate data can contain
+    // false candidates. Readers confirm a candidate by inflating the member
+    // before it up to that offset, which checks its CRC32 and ISIZE trailer.
+    inline std::size_t gz_find_member(const std::uint8_t* data, std::size_t size, std::size_t from)
+    {
+      static const std::size_t header_size = 10;
+      while (from + header_size <= size)
+      {
+        const std::uint8_t* p = static_cast<const std::uint8_t*>(std::memchr(data + from, 0x1f, size - header_size + 1 - from));
+        if (!p)
+          break;
+        if (p[1] == 0x8b && p[2] == 8 && (p[3] & 0xe0) == 0 && (p[8] == 0 || p[8] == 2 || p[8] == 4) && (p[9] <= 13 || p[9] == 255))
+          return std::size_t(p - data);
+        from = std::size_t(p - data) + 1;
+      }
+      return size;
+    }
+  }
+
   namespace gz
   {
-    class ibuf : public std::streambuf
+    struct ibuf_options
     {
+      // Skips CRC32 computation and verification of each member. Only for data
+      // whose integrity is guaranteed elsewhere.
+      bool ignore_checks = false;
+      // Serves the stream's buffers and zlib's state. Must outlive the stream,
+      // and be thread safe with speculative_threads, whose workers share it.
+      memory_resource* resource = nullptr;
+      // Worker threads that inflate each member speculatively, after
+      // rapidgzip: chunks of the deflate data are inflated from guessed block
+      // boundaries, with bytes of the unknown preceding window left as
+      // markers until the chunk before is done. Output and checks are those
+      // of the serial reader. Needs a seekable file; 0 reads serially, as does
+      // a pipe. bgzf::ibuf cannot tell or seek while it is on.
+      std::size_t speculative_threads = 0;
+      // Compressed bytes per speculative chunk. Each chunk in flight holds
+      // up to twice this plus its output.
+      std::size_t speculative_chunk_size = 2 * 1024 * 1024;
+      // Most bytes a speculative chunk may inflate to. Chunks that expand
+      // further are inflated by the reader with zlib instead, which bounds the
+      // markers held per chunk. 0 uses 8 times speculative_chunk_size.
+      std::size_t speculative_max_chunk_output = 0;
+    };
+
+    class ibuf : public basic_ibuf<ibuf, 64 * 1024, 64 * 1024>
+    {
+      typedef basic_ibuf<ibuf, 64 * 1024, 64 * 1024> base_type;
+      friend base_type;
     public:
-      ibuf(FILE* fp)
+      ibuf(FILE* fp, const ibuf_options& opts = ibuf_options())
         :
-        zstrm_({0}),
-        compressed_buffer_(default_block_size),
-        decompressed_buffer_(default_block_size),
-        discard_amount_(0),
+        base_type(fp, opts.resource),
+        zstrm_(),
         current_block_position_(0),
-        uncompressed_block_offset_(0),
-        fp_(fp),
-        put_back_size_(0),
-        at_block_boundary_(false)
+        uncompressed_block_offset_(0)
       {
         if (fp_)
         {
+          detail::use_resource(zstrm_, opts.resource);
           zlib_res_ = inflateInit2(&zstrm_, 15 + 16); // 16 for GZIP only.
           if (zlib_res_ != Z_OK)
           {
             // TODO: handle error.
           }
+          else if (opts.ignore_checks)
+          {
+            inflateValidate(&zstrm_, 0); // persists across inflateReset().
+          }
+
+          if (opts.speculative_threads)
+          {
+            long start = ftell(fp_);
+            speculative_.reset(new detail::speculative_inflater(fp_, opts.speculative_threads, opts.speculative_chunk_size, opts.ignore_checks, opts.resource, opts.speculative_max_chunk_output));
+            if (speculative_->unusable()) // e.g. a pipe; read serially.
+            {
+              speculative_.reset();
+              if (start >= 0)
+                fseek(fp_, start, SEEK_SET);
+            }
+          }
         }
-        char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
-        setg(end, end, end);
       }
 
-      ibuf(const std::string& file_path) : ibuf(fopen(file_path.c_str(), "rb")) {}
+      ibuf(const std::string& file_path, const ibuf_options& opts = ibuf_options()) : ibuf(fopen(file_path.c_str(), "rb"), opts) {}
 #if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
       ibuf(ibuf&& src)
         :
-        std::streambuf(std::move(src))
+        base_type(std::move(src))
       {
         this->move(std::move(src));
       }
@@ -55,8 +124,8 @@ namespace shrinkwrap
       {
         if (&src != this)
         {
-          std::streambuf::operator=(std::move(src));
           this->destroy();
+          base_type::operator=(std::move(src));
           this->move(std::move(src));
         }
 
@@ -68,33 +137,29 @@ namespace shrinkwrap
         this->destroy();
       }
 
-    private:
-      //ixzbuf(const ixzbuf& src) = delete;
-      //ixzbuf& operator=(const ixzbuf& src) = delete;
+      // Speculative chunks whose output was used; 0 when reading serially.
+      std::size_t speculative_chunks_used() const { return speculative_ ? speculative_->accepted_chunks() : 0; }
 
+    private:
       void destroy()
       {
         if (fp_)
-        {
           inflateEnd(&zstrm_);
-          fclose(fp_);
-        }
       }
 
+      // z_stream points back at itself, so it is copied by zlib and the source released.
       void move(ibuf&& src)
       {
-        zstrm_ = src.zstrm_;
-        src.zstrm_ = {0};
-        compressed_buffer_ = std::move(src.compressed_buffer_);
-        decompressed_buffer_ = std::move(src.decompressed_buffer_);
-        discard_amount_ = src.discard_amount_;
+        if (fp_)
+        {
+          inflateCopy(&zstrm_, &src.zstrm_);
+          inflateEnd(&src.zstrm_);
+        }
+        src.zstrm_ = z_stream();
         current_block_position_ = src.current_block_position_;
         uncompressed_block_offset_ = src.uncompressed_block_offset_;
-        at_block_boundary_ = src.at_block_boundary_;
-        fp_ = src.fp_;
-        src.fp_ = nullptr;
-        put_back_size_ = src.put_back_size_;
         zlib_res_ = src.zlib_res_;
+        speculative_ = std::move(src.speculative_);
       }
 
       void replenish_compressed_buffer()
@@ -103,98 +168,468 @@ namespace shrinkwrap
         zstrm_.avail_in = fread(compressed_buffer_.data(), 1, compressed_buffer_.size(), fp_);
       }
 
+      bool decodable() const
+      {
+        if (speculative_)
+          return good() && !speculative_->done();
+        return good() && (zstrm_.avail_in > 0 || (!feof(fp_) && !ferror(fp_)));
+      }
+
+      bool good() const
+      {
+        return zlib_res_ == Z_OK || zlib_res_ == Z_STREAM_END;
+      }
+
+      std::size_t decode()
+      {
+        if (speculative_)
+        {
+          std::size_t decoded = speculative_->read((char*) decompressed_buffer_.data(), decompressed_buffer_.size());
+          if (!decoded && speculative_->failed())
+            zlib_res_ = Z_DATA_ERROR;
+          return decoded;
+        }
+
+        zstrm_.next_out = decompressed_buffer_.data();
+        zstrm_.avail_out = static_cast<std::uint32_t>(decompressed_buffer_.size());
+
+        if (zstrm_.avail_in == 0 && !feof(fp_) && !ferror(fp_))
+        {
+          replenish_compressed_buffer();
+        }
+
+        if (zlib_res_ == Z_STREAM_END && zstrm_.avail_in > 0)
+        {
+          zlib_res_ = inflateReset(&zstrm_);
+          uncompressed_block_offset_ = 0;
+          current_block_position_ = std::size_t(ftell(fp_)) - zstrm_.avail_in;
+        }
+
+        zlib_res_ = inflate(&zstrm_, Z_NO_FLUSH);
+
+        std::size_t decoded = decompressed_buffer_.size() - zstrm_.avail_out;
+        uncompressed_block_offset_ += decoded;
+        return decoded;
+      }
+
     protected:
+      virtual std::streambuf::pos_type seekoff(std::streambuf::off_type /*off*/, std::ios_base::seekdir /*way*/, std::ios_base::openmode /*which*/)
+      {
+        return pos_type(off_type(-1));
+      }
 
-      virtual std::streambuf::int_type underflow()
+    protected:
+      int zlib_res_;
+      z_stream zstrm_;
+      std::size_t current_block_position_;
+      std::size_t uncompressed_block_offset_;
+      std::unique_ptr<detail::speculative_inflater> speculative_;
+    };
+
+    struct parallel_ibuf_options : ibuf_options, parallel_options
+    {
+      // Compressed bytes per chunk. Chunks end at the first member header past
+      // this size, or at twice this size, so a member larger than a chunk is
+      // streamed rather than held whole.
+      std::size_t chunk_size = 1024 * 1024;
+      // Chunks inflated ahead of the reader. 0 uses twice the worker count.
+      std::size_t max_chunks_in_flight = 0;
+      // Most bytes a worker inflates from one chunk. The reader inflates the
+      // rest of a chunk that expands further (runs of zeros, zip bombs) as it is
+      // read, like a member that runs past its chunk. 0 uses 8 times chunk_size.
+      std::size_t max_chunk_output = 0;
+    };
+
+    // Reads multi-member gzip files (concatenated logs, segmenting writers,
+    // seek points) by inflating chunks of whole members concurrently and
+    // handing them out in order. Chunks are cut at candidate member headers.
+    // A chunk that inflates to a clean member end at its last byte confirms the
+    // next one's start. One that runs out of input mid-member was cut at a
+    // false candidate or inside a large member: its member is inflated on from
+    // where the worker stopped, by the reader, until the input ends at a member
+    // end and the chunks after it can be trusted again. So is one that inflates
+    // to more than max_chunk_output.
+    class parallel_ibuf : public std::streambuf
+    {
+    public:
+      parallel_ibuf(FILE* fp, const parallel_ibuf_options& opts = parallel_ibuf_options())
+        :
+        fp_(fp),
+        read_pos_(0),
+        chunk_size_(std::max<std::size_t>(1, opts.chunk_size)),
+        max_chunk_output_(opts.max_chunk_output ? opts.max_chunk_output : 8 * chunk_size_),
+        pool_(opts.pool),
+        stream_fed_(0),
+        stream_member_end_(false),
+        resource_(opts.resource),
+        ignore_checks_(opts.ignore_checks),
+        failed_(false)
       {
-        if (!fp_)
-          return traits_type::eof();
-        if (gptr() < egptr()) // buffer not exhausted
-          return traits_type::to_int_type(*gptr());
+        if (!pool_)
+        {
+          owned_pool_.reset(new thread_pool(std::max<std::size_t>(1, opts.thread_count)));
+          pool_ = owned_pool_.get();
+        }
+        window_ = opts.max_chunks_in_flight ? opts.max_chunks_in_flight : 2 * pool_->size();
+
+        char* end = current_chunk_.data() + current_chunk_.size();
+        setg(end, end, end);
+      }
+
+      parallel_ibuf(const std::string& file_path, const parallel_ibuf_options& opts = parallel_ibuf_options()) : parallel_ibuf(fopen(file_path.c_str(), "rb"), opts) {}
+
+      parallel_ibuf(const parallel_ibuf&) = delete;
+      parallel_ibuf& operator=(const parallel_ibuf&) = delete;
+
+      virtual ~parallel_ibuf()
+      {
+        cancel();
+        if (fp_)
+          fclose(fp_);
+      }
 
-        while ((zlib_res_ == Z_OK || zlib_res_ == Z_STREAM_END) && gptr() >= egptr() && (zstrm_.avail_in > 0 || (!feof(fp_) && !ferror(fp_))))
+      // True if a chunk failed to inflate or the file is truncated. The stream
+      // ends with what inflated before the error, as gz::ibuf does.
+      bool failed() const { return failed_; }
+
+    private:
+      enum class chunk_status
+      {
+        complete, // ends at a member end.
+        incomplete, // ran out of input inside a member, or hit max_chunk_output.
+        corrupt
+      };
+
+      struct chunk
+      {
+        chunk() : zstrm(), inflating(false), fed(0) {}
+
+        chunk(const chunk&) = delete;
+        chunk& operator=(const chunk&) = delete;
+
+        ~chunk()
         {
-          zstrm_.next_out = decompressed_buffer_.data();
-          zstrm_.avail_out = static_cast<std::uint32_t>(decompressed_buffer_.size());
+          if (inflating)
+            inflateEnd(&zstrm);
+        }
 
-          if (zstrm_.avail_in == 0 && !feof(fp_) && !ferror(fp_))
+        std::vector<std::uint8_t> compressed;
+        std::vector<char> decompressed;
+        z_stream zstrm; // left open when the chunk ends inside a member.
+        bool inflating;
+        std::size_t fed; // compressed bytes handed to zstrm.
+      };
+
+      // Moves the compressed bytes up to the first member header past
+      // chunk_size out of the read buffer, at most twice chunk_size of them, or
+      // the rest of the file.
+      bool read_chunk(std::vector<std::uint8_t>& dest)
+      {
+        const std::size_t max_size = 2 * chunk_size_;
+        while (true)
+        {
+          std::size_t available = std::min(read_buffer_.size() - read_pos_, max_size);
+          std::size_t cut = detail::gz_find_member(read_buffer_.data() + read_pos_, available, chunk_size_);
+          if (cut < available || available == max_size || ((feof(fp_) || ferror(fp_)) && available))
           {
-            replenish_compressed_buffer();
+            dest.assign(read_buffer_.begin() + read_pos_, read_buffer_.begin() + read_pos_ + cut);
+            read_pos_ += cut;
+            return true;
           }
 
+          if (feof(fp_) || ferror(fp_))
+          {
+            if (ferror(fp_))
+              failed_ = true;
+            return false;
+          }
 
+          read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin() + read_pos_);
+          read_pos_ = 0;
+          std::size_t used = read_buffer_.size();
+          read_buffer_.resize(used + std::max(used, chunk_size_));
+          read_buffer_.resize(used + fread(read_buffer_.data() + used, 1, read_buffer_.size() - used, fp_));
+        }
+      }
 
-          //assert(zstrm_.avail_in > 0);
-          if (zlib_res_ == Z_STREAM_END && zstrm_.avail_in > 0)
+      chunk_status decode_chunk(chunk& c) const
+      {
+        z_stream& zs = c.zstrm;
+        detail::use_resource(zs, resource_);
+        if (inflateInit2(&zs, 15 + 16) != Z_OK) // 16 for GZIP only.
+          return chunk_status::corrupt;
+        c.inflating = true;
+        if (ignore_checks_)
+          inflateValidate(&zs, 0);
+
+        std::size_t& fed = c.fed;
+        std::size_t used = 0;
+        int res = Z_OK;
+        chunk_status ret = chunk_status::incomplete;
+        c.decompressed.resize(std::min(std::max<std::size_t>(c.compressed.size() * 4, 64 * 1024), max_chunk_output_));
+        while (true)
+        {
+          if (zs.avail_in == 0 && fed < c.compressed.size())
           {
-            zlib_res_ = inflateReset(&zstrm_);
-            uncompressed_block_offset_ = 0;
-            current_block_position_ = std::size_t(ftell(fp_)) - zstrm_.avail_in;
+            std::size_t piece = std::min<std::size_t>(c.compressed.size() - fed, std::numeric_limits<uInt>::max());
+            zs.next_in = c.compressed.data() + fed;
+            zs.avail_in = uInt(piece);
+            fed += piece;
+          }
+
+          if (res == Z_STREAM_END)
+          {
+            if (zs.avail_in == 0)
+            {
+              ret = chunk_status::complete;
+              break;
+            }
+            inflateReset(&zs); // the next member.
           }
 
-          zlib_res_ = inflate(&zstrm_, Z_NO_FLUSH);
+          if (used == c.decompressed.size())
+          {
+            if (used >= max_chunk_output_)
+              break; // incomplete, the reader inflates the rest.
+            c.decompressed.resize(std::min(c.decompressed.size() * 2, max_chunk_output_));
+          }
+          std::size_t space = std::min<std::size_t>(c.decompressed.size() - used, std::numeric_limits<uInt>::max());
+          zs.next_out = reinterpret_cast<Bytef*>(c.decompressed.data() + used);
+          zs.avail_out = uInt(space);
+          res = inflate(&zs, Z_NO_FLUSH);
+          used += space - zs.avail_out;
+
+          if (res == Z_BUF_ERROR || (res == Z_OK && zs.avail_in == 0 && fed == c.compressed.size() && zs.avail_out != 0))
+            break; // incomplete
+          if (res != Z_OK && res != Z_STREAM_END)
+          {
+            ret = chunk_status::corrupt;
+            break;
+          }
+        }
+
+        if (ret != chunk_status::incomplete)
+        {
+          inflateEnd(&zs);
+          c.inflating = false;
+        }
+        c.decompressed.resize(used);
+        return ret;
+      }
 
+      std::future<chunk_status> submit(const std::shared_ptr<chunk>& c)
+      {
+        return pool_->submit([this, c]() { return decode_chunk(*c); });
+      }
+
+      void fill_window()
+      {
+        while (in_flight_.size() < window_ && !failed_)
+        {
+          std::shared_ptr<chunk> c(new chunk());
+          if (!read_chunk(c->compressed))
+            break;
+          std::future<chunk_status> decoded = submit(c);
+          in_flight_.push_back(std::make_pair(c, std::move(decoded)));
+        }
+      }
 
-          char* start = ((char*) decompressed_buffer_.data());
-          setg(start, start, start + (decompressed_buffer_.size() - zstrm_.avail_out));
-          uncompressed_block_offset_ += (egptr() - gptr());
+      // Takes the compressed bytes of the next chunk, dropping what its worker
+      // inflated. Chunks in flight are contiguous with the streamed one.
+      bool take_next(std::vector<std::uint8_t>& dest)
+      {
+        if (in_flight_.empty())
+          return read_chunk(dest);
+        in_flight_.front().second.wait();
+        dest.swap(in_flight_.front().first->compressed);
+        in_flight_.pop_front();
+        return true;
+      }
 
-          if (discard_amount_ > 0)
+      // Inflates the member that ran past its chunk on from where the worker
+      // stopped, with input from the chunks after it, into current_chunk_.
+      // Streaming ends once the input ends at a member end.
+      std::size_t stream_member()
+      {
+        z_stream& zs = streaming_->zstrm;
+        std::vector<std::uint8_t>& input = streaming_->compressed;
+        current_chunk_.resize(std::max<std::size_t>(chunk_size_, 64 * 1024));
+        std::size_t space = std::min<std::size_t>(current_chunk_.size(), std::numeric_limits<uInt>::max());
+        zs.next_out = reinterpret_cast<Bytef*>(current_chunk_.data());
+        zs.avail_out = uInt(space);
+
+        bool ok = true;
+        while (zs.avail_out > 0)
+        {
+          if (zs.avail_in == 0 && stream_fed_ == input.size())
           {
-            std::uint64_t advance_amount = discard_amount_;
-            if ((egptr() - gptr()) < advance_amount)
-              advance_amount = (egptr() - gptr());
-            setg(start, gptr() + advance_amount, egptr());
-            discard_amount_ -= advance_amount;
+            if (stream_member_end_)
+              break;
+            input.clear();
+            stream_fed_ = 0;
+            if (!take_next(input))
+            {
+              ok = false; // truncated file.
+              break;
+            }
+          }
+
+          if (zs.avail_in == 0)
+          {
+            std::size_t piece = std::min<std::size_t>(input.size() - stream_fed_, std::numeric_limits<uInt>::max());
+            zs.next_in = input.data() + stream_fed_;
+            zs.avail_in = uInt(piece);
+            stream_fed_ += piece;
+          }
+
+          if (stream_member_end_)
+          {
+            inflateReset(&zs); // the next member.
+            stream_member_end_ = false;
+          }
+
+          int res = inflate(&zs, Z_NO_FLUSH);
+          if (res == Z_STREAM_END)
+            stream_member_end_ = true;
+          else if (res != Z_OK && res != Z_BUF_ERROR)
+          {
+            ok = false;
+            break;
           }
         }
 
-        if (zlib_res_ != Z_OK && zlib_res_ != Z_STREAM_END)
-          return traits_type::eof();
-        else if (gptr() >= egptr())
-          return traits_type::eof();
+        if (!ok)
+        {
+          failed_ = true;
+          cancel();
+        }
+        std::size_t decoded = space - zs.avail_out;
+        if (!ok || (stream_member_end_ && zs.avail_in == 0 && stream_fed_ == input.size()))
+          streaming_.reset();
+        return decoded;
+      }
 
-        return traits_type::to_int_type(*gptr());
+      // Waits for outstanding chunks, which reference this object.
+      void cancel()
+      {
+        for (auto it = in_flight_.begin(); it != in_flight_.end(); ++it)
+          it->second.wait();
+        in_flight_.clear();
       }
 
-      virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir way, std::ios_base::openmode which)
+    protected:
+      virtual std::streambuf::int_type underflow()
       {
-        return pos_type(off_type(-1));
+        if (!fp_)
+          return traits_type::eof();
+        if (gptr() < egptr()) // buffer not exhausted
+          return traits_type::to_int_type(*gptr());
+
+        while (true)
+        {
+          if (streaming_)
+          {
+            std::size_t decoded = stream_member();
+            if (decoded)
+            {
+              setg(current_chunk_.data(), current_chunk_.data(), current_chunk_.data() + decoded);
+              return traits_type::to_int_type(*gptr());
+            }
+            continue;
+          }
+
+          fill_window();
+          if (in_flight_.empty())
+            return traits_type::eof();
+
+          std::shared_ptr<chunk> c = in_flight_.front().first;
+          chunk_status status = in_flight_.front().second.get();
+          in_flight_.pop_front();
+          if (status == chunk_status::incomplete)
+          {
+            streaming_ = c; // after handing out what the worker inflated.
+            stream_fed_ = c->fed;
+            stream_member_end_ = false;
+          }
+
+          if (status == chunk_status::corrupt)
+          {
+            failed_ = true;
+            cancel();
+          }
+
+          current_chunk_.swap(c->decompressed);
+          if (!current_chunk_.empty())
+          {
+            setg(current_chunk_.data(), current_chunk_.data(), current_chunk_.data() + current_chunk_.size());
+            return traits_type::to_int_type(*gptr());
+          }
+          if (failed_)
+            return traits_type::eof();
+        }
       }
 
     private:
-      std::vector<std::uint8_t> compressed_buffer_;
-      std::vector<std::uint8_t> decompressed_buffer_;
-      std::size_t put_back_size_;
-      bool at_block_boundary_;
-    protected:
-      static const std::size_t default_block_size = 64 * 1024;
-      int zlib_res_;
-      z_stream zstrm_;
-      std::uint16_t discard_amount_;
-      std::size_t current_block_position_;
-      std::size_t uncompressed_block_offset_;
       FILE* fp_;
+      std::vector<std::uint8_t> read_buffer_;
+      std::size_t read_pos_;
+      std::size_t chunk_size_;
+      std::size_t max_chunk_output_;
+      std::vector<char> current_chunk_;
+      std::unique_ptr<thread_pool> owned_pool_;
+      thread_pool* pool_;
+      std::size_t window_;
+      std::deque<std::pair<std::shared_ptr<chunk>, std::future<chunk_status>>> in_flight_;
+      std::shared_ptr<chunk> streaming_;
+      std::size_t stream_fed_;
+      bool stream_member_end_;
+      memory_resource* resource_;
+      bool ignore_checks_;
+      bool failed_;
     };
 
-    class obuf : public std::streambuf
+    // BGZF ignores the flush and seek point options, as its blocks already are
+    // seek points.
+    struct obuf_options : seek_point_options
     {
+      int compression_level = 6; // Z_DEFAULT_COMPRESSION
+      // Moves the level between min_level and max_level so that compression
+      // keeps up with the caller. New levels take effect between deflate blocks.
+      bool adaptive_level = false;
+      int min_level = 1;
+      int max_level = 9;
+      // Serves the stream's buffers and zlib's state. Must outlive the stream.
+      memory_resource* resource = nullptr;
+      // Done on flush() and when the 64 KiB put area fills. end_block starts a
+      // new gzip member.
+      flush_mode on_flush = flush_mode::sync;
+      flush_mode on_buffer_full = flush_mode::none;
+      // Stores pieces (put areas, BGZF blocks) that a sample shows won't
+      // compress, instead of deflating them at the configured level.
+      bool detect_incompressible = true;
+    };
+
+    class obuf : public basic_obuf<obuf, 64 * 1024, 64 * 1024>
+    {
+      typedef basic_obuf<obuf, 64 * 1024, 64 * 1024> base_type;
+      friend base_type;
     public:
-      obuf(FILE* fp)
+      obuf(FILE* fp, const obuf_options& opts = obuf_options())
         :
-        zstrm_({0}),
-        fp_(fp),
-        compressed_buffer_(default_block_size),
-        decompressed_buffer_(default_block_size)
+        base_type(fp, opts.resource),
+        zstrm_(),
+        level_ctl_(opts.compression_level, opts.min_level, opts.max_level, opts.adaptive_level),
+        on_flush_(opts.on_flush),
+        on_buffer_full_(opts.on_buffer_full),
+        member_ended_(false),
+        detect_incompressible_(opts.detect_incompressible),
+        level_(level_ctl_.level()),
+        seek_points_(opts)
       {
-        if (!fp_)
-        {
-          char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
-          setp(end, end);
-        }
-        else
+        if (fp_)
         {
-          zlib_res_ = deflateInit2(&zstrm_, Z_DEFAULT_COMPRESSION, Z_DEFLATED, (15 | 16), 8, Z_DEFAULT_STRATEGY); // |16 for GZIP
+          detail::use_resource(zstrm_, opts.resource);
+          zlib_res_ = deflateInit2(&zstrm_, level_, Z_DEFLATED, (15 | 16), 8, Z_DEFAULT_STRATEGY); // |16 for GZIP
           if (zlib_res_ != Z_OK)
           {
             // TODO: handle error.
@@ -202,17 +637,14 @@ namespace shrinkwrap
 
           zstrm_.next_out = compressed_buffer_.data();
           zstrm_.avail_out = static_cast<std::uint32_t>(compressed_buffer_.size());
-
-          char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
-          setp((char*) decompressed_buffer_.data(), end);
         }
       }
 
-      obuf(const std::string& file_path) : obuf(fopen(file_path.c_str(), "wb")) {}
+      obuf(const std::string& file_path, const obuf_options& opts = obuf_options()) : obuf(fopen(file_path.c_str(), "wb"), opts) {}
 #if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
       obuf(obuf&& src)
         :
-        std::streambuf(std::move(src))
+        base_type(std::move(src))
       {
         this->move(std::move(src));
       }
@@ -221,8 +653,8 @@ namespace shrinkwrap
       {
         if (&src != this)
         {
-          std::streambuf::operator=(std::move(src));
           this->close();
+          base_type::operator=(std::move(src));
           this->move(std::move(src));
         }
 
@@ -235,116 +667,155 @@ namespace shrinkwrap
       }
 
     private:
+      // z_stream points back at itself, so it is copied by zlib and the source released.
       void move(obuf&& src)
       {
-        compressed_buffer_ = std::move(src.compressed_buffer_);
-        decompressed_buffer_ = std::move(src.decompressed_buffer_);
-        zstrm_ = src.zstrm_;
-        fp_ = src.fp_;
-        src.fp_ = nullptr;
+        if (fp_)
+        {
+          deflateCopy(&zstrm_, &src.zstrm_);
+          deflateEnd(&src.zstrm_);
+        }
+        src.zstrm_ = z_stream();
         zlib_res_ = src.zlib_res_;
+        level_ctl_ = src.level_ctl_;
+        on_flush_ = src.on_flush_;
+        on_buffer_full_ = src.on_buffer_full_;
+        member_ended_ = src.member_ended_;
+        detect_incompressible_ = src.detect_incompressible_;
+        level_ = src.level_;
+        seek_points_ = src.seek_points_;
       }
 
-      void close()
+      // Switches deflate to level, the adaptive one or Z_NO_COMPRESSION for
+      // incompressible pieces. deflateParams ends the current deflate block with
+      // what it has buffered and reports Z_BUF_ERROR, without changing the
+      // level, when that does not fit the output buffer.
+      int set_level(int level)
       {
-        if (fp_)
+        do
         {
-          sync();
-          int res = deflateEnd(&zstrm_);
-          if (zlib_res_ == Z_OK)
-            zlib_res_ = res;
-          fclose(fp_);
-          fp_ = nullptr;
-        }
+          zlib_res_ = deflateParams(&zstrm_, level, Z_DEFAULT_STRATEGY);
+          if ((compressed_buffer_.size() - zstrm_.avail_out) > 0 && !fwrite(compressed_buffer_.data(), compressed_buffer_.size() - zstrm_.avail_out, 1, fp_))
+            return -1;
+          zstrm_.next_out = compressed_buffer_.data();
+          zstrm_.avail_out = static_cast<std::uint32_t>(compressed_buffer_.size());
+        } while (zlib_res_ == Z_BUF_ERROR);
+
+        if (zlib_res_ != Z_OK)
+          return -1;
+        level_ = level;
+        return 0;
       }
-    protected:
-      virtual int overflow(int c)
-      {
-        if (!fp_)
-          return traits_type::eof();
 
-        if ((epptr() - pptr()) > 0)
+      static int deflate_flush(flush_mode mode)
+      {
+        switch (mode)
         {
-          assert(!"Put buffer not empty, this should never happen");
-          this->sputc(static_cast<char>(0xFF & c));
+          case flush_mode::none: return Z_NO_FLUSH;
+          case flush_mode::sync: return Z_SYNC_FLUSH;
+          case flush_mode::full: return Z_FULL_FLUSH;
+          default: return Z_FINISH;
         }
-        else
+      }
+
+      void close()
+      {
+        if (fp_)
         {
-          zstrm_.next_in = decompressed_buffer_.data();
-          zstrm_.avail_in = static_cast<std::uint32_t>(decompressed_buffer_.size());
-          while (zlib_res_ == Z_OK && zstrm_.avail_in > 0)
-          {
-            zlib_res_ = deflate(&zstrm_, Z_SYNC_FLUSH);
+          sync();
 
+          // Write the final deflate block and the gzip trailer (CRC32/ISIZE),
+          // unless the last flush already ended the member.
+          zstrm_.next_in = nullptr;
+          zstrm_.avail_in = 0;
+          while (zlib_res_ == Z_OK && !member_ended_)
+          {
+            zlib_res_ = deflate(&zstrm_, Z_FINISH);
             if ((compressed_buffer_.size() - zstrm_.avail_out) > 0 && !fwrite(compressed_buffer_.data(), compressed_buffer_.size() - zstrm_.avail_out, 1, fp_))
-            {
-              // TODO: handle error.
-              return traits_type::eof();
-            }
+              break;
             zstrm_.next_out = compressed_buffer_.data();
             zstrm_.avail_out = static_cast<std::uint32_t>(compressed_buffer_.size());
           }
-
           if (zlib_res_ == Z_STREAM_END)
-            zlib_res_ = deflateReset(&zstrm_);
+            zlib_res_ = Z_OK;
 
-          assert(zstrm_.avail_in == 0);
-          decompressed_buffer_[0] = reinterpret_cast<unsigned char&>(c);
-          setp((char*) decompressed_buffer_.data() + 1, (char*) decompressed_buffer_.data() + decompressed_buffer_.size());
+          int res = deflateEnd(&zstrm_);
+          if (zlib_res_ == Z_OK)
+            zlib_res_ = res;
+          fclose(fp_);
+          fp_ = nullptr;
         }
-
-        return (zlib_res_ == Z_OK ? traits_type::to_int_type(c) : traits_type::eof());
       }
 
-      virtual int sync()
+      // A flushing mode runs deflate until its output no longer fills the
+      // buffer. Z_FINISH ends the member and the next piece starts another.
+      bool encode(std::uint8_t* data, std::size_t size, bool flush)
       {
-        if (!fp_)
-          return -1;
-
-        zstrm_.next_in = decompressed_buffer_.data();
-        zstrm_.avail_in = static_cast<std::uint32_t>(decompressed_buffer_.size() - (epptr() - pptr()));
-        if (zstrm_.avail_in)
+        return seek_points_.split(data, size, flush ? on_flush_ : on_buffer_full_, [this](std::uint8_t* piece, std::size_t piece_size, flush_mode mode)
         {
-          while (zlib_res_ == Z_OK && zstrm_.avail_in > 0)
-          {
-            zlib_res_ = deflate(&zstrm_, Z_SYNC_FLUSH);
+          return encode_piece(piece, piece_size, mode);
+        });
+      }
 
-            if ((compressed_buffer_.size() - zstrm_.avail_out) > 0 && !fwrite(compressed_buffer_.data(), compressed_buffer_.size() - zstrm_.avail_out, 1, fp_))
-            {
-              // TODO: handle error.
-              return -1;
-            }
-            zstrm_.next_out = compressed_buffer_.data();
-            zstrm_.avail_out = static_cast<std::uint32_t>(compressed_buffer_.size());
+      bool encode_piece(std::uint8_t* data, std::size_t size, flush_mode mode)
+      {
+        int deflate_mode = deflate_flush(mode);
+        int level = detect_incompressible_ && detail::looks_incompressible(data, size) ? Z_NO_COMPRESSION : level_ctl_.level();
+        if (zlib_res_ == Z_OK && level != level_ && set_level(level) != 0)
+          return false;
+
+        zstrm_.next_in = data;
+        zstrm_.avail_in = static_cast<std::uint32_t>(size);
+        level_ctl_.begin_work();
+        bool output_full = false;
+        while (zlib_res_ == Z_OK && (zstrm_.avail_in > 0 || (deflate_mode != Z_NO_FLUSH && (output_full || deflate_mode == Z_FINISH))))
+        {
+          zlib_res_ = deflate(&zstrm_, deflate_mode);
+          level_ctl_.end_compress();
 
+          output_full = zstrm_.avail_out == 0;
+          if ((compressed_buffer_.size() - zstrm_.avail_out) > 0 && !fwrite(compressed_buffer_.data(), compressed_buffer_.size() - zstrm_.avail_out, 1, fp_))
+          {
+            // TODO: handle error.
+            return false;
           }
-
-          if (zlib_res_ != Z_OK)
-            return -1;
-
-          assert(zstrm_.avail_in == 0);
-          setp((char*) decompressed_buffer_.data(), (char*) decompressed_buffer_.data() + decompressed_buffer_.size());
+          level_ctl_.end_write();
+          zstrm_.next_out = compressed_buffer_.data();
+          zstrm_.avail_out = static_cast<std::uint32_t>(compressed_buffer_.size());
         }
 
-        return 0;
+        if (zlib_res_ == Z_BUF_ERROR) // a flush that had already completed.
+          zlib_res_ = Z_OK;
+        member_ended_ = zlib_res_ == Z_STREAM_END;
+        if (zlib_res_ == Z_STREAM_END)
+          zlib_res_ = deflateReset(&zstrm_);
+        if (zlib_res_ != Z_OK)
+          return false;
+        level_ctl_.update(); // applied by the next piece.
+
+        assert(zstrm_.avail_in == 0);
+        return true;
       }
 
     private:
-      static const std::size_t default_block_size = 64 * 1024;
-      std::vector<std::uint8_t> compressed_buffer_;
-      std::vector<std::uint8_t> decompressed_buffer_;
       z_stream zstrm_;
-      FILE* fp_;
       int zlib_res_;
+      detail::level_controller level_ctl_;
+      flush_mode on_flush_;
+      flush_mode on_buffer_full_;
+      bool member_ended_;
+      bool detect_incompressible_;
+      int level_; // deflate's current level.
+      detail::seek_point_splitter seek_points_;
     };
 
     class istream : public std::istream
     {
     public:
-      istream(const std::string& file_path)
+      istream(const std::string& file_path, const ibuf_options& opts = ibuf_options())
         :
         std::istream(&sbuf_),
-        sbuf_(file_path)
+        sbuf_(file_path, opts)
       {
       }
 #if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
@@ -369,15 +840,30 @@ namespace shrinkwrap
       ::shrinkwrap::gz::ibuf sbuf_;
     };
 
+    class parallel_istream : public std::istream
+    {
+    public:
+      parallel_istream(const std::string& file_path, const parallel_ibuf_options& opts = parallel_ibuf_options())
+        :
+        std::istream(&sbuf_),
+        sbuf_(file_path, opts)
+      {
+      }
+
+      bool failed() const { return sbuf_.failed(); }
+    private:
+      ::shrinkwrap::gz::parallel_ibuf sbuf_;
+    };
+
 
 
     class ostream : public std::ostream
     {
     public:
-      ostream(const std::string& file_path)
+      ostream(const std::string& file_path, const obuf_options& opts = obuf_options())
         :
         std::ostream(&sbuf_),
-        sbuf_(file_path)
+        sbuf_(file_path, opts)
       {
       }
 #if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
@@ -403,8 +889,226 @@ namespace shrinkwrap
     };
   }
 
+  namespace detail
+  {
+    // Compresses one BGZF block: header, raw deflate data and CRC32/ISIZE footer.
+    // The deflate state is set up on the first block and reset for each later
+    // one, so blocks after the first do not allocate.
+    class bgzf_block_encoder
+    {
+    public:
+      static const std::size_t max_block_size = 0x10000; // 64k
+      // Same limit as htslib, which leaves room for deflate's stored block
+      // overhead so that any input fits in a single BGZF block.
+      static const std::size_t max_input_length = 0xff00;
+
+      bgzf_block_encoder(memory_resource* resource = nullptr, bool detect_incompressible = true)
+        :
+        compressed_buffer_(resource),
+        resource_(resource),
+        zs_(),
+        zs_level_(no_stream),
+        detect_incompressible_(detect_incompressible)
+      {
+      }
+
+      bgzf_block_encoder(const bgzf_block_encoder&) = delete;
+      bgzf_block_encoder& operator=(const bgzf_block_encoder&) = delete;
+
+      // The deflate state refers to itself and holds nothing between blocks, so
+      // a moved-to encoder starts a new one.
+      bgzf_block_encoder(bgzf_block_encoder&& src)
+        :
+        compressed_buffer_(std::move(src.compressed_buffer_)),
+        resource_(src.resource_),
+        zs_(),
+        zs_level_(no_stream),
+        detect_incompressible_(src.detect_incompressible_)
+      {
+        src.end_stream();
+      }
+
+      bgzf_block_encoder& operator=(bgzf_block_encoder&& src)
+      {
+        if (&src != this)
+        {
+          end_stream();
+          compressed_buffer_ = std::move(src.compressed_buffer_);
+          resource_ = src.resource_;
+          detect_incompressible_ = src.detect_incompressible_;
+          src.end_stream();
+        }
+        return *this;
+      }
+
+      ~bgzf_block_encoder()
+      {
+        end_stream();
+      }
+
+      // Returns the length of the block at data(), or 0 on failure. An empty
+      // input yields the BGZF EOF marker.
+      std::size_t encode(const std::uint8_t* input, std::uint32_t input_length, int level)
+      {
+        /* BGZF/GZIP header (speciallized from RFC 1952; little endian):
+         * +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+         * | 31|139|  8|  4|              0|  0|255|      6| 66| 67|      2|BLK_LEN|
+         * +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+         */
+        const std::array<uint8_t, block_header_length> block_header = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 0, 0};
+
+        std::uint8_t *buffer = compressed_buffer_.data();
+        std::uint32_t compressed_length = 0;
+
+        if (input_length > max_input_length)
+          return 0;
+
+        std::memcpy(buffer, block_header.data(), block_header_length); // the last two bytes are a place holder for the length of the block
+
+        // Blocks that do not compress enough are stored rather than divided, so
+        // every byte stays in the block that tellp() reported for it. Blocks the
+        // probe expects to end up stored skip the first attempt.
+        int zlib_res = Z_OK;
+        if (level != Z_NO_COMPRESSION && !(detect_incompressible_ && looks_incompressible(input, input_length)))
+          zlib_res = deflate_block(input, input_length, level, compressed_length);
+        if (zlib_res == Z_OK || zlib_res == Z_BUF_ERROR)
+          zlib_res = deflate_block(input, input_length, Z_NO_COMPRESSION, compressed_length);
+
+        if (zlib_res != Z_STREAM_END)
+          return 0;
+
+        compressed_length += block_header_length + block_footer_length;
+        assert(compressed_length <= max_block_size);
+
+        pack_int_16(&buffer[16], static_cast<std::uint16_t>(compressed_length - 1)); // write the compressed_length; -1 to fit 2 bytes
+        std::uint32_t crc = crc32(0L, NULL, 0L);
+        crc = crc32(crc, input, input_length);
+        pack_int_32(&buffer[compressed_length - 8], crc);
+        pack_int_32(&buffer[compressed_length - 4], input_length);
+        return compressed_length;
+      }
+
+      const std::uint8_t* data() const { return compressed_buffer_.data(); }
+
+      static void pack_int_16(uint8_t *buffer, uint16_t value)
+      {
+        buffer[0] = uint8_t(value);
+        buffer[1] = uint8_t(value >> 8);
+      }
+
+      static void pack_int_32(uint8_t *buffer, uint32_t value)
+      {
+        buffer[0] = uint8_t(value);
+        buffer[1] = uint8_t(value >> 8);
+        buffer[2] = uint8_t(value >> 16);
+        buffer[3] = uint8_t(value >> 24);
+      }
+
+      static void pack_int_64(uint8_t *buffer, uint64_t value)
+      {
+        pack_int_32(buffer, uint32_t(value));
+        pack_int_32(buffer + 4, uint32_t(value >> 32));
+      }
+
+    private:
+      // Raw deflates the input into the compressed buffer after the header.
+      // Returns Z_STREAM_END on success and Z_OK or Z_BUF_ERROR if the output did
+      // not fit.
+      int deflate_block(const std::uint8_t* input, std::uint32_t input_length, int level, std::uint32_t& output_length)
+      {
+        if (!start_block(level))
+          return Z_STREAM_ERROR;
+
+        zs_.next_in = const_cast<std::uint8_t*>(input);
+        zs_.avail_in = input_length;
+
+        int zlib_res = deflate(&zs_, Z_FINISH);
+        output_length = static_cast<std::uint32_t>(zs_.total_out);
+        return zlib_res;
+      }
+
+      // Readies the deflate state for a new block at level, creating it if needed.
+      bool start_block(int level)
+      {
+        if (zs_level_ == no_stream)
+        {
+          use_resource(zs_, resource_);
+          if (deflateInit2(&zs_, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) // -15 to disable zlib header/footer
+            return false;
+          zs_level_ = level;
+        }
+        else if (deflateReset(&zs_) != Z_OK)
+        {
+          return false;
+        }
+
+        zs_.next_out = &compressed_buffer_[block_header_length];
+        zs_.avail_out = static_cast<std::uint32_t>(compressed_buffer_.size() - block_header_length - block_footer_length);
+        if (level != zs_level_)
+        {
+          // Nothing is pending after a reset, so this only swaps parameters.
+          if (deflateParams(&zs_, level, Z_DEFAULT_STRATEGY) != Z_OK)
+            return false;
+          zs_level_ = level;
+        }
+        return true;
+      }
+
+      void end_stream()
+      {
+        if (zs_level_ != no_stream)
+          deflateEnd(&zs_);
+        zs_ = z_stream();
+        zs_level_ = no_stream;
+      }
+
+    private:
+      static const std::size_t block_header_length = 18;
+      static const std::size_t block_footer_length = 8;
+      static const int no_stream = -2; // zs_level_ before deflateInit2.
+      fixed_buffer<max_block_size> compressed_buffer_;
+      memory_resource* resource_;
+      z_stream zs_;
+      int zs_level_;
+      bool detect_incompressible_;
+    };
+  }
+
   namespace bgzf
   {
+    typedef gz::ibuf_options ibuf_options;
+
+    // Walks the BGZF block headers from the start of the file without inflating.
+    // Returns false if the file is not BGZF. The file position is left undefined.
+    inline bool scan_blocks(FILE* fp, std::vector<block_info>& blocks)
+    {
+      blocks.clear();
+      if (!fp || fseek(fp, 0, SEEK_SET))
+        return false;
+
+      std::array<std::uint8_t, 18> header;
+      std::array<std::uint8_t, 4> isize;
+      std::uint64_t compressed_offset = 0;
+      std::uint64_t uncompressed_offset = 0;
+      std::size_t read_size;
+      while ((read_size = fread(header.data(), 1, header.size(), fp)) == header.size())
+      {
+        if (header[0] != 31 || header[1] != 139 || header[2] != 8 || (header[3] & 4) == 0 || header[12] != 66 || header[13] != 67 || header[14] != 2 || header[15] != 0)
+          return false;
+
+        std::uint64_t block_size = (std::uint64_t(header[16]) | (std::uint64_t(header[17]) << 8)) + 1;
+        if (fseek(fp, long(compressed_offset + block_size - isize.size()), SEEK_SET) || !fread(isize.data(), isize.size(), 1, fp))
+          return false;
+
+        std::uint64_t uncompressed_size = std::uint64_t(isize[0]) | (std::uint64_t(isize[1]) << 8) | (std::uint64_t(isize[2]) << 16) | (std::uint64_t(isize[3]) << 24);
+        blocks.push_back(block_info(compressed_offset, block_size, uncompressed_offset, uncompressed_size));
+        compressed_offset += block_size;
+        uncompressed_offset += uncompressed_size;
+      }
+
+      return read_size == 0 && !ferror(fp);
+    }
+
     class ibuf : public gz::ibuf
     {
     public:
@@ -420,7 +1124,7 @@ namespace shrinkwrap
       {
         if (&src != this)
         {
-          ibuf::operator=(std::move(src));
+          gz::ibuf::operator=(std::move(src));
         }
 
         return *this;
@@ -432,9 +1136,9 @@ namespace shrinkwrap
       }
 
     protected:
-      virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir way, std::ios_base::openmode which) // Supports tellg for virtual offset.
+      virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir way, std::ios_base::openmode /*which*/) // Supports tellg for virtual offset.
       {
-        if (off == 0 && way == std::ios::cur)
+        if (off == 0 && way == std::ios::cur && !speculative_)
         {
           if (egptr() - gptr() == 0 && zlib_res_ == Z_STREAM_END)
           {
@@ -455,12 +1159,12 @@ namespace shrinkwrap
       }
 
       //coffset << 16 | uoffset
-      virtual std::streambuf::pos_type seekpos(std::streambuf::pos_type pos, std::ios_base::openmode which)
+      virtual std::streambuf::pos_type seekpos(std::streambuf::pos_type pos, std::ios_base::openmode /*which*/)
       {
         std::uint64_t compressed_offset = ((static_cast<std::uint64_t>(pos) >> 16) & 0x0000FFFFFFFFFFFF);
         std::uint16_t uncompressed_offset = (std::uint16_t) (static_cast<std::uint64_t>(pos) & 0x000000000000FFFF);
 
-        if (fp_ == 0 || sync())
+        if (fp_ == 0 || speculative_ || sync())
           return pos_type(off_type(-1));
 
         long seek_amount = static_cast<long>(compressed_offset);
@@ -473,43 +1177,45 @@ namespace shrinkwrap
         zstrm_.next_in = nullptr;
         zstrm_.avail_in = 0;
         zlib_res_ = inflateReset(&zstrm_);
-        char* end = egptr();
-        setg(end, end, end);
+        reset_get_area();
 
         return pos;
       }
     };
 
-    class obuf : public std::streambuf
+    struct obuf_options : gz::obuf_options
+    {
+      // Writes a .gzi index (as produced by "bgzip -i") next to the output file
+      // on close. Only honored when the obuf is opened with a file path.
+      bool write_gzi_index = false;
+    };
+
+    class obuf : public basic_obuf<obuf, 0, detail::bgzf_block_encoder::max_input_length>
     {
+      typedef basic_obuf<obuf, 0, detail::bgzf_block_encoder::max_input_length> base_type;
+      friend base_type;
     public:
-      obuf(FILE* fp, std::ios::open_mode mode = std::ios::out)
+      obuf(FILE* fp, std::ios::openmode mode = std::ios::out, const obuf_options& opts = obuf_options())
         :
-        fp_(fp),
-        compressed_buffer_(bgzf_block_size),
-        decompressed_buffer_(bgzf_block_size)
+        base_type(fp, opts.resource),
+        encoder_(opts.resource, opts.detect_incompressible),
+        block_address_(0),
+        uncompressed_address_(0),
+        level_ctl_(opts.compression_level, opts.min_level, opts.max_level, opts.adaptive_level)
       {
-        if (!fp_ || ferror(fp_))
+        if (fp_ && ferror(fp_))
         {
           char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
           setp(end, end);
         }
-        else
+        else if (fp_)
         {
-          char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
-          setp((char*) decompressed_buffer_.data(), end);
-
           if (mode & std::ios::app)
           {
-            bool has_eof = false;
-
-            const std::array<std::uint8_t, 28> empty_block = {31, 139, 10, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+            const std::array<std::uint8_t, 28> empty_block = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
             std::array<std::uint8_t, 28>  buf;
 
-            fseek(fp_, -28, SEEK_END);
-            fread(buf.data(), buf.size(), 1, fp_);
-
-            if (memcmp(empty_block.data(), buf.data(), buf.size()) == 0)
+            if (fseek(fp_, -28, SEEK_END) == 0 && fread(buf.data(), buf.size(), 1, fp_) && memcmp(empty_block.data(), buf.data(), buf.size()) == 0)
             {
               // Overwrite the trailing EOF.
               fseek(fp_, -28, SEEK_END);
@@ -520,15 +1226,39 @@ namespace shrinkwrap
               fseek(fp_, 0, SEEK_END);
             }
 
+            long pos = ftell(fp_);
+            block_address_ = pos > 0 ? std::uint64_t(pos) : 0;
           }
         }
       }
 
-      obuf(const std::string& file_path, std::ios::open_mode mode = std::ios::out) : obuf(fopen(file_path.c_str(), mode & std::ios::app ? "r+b" : "wb"), mode) {}
+      obuf(const std::string& file_path, std::ios::openmode mode = std::ios::out, const obuf_options& opts = obuf_options())
+        : obuf(fopen(file_path.c_str(), mode & std::ios::app ? "r+b" : "wb"), mode, opts)
+      {
+        if (fp_ && opts.write_gzi_index)
+        {
+          gzi_path_ = file_path + ".gzi";
+          if (block_address_ > 0)
+          {
+            // Recover index entries and the uncompressed size of the existing data.
+            std::vector<block_info> blocks;
+            if (scan_blocks(fp_, blocks))
+            {
+              for (auto it = blocks.begin(); it != blocks.end() && it->compressed_offset < block_address_; ++it)
+              {
+                if (it->compressed_offset > 0)
+                  gzi_entries_.push_back(std::make_pair(it->compressed_offset, uncompressed_address_));
+                uncompressed_address_ += it->uncompressed_size;
+              }
+            }
+            fseek(fp_, long(block_address_), SEEK_SET);
+          }
+        }
+      }
 #if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
       obuf(obuf&& src)
         :
-        std::streambuf(std::move(src))
+        base_type(std::move(src))
       {
         this->move(std::move(src));
       }
@@ -537,8 +1267,8 @@ namespace shrinkwrap
       {
         if (&src != this)
         {
-          std::streambuf::operator=(std::move(src));
           this->close();
+          base_type::operator=(std::move(src));
           this->move(std::move(src));
         }
 
@@ -553,10 +1283,12 @@ namespace shrinkwrap
     private:
       void move(obuf&& src)
       {
-        compressed_buffer_ = std::move(src.compressed_buffer_);
-        decompressed_buffer_ = std::move(src.decompressed_buffer_);
-        fp_ = src.fp_;
-        src.fp_ = nullptr;
+        encoder_ = std::move(src.encoder_);
+        block_address_ = src.block_address_;
+        uncompressed_address_ = src.uncompressed_address_;
+        gzi_path_ = std::move(src.gzi_path_);
+        gzi_entries_ = std::move(src.gzi_entries_);
+        level_ctl_ = src.level_ctl_;
       }
 
       void close()
@@ -568,43 +1300,50 @@ namespace shrinkwrap
 
           fclose(fp_);
           fp_ = nullptr;
+
+          if (!gzi_path_.empty())
+            write_gzi_index();
         }
       }
-    protected:
-      // tellp won't work because there is no guarantee that the uncompressed block
-      // won't be divided into multiple compressed blocks when synced.
-      //virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir way, std::ios_base::openmode which);
-
 
-      virtual int overflow(int c)
+      // Little endian entry count followed by (compressed, uncompressed) offset
+      // pairs for every block but the first.
+      bool write_gzi_index()
       {
-        if (!fp_)
-          return traits_type::eof();
-
-        if ((epptr() - pptr()) > 0)
+        FILE* fp = fopen(gzi_path_.c_str(), "wb");
+        if (!fp)
+          return false;
+
+        std::array<std::uint8_t, 16> buf;
+        detail::bgzf_block_encoder::pack_int_64(buf.data(), gzi_entries_.size());
+        bool ret = fwrite(buf.data(), 8, 1, fp) == 1;
+        for (auto it = gzi_entries_.begin(); ret && it != gzi_entries_.end(); ++it)
         {
-          assert(!"Put buffer not empty, this should never happen");
-          this->sputc(static_cast<char>(0xFF & c));
+          detail::bgzf_block_encoder::pack_int_64(&buf[0], it->first);
+          detail::bgzf_block_encoder::pack_int_64(&buf[8], it->second);
+          ret = fwrite(buf.data(), buf.size(), 1, fp) == 1;
         }
-        else
-        {
-          if (sync() != 0)
-            return traits_type::eof();
-
 
-          (*pptr()) = reinterpret_cast<unsigned char&>(c);
-          setp(pptr() + 1, (char*) decompressed_buffer_.data() + decompressed_buffer_.size());
+        return (fclose(fp) == 0 && ret);
+      }
+    protected:
+      // tellp returns the BGZF virtual offset ((block_address << 16) | in_block_offset)
+      // of the next byte to be written. It stays valid after the block is flushed
+      // since blocks are never divided when compressed.
+      virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir way, std::ios_base::openmode which)
+      {
+        if (fp_ && off == 0 && way == std::ios::cur && (which & std::ios::out))
+        {
+          std::uint64_t in_block_offset = static_cast<std::uint64_t>(pptr() - (char*) decompressed_buffer_.data());
+          return pos_type(off_type((block_address_ << 16) | in_block_offset));
         }
-
-        return traits_type::to_int_type(c);
+        return pos_type(off_type(-1));
       }
 
-      virtual int sync()
+      // Each full put area, and whatever sync() finds, becomes one block.
+      bool encode(std::uint8_t* /*data*/, std::size_t size, bool /*flush*/)
       {
-        std::uint32_t block_length = static_cast<std::uint32_t>(decompressed_buffer_.size() - (epptr() - pptr()));
-        if (block_length)
-          return write_compressed_block(block_length);
-        return 0;
+        return write_compressed_block(static_cast<std::uint32_t>(size)) == 0;
       }
 
       int write_compressed_block(std::uint32_t block_length)
@@ -612,115 +1351,50 @@ namespace shrinkwrap
         if (!fp_)
           return -1;
 
-        /* BGZF/GZIP header (speciallized from RFC 1952; little endian):
-         * +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-         * | 31|139|  8|  4|              0|  0|255|      6| 66| 67|      2|BLK_LEN|
-         * +---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-         */
-        const std::array<uint8_t, block_header_length> block_header = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 66, 67, 2, 0, 0, 0};
+        assert(block_length <= max_block_input_length); // guaranteed by the caller
 
-        std::uint32_t input_length = block_length;
-        std::uint8_t *buffer = compressed_buffer_.data();
-        std::uint32_t buffer_size = bgzf_block_size;
+        level_ctl_.begin_work();
+        std::size_t compressed_length = encoder_.encode(decompressed_buffer_.data(), block_length, level_ctl_.level());
+        level_ctl_.end_compress();
 
-        std::uint32_t compressed_length = 0;
-        std::uint32_t remaining;
-        std::uint32_t crc;
-
-        assert(block_length <= bgzf_block_size); // guaranteed by the caller
-
-        std::memcpy(buffer, block_header.data(), block_header_length); // the last two bytes are a place holder for the length of the block
-
-        z_stream zs;
-        int zlib_res = Z_OK;
-        while (zlib_res == Z_OK) // loop to retry for blocks that do not compress enough
+        if (compressed_length)
         {
-          zs = {0};
-          zs.next_in = decompressed_buffer_.data();
-          zs.avail_in = input_length;
-          zs.next_out = &buffer[block_header_length];
-          zs.avail_out = static_cast<std::uint32_t>(compressed_buffer_.size());
-          //zs.avail_out = buffer_size - BLOCK_HEADER_LENGTH - BLOCK_FOOTER_LENGTH;
-
-          zlib_res = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY); // -15 to disable zlib header/footer
-          if (zlib_res == Z_OK)
-          {
-            zlib_res = deflate(&zs, Z_FINISH);
-            if (zlib_res == Z_OK) //zlib_res_ != Z_STREAM_END)  // not compressed enough
-            {
-              input_length -= 1024;
-              assert(input_length > 0); // logically, this should not happen
-              deflateEnd(&zs);
-            }
-          }
-        }
-
-        if (deflateEnd(&zs) == Z_OK && zlib_res == Z_STREAM_END)
-        {
-          compressed_length = static_cast<std::uint32_t>(zs.total_out);
-          compressed_length += block_header_length + block_footer_length;
-          assert(compressed_length <= bgzf_block_size);
-
-          assert(compressed_length > 0);
-          pack_int_16(&buffer[16], static_cast<std::uint16_t>(compressed_length - 1)); // write the compressed_length; -1 to fit 2 bytes
-          crc = crc32(0L, NULL, 0L);
-          crc = crc32(crc, decompressed_buffer_.data(), input_length);
-          pack_int_32(&buffer[compressed_length - 8], crc);
-          pack_int_32(&buffer[compressed_length - 4], input_length);
-
-          if (!fwrite(compressed_buffer_.data(), compressed_length, 1, fp_) || ferror(fp_))
+          if (!fwrite(encoder_.data(), compressed_length, 1, fp_) || ferror(fp_))
           {
             // TODO: handle error.
             return -1;
           }
+          level_ctl_.end_write();
+          level_ctl_.update();
 
-          remaining = block_length - input_length;
-          if (remaining > 0)
-          {
-            assert(remaining <= input_length);
-            memcpy(decompressed_buffer_.data(), decompressed_buffer_.data() + input_length, remaining);
-          }
-
-          setp((char *) decompressed_buffer_.data() + remaining, (char *) decompressed_buffer_.data() + decompressed_buffer_.size());
+          if (!gzi_path_.empty() && block_length && block_address_ > 0)
+            gzi_entries_.push_back(std::make_pair(block_address_, uncompressed_address_));
+          block_address_ += compressed_length;
+          uncompressed_address_ += block_length;
           return 0;
         }
 
         return -1;
       }
 
-      static void pack_int_16(uint8_t *buffer, uint16_t value)
-      {
-        buffer[0] = uint8_t(value);
-        buffer[1] = uint8_t(value >> 8);
-      }
-
-      static void pack_int_32(uint8_t *buffer, uint32_t value)
-      {
-        buffer[0] = uint8_t(value);
-        buffer[1] = uint8_t(value >> 8);
-        buffer[2] = uint8_t(value >> 16);
-        buffer[3] = uint8_t(value >> 24);
-      }
-
     private:
-      static const std::size_t block_header_length = 18;
-      static const std::size_t block_footer_length = 8;
-      static const std::size_t bgzf_block_size = 0x10000; // 64k
-
-
-      static const std::size_t default_block_size = 64 * 1024;
-      std::vector<std::uint8_t> compressed_buffer_;
-      std::vector<std::uint8_t> decompressed_buffer_;
-      FILE* fp_;
+      static const std::size_t max_block_input_length = detail::bgzf_block_encoder::max_input_length;
+
+      detail::bgzf_block_encoder encoder_;
+      std::uint64_t block_address_;
+      std::uint64_t uncompressed_address_;
+      std::string gzi_path_;
+      std::vector<std::pair<std::uint64_t, std::uint64_t>> gzi_entries_;
+      detail::level_controller level_ctl_;
     };
 
     class istream : public std::istream
     {
     public:
-      istream(const std::string& file_path)
+      istream(const std::string& file_path, const ibuf_options& opts = ibuf_options())
         :
         std::istream(&sbuf_),
-        sbuf_(file_path)
+        sbuf_(file_path, opts)
       {
       }
 #if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
@@ -748,12 +1422,14 @@ namespace shrinkwrap
     class ostream : public std::ostream
     {
     public:
-      ostream(const std::string& file_path, std::ios::open_mode mode = std::ios::out)
+      ostream(const std::string& file_path, std::ios::openmode mode = std::ios::out, const obuf_options& opts = obuf_options())
         :
         std::ostream(&sbuf_),
-        sbuf_(file_path)
+        sbuf_(file_path, mode, opts)
       {
       }
+
+      ostream(const std::string& file_path, const obuf_options& opts) : ostream(file_path, std::ios::out, opts) {}
 #if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
       ostream(ostream&& src)
         :
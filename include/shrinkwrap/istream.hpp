@@ -4,9 +4,13 @@
 #include "xz.hpp"
 #include "gz.hpp"
 #include "zstd.hpp"
+#include "lz4.hpp"
+#include "bz2.hpp"
 
 #include <streambuf>
 #include <memory>
+#include <cstring>
+#include <stdexcept>
 
 namespace shrinkwrap
 {
@@ -19,14 +23,50 @@ namespace shrinkwrap
     }
   }
 
+  enum class format
+  {
+    unknown = 0,
+    gz,
+    xz,
+    zstd,
+    bgzf, // output only; detect_format() reports BGZF input as gz.
+    lz4,
+    bz2
+  };
+
+  // Identifies the compression format from the leading bytes of a file or buffer.
+  inline format detect_format(const std::uint8_t* data, std::size_t size)
+  {
+    static const std::uint8_t gz_magic[] = {0x1F, 0x8B};
+    static const std::uint8_t xz_magic[] = {0xFD, 0x37, 0x7A, 0x58, 0x5A, 0x00};
+    static const std::uint8_t zstd_magic[] = {0x28, 0xB5, 0x2F, 0xFD};
+    static const std::uint8_t lz4_magic[] = {0x04, 0x22, 0x4D, 0x18};
+    static const std::uint8_t bz2_magic[] = {0x42, 0x5A, 0x68}; // "BZh", followed by the block size.
+
+    if (size >= sizeof(gz_magic) && std::memcmp(data, gz_magic, sizeof(gz_magic)) == 0)
+      return format::gz;
+    if (size >= sizeof(xz_magic) && std::memcmp(data, xz_magic, sizeof(xz_magic)) == 0)
+      return format::xz;
+    if (size >= sizeof(zstd_magic) && std::memcmp(data, zstd_magic, sizeof(zstd_magic)) == 0)
+      return format::zstd;
+    if (size >= sizeof(lz4_magic) && std::memcmp(data, lz4_magic, sizeof(lz4_magic)) == 0)
+      return format::lz4;
+    if (size >= sizeof(bz2_magic) && std::memcmp(data, bz2_magic, sizeof(bz2_magic)) == 0)
+      return format::bz2;
+    return format::unknown;
+  }
+
   class istream : public std::istream
   {
   public:
-    istream(const std::string& file_path)
+    // resource, if given, serves the buffers and codec state of the stream.
+    istream(const std::string& file_path, memory_resource* resource = nullptr)
       :
       std::istream(nullptr)
     {
       FILE* fp = fopen(file_path.c_str(), "rb");
+      if (!fp)
+        throw std::runtime_error("could not open " + file_path);
 
       int first_byte = fgetc(fp);
       ungetc(first_byte, fp);
@@ -34,14 +74,40 @@ namespace shrinkwrap
       switch (char(first_byte))
       {
         case '\x1F':
-          sbuf_ = detail::make_unique<::shrinkwrap::bgzf::ibuf>(fp);
+        {
+          gz::ibuf_options opts;
+          opts.resource = resource;
+          sbuf_ = detail::make_unique<::shrinkwrap::bgzf::ibuf>(fp, opts);
           break;
+        }
         case char('\xFD'):
-          sbuf_ = detail::make_unique<::shrinkwrap::xz::ibuf>(fp);
+        {
+          xz::ibuf_options opts;
+          opts.resource = resource;
+          sbuf_ = detail::make_unique<::shrinkwrap::xz::ibuf>(fp, opts);
           break;
+        }
         case '\x28':
-          sbuf_ = detail::make_unique<::shrinkwrap::zstd::ibuf>(fp);
+        {
+          zstd::ibuf_options opts;
+          opts.resource = resource;
+          sbuf_ = detail::make_unique<::shrinkwrap::zstd::ibuf>(fp, opts);
+          break;
+        }
+        case '\x04':
+        {
+          lz4::ibuf_options opts;
+          opts.resource = resource;
+          sbuf_ = detail::make_unique<::shrinkwrap::lz4::ibuf>(fp, opts);
+          break;
+        }
+        case '\x42':
+        {
+          bz2::ibuf_options opts;
+          opts.resource = resource;
+          sbuf_ = detail::make_unique<::shrinkwrap::bz2::ibuf>(fp, opts);
           break;
+        }
         default:
           throw std::runtime_error("raw files not yet supported.");
 
@@ -0,0 +1,447 @@
+#ifndef SHRINKWRAP_LZ4_HPP
+#define SHRINKWRAP_LZ4_HPP
+
+#include <lz4frame.h>
+
+#include <streambuf>
+#include <stdio.h>
+#include <assert.h>
+
+#include "common.hpp"
+#include "basic_buf.hpp"
+
+namespace shrinkwrap
+{
+  namespace lz4
+  {
+    struct ibuf_options
+    {
+      // Skips verification of block and content checksums. Only for data whose
+      // integrity is guaranteed elsewhere.
+      bool ignore_checks = false;
+      // Serves the stream's buffers. Must outlive the stream. The decompression
+      // context stays on the heap, since shared builds of liblz4 don't export
+      // LZ4F_createDecompressionContext_advanced().
+      memory_resource* resource = nullptr;
+    };
+
+    class ibuf : public basic_ibuf<ibuf, 64 * 1024, 128 * 1024>
+    {
+      typedef basic_ibuf<ibuf, 64 * 1024, 128 * 1024> base_type;
+      friend base_type;
+    public:
+      ibuf(FILE* fp, const ibuf_options& opts = ibuf_options())
+        :
+        base_type(fp, opts.resource),
+        dctx_(nullptr),
+        options_(),
+        input_pos_(0),
+        input_size_(0),
+        res_(0),
+        current_block_position_(0)
+      {
+        options_.skipChecksums = opts.ignore_checks ? 1 : 0;
+        if (fp_)
+        {
+          res_ = LZ4F_createDecompressionContext(&dctx_, LZ4F_VERSION);
+          if (LZ4F_isError(res_))
+          {
+            // TODO: handle error.
+          }
+        }
+      }
+
+      ibuf(const std::string& file_path, const ibuf_options& opts = ibuf_options()) : ibuf(fopen(file_path.c_str(), "rb"), opts) {}
+
+#if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
+      ibuf(ibuf&& src)
+        :
+        base_type(std::move(src))
+      {
+        this->move(std::move(src));
+      }
+
+      ibuf& operator=(ibuf&& src)
+      {
+        if (&src != this)
+        {
+          this->destroy();
+          base_type::operator=(std::move(src));
+          this->move(std::move(src));
+        }
+
+        return *this;
+      }
+#endif
+
+      virtual ~ibuf()
+      {
+        this->destroy();
+      }
+
+    private:
+      void destroy()
+      {
+        if (dctx_)
+          LZ4F_freeDecompressionContext(dctx_);
+        dctx_ = nullptr;
+      }
+
+      void move(ibuf&& src)
+      {
+        dctx_ = src.dctx_;
+        src.dctx_ = nullptr;
+        options_ = src.options_;
+        input_pos_ = src.input_pos_;
+        input_size_ = src.input_size_;
+        res_ = src.res_;
+        current_block_position_ = src.current_block_position_;
+      }
+
+      void replenish_compressed_buffer()
+      {
+        input_pos_ = 0;
+        input_size_ = fread(compressed_buffer_.data(), 1, compressed_buffer_.size(), fp_);
+      }
+
+      bool decodable() const
+      {
+        return good() && (input_pos_ < input_size_ || (!feof(fp_) && !ferror(fp_)));
+      }
+
+      bool good() const
+      {
+        return dctx_ && !LZ4F_isError(res_);
+      }
+
+      // LZ4F_decompress() returns 0 at the end of each frame and the size of the
+      // next expected input otherwise.
+      std::size_t decode()
+      {
+        if (input_pos_ == input_size_ && !feof(fp_) && !ferror(fp_))
+        {
+          replenish_compressed_buffer();
+        }
+
+        if (res_ == 0 && input_pos_ < input_size_)
+          current_block_position_ = std::size_t(ftell(fp_)) - (input_size_ - input_pos_);
+
+        std::size_t src_size = input_size_ - input_pos_;
+        std::size_t dst_size = decompressed_buffer_.size();
+        res_ = LZ4F_decompress(dctx_, decompressed_buffer_.data(), &dst_size, compressed_buffer_.data() + input_pos_, &src_size, &options_);
+        input_pos_ += src_size;
+        return LZ4F_isError(res_) ? 0 : dst_size;
+      }
+
+    protected:
+      // Like zstd::ibuf, positions are compressed offsets of frames: tellg()
+      // reports the start of the current frame and seekg() must be given the
+      // start of a frame, e.g. one reported by tellp() after a flush.
+      virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir way, std::ios_base::openmode /*which*/)
+      {
+        if (fp_ && off == 0 && way == std::ios::cur)
+        {
+          if (egptr() - gptr() == 0 && res_ == 0)
+          {
+            std::uint64_t compressed_offset = std::size_t(ftell(fp_)) - (input_size_ - input_pos_);
+            return pos_type(off_type(compressed_offset));
+          }
+          else
+          {
+            std::uint64_t compressed_offset = current_block_position_;
+            return pos_type(off_type(compressed_offset));
+          }
+        }
+        return pos_type(off_type(-1));
+      }
+
+      virtual std::streambuf::pos_type seekpos(std::streambuf::pos_type pos, std::ios_base::openmode /*which*/)
+      {
+        std::uint64_t compressed_offset = static_cast<std::uint64_t>(pos);
+
+        if (fp_ == 0 || !dctx_ || sync())
+          return pos_type(off_type(-1));
+
+        long seek_amount = static_cast<long>(compressed_offset);
+        if (fseek(fp_, seek_amount, SEEK_SET))
+          return pos_type(off_type(-1));
+
+        LZ4F_resetDecompressionContext(dctx_);
+        input_pos_ = 0;
+        input_size_ = 0;
+        res_ = 0;
+        reset_get_area();
+
+        return pos;
+      }
+
+    private:
+      LZ4F_dctx* dctx_;
+      LZ4F_decompressOptions_t options_;
+      std::size_t input_pos_;
+      std::size_t input_size_;
+      std::size_t res_;
+      std::size_t current_block_position_;
+    };
+
+    struct obuf_options
+    {
+      // 0 (and negative accelerations) use the fast compressor, 3 to 12 LZ4HC.
+      int compression_level = 0;
+      // Blocks that don't reference earlier blocks of their frame, so that each
+      // decodes on its own. Linked blocks compress slightly better.
+      bool independent_blocks = true;
+      // Ends each frame with an xxHash32 of its content.
+      bool content_checksum = true;
+      // Follows each block with an xxHash32 of its compressed data.
+      bool block_checksum = false;
+      // Serves the stream's buffers. Must outlive the stream. The compression
+      // context stays on the heap, as for ibuf.
+      memory_resource* resource = nullptr;
+      // Done on flush() and when the put area fills. A full put area is always
+      // one whole block, so only full and end_block change what that writes.
+      // LZ4F_flush keeps the history, so full ends the frame, as end_block.
+      flush_mode on_flush = flush_mode::end_block;
+      flush_mode on_buffer_full = flush_mode::none;
+    };
+
+    // Writes 64 KiB blocks (LZ4F_max64KB). A flush that ends the frame makes
+    // tellp() a position ibuf can seek to; the next write starts a new frame.
+    class obuf : public basic_obuf<obuf, 64 * 1024 + 64, 64 * 1024> // input plus frame header, block header and checksum, end mark and content checksum.
+    {
+      typedef basic_obuf<obuf, 64 * 1024 + 64, 64 * 1024> base_type;
+      friend base_type;
+    public:
+      obuf(FILE* fp, const obuf_options& opts = obuf_options())
+        :
+        base_type(fp, opts.resource),
+        block_position_(0),
+        cctx_(nullptr),
+        prefs_({}),
+        on_flush_(opts.on_flush),
+        on_buffer_full_(opts.on_buffer_full),
+        in_frame_(false),
+        res_(0)
+      {
+        prefs_.frameInfo.blockSizeID = LZ4F_max64KB;
+        prefs_.frameInfo.blockMode = opts.independent_blocks ? LZ4F_blockIndependent : LZ4F_blockLinked;
+        prefs_.frameInfo.contentChecksumFlag = opts.content_checksum ? LZ4F_contentChecksumEnabled : LZ4F_noContentChecksum;
+        prefs_.frameInfo.blockChecksumFlag = opts.block_checksum ? LZ4F_blockChecksumEnabled : LZ4F_noBlockChecksum;
+        prefs_.compressionLevel = opts.compression_level;
+        prefs_.autoFlush = 0; // a partial block stays in the context until a flush or a later write completes it.
+        if (fp_)
+        {
+          res_ = LZ4F_createCompressionContext(&cctx_, LZ4F_VERSION);
+          if (LZ4F_isError(res_))
+          {
+            // TODO: handle error.
+          }
+          assert(LZ4F_HEADER_SIZE_MAX + LZ4F_compressBound(decompressed_buffer_.size(), &prefs_) <= compressed_buffer_.size());
+        }
+      }
+
+      obuf(const std::string& file_path, const obuf_options& opts = obuf_options()) : obuf(fopen(file_path.c_str(), "wb"), opts) {}
+
+#if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
+      obuf(obuf&& src)
+        :
+        base_type(std::move(src))
+      {
+        this->move(std::move(src));
+      }
+
+      obuf& operator=(obuf&& src)
+      {
+        if (&src != this)
+        {
+          this->close();
+          base_type::operator=(std::move(src));
+          this->move(std::move(src));
+        }
+
+        return *this;
+      }
+#endif
+
+      virtual ~obuf()
+      {
+        this->close();
+      }
+
+    private:
+      void move(obuf&& src)
+      {
+        block_position_ = src.block_position_;
+        cctx_ = src.cctx_;
+        src.cctx_ = nullptr;
+        prefs_ = src.prefs_;
+        on_flush_ = src.on_flush_;
+        on_buffer_full_ = src.on_buffer_full_;
+        in_frame_ = src.in_frame_;
+        res_ = src.res_;
+      }
+
+      void close()
+      {
+        if (fp_)
+        {
+          sync();
+          if (in_frame_)
+            end_frame(flush_mode::end_block);
+          fclose(fp_);
+          fp_ = nullptr;
+        }
+        if (cctx_)
+        {
+          LZ4F_freeCompressionContext(cctx_);
+          cctx_ = nullptr;
+        }
+      }
+
+      // Writes the partial block held by the context and, for full and
+      // end_block, the end mark and content checksum.
+      bool end_frame(flush_mode mode)
+      {
+        bool end = mode == flush_mode::full || mode == flush_mode::end_block;
+        if (end)
+          res_ = LZ4F_compressEnd(cctx_, compressed_buffer_.data(), compressed_buffer_.size(), nullptr);
+        else
+          res_ = LZ4F_flush(cctx_, compressed_buffer_.data(), compressed_buffer_.size(), nullptr);
+        if (LZ4F_isError(res_))
+          return false;
+        if (res_ && !fwrite(compressed_buffer_.data(), res_, 1, fp_))
+        {
+          // TODO: handle error.
+          return false;
+        }
+
+        if (end)
+        {
+          in_frame_ = false;
+          block_position_ = ftell(fp_);
+        }
+        return true;
+      }
+
+      bool encode(std::uint8_t* data, std::size_t size, bool flush)
+      {
+        if (!cctx_ || LZ4F_isError(res_))
+          return false;
+
+        std::size_t output_size = 0;
+        if (size && !in_frame_)
+        {
+          res_ = LZ4F_compressBegin(cctx_, compressed_buffer_.data(), compressed_buffer_.size(), &prefs_);
+          if (LZ4F_isError(res_))
+            return false;
+          output_size = res_;
+          in_frame_ = true;
+        }
+
+        if (size)
+        {
+          res_ = LZ4F_compressUpdate(cctx_, compressed_buffer_.data() + output_size, compressed_buffer_.size() - output_size, data, size, nullptr);
+          if (LZ4F_isError(res_))
+            return false;
+          output_size += res_;
+        }
+
+        if (output_size && !fwrite(compressed_buffer_.data(), output_size, 1, fp_))
+        {
+          // TODO: handle error.
+          return false;
+        }
+
+        flush_mode mode = flush ? on_flush_ : on_buffer_full_;
+        if (mode == flush_mode::none || !in_frame_)
+          return true;
+        return end_frame(mode);
+      }
+
+    protected:
+      virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir way, std::ios_base::openmode /*which*/)
+      {
+        if (off == 0 && way == std::ios::cur)
+        {
+          return block_position_;
+        }
+        return pos_type(off_type(-1));
+      }
+
+    private:
+      std::streambuf::pos_type block_position_;
+      LZ4F_cctx* cctx_;
+      LZ4F_preferences_t prefs_;
+      flush_mode on_flush_;
+      flush_mode on_buffer_full_;
+      bool in_frame_;
+      std::size_t res_;
+    };
+
+    class istream : public std::istream
+    {
+    public:
+      istream(const std::string& file_path, const ibuf_options& opts = ibuf_options())
+        :
+        std::istream(&sbuf_),
+        sbuf_(file_path, opts)
+      {
+      }
+
+#if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
+      istream(istream&& src)
+        :
+        std::istream(&sbuf_),
+        sbuf_(std::move(src.sbuf_))
+      {
+      }
+
+      istream& operator=(istream&& src)
+      {
+        if (&src != this)
+        {
+          std::istream::operator=(std::move(src));
+          sbuf_ = std::move(src.sbuf_);
+        }
+        return *this;
+      }
+#endif
+    private:
+      ::shrinkwrap::lz4::ibuf sbuf_;
+    };
+
+    class ostream : public std::ostream
+    {
+    public:
+      ostream(const std::string& file_path, const obuf_options& opts = obuf_options())
+        :
+        std::ostream(&sbuf_),
+        sbuf_(file_path, opts)
+      {
+      }
+
+#if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
+      ostream(ostream&& src)
+        :
+        std::ostream(&sbuf_),
+        sbuf_(std::move(src.sbuf_))
+      {
+      }
+
+      ostream& operator=(ostream&& src)
+      {
+        if (&src != this)
+        {
+          std::ostream::operator=(std::move(src));
+          sbuf_ = std::move(src.sbuf_);
+        }
+        return *this;
+      }
+#endif
+    private:
+      ::shrinkwrap::lz4::obuf sbuf_;
+    };
+  }
+}
+
+#endif //SHRINKWRAP_LZ4_HPP
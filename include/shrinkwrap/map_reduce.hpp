@@ -0,0 +1,224 @@
+#ifndef SHRINKWRAP_MAP_REDUCE_HPP
+#define SHRINKWRAP_MAP_REDUCE_HPP
+
+#include "verify.hpp"
+#include "record_reader.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace shrinkwrap
+{
+  struct map_reduce_options : parallel_options
+  {
+    // Hands map only whole delimiter terminated records. Records that cross unit
+    // boundaries are reassembled and mapped on the calling thread.
+    bool split_records = false;
+    char delimiter = '\n';
+  };
+
+  namespace detail
+  {
+    template <typename T>
+    struct mapped_unit
+    {
+      mapped_unit(const T& init) : value(init), mapped(false), has_delimiter(false), size(0) {}
+
+      T value;
+      bool mapped;
+      bool has_delimiter;
+      std::size_t size;
+      std::string head; // bytes before the first delimiter, or the whole unit without one.
+      std::string tail; // bytes after the last delimiter.
+    };
+
+    struct append_sink
+    {
+      append_sink(std::vector<char>& d) : dest(d) {}
+      void operator()(const char* data, std::size_t size) { dest.insert(dest.end(), data, data + size); }
+      std::vector<char>& dest;
+    };
+
+    template <typename T, typename MapFn>
+    void map_unit(const char* data, std::size_t size, std::uint64_t uncompressed_offset, const map_reduce_options& opts, MapFn& map, mapped_unit<T>& dest)
+    {
+      dest.size = size;
+      if (!opts.split_records)
+      {
+        dest.value = map(data, size, uncompressed_offset);
+        dest.mapped = true;
+        return;
+      }
+
+      const char* first = find_byte(data, size, opts.delimiter);
+      if (!first)
+      {
+        dest.head.assign(data, size);
+        return;
+      }
+
+      const char* last = data + size - 1;
+      while (*last != opts.delimiter)
+        --last;
+
+      dest.has_delimiter = true;
+      dest.head.assign(data, first);
+      dest.tail.assign(last + 1, data + size);
+      if (first < last)
+      {
+        std::uint64_t interior_offset = uncompressed_offset == block_info::unknown_size ? uncompressed_offset : uncompressed_offset + std::uint64_t(first + 1 - data);
+        dest.value = map(first + 1, std::size_t(last - first), interior_offset);
+        dest.mapped = true;
+      }
+    }
+
+    // Folds unit results in file order and maps the records that span units.
+    template <typename T, typename MapFn, typename ReduceFn>
+    class unit_stitcher
+    {
+    public:
+      unit_stitcher(const T& init, MapFn& map, ReduceFn& reduce, const map_reduce_options& opts)
+        :
+        result_(init),
+        map_(map),
+        reduce_(reduce),
+        opts_(opts),
+        carry_offset_(0),
+        position_(0)
+      {
+      }
+
+      void add(const mapped_unit<T>& unit)
+      {
+        if (!opts_.split_records)
+        {
+          result_ = reduce_(result_, unit.value);
+        }
+        else
+        {
+          if (carry_.empty())
+            carry_offset_ = position_;
+          carry_ += unit.head;
+
+          if (unit.has_delimiter)
+          {
+            carry_.push_back(opts_.delimiter);
+            result_ = reduce_(result_, map_(carry_.data(), carry_.size(), carry_offset_));
+            if (unit.mapped)
+              result_ = reduce_(result_, unit.value);
+            carry_ = unit.tail;
+            carry_offset_ = position_ + unit.size - unit.tail.size();
+          }
+        }
+        position_ += unit.size;
+      }
+
+      T finish()
+      {
+        if (!carry_.empty())
+          result_ = reduce_(result_, map_(carry_.data(), carry_.size(), carry_offset_));
+        return result_;
+      }
+
+    private:
+      T result_;
+      MapFn& map_;
+      ReduceFn& reduce_;
+      const map_reduce_options& opts_;
+      std::string carry_;
+      std::uint64_t carry_offset_;
+      std::uint64_t position_;
+    };
+
+    template <typename Decoder>
+    struct map_worker
+    {
+      unit_reader<Decoder> reader;
+      std::vector<char> decoded;
+    };
+
+    template <typename Decoder, typename T, typename MapFn, typename DecodeFn>
+    void map_units(const std::string& file_path, const std::vector<block_info>& units, const map_reduce_options& opts, MapFn& map, DecodeFn decode, std::vector<mapped_unit<T>>& results)
+    {
+      parallel_for_each<map_worker<Decoder>>(units.size(), opts, [&](map_worker<Decoder>& w, std::size_t i)
+      {
+        w.decoded.clear();
+        append_sink sink(w.decoded);
+        if (!w.reader.read(file_path, units[i]) || !decode(w.reader, sink))
+          throw std::runtime_error("failed to decode unit at offset " + std::to_string(units[i].compressed_offset) + " of " + file_path);
+        map_unit(w.decoded.data(), w.decoded.size(), units[i].uncompressed_offset, opts, map, results[i]);
+      });
+    }
+  }
+
+  // Runs map(const char* data, std::size_t size, std::uint64_t uncompressed_offset)
+  // on every independently decodable unit of a BGZF, xz or zstd file on worker
+  // threads, then folds the results in file order with reduce(T, T), starting
+  // from init. map must be safe to call concurrently. The offset passed for a
+  // unit is block_info::unknown_size when the file does not record it. Plain
+  // gzip is read serially in 1 MiB pieces. Throws std::runtime_error if the file
+  // cannot be read or a unit fails to decode.
+  template <typename T, typename MapFn, typename ReduceFn>
+  T map_reduce(const std::string& file_path, T init, MapFn map, ReduceFn reduce, const map_reduce_options& opts = map_reduce_options())
+  {
+    FILE* fp = fopen(file_path.c_str(), "rb");
+    if (!fp)
+      throw std::runtime_error("could not open " + file_path);
+
+    std::vector<block_info> units;
+    format fmt = format::unknown;
+    lzma_check check = LZMA_CHECK_NONE;
+    bool scanned = detail::scan_units(fp, units, fmt, check);
+    fclose(fp);
+
+    detail::unit_stitcher<T, MapFn, ReduceFn> stitcher(init, map, reduce, opts);
+    if (!scanned)
+    {
+      if (fmt != format::gz)
+        throw std::runtime_error("unsupported file: " + file_path);
+
+      gz::istream is(file_path);
+      std::vector<char> chunk(1024 * 1024);
+      std::uint64_t offset = 0;
+      while (is.read(chunk.data(), chunk.size()) || is.gcount() > 0)
+      {
+        detail::mapped_unit<T> unit(init);
+        std::size_t size = static_cast<std::size_t>(is.gcount());
+        detail::map_unit(chunk.data(), size, offset, opts, map, unit);
+        stitcher.add(unit);
+        offset += size;
+      }
+      return stitcher.finish();
+    }
+
+    std::vector<detail::mapped_unit<T>> results(units.size(), detail::mapped_unit<T>(init));
+    switch (fmt)
+    {
+      case format::bgzf:
+        detail::map_units<detail::bgzf_block_decoder>(file_path, units, opts, map, [](detail::unit_reader<detail::bgzf_block_decoder>& r, detail::append_sink& sink)
+        {
+          return r.decoder.decode(r.buffer.data(), r.buffer.size(), sink);
+        }, results);
+        break;
+      case format::xz:
+        detail::map_units<detail::xz_block_decoder>(file_path, units, opts, map, [check](detail::unit_reader<detail::xz_block_decoder>& r, detail::append_sink& sink)
+        {
+          return r.decoder.decode(r.buffer.data(), r.buffer.size(), check, sink);
+        }, results);
+        break;
+      default:
+        detail::map_units<detail::zstd_frame_decoder>(file_path, units, opts, map, [](detail::unit_reader<detail::zstd_frame_decoder>& r, detail::append_sink& sink)
+        {
+          return r.decoder.decode(r.buffer.data(), r.buffer.size(), sink);
+        }, results);
+        break;
+    }
+
+    for (auto it = results.begin(); it != results.end(); ++it)
+      stitcher.add(*it);
+    return stitcher.finish();
+  }
+}
+
+#endif //SHRINKWRAP_MAP_REDUCE_HPP
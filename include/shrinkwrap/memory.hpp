@@ -0,0 +1,208 @@
+#ifndef SHRINKWRAP_MEMORY_HPP
+#define SHRINKWRAP_MEMORY_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+namespace shrinkwrap
+{
+  // Source of the memory behind the stream buffers and the codec libraries'
+  // state. Mirrors C++17's std::pmr::memory_resource, so an adapter around a
+  // pmr resource, arena or NUMA-local pool only needs to forward the two calls.
+  // do_allocate may throw std::bad_alloc or return nullptr.
+  class memory_resource
+  {
+  public:
+    static const std::size_t max_alignment = alignof(std::max_align_t);
+
+    virtual ~memory_resource() {}
+
+    void* allocate(std::size_t bytes, std::size_t alignment = max_alignment)
+    {
+      return do_allocate(bytes, alignment);
+    }
+
+    void deallocate(void* p, std::size_t bytes, std::size_t alignment = max_alignment)
+    {
+      do_deallocate(p, bytes, alignment);
+    }
+
+  protected:
+    virtual void* do_allocate(std::size_t bytes, std::size_t alignment) = 0;
+    virtual void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) = 0;
+  };
+
+  namespace detail
+  {
+    class new_delete_memory_resource : public memory_resource
+    {
+    protected:
+      virtual void* do_allocate(std::size_t bytes, std::size_t /*alignment*/)
+      {
+        return ::operator new(bytes);
+      }
+
+      virtual void do_deallocate(void* p, std::size_t /*bytes*/, std::size_t /*alignment*/)
+      {
+        ::operator delete(p);
+      }
+    };
+  }
+
+  // Used wherever no resource is given.
+  inline memory_resource* new_delete_resource()
+  {
+    static detail::new_delete_memory_resource instance;
+    return &instance;
+  }
+
+  // Caps the memory drawn from upstream by every stream that shares it, e.g. a
+  // process-wide budget for hundreds of concurrent streams. A request that
+  // would go past the limit fails, which the codec libraries report as a
+  // memory error on the stream that made it. Thread safe.
+  class memory_budget : public memory_resource
+  {
+  public:
+    explicit memory_budget(std::uint64_t limit, memory_resource* upstream = nullptr)
+      :
+      upstream_(upstream ? upstream : new_delete_resource()),
+      limit_(limit),
+      in_use_(0),
+      peak_(0)
+    {
+    }
+
+    memory_budget(const memory_budget&) = delete;
+    memory_budget& operator=(const memory_budget&) = delete;
+
+    std::uint64_t limit() const { return limit_; }
+    // Bytes currently allocated through this budget.
+    std::uint64_t in_use() const { return in_use_.load(); }
+    // Highest in_use() seen so far.
+    std::uint64_t peak() const { return peak_.load(); }
+
+  protected:
+    virtual void* do_allocate(std::size_t bytes, std::size_t alignment)
+    {
+      std::uint64_t used = in_use_.fetch_add(bytes) + bytes;
+      if (used > limit_)
+      {
+        in_use_.fetch_sub(bytes);
+        throw std::bad_alloc();
+      }
+
+      void* ret = nullptr;
+      try
+      {
+        ret = upstream_->allocate(bytes, alignment);
+      }
+      catch (...)
+      {
+        in_use_.fetch_sub(bytes);
+        throw;
+      }
+      if (!ret)
+      {
+        in_use_.fetch_sub(bytes);
+        return nullptr;
+      }
+
+      std::uint64_t peak = peak_.load();
+      while (used > peak && !peak_.compare_exchange_weak(peak, used)) {}
+      return ret;
+    }
+
+    virtual void do_deallocate(void* p, std::size_t bytes, std::size_t alignment)
+    {
+      upstream_->deallocate(p, bytes, alignment);
+      in_use_.fetch_sub(bytes);
+    }
+
+  private:
+    memory_resource* upstream_;
+    std::uint64_t limit_;
+    std::atomic<std::uint64_t> in_use_;
+    std::atomic<std::uint64_t> peak_;
+  };
+
+  namespace detail
+  {
+    // zlib, liblzma and zstd free without a size, so blocks handed to them carry
+    // their size in a header that keeps the payload max aligned.
+    static const std::size_t codec_block_header = memory_resource::max_alignment > sizeof(std::size_t) ? memory_resource::max_alignment : sizeof(std::size_t);
+
+    // Returns nullptr on failure, which every codec library reports as a memory error.
+    inline void* codec_allocate(memory_resource* resource, std::size_t bytes)
+    {
+      void* block = nullptr;
+      try
+      {
+        block = resource->allocate(bytes + codec_block_header);
+      }
+      catch (const std::bad_alloc&)
+      {
+        return nullptr;
+      }
+
+      if (!block)
+        return nullptr;
+      *static_cast<std::size_t*>(block) = bytes;
+      return static_cast<char*>(block) + codec_block_header;
+    }
+
+    inline void codec_deallocate(memory_resource* resource, void* p)
+    {
+      if (p)
+      {
+        char* block = static_cast<char*>(p) - codec_block_header;
+        resource->deallocate(block, *reinterpret_cast<std::size_t*>(block) + codec_block_header);
+      }
+    }
+
+    // Standard allocator over a memory_resource, for buffers whose size is only
+    // known at run time. Null uses new_delete_resource().
+    template <typename T>
+    class resource_allocator
+    {
+    public:
+      typedef T value_type;
+
+      resource_allocator(memory_resource* resource = nullptr) : resource_(resource ? resource : new_delete_resource()) {}
+
+      template <typename U>
+      resource_allocator(const resource_allocator<U>& src) : resource_(src.resource()) {}
+
+      T* allocate(std::size_t n)
+      {
+        void* ret = resource_->allocate(n * sizeof(T), alignof(T));
+        if (!ret)
+          throw std::bad_alloc();
+        return static_cast<T*>(ret);
+      }
+
+      void deallocate(T* p, std::size_t n)
+      {
+        resource_->deallocate(p, n * sizeof(T), alignof(T));
+      }
+
+      memory_resource* resource() const { return resource_; }
+
+    private:
+      memory_resource* resource_;
+    };
+
+    template <typename T, typename U>
+    bool operator==(const resource_allocator<T>& a, const resource_allocator<U>& b) { return a.resource() == b.resource(); }
+
+    template <typename T, typename U>
+    bool operator!=(const resource_allocator<T>& a, const resource_allocator<U>& b) { return a.resource() != b.resource(); }
+
+    template <typename T>
+    using resource_vector = std::vector<T, resource_allocator<T>>;
+  }
+}
+
+#endif //SHRINKWRAP_MEMORY_HPP
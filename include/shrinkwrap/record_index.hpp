@@ -0,0 +1,460 @@
+#ifndef SHRINKWRAP_RECORD_INDEX_HPP
+#define SHRINKWRAP_RECORD_INDEX_HPP
+
+#include "gz.hpp"
+#include "block_decoder.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SHRINKWRAP_HAS_MMAP 1
+#endif
+
+namespace shrinkwrap
+{
+  namespace bgzf
+  {
+    // Maps user keys to the BGZF virtual offsets of the records that carry them.
+    // Records are delimiter separated and key_of(const char* data, std::size_t size)
+    // extracts an ordered Key from each record (without its delimiter).
+    //
+    // This is a linear index: one chunk per BGZF block, holding the key range
+    // and virtual offset range of the records that start in that block. For
+    // input sorted by key, queries binary search the chunk table; otherwise
+    // every chunk whose key range overlaps the query is visited.
+    template <typename Key>
+    class record_index
+    {
+      static_assert(std::is_trivial<Key>::value && std::is_standard_layout<Key>::value, "record_index keys are stored on disk as raw bytes");
+    public:
+      struct chunk
+      {
+        Key min_key;
+        Key max_key;
+        std::uint64_t begin; // virtual offset of the first record
+        std::uint64_t end; // virtual offset past the last record
+      };
+
+      class cursor;
+
+      record_index()
+        :
+        chunks_(nullptr),
+        chunk_count_(0),
+        delimiter_('\n'),
+        sorted_(true),
+        map_(nullptr),
+        map_size_(0)
+      {
+      }
+
+      record_index(const record_index&) = delete;
+      record_index& operator=(const record_index&) = delete;
+
+      record_index(record_index&& src)
+        :
+        record_index()
+      {
+        this->move(std::move(src));
+      }
+
+      record_index& operator=(record_index&& src)
+      {
+        if (&src != this)
+        {
+          this->destroy();
+          this->move(std::move(src));
+        }
+        return *this;
+      }
+
+      ~record_index()
+      {
+        this->destroy();
+      }
+
+      // Reads the whole BGZF file once. Throws std::runtime_error on failure.
+      template <typename KeyFn>
+      static record_index build(const std::string& bgzf_path, KeyFn key_of, char delimiter = '\n')
+      {
+        record_index ret;
+        ret.delimiter_ = delimiter;
+
+        FILE* fp = fopen(bgzf_path.c_str(), "rb");
+        std::vector<block_info> blocks;
+        if (!fp || !scan_blocks(fp, blocks))
+        {
+          if (fp)
+            fclose(fp);
+          throw std::runtime_error("not a BGZF file: " + bgzf_path);
+        }
+
+        detail::bgzf_block_decoder decoder;
+        std::vector<std::uint8_t> compressed;
+        std::string record;
+        std::uint64_t record_start = 0;
+        bool in_record = false;
+        const char* block_data = nullptr;
+        std::size_t block_size = 0;
+        auto sink = [&block_data, &block_size](const char* data, std::size_t size) { block_data = data; block_size = size; };
+
+        for (auto it = blocks.begin(); it != blocks.end(); ++it)
+        {
+          compressed.resize(static_cast<std::size_t>(it->compressed_size));
+          block_size = 0;
+          if (fseek(fp, long(it->compressed_offset), SEEK_SET) || !fread(compressed.data(), compressed.size(), 1, fp) || !decoder.decode(compressed.data(), compressed.size(), sink))
+          {
+            fclose(fp);
+            throw std::runtime_error("failed to decode BGZF block in " + bgzf_path);
+          }
+
+          std::size_t pos = 0;
+          while (pos < block_size)
+          {
+            if (!in_record)
+            {
+              record_start = (it->compressed_offset << 16) | pos;
+              record.clear();
+              in_record = true;
+            }
+
+            const char* found = static_cast<const char*>(std::memchr(block_data + pos, delimiter, block_size - pos));
+            std::size_t stop = found ? std::size_t(found - block_data) : block_size;
+            record.append(block_data + pos, stop - pos);
+            pos = stop;
+            if (found)
+            {
+              ret.add_record(record_start, key_of(record.data(), record.size()));
+              in_record = false;
+              ++pos;
+            }
+          }
+        }
+
+        if (in_record && !record.empty())
+          ret.add_record(record_start, key_of(record.data(), record.size()));
+
+        std::uint64_t end_offset = blocks.empty() ? 0 : ((blocks.back().compressed_offset + blocks.back().compressed_size) << 16);
+        if (!ret.owned_chunks_.empty())
+          ret.owned_chunks_.back().end = end_offset;
+        ret.chunks_ = ret.owned_chunks_.data();
+        ret.chunk_count_ = ret.owned_chunks_.size();
+
+        fclose(fp);
+        return ret;
+      }
+
+      bool save(const std::string& index_path) const
+      {
+        FILE* fp = fopen(index_path.c_str(), "wb");
+        if (!fp)
+          return false;
+
+        file_header header = make_header();
+        bool ret = fwrite(&header, sizeof(header), 1, fp) == 1 && (chunk_count_ == 0 || fwrite(chunks_, sizeof(chunk), chunk_count_, fp) == chunk_count_);
+        return (fclose(fp) == 0 && ret);
+      }
+
+      // Maps the chunk table from disk when mmap is available. The format is
+      // native endian. Throws std::runtime_error on failure.
+      static record_index load(const std::string& index_path)
+      {
+        record_index ret;
+        file_header header;
+#ifdef SHRINKWRAP_HAS_MMAP
+        int fd = open(index_path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || std::size_t(st.st_size) < sizeof(header))
+        {
+          if (fd >= 0)
+            ::close(fd);
+          throw std::runtime_error("failed to open record index: " + index_path);
+        }
+
+        ret.map_size_ = std::size_t(st.st_size);
+        ret.map_ = mmap(nullptr, ret.map_size_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (ret.map_ == MAP_FAILED)
+        {
+          ret.map_ = nullptr;
+          throw std::runtime_error("failed to map record index: " + index_path);
+        }
+
+        std::memcpy(&header, ret.map_, sizeof(header));
+        if (!ret.init_from_header(header, ret.map_size_ - sizeof(header)))
+          throw std::runtime_error("invalid record index: " + index_path);
+        ret.chunks_ = reinterpret_cast<const chunk*>(static_cast<const char*>(ret.map_) + sizeof(header));
+#else
+        FILE* fp = fopen(index_path.c_str(), "rb");
+        bool ok = fp && fread(&header, sizeof(header), 1, fp) == 1 && ret.init_from_header(header, std::numeric_limits<std::size_t>::max());
+        if (ok)
+        {
+          ret.owned_chunks_.resize(ret.chunk_count_);
+          ok = ret.chunk_count_ == 0 || fread(ret.owned_chunks_.data(), sizeof(chunk), ret.chunk_count_, fp) == ret.chunk_count_;
+          ret.chunks_ = ret.owned_chunks_.data();
+        }
+        if (fp)
+          fclose(fp);
+        if (!ok)
+          throw std::runtime_error("invalid record index: " + index_path);
+#endif
+        return ret;
+      }
+
+      std::size_t size() const { return chunk_count_; }
+      const chunk* begin() const { return chunks_; }
+      const chunk* end() const { return chunks_ + chunk_count_; }
+      char delimiter() const { return delimiter_; }
+      bool sorted() const { return sorted_; }
+
+      // Virtual offset ranges [first, second) that may hold records with keys in
+      // [lo, hi]. Adjacent chunks are merged.
+      std::vector<std::pair<std::uint64_t, std::uint64_t>> ranges(const Key& lo, const Key& hi) const
+      {
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> ret;
+        const chunk* it = chunks_;
+        if (sorted_)
+          it = std::lower_bound(begin(), end(), lo, [](const chunk& c, const Key& k) { return c.max_key < k; });
+
+        for ( ; it != end(); ++it)
+        {
+          if (hi < it->min_key)
+          {
+            if (sorted_)
+              break;
+            continue;
+          }
+          if (it->max_key < lo)
+            continue;
+
+          if (!ret.empty() && ret.back().second == it->begin)
+            ret.back().second = it->end;
+          else
+            ret.push_back(std::make_pair(it->begin, it->end));
+        }
+
+        return ret;
+      }
+
+      // Iterates the records with keys in [lo, hi], reading only the blocks
+      // covered by matching chunks.
+      template <typename KeyFn>
+      cursor query(const std::string& bgzf_path, const Key& lo, const Key& hi, KeyFn key_of) const
+      {
+        return cursor(bgzf_path, ranges(lo, hi), lo, hi, std::function<Key(const char*, std::size_t)>(key_of), delimiter_, sorted_);
+      }
+
+      class cursor
+      {
+      public:
+        class iterator
+        {
+        public:
+          typedef std::input_iterator_tag iterator_category;
+          typedef std::string value_type;
+          typedef std::ptrdiff_t difference_type;
+          typedef const std::string* pointer;
+          typedef const std::string& reference;
+
+          iterator(cursor* c = nullptr) : cursor_(c) {}
+          const std::string& operator*() const { return cursor_->record(); }
+          const std::string* operator->() const { return &cursor_->record(); }
+          iterator& operator++()
+          {
+            if (!cursor_->next())
+              cursor_ = nullptr;
+            return *this;
+          }
+          bool operator==(const iterator& other) const { return cursor_ == other.cursor_; }
+          bool operator!=(const iterator& other) const { return cursor_ != other.cursor_; }
+        private:
+          cursor* cursor_;
+        };
+
+        cursor(const std::string& bgzf_path, std::vector<std::pair<std::uint64_t, std::uint64_t>> ranges, const Key& lo, const Key& hi, std::function<Key(const char*, std::size_t)> key_of, char delimiter, bool sorted)
+          :
+          is_(new istream(bgzf_path)),
+          ranges_(std::move(ranges)),
+          current_range_(0),
+          lo_(lo),
+          hi_(hi),
+          key_of_(std::move(key_of)),
+          delimiter_(delimiter),
+          sorted_(sorted),
+          seek_pending_(true)
+        {
+        }
+
+        // Advances to the next matching record. Returns false when done.
+        bool next()
+        {
+          while (current_range_ < ranges_.size())
+          {
+            if (seek_pending_)
+            {
+              is_->clear();
+              is_->seekg(std::streampos(std::streamoff(ranges_[current_range_].first)));
+              seek_pending_ = false;
+            }
+
+            std::uint64_t pos = static_cast<std::uint64_t>(is_->tellg());
+            if (!(*is_) || pos >= ranges_[current_range_].second || !std::getline(*is_, record_, delimiter_))
+            {
+              ++current_range_;
+              seek_pending_ = true;
+              continue;
+            }
+
+            Key k = key_of_(record_.data(), record_.size());
+            if (hi_ < k)
+            {
+              if (sorted_)
+                current_range_ = ranges_.size();
+              continue;
+            }
+            if (!(k < lo_))
+              return true;
+          }
+
+          return false;
+        }
+
+        const std::string& record() const { return record_; }
+
+        iterator begin()
+        {
+          return next() ? iterator(this) : iterator();
+        }
+
+        iterator end() { return iterator(); }
+
+      private:
+        std::unique_ptr<istream> is_;
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> ranges_;
+        std::size_t current_range_;
+        Key lo_;
+        Key hi_;
+        std::function<Key(const char*, std::size_t)> key_of_;
+        std::string record_;
+        char delimiter_;
+        bool sorted_;
+        bool seek_pending_;
+      };
+
+    private:
+      struct file_header
+      {
+        char magic[8];
+        std::uint32_t chunk_size;
+        std::uint32_t flags;
+        std::uint32_t delimiter;
+        std::uint32_t reserved;
+        std::uint64_t chunk_count;
+      };
+
+      static const std::uint32_t sorted_flag = 1;
+
+      static const char* magic() { return "SWRIDX01"; }
+
+      file_header make_header() const
+      {
+        file_header header;
+        std::memcpy(header.magic, magic(), sizeof(header.magic));
+        header.chunk_size = sizeof(chunk);
+        header.flags = sorted_ ? sorted_flag : 0;
+        header.delimiter = std::uint32_t(static_cast<unsigned char>(delimiter_));
+        header.reserved = 0;
+        header.chunk_count = chunk_count_;
+        return header;
+      }
+
+      bool init_from_header(const file_header& header, std::size_t payload_size)
+      {
+        if (std::memcmp(header.magic, magic(), sizeof(header.magic)) != 0 || header.chunk_size != sizeof(chunk) || header.chunk_count > payload_size / sizeof(chunk))
+          return false;
+        sorted_ = (header.flags & sorted_flag) != 0;
+        delimiter_ = char(header.delimiter);
+        chunk_count_ = static_cast<std::size_t>(header.chunk_count);
+        return true;
+      }
+
+      void add_record(std::uint64_t virtual_offset, const Key& k)
+      {
+        if (owned_chunks_.empty() || (owned_chunks_.back().begin >> 16) != (virtual_offset >> 16))
+        {
+          if (!owned_chunks_.empty())
+          {
+            owned_chunks_.back().end = virtual_offset;
+            if (k < owned_chunks_.back().max_key)
+              sorted_ = false;
+          }
+          chunk c;
+          std::memset(&c, 0, sizeof(c)); // padding is saved to disk.
+          c.min_key = k;
+          c.max_key = k;
+          c.begin = virtual_offset;
+          c.end = virtual_offset;
+          owned_chunks_.push_back(c);
+        }
+        else
+        {
+          chunk& c = owned_chunks_.back();
+          if (k < c.max_key)
+            sorted_ = false;
+          if (k < c.min_key)
+            c.min_key = k;
+          if (c.max_key < k)
+            c.max_key = k;
+        }
+      }
+
+      void move(record_index&& src)
+      {
+        owned_chunks_ = std::move(src.owned_chunks_);
+        chunks_ = owned_chunks_.empty() ? src.chunks_ : owned_chunks_.data();
+        chunk_count_ = src.chunk_count_;
+        delimiter_ = src.delimiter_;
+        sorted_ = src.sorted_;
+        map_ = src.map_;
+        map_size_ = src.map_size_;
+        src.chunks_ = nullptr;
+        src.chunk_count_ = 0;
+        src.map_ = nullptr;
+        src.map_size_ = 0;
+      }
+
+      void destroy()
+      {
+#ifdef SHRINKWRAP_HAS_MMAP
+        if (map_)
+          munmap(map_, map_size_);
+#endif
+        map_ = nullptr;
+      }
+
+    private:
+      std::vector<chunk> owned_chunks_;
+      const chunk* chunks_;
+      std::size_t chunk_count_;
+      char delimiter_;
+      bool sorted_;
+      void* map_;
+      std::size_t map_size_;
+    };
+  }
+}
+
+#endif //SHRINKWRAP_RECORD_INDEX_HPP
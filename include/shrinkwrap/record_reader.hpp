@@ -0,0 +1,144 @@
+#ifndef SHRINKWRAP_RECORD_READER_HPP
+#define SHRINKWRAP_RECORD_READER_HPP
+
+#include <cstring>
+#include <istream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace shrinkwrap
+{
+  // Non-owning view of a record, valid until the next call to record_reader::next.
+  struct record_view
+  {
+    record_view() : data(nullptr), size(0) {}
+    record_view(const char* d, std::size_t s) : data(d), size(s) {}
+    std::string str() const { return std::string(data, size); }
+
+    const char* data;
+    std::size_t size;
+  };
+
+  namespace detail
+  {
+    // Returns a pointer to the first c in [data, data + size) or nullptr.
+    inline const char* find_byte(const char* data, std::size_t size, char c)
+    {
+#if (defined(__AVX2__) || defined(__SSE2__)) && defined(__GNUC__)
+      const char* end = data + size;
+#if defined(__AVX2__)
+      const __m256i needle32 = _mm256_set1_epi8(c);
+      for ( ; end - data >= 32; data += 32)
+      {
+        unsigned mask = unsigned(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(data)), needle32)));
+        if (mask)
+          return data + __builtin_ctz(mask);
+      }
+#endif
+      const __m128i needle16 = _mm_set1_epi8(c);
+      for ( ; end - data >= 16; data += 16)
+      {
+        unsigned mask = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), needle16)));
+        if (mask)
+          return data + __builtin_ctz(mask);
+      }
+      for ( ; data < end; ++data)
+      {
+        if (*data == c)
+          return data;
+      }
+      return nullptr;
+#else
+      return static_cast<const char*>(std::memchr(data, c, size));
+#endif
+    }
+
+    // Reaches the protected get area of any streambuf.
+    class get_area_access : public std::streambuf
+    {
+    public:
+      static char* next(std::streambuf* sb) { return (sb->*&get_area_access::gptr)(); }
+      static void advance(std::streambuf* sb, std::size_t n) { (sb->*&get_area_access::gbump)(static_cast<int>(n)); }
+    };
+  }
+
+  // Splits the decompressed stream into delimiter separated records without
+  // copying them. Records are found in the stream buffer's get area and returned
+  // as views into it; only a record that spans a buffer refill is assembled in a
+  // separate buffer. The delimiter is not part of the record. Works with every
+  // shrinkwrap ibuf.
+  class record_reader
+  {
+  public:
+    record_reader(std::streambuf* sb, char delimiter = '\n')
+      :
+      sb_(sb),
+      delimiter_(delimiter)
+    {
+    }
+
+    record_reader(std::istream& is, char delimiter = '\n') : record_reader(is.rdbuf(), delimiter) {}
+
+    // Returns false once the stream is exhausted. A final record without a
+    // trailing delimiter is still returned.
+    bool next(record_view& rec)
+    {
+      stitch_.clear();
+      if (!sb_)
+        return false;
+
+      while (true)
+      {
+        std::streamsize available = sb_->in_avail();
+        if (available <= 0)
+        {
+          if (std::streambuf::traits_type::eq_int_type(sb_->sgetc(), std::streambuf::traits_type::eof()))
+            break;
+          available = sb_->in_avail();
+          if (available <= 0)
+            break;
+        }
+
+        const char* begin = detail::get_area_access::next(sb_);
+        std::size_t size = static_cast<std::size_t>(available);
+        const char* found = detail::find_byte(begin, size, delimiter_);
+        if (found)
+        {
+          std::size_t length = std::size_t(found - begin);
+          detail::get_area_access::advance(sb_, length + 1);
+          if (stitch_.empty())
+          {
+            rec = record_view(begin, length);
+          }
+          else
+          {
+            stitch_.insert(stitch_.end(), begin, found);
+            rec = record_view(stitch_.data(), stitch_.size());
+          }
+          return true;
+        }
+
+        // The record continues past this buffer.
+        stitch_.insert(stitch_.end(), begin, begin + size);
+        detail::get_area_access::advance(sb_, size);
+      }
+
+      if (stitch_.empty())
+        return false;
+      rec = record_view(stitch_.data(), stitch_.size());
+      return true;
+    }
+
+  private:
+    std::streambuf* sb_;
+    std::vector<char> stitch_;
+    char delimiter_;
+  };
+}
+
+#endif //SHRINKWRAP_RECORD_READER_HPP
@@ -0,0 +1,339 @@
+#ifndef SHRINKWRAP_SPLIT_HPP
+#define SHRINKWRAP_SPLIT_HPP
+
+#include "verify.hpp"
+
+#include <string>
+#include <vector>
+
+namespace shrinkwrap
+{
+  // Divides a file into at most split_count ranges of whole BGZF blocks, xz
+  // blocks or zstd frames with roughly equal compressed sizes. Each range is a
+  // block_info spanning its units; the uncompressed offset and size are
+  // unknown_size when the file does not record them. Plain gzip cannot be split
+  // and yields a single range. Returns an empty vector if the file can't be read.
+  inline std::vector<block_info> make_splits(const std::string& file_path, std::size_t split_count)
+  {
+    std::vector<block_info> ret;
+    FILE* fp = fopen(file_path.c_str(), "rb");
+    if (!fp)
+      return ret;
+
+    std::vector<block_info> units;
+    format fmt = format::unknown;
+    lzma_check check = LZMA_CHECK_NONE;
+    bool scanned = detail::scan_units(fp, units, fmt, check);
+    long file_size = (fseek(fp, 0, SEEK_END) == 0) ? ftell(fp) : -1;
+    fclose(fp);
+
+    if (!scanned)
+    {
+      if (fmt == format::gz && file_size > 0)
+        ret.push_back(block_info(0, std::uint64_t(file_size), 0));
+      return ret;
+    }
+
+    if (units.empty() || split_count == 0)
+      return ret;
+
+    std::uint64_t total = (units.back().compressed_offset + units.back().compressed_size) - units.front().compressed_offset;
+    std::uint64_t consumed = 0;
+    auto it = units.begin();
+    for (std::size_t k = 0; k < split_count && it != units.end(); ++k)
+    {
+      // Cut at the first unit boundary at or past this split's share.
+      std::uint64_t target = (k + 1 == split_count) ? total : total / split_count * (k + 1) + total % split_count * (k + 1) / split_count;
+      block_info split(it->compressed_offset, 0, it->uncompressed_offset, 0);
+      do
+      {
+        split.compressed_size += it->compressed_size;
+        if (it->uncompressed_size == block_info::unknown_size || split.uncompressed_size == block_info::unknown_size)
+          split.uncompressed_size = block_info::unknown_size;
+        else
+          split.uncompressed_size += it->uncompressed_size;
+        consumed += it->compressed_size;
+        ++it;
+      } while (it != units.end() && consumed < target);
+      ret.push_back(split);
+    }
+
+    return ret;
+  }
+
+  // Decodes only the units inside a range returned by make_splits and reports
+  // end of file at the end of the range.
+  class split_ibuf : public std::streambuf
+  {
+  public:
+    split_ibuf(const std::string& file_path, const block_info& split)
+      :
+      fp_(fopen(file_path.c_str(), "rb")),
+      fmt_(format::unknown),
+      compressed_buffer_(64 * 1024),
+      decompressed_buffer_(64 * 1024),
+      read_offset_(split.compressed_offset),
+      end_offset_(split.compressed_offset + split.compressed_size),
+      zstrm_(),
+      zstd_strm_(nullptr),
+      zstd_res_(0),
+      lzma_strm_(LZMA_STREAM_INIT),
+      block_offset_(split.compressed_offset),
+      in_block_(false),
+      in_member_(false),
+      failed_(false)
+    {
+      std::array<std::uint8_t, LZMA_STREAM_HEADER_SIZE> stream_header;
+      std::size_t header_size = fp_ ? fread(stream_header.data(), 1, stream_header.size(), fp_) : 0;
+      fmt_ = detect_format(stream_header.data(), header_size);
+      switch (fmt_)
+      {
+        case format::gz:
+          failed_ = inflateInit2(&zstrm_, 15 + 16) != Z_OK;
+          break;
+        case format::zstd:
+          zstd_strm_ = ZSTD_createDStream();
+          failed_ = !zstd_strm_ || ZSTD_isError(ZSTD_initDStream(zstd_strm_));
+          break;
+        case format::xz:
+          failed_ = header_size != stream_header.size() || lzma_stream_header_decode(&stream_flags_, stream_header.data()) != LZMA_OK;
+          break;
+        default:
+          failed_ = true;
+      }
+
+      failed_ = failed_ || fseek(fp_, long(read_offset_), SEEK_SET) != 0;
+      char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
+      setg(end, end, end);
+    }
+
+    split_ibuf(const split_ibuf&) = delete;
+    split_ibuf& operator=(const split_ibuf&) = delete;
+
+    virtual ~split_ibuf()
+    {
+      if (fmt_ == format::gz)
+        inflateEnd(&zstrm_);
+      ZSTD_freeDStream(zstd_strm_);
+      lzma_end(&lzma_strm_);
+      if (fp_)
+        fclose(fp_);
+    }
+
+    // True if the range could not be read or decoded in full.
+    bool failed() const { return failed_; }
+
+  private:
+    // Reads the next piece of the range. Returns false at the end of the range.
+    bool fill_input(const std::uint8_t*& next_in, std::size_t& avail_in)
+    {
+      if (avail_in > 0)
+        return true;
+      if (read_offset_ >= end_offset_)
+        return false;
+
+      std::size_t want = static_cast<std::size_t>(std::min<std::uint64_t>(compressed_buffer_.size(), end_offset_ - read_offset_));
+      std::size_t got = fread(compressed_buffer_.data(), 1, want, fp_);
+      read_offset_ += got;
+      next_in = compressed_buffer_.data();
+      avail_in = got;
+      if (got == 0)
+        failed_ = true; // file is shorter than the range.
+      return got > 0;
+    }
+
+    std::size_t decode_gz()
+    {
+      const std::uint8_t* next_in = zstrm_.next_in;
+      std::size_t avail_in = zstrm_.avail_in;
+      bool input = fill_input(next_in, avail_in);
+      if (!input && !in_member_)
+        return 0;
+      zstrm_.next_in = const_cast<std::uint8_t*>(next_in);
+      zstrm_.avail_in = static_cast<std::uint32_t>(avail_in);
+
+      // Without new input, inflate still drains output it holds back.
+      zstrm_.next_out = decompressed_buffer_.data();
+      zstrm_.avail_out = static_cast<std::uint32_t>(decompressed_buffer_.size());
+      in_member_ = true;
+      int res = inflate(&zstrm_, Z_NO_FLUSH);
+      std::size_t decoded = decompressed_buffer_.size() - zstrm_.avail_out;
+      if (res == Z_STREAM_END)
+      {
+        res = inflateReset(&zstrm_); // next member
+        in_member_ = false;
+      }
+      if (res != Z_OK && res != Z_BUF_ERROR)
+        failed_ = true;
+      else if (!input && decoded == 0 && in_member_)
+        failed_ = true; // member runs past the range.
+      return decoded;
+    }
+
+    std::size_t decode_zstd()
+    {
+      const std::uint8_t* next_in = static_cast<const std::uint8_t*>(zstd_input_.src) + zstd_input_.pos;
+      std::size_t avail_in = zstd_input_.size - zstd_input_.pos;
+      bool input = fill_input(next_in, avail_in);
+      if (!input && zstd_res_ == 0)
+        return 0;
+      zstd_input_ = {next_in, avail_in, 0};
+
+      if (zstd_res_ == 0 && ZSTD_isError(zstd_res_ = ZSTD_initDStream(zstd_strm_)))
+      {
+        failed_ = true;
+        return 0;
+      }
+
+      // Without new input, the decoder still drains output it holds back.
+      ZSTD_outBuffer output = {decompressed_buffer_.data(), decompressed_buffer_.size(), 0};
+      zstd_res_ = ZSTD_decompressStream(zstd_strm_, &output, &zstd_input_);
+      if (ZSTD_isError(zstd_res_))
+      {
+        failed_ = true;
+        return 0;
+      }
+      if (!input && output.pos == 0)
+        failed_ = true; // frame runs past the range.
+      return output.pos;
+    }
+
+    std::size_t decode_xz()
+    {
+      if (!in_block_)
+      {
+        if (block_offset_ >= end_offset_)
+          return 0;
+
+        std::array<std::uint8_t, LZMA_BLOCK_HEADER_SIZE_MAX> header;
+        if (fseek(fp_, long(block_offset_), SEEK_SET) || !fread(header.data(), 1, 1, fp_) || header[0] == 0x00)
+        {
+          failed_ = true;
+          return 0;
+        }
+
+        block_.version = 1;
+        block_.check = stream_flags_.check;
+        block_.filters = filters_.data();
+        block_.header_size = lzma_block_header_size_decode(header[0]);
+        const lzma_allocator* header_allocator = header_scratch_.allocator(nullptr);
+        if (!fread(&header[1], block_.header_size - 1, 1, fp_) || lzma_block_header_decode(&block_, header_allocator, header.data()) != LZMA_OK)
+        {
+          failed_ = true;
+          return 0;
+        }
+
+        lzma_ret res = lzma_block_decoder(&lzma_strm_, &block_);
+        for (std::size_t i = 0; filters_[i].id != LZMA_VLI_UNKNOWN; ++i)
+          xz::detail::free_with(header_allocator, filters_[i].options); // copied by the decoder.
+        if (res != LZMA_OK)
+        {
+          failed_ = true;
+          return 0;
+        }
+
+        read_offset_ = block_offset_ + block_.header_size;
+        lzma_strm_.avail_in = 0;
+        in_block_ = true;
+      }
+
+      const std::uint8_t* next_in = lzma_strm_.next_in;
+      std::size_t avail_in = lzma_strm_.avail_in;
+      bool input = fill_input(next_in, avail_in);
+      lzma_strm_.next_in = next_in;
+      lzma_strm_.avail_in = avail_in;
+
+      lzma_strm_.next_out = decompressed_buffer_.data();
+      lzma_strm_.avail_out = decompressed_buffer_.size();
+      lzma_ret res = lzma_code(&lzma_strm_, LZMA_RUN);
+      std::size_t decoded = decompressed_buffer_.size() - lzma_strm_.avail_out;
+      if (res == LZMA_STREAM_END)
+      {
+        block_offset_ += lzma_block_total_size(&block_);
+        in_block_ = false;
+      }
+      else if (res != LZMA_OK || (!input && decoded == 0))
+      {
+        failed_ = true; // corrupt, or block runs past the range.
+      }
+      return decoded;
+    }
+
+  protected:
+    virtual std::streambuf::int_type underflow()
+    {
+      if (gptr() < egptr()) // buffer not exhausted
+        return traits_type::to_int_type(*gptr());
+
+      while (!failed_)
+      {
+        std::size_t decoded = 0;
+        bool more = true;
+        switch (fmt_)
+        {
+          case format::gz:
+            decoded = decode_gz();
+            more = zstrm_.avail_in > 0 || read_offset_ < end_offset_ || decoded > 0 || in_member_;
+            break;
+          case format::zstd:
+            decoded = decode_zstd();
+            more = zstd_input_.pos < zstd_input_.size || read_offset_ < end_offset_ || decoded > 0 || zstd_res_ != 0;
+            break;
+          default:
+            decoded = decode_xz();
+            more = in_block_ || block_offset_ < end_offset_;
+            break;
+        }
+
+        if (decoded)
+        {
+          char* start = ((char*) decompressed_buffer_.data());
+          setg(start, start, start + decoded);
+          return traits_type::to_int_type(*gptr());
+        }
+        if (!more)
+          break;
+      }
+
+      return traits_type::eof();
+    }
+
+  private:
+    FILE* fp_;
+    format fmt_;
+    std::vector<std::uint8_t> compressed_buffer_;
+    std::vector<std::uint8_t> decompressed_buffer_;
+    std::uint64_t read_offset_;
+    std::uint64_t end_offset_;
+    z_stream zstrm_;
+    ZSTD_DStream* zstd_strm_;
+    ZSTD_inBuffer zstd_input_ = {nullptr, 0, 0};
+    std::size_t zstd_res_;
+    lzma_stream lzma_strm_;
+    lzma_stream_flags stream_flags_;
+    lzma_block block_;
+    std::array<lzma_filter, LZMA_FILTERS_MAX + 1> filters_;
+    xz::detail::header_scratch header_scratch_;
+    std::uint64_t block_offset_;
+    bool in_block_;
+    bool in_member_;
+    bool failed_;
+  };
+
+  class split_istream : public std::istream
+  {
+  public:
+    split_istream(const std::string& file_path, const block_info& split)
+      :
+      std::istream(&sbuf_),
+      sbuf_(file_path, split)
+    {
+    }
+
+    bool failed() const { return sbuf_.failed(); }
+  private:
+    ::shrinkwrap::split_ibuf sbuf_;
+  };
+}
+
+#endif //SHRINKWRAP_SPLIT_HPP
@@ -0,0 +1,166 @@
+#ifndef SHRINKWRAP_THREAD_POOL_HPP
+#define SHRINKWRAP_THREAD_POOL_HPP
+
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <deque>
+#include <vector>
+
+namespace shrinkwrap
+{
+  class thread_pool
+  {
+  public:
+    thread_pool(std::size_t thread_count = default_thread_count())
+      :
+      active_count_(0),
+      stopping_(false)
+    {
+      if (thread_count == 0)
+        thread_count = 1;
+
+      threads_.reserve(thread_count);
+      for (std::size_t i = 0; i < thread_count; ++i)
+        threads_.emplace_back(&thread_pool::worker_loop, this);
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    ~thread_pool()
+    {
+      {
+        std::unique_lock<std::mutex> lk(mutex_);
+        stopping_ = true;
+      }
+      task_available_.notify_all();
+
+      for (auto it = threads_.begin(); it != threads_.end(); ++it)
+        it->join();
+    }
+
+    static std::size_t default_thread_count()
+    {
+      std::size_t ret = std::thread::hardware_concurrency();
+      return ret ? ret : 1;
+    }
+
+    std::size_t size() const { return threads_.size(); }
+
+    template <typename Fn>
+    auto submit(Fn fn) -> std::future<decltype(fn())>
+    {
+      typedef decltype(fn()) result_type;
+      std::shared_ptr<std::packaged_task<result_type()>> task(new std::packaged_task<result_type()>(std::move(fn)));
+      std::future<result_type> ret = task->get_future();
+
+      {
+        std::unique_lock<std::mutex> lk(mutex_);
+        tasks_.emplace_back([task]() { (*task)(); });
+      }
+      task_available_.notify_one();
+
+      return ret;
+    }
+
+    // Blocks until the queue is drained and no task is running.
+    void wait()
+    {
+      std::unique_lock<std::mutex> lk(mutex_);
+      idle_.wait(lk, [this]() { return tasks_.empty() && active_count_ == 0; });
+    }
+
+  private:
+    void worker_loop()
+    {
+      while (true)
+      {
+        std::function<void()> task;
+        {
+          std::unique_lock<std::mutex> lk(mutex_);
+          task_available_.wait(lk, [this]() { return stopping_ || !tasks_.empty(); });
+          if (tasks_.empty())
+            return; // stopping_ is set and nothing is left to run.
+          task = std::move(tasks_.front());
+          tasks_.pop_front();
+          ++active_count_;
+        }
+
+        task();
+
+        {
+          std::unique_lock<std::mutex> lk(mutex_);
+          --active_count_;
+          if (tasks_.empty() && active_count_ == 0)
+            idle_.notify_all();
+        }
+      }
+    }
+
+  private:
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable task_available_;
+    std::condition_variable idle_;
+    std::size_t active_count_;
+    bool stopping_;
+  };
+
+  struct parallel_options
+  {
+    // Worker count used when no pool is given.
+    std::size_t thread_count = thread_pool::default_thread_count();
+    // Optional caller-owned pool, shared across calls.
+    thread_pool* pool = nullptr;
+  };
+
+  namespace detail
+  {
+    // Calls fn(state, i) for every i in [0, item_count) on up to pool.size()
+    // workers. Each worker default-constructs one State and keeps it for all the
+    // items it processes. Exceptions thrown by fn are rethrown after all workers
+    // have finished.
+    template <typename State, typename Fn>
+    void parallel_for_each(std::size_t item_count, const parallel_options& opts, Fn fn)
+    {
+      if (item_count == 0)
+        return;
+
+      std::unique_ptr<thread_pool> owned_pool;
+      thread_pool* pool = opts.pool;
+      if (!pool)
+      {
+        owned_pool.reset(new thread_pool(std::min(item_count, std::max<std::size_t>(1, opts.thread_count))));
+        pool = owned_pool.get();
+      }
+
+      std::atomic<std::size_t> next_item(0);
+      std::size_t worker_count = std::min(item_count, pool->size());
+      std::vector<std::future<void>> workers;
+      workers.reserve(worker_count);
+      for (std::size_t w = 0; w < worker_count; ++w)
+      {
+        workers.push_back(pool->submit([&next_item, item_count, &fn]()
+        {
+          State state;
+          for (std::size_t i = next_item++; i < item_count; i = next_item++)
+            fn(state, i);
+        }));
+      }
+
+      for (auto it = workers.begin(); it != workers.end(); ++it)
+        it->wait();
+      for (auto it = workers.begin(); it != workers.end(); ++it)
+        it->get();
+    }
+  }
+}
+
+#endif //SHRINKWRAP_THREAD_POOL_HPP
@@ -0,0 +1,369 @@
+#ifndef SHRINKWRAP_TRANSCODE_HPP
+#define SHRINKWRAP_TRANSCODE_HPP
+
+#include "istream.hpp"
+#include "thread_pool.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace shrinkwrap
+{
+  struct transcode_options : parallel_options
+  {
+    // format::unknown picks the output format from the sink's extension
+    // (.gz, .bgz/.bgzf, .xz, .zst).
+    format output_format = format::unknown;
+    // -1 uses the codec default. Ignored for xz.
+    int compression_level = -1;
+    // Decoded chunks buffered between stages. 0 uses twice the worker count.
+    std::size_t queue_depth = 0;
+    // Stores chunks that look incompressible instead of compressing them, as
+    // the gz, BGZF and zstd obuf_options do. Ignored for xz.
+    bool detect_incompressible = true;
+  };
+
+  namespace detail
+  {
+    // Blocking FIFO with a fixed capacity. close() wakes every waiter; push then
+    // fails and pop drains what is left.
+    template <typename T>
+    class bounded_queue
+    {
+    public:
+      bounded_queue(std::size_t capacity) : capacity_(std::max<std::size_t>(1, capacity)), closed_(false) {}
+
+      bool push(T&& v)
+      {
+        std::unique_lock<std::mutex> lk(mutex_);
+        not_full_.wait(lk, [this]() { return closed_ || items_.size() < capacity_; });
+        if (closed_)
+          return false;
+        items_.push_back(std::move(v));
+        not_empty_.notify_one();
+        return true;
+      }
+
+      bool pop(T& dest)
+      {
+        std::unique_lock<std::mutex> lk(mutex_);
+        not_empty_.wait(lk, [this]() { return closed_ || !items_.empty(); });
+        if (items_.empty())
+          return false;
+        dest = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+      }
+
+      void close()
+      {
+        std::unique_lock<std::mutex> lk(mutex_);
+        closed_ = true;
+        not_full_.notify_all();
+        not_empty_.notify_all();
+      }
+
+    private:
+      std::deque<T> items_;
+      std::size_t capacity_;
+      bool closed_;
+      std::mutex mutex_;
+      std::condition_variable not_full_;
+      std::condition_variable not_empty_;
+    };
+
+    struct transcode_chunk
+    {
+      transcode_chunk() : seq(0) {}
+      std::size_t seq;
+      std::vector<char> data;
+    };
+
+    class zstd_frame_encoder
+    {
+    public:
+      zstd_frame_encoder(bool detect_incompressible = true) : cctx_(ZSTD_createCCtx()), detect_incompressible_(detect_incompressible) {}
+
+      zstd_frame_encoder(const zstd_frame_encoder&) = delete;
+      zstd_frame_encoder& operator=(const zstd_frame_encoder&) = delete;
+
+      ~zstd_frame_encoder()
+      {
+        ZSTD_freeCCtx(cctx_);
+      }
+
+      // Writes one frame, with its content size in the header, to out.
+      bool encode(const char* data, std::size_t size, int level, std::vector<std::uint8_t>& out)
+      {
+        if (!cctx_)
+          return false;
+        if (detect_incompressible_ && looks_incompressible(reinterpret_cast<const std::uint8_t*>(data), size))
+        {
+          out.clear();
+          return zstd_write_raw_frame(reinterpret_cast<const std::uint8_t*>(data), size, [&out](const void* buf, std::size_t len)
+          {
+            out.insert(out.end(), static_cast<const std::uint8_t*>(buf), static_cast<const std::uint8_t*>(buf) + len);
+            return true;
+          });
+        }
+        out.resize(ZSTD_compressBound(size));
+        std::size_t res = ZSTD_compressCCtx(cctx_, out.data(), out.size(), data, size, level);
+        if (ZSTD_isError(res))
+          return false;
+        out.resize(res);
+        return true;
+      }
+
+    private:
+      ZSTD_CCtx* cctx_;
+      bool detect_incompressible_;
+    };
+
+    class transcode_encoder
+    {
+    public:
+      transcode_encoder(bool detect_incompressible = true)
+        :
+        fmt_(format::unknown),
+        level_(0),
+        bgzf_(nullptr, detect_incompressible),
+        zstd_(detect_incompressible)
+      {
+      }
+
+      void init(format fmt, int level)
+      {
+        fmt_ = fmt;
+        level_ = level;
+      }
+
+      // Encodes a chunk into independent BGZF blocks or a single zstd frame.
+      bool encode(const std::vector<char>& chunk, std::vector<std::uint8_t>& out)
+      {
+        if (fmt_ == format::zstd)
+          return zstd_.encode(chunk.data(), chunk.size(), level_, out);
+
+        const std::size_t max_length = bgzf_block_encoder::max_input_length;
+        out.clear();
+        for (std::size_t pos = 0; pos < chunk.size(); pos += max_length)
+        {
+          std::uint32_t length = static_cast<std::uint32_t>(std::min(chunk.size() - pos, max_length));
+          std::size_t block_size = bgzf_.encode(reinterpret_cast<const std::uint8_t*>(chunk.data() + pos), length, level_);
+          if (!block_size)
+            return false;
+          out.insert(out.end(), bgzf_.data(), bgzf_.data() + block_size);
+        }
+        return true;
+      }
+
+    private:
+      format fmt_;
+      int level_;
+      bgzf_block_encoder bgzf_;
+      zstd_frame_encoder zstd_;
+    };
+
+    inline format format_from_extension(const std::string& file_path)
+    {
+      std::size_t dot = file_path.find_last_of('.');
+      std::string ext = dot == std::string::npos ? std::string() : file_path.substr(dot + 1);
+      if (ext == "gz")
+        return format::gz;
+      if (ext == "bgz" || ext == "bgzf")
+        return format::bgzf;
+      if (ext == "xz")
+        return format::xz;
+      if (ext == "zst")
+        return format::zstd;
+      return format::unknown;
+    }
+
+    // Single encoder stage for formats without independent blocks.
+    template <typename OutT>
+    bool write_serial(OutT& os, bounded_queue<transcode_chunk>& decoded)
+    {
+      transcode_chunk chunk;
+      while (os.good() && decoded.pop(chunk))
+        os.write(chunk.data.data(), chunk.data.size());
+      os.flush();
+      return os.good();
+    }
+
+    // Chunks are encoded on the pool and written here in order. At most window
+    // encoded chunks wait for the writer.
+    inline bool write_parallel(FILE* fp, bounded_queue<transcode_chunk>& decoded, format fmt, int level, std::size_t window, const transcode_options& opts)
+    {
+      std::unique_ptr<thread_pool> owned_pool;
+      thread_pool* pool = opts.pool;
+      if (!pool)
+      {
+        owned_pool.reset(new thread_pool(std::max<std::size_t>(1, opts.thread_count)));
+        pool = owned_pool.get();
+      }
+
+      std::mutex mtx;
+      std::condition_variable cv;
+      std::map<std::size_t, std::vector<std::uint8_t>> encoded;
+      std::size_t next_write = 0;
+      std::size_t active_workers = pool->size();
+      bool failed = false;
+
+      std::vector<std::future<void>> workers;
+      for (std::size_t w = 0; w < pool->size(); ++w)
+      {
+        workers.push_back(pool->submit([&]()
+        {
+          transcode_encoder encoder(opts.detect_incompressible);
+          encoder.init(fmt, level);
+          transcode_chunk chunk;
+          std::vector<std::uint8_t> out;
+          while (decoded.pop(chunk))
+          {
+            bool ok = encoder.encode(chunk.data, out);
+            std::unique_lock<std::mutex> lk(mtx);
+            cv.wait(lk, [&]() { return failed || chunk.seq < next_write + window; });
+            if (!ok)
+              failed = true;
+            if (failed)
+              break;
+            encoded[chunk.seq].swap(out);
+            cv.notify_all();
+          }
+
+          std::unique_lock<std::mutex> lk(mtx);
+          --active_workers;
+          cv.notify_all();
+        }));
+      }
+
+      bool ret = true;
+      while (ret)
+      {
+        std::vector<std::uint8_t> out;
+        {
+          std::unique_lock<std::mutex> lk(mtx);
+          cv.wait(lk, [&]() { return failed || encoded.count(next_write) || active_workers == 0; });
+
+          auto it = encoded.find(next_write);
+          if (failed || it == encoded.end())
+          {
+            ret = !failed;
+            break;
+          }
+          out.swap(it->second);
+          encoded.erase(it);
+          ++next_write;
+          cv.notify_all();
+        }
+
+        if (!out.empty() && !fwrite(out.data(), out.size(), 1, fp))
+        {
+          std::unique_lock<std::mutex> lk(mtx);
+          failed = true;
+          ret = false;
+          cv.notify_all();
+        }
+      }
+
+      if (!ret)
+        decoded.close();
+      for (auto it = workers.begin(); it != workers.end(); ++it)
+        it->wait();
+
+      if (ret && fmt == format::bgzf)
+      {
+        bgzf_block_encoder eof;
+        std::size_t eof_size = eof.encode(nullptr, 0, level);
+        ret = eof_size && fwrite(eof.data(), eof_size, 1, fp);
+      }
+      return ret;
+    }
+  }
+
+  // Decodes source (gz, BGZF, xz or zstd) and re-encodes it to sink. Decoding,
+  // encoding and writing run as concurrent stages connected by bounded queues.
+  // BGZF blocks and zstd frames (one per chunk) are encoded on parallel_options
+  // workers; gz and xz output is encoded by a single stage.
+  inline bool transcode(const std::string& source, const std::string& sink, const transcode_options& opts = transcode_options())
+  {
+    format fmt = opts.output_format == format::unknown ? detail::format_from_extension(sink) : opts.output_format;
+    if (fmt == format::unknown)
+      return false;
+
+    std::size_t worker_count = opts.pool ? opts.pool->size() : std::max<std::size_t>(1, opts.thread_count);
+    std::size_t depth = opts.queue_depth ? opts.queue_depth : 2 * worker_count;
+    std::size_t chunk_size = fmt == format::bgzf ? 16 * detail::bgzf_block_encoder::max_input_length : 1024 * 1024;
+
+    std::unique_ptr<std::istream> is;
+    try
+    {
+      is.reset(new istream(source));
+    }
+    catch (const std::exception&)
+    {
+      return false;
+    }
+
+    detail::bounded_queue<detail::transcode_chunk> decoded(depth);
+    bool read_ok = true;
+    std::thread reader([&]()
+    {
+      for (std::size_t seq = 0; ; ++seq)
+      {
+        detail::transcode_chunk chunk;
+        chunk.seq = seq;
+        chunk.data.resize(chunk_size);
+        is->read(chunk.data.data(), chunk.data.size());
+        chunk.data.resize(static_cast<std::size_t>(is->gcount()));
+        if (chunk.data.empty() || !decoded.push(std::move(chunk)))
+          break;
+      }
+      read_ok = !is->bad();
+      decoded.close();
+    });
+
+    bool write_ok = false;
+    switch (fmt)
+    {
+      case format::gz:
+      {
+        gz::obuf_options gz_opts;
+        if (opts.compression_level >= 0)
+          gz_opts.compression_level = opts.compression_level;
+        gz_opts.detect_incompressible = opts.detect_incompressible;
+        gz::ostream os(sink, gz_opts);
+        write_ok = detail::write_serial(os, decoded);
+        break;
+      }
+      case format::xz:
+      {
+        xz::ostream os(sink);
+        write_ok = detail::write_serial(os, decoded);
+        break;
+      }
+      default:
+      {
+        FILE* fp = fopen(sink.c_str(), "wb");
+        if (fp)
+        {
+          int level = opts.compression_level >= 0 ? opts.compression_level : (fmt == format::zstd ? 3 : Z_DEFAULT_COMPRESSION);
+          write_ok = detail::write_parallel(fp, decoded, fmt, level, depth, opts);
+          write_ok = (fclose(fp) == 0) && write_ok;
+        }
+        break;
+      }
+    }
+
+    decoded.close();
+    reader.join();
+    return read_ok && write_ok;
+  }
+}
+
+#endif //SHRINKWRAP_TRANSCODE_HPP
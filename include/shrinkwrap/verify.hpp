@@ -0,0 +1,221 @@
+#ifndef SHRINKWRAP_VERIFY_HPP
+#define SHRINKWRAP_VERIFY_HPP
+
+#include "istream.hpp"
+#include "block_decoder.hpp"
+#include "thread_pool.hpp"
+
+#include <string>
+#include <vector>
+#include <mutex>
+
+namespace shrinkwrap
+{
+  struct verify_options : parallel_options
+  {
+  };
+
+  struct verify_result
+  {
+    verify_result() : ok(false), unit_count(0), error_offset(0) {}
+    explicit operator bool() const { return ok; }
+
+    bool ok;
+    std::size_t unit_count; // blocks or frames checked
+    std::uint64_t error_offset; // compressed offset of the first unit that failed
+  };
+
+  namespace detail
+  {
+    struct discard_sink
+    {
+      void operator()(const char*, std::size_t) {}
+    };
+
+    template <typename Decoder>
+    struct unit_reader
+    {
+      unit_reader() : fp(nullptr) {}
+      ~unit_reader()
+      {
+        if (fp)
+          fclose(fp);
+      }
+
+      bool read(const std::string& file_path, const block_info& unit)
+      {
+        if (!fp && !(fp = fopen(file_path.c_str(), "rb")))
+          return false;
+        buffer.resize(static_cast<std::size_t>(unit.compressed_size));
+        return fseek(fp, long(unit.compressed_offset), SEEK_SET) == 0 && (buffer.empty() || fread(buffer.data(), buffer.size(), 1, fp) == 1);
+      }
+
+      FILE* fp;
+      std::vector<std::uint8_t> buffer;
+      Decoder decoder;
+    };
+
+    // Checks every unit on the pool. check(reader) decodes reader.buffer.
+    template <typename Decoder, typename CheckFn>
+    verify_result verify_units(const std::string& file_path, const std::vector<block_info>& units, const verify_options& opts, CheckFn check)
+    {
+      verify_result ret;
+      ret.ok = true;
+      ret.unit_count = units.size();
+
+      std::mutex mtx;
+      parallel_for_each<unit_reader<Decoder>>(units.size(), opts, [&](unit_reader<Decoder>& reader, std::size_t i)
+      {
+        if (!reader.read(file_path, units[i]) || !check(reader))
+        {
+          std::unique_lock<std::mutex> lk(mtx);
+          if (ret.ok || units[i].compressed_offset < ret.error_offset)
+            ret.error_offset = units[i].compressed_offset;
+          ret.ok = false;
+        }
+      });
+
+      return ret;
+    }
+
+    // Plain gzip has no block index, so members are inflated serially.
+    inline verify_result verify_gzip(FILE* fp)
+    {
+      verify_result ret;
+      z_stream zstrm = z_stream();
+      if (fseek(fp, 0, SEEK_SET) || inflateInit2(&zstrm, 15 + 16) != Z_OK)
+        return ret;
+
+      std::vector<std::uint8_t> compressed_buffer(64 * 1024);
+      std::vector<std::uint8_t> decompressed_buffer(64 * 1024);
+      std::uint64_t member_offset = 0;
+      std::uint64_t consumed = 0;
+      int res = Z_OK;
+      while (res == Z_OK)
+      {
+        if (zstrm.avail_in == 0)
+        {
+          zstrm.next_in = compressed_buffer.data();
+          zstrm.avail_in = static_cast<std::uint32_t>(fread(compressed_buffer.data(), 1, compressed_buffer.size(), fp));
+          if (zstrm.avail_in == 0)
+            break; // truncated member
+        }
+
+        zstrm.next_out = decompressed_buffer.data();
+        zstrm.avail_out = static_cast<std::uint32_t>(decompressed_buffer.size());
+        std::uint32_t avail_in = zstrm.avail_in;
+        res = inflate(&zstrm, Z_NO_FLUSH);
+        consumed += avail_in - zstrm.avail_in;
+
+        if (res == Z_STREAM_END)
+        {
+          ++ret.unit_count;
+          if (zstrm.avail_in == 0)
+          {
+            zstrm.next_in = compressed_buffer.data();
+            zstrm.avail_in = static_cast<std::uint32_t>(fread(compressed_buffer.data(), 1, compressed_buffer.size(), fp));
+          }
+
+          if (zstrm.avail_in > 0)
+          {
+            member_offset = consumed;
+            res = inflateReset(&zstrm); // next member
+          }
+        }
+      }
+
+      inflateEnd(&zstrm);
+      ret.ok = (res == Z_STREAM_END && !ferror(fp));
+      if (!ret.ok)
+        ret.error_offset = member_offset;
+      return ret;
+    }
+  }
+
+  namespace detail
+  {
+    // Lists the independently decodable units of a BGZF, xz or zstd file and
+    // reports the format (format::bgzf for BGZF). Returns false for plain gzip,
+    // which has no units, and for unreadable files.
+    inline bool scan_units(FILE* fp, std::vector<block_info>& units, format& fmt, lzma_check& check)
+    {
+      units.clear();
+      fmt = format::unknown;
+      check = LZMA_CHECK_NONE;
+
+      std::array<std::uint8_t, LZMA_STREAM_HEADER_SIZE> stream_header;
+      if (fseek(fp, 0, SEEK_SET))
+        return false;
+      std::size_t header_size = fread(stream_header.data(), 1, stream_header.size(), fp);
+      fmt = detect_format(stream_header.data(), header_size);
+      switch (fmt)
+      {
+        case format::gz:
+          if (bgzf::scan_blocks(fp, units))
+          {
+            fmt = format::bgzf;
+            return true;
+          }
+          return false;
+        case format::xz:
+        {
+          lzma_stream_flags header_flags;
+          return header_size == stream_header.size() && lzma_stream_header_decode(&header_flags, stream_header.data()) == LZMA_OK && xz::scan_blocks(fp, units, &check) && check == header_flags.check;
+        }
+        case format::zstd:
+          return zstd::scan_frames(fp, units);
+        default:
+          return false;
+      }
+    }
+  }
+
+  // Validates the integrity of a gz, BGZF, xz or zstd file without handing any
+  // decompressed data to the caller. BGZF blocks (CRC32 and ISIZE), xz blocks
+  // (block check) and zstd frames (content checksum, when present) are checked
+  // concurrently.
+  inline verify_result verify(const std::string& file_path, const verify_options& opts = verify_options())
+  {
+    verify_result ret;
+    FILE* fp = fopen(file_path.c_str(), "rb");
+    if (!fp)
+      return ret;
+
+    std::vector<block_info> units;
+    format fmt = format::unknown;
+    lzma_check check = LZMA_CHECK_NONE;
+    bool scanned = detail::scan_units(fp, units, fmt, check);
+    if (!scanned)
+    {
+      if (fmt == format::gz)
+        ret = detail::verify_gzip(fp);
+      fclose(fp);
+      return ret;
+    }
+
+    fclose(fp);
+    switch (fmt)
+    {
+      case format::bgzf:
+        return detail::verify_units<detail::bgzf_block_decoder>(file_path, units, opts, [](detail::unit_reader<detail::bgzf_block_decoder>& r)
+        {
+          detail::discard_sink sink;
+          return r.decoder.decode(r.buffer.data(), r.buffer.size(), sink);
+        });
+      case format::xz:
+        return detail::verify_units<detail::xz_block_decoder>(file_path, units, opts, [check](detail::unit_reader<detail::xz_block_decoder>& r)
+        {
+          detail::discard_sink sink;
+          return r.decoder.decode(r.buffer.data(), r.buffer.size(), check, sink);
+        });
+      default:
+        return detail::verify_units<detail::zstd_frame_decoder>(file_path, units, opts, [](detail::unit_reader<detail::zstd_frame_decoder>& r)
+        {
+          detail::discard_sink sink;
+          return r.decoder.decode(r.buffer.data(), r.buffer.size(), sink);
+        });
+    }
+  }
+}
+
+#endif //SHRINKWRAP_VERIFY_HPP
@@ -11,23 +11,176 @@
 #include <limits>
 #include <cstring>
 
+#include "common.hpp"
+#include "basic_buf.hpp"
+
 namespace shrinkwrap
 {
   namespace xz
   {
-    class ibuf : public std::streambuf
+    namespace detail
+    {
+      inline void* lzma_allocate(void* opaque, size_t nmemb, size_t size)
+      {
+        return ::shrinkwrap::detail::codec_allocate(static_cast<memory_resource*>(opaque), nmemb * size);
+      }
+
+      inline void lzma_deallocate(void* opaque, void* ptr)
+      {
+        ::shrinkwrap::detail::codec_deallocate(static_cast<memory_resource*>(opaque), ptr);
+      }
+
+      inline lzma_allocator make_allocator(memory_resource* resource)
+      {
+        lzma_allocator ret = {lzma_allocate, lzma_deallocate, resource};
+        return ret;
+      }
+
+      // Releases memory that liblzma allocated through allocator (null for malloc),
+      // e.g. decoded filter options.
+      inline void free_with(const lzma_allocator* allocator, void* ptr)
+      {
+        if (allocator)
+          allocator->free(allocator->opaque, ptr);
+        else
+          free(ptr);
+      }
+
+      // Serves the filter options that lzma_block_header_decode() allocates for
+      // every block from a fixed buffer. They are freed as soon as the block
+      // decoder has copied them, so each block reuses the buffer. Anything
+      // that does not fit goes to the fallback allocator (null for malloc).
+      class header_scratch
+      {
+      public:
+        header_scratch() : used_(0), fallback_(nullptr) {}
+
+        header_scratch(const header_scratch&) = delete;
+        header_scratch& operator=(const header_scratch&) = delete;
+
+        // Call once per block header, after the previous block's options are freed.
+        const lzma_allocator* allocator(const lzma_allocator* fallback)
+        {
+          used_ = 0;
+          fallback_ = fallback;
+          allocator_.alloc = allocate;
+          allocator_.free = deallocate;
+          allocator_.opaque = this; // re-pointed each time, so owners may move.
+          return &allocator_;
+        }
+
+      private:
+        static void* allocate(void* opaque, size_t nmemb, size_t size)
+        {
+          header_scratch& self = *static_cast<header_scratch*>(opaque);
+          std::size_t bytes = (nmemb * size + memory_resource::max_alignment - 1) / memory_resource::max_alignment * memory_resource::max_alignment;
+          if (bytes <= self.buffer_.size() - self.used_)
+          {
+            void* ret = &self.buffer_[self.used_];
+            self.used_ += bytes;
+            return ret;
+          }
+          return self.fallback_ ? self.fallback_->alloc(self.fallback_->opaque, nmemb, size) : malloc(nmemb * size);
+        }
+
+        static void deallocate(void* opaque, void* ptr)
+        {
+          header_scratch& self = *static_cast<header_scratch*>(opaque);
+          std::uint8_t* p = static_cast<std::uint8_t*>(ptr);
+          if (p < self.buffer_.data() || p >= self.buffer_.data() + self.buffer_.size())
+            free_with(self.fallback_, ptr);
+        }
+
+        // Room for LZMA_FILTERS_MAX sets of options the size of lzma_options_lzma.
+        alignas(memory_resource::max_alignment) std::array<std::uint8_t, LZMA_FILTERS_MAX * 256> buffer_;
+        std::size_t used_;
+        const lzma_allocator* fallback_;
+        lzma_allocator allocator_;
+      };
+
+      // Decodes the stream footer and index at the end of the file.
+      inline bool decode_index(FILE* fp, std::uint64_t memlimit, lzma_stream_flags& footer_flags, lzma_index*& index, const lzma_allocator* allocator = nullptr)
+      {
+        std::array<std::uint8_t, LZMA_STREAM_HEADER_SIZE> stream_footer;
+        if (!fp || fseek(fp, -long(stream_footer.size()), SEEK_END) || !fread(stream_footer.data(), stream_footer.size(), 1, fp))
+          return false;
+
+        if (lzma_stream_footer_decode(&footer_flags, stream_footer.data()) != LZMA_OK)
+          return false;
+
+        std::vector<std::uint8_t> index_raw(footer_flags.backward_size);
+        if (fseek(fp, -long(footer_flags.backward_size + stream_footer.size()), SEEK_END) || !fread(index_raw.data(), index_raw.size(), 1, fp))
+          return false;
+
+        size_t in_pos = 0;
+        return lzma_index_buffer_decode(&index, &memlimit, allocator, index_raw.data(), &in_pos, index_raw.size()) == LZMA_OK;
+      }
+
+      // Lowers the level of preset until its encoder fits in memory_limit (0 is
+      // unlimited). Stops at level 0 even if that does not fit.
+      inline std::uint32_t fit_preset(std::uint32_t preset, std::uint64_t memory_limit)
+      {
+        std::uint32_t level = preset & LZMA_PRESET_LEVEL_MASK;
+        std::uint32_t flags = preset & ~std::uint32_t(LZMA_PRESET_LEVEL_MASK);
+        while (memory_limit && level > 0 && lzma_easy_encoder_memusage(level | flags) > memory_limit)
+          --level;
+        return level | flags;
+      }
+    }
+
+    // Lists the blocks recorded in the stream index. The file position is left
+    // undefined.
+    inline bool scan_blocks(FILE* fp, std::vector<block_info>& blocks, lzma_check* check = nullptr)
+    {
+      blocks.clear();
+
+      lzma_stream_flags footer_flags;
+      lzma_index* index = nullptr;
+      if (!detail::decode_index(fp, UINT64_MAX, footer_flags, index))
+        return false;
+
+      lzma_index_iter itr;
+      lzma_index_iter_init(&itr, index);
+      while (!lzma_index_iter_next(&itr, LZMA_INDEX_ITER_BLOCK))
+        blocks.push_back(block_info(itr.block.compressed_file_offset, itr.block.total_size, itr.block.uncompressed_file_offset, itr.block.uncompressed_size));
+
+      if (check)
+        *check = footer_flags.check;
+
+      lzma_index_end(index, nullptr);
+      return true;
+    }
+
+    struct ibuf_options
     {
+      // Skips verification of the block checks (CRC32/CRC64/SHA-256). Only for
+      // data whose integrity is guaranteed elsewhere.
+      bool ignore_checks = false;
+      // Serves the stream's buffers and liblzma's state. Must outlive the stream.
+      memory_resource* resource = nullptr;
+      // Bytes liblzma may use for a block's filter chain or for the index read
+      // by seeks. Blocks needing more fail with LZMA_MEMLIMIT_ERROR. 0 is unlimited.
+      std::uint64_t memory_limit = 0;
+    };
+
+    class ibuf : public basic_ibuf<ibuf, (BUFSIZ >= LZMA_BLOCK_HEADER_SIZE_MAX ? BUFSIZ : LZMA_BLOCK_HEADER_SIZE_MAX), (BUFSIZ >= LZMA_BLOCK_HEADER_SIZE_MAX ? BUFSIZ : LZMA_BLOCK_HEADER_SIZE_MAX)>
+    {
+      typedef basic_ibuf<ibuf, (BUFSIZ >= LZMA_BLOCK_HEADER_SIZE_MAX ? BUFSIZ : LZMA_BLOCK_HEADER_SIZE_MAX), (BUFSIZ >= LZMA_BLOCK_HEADER_SIZE_MAX ? BUFSIZ : LZMA_BLOCK_HEADER_SIZE_MAX)> base_type;
+      friend base_type;
     public:
-      ibuf(FILE* fp)
+      ibuf(FILE* fp, const ibuf_options& opts = ibuf_options())
         :
+        base_type(fp, opts.resource),
+        lzma_block_decoder_(LZMA_STREAM_INIT),
+        allocator_(detail::make_allocator(opts.resource)),
         decoded_position_(0),
-        discard_amount_(0),
-        fp_(fp),
-        put_back_size_(0),
         lzma_index_(nullptr),
         at_block_boundary_(true),
-        lzma_block_decoder_(LZMA_STREAM_INIT)
+        block_memory_usage_(0),
+        memory_limit_(opts.memory_limit),
+        ignore_checks_(opts.ignore_checks)
       {
+        lzma_block_decoder_.allocator = opts.resource ? &allocator_ : nullptr;
         if (fp_)
         {
           fread(stream_header_.data(), stream_header_.size(), 1, fp_); // TODO: handle error.
@@ -37,16 +190,14 @@ namespace shrinkwrap
             // TODO: handle error.
           }
         }
-        char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
-        setg(end, end, end);
       }
 
-      ibuf(const std::string& file_path) :ibuf(fopen(file_path.c_str(), "rb")) {}
+      ibuf(const std::string& file_path, const ibuf_options& opts = ibuf_options()) : ibuf(fopen(file_path.c_str(), "rb"), opts) {}
 
 #if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
       ibuf(ibuf&& src)
         :
-        std::streambuf(std::move(src))
+        base_type(std::move(src))
       {
         this->move(std::move(src));
       }
@@ -55,8 +206,8 @@ namespace shrinkwrap
       {
         if (&src != this)
         {
-          std::streambuf::operator=(std::move(src));
           this->destroy();
+          base_type::operator=(std::move(src));
           this->move(std::move(src));
         }
 
@@ -69,115 +220,124 @@ namespace shrinkwrap
         this->destroy();
       }
 
-    protected:
-      virtual std::streambuf::int_type underflow()
+      // Bytes held by the buffers, the block decoder and the index. Block
+      // decoders don't support lzma_memusage(), so their share is the estimate
+      // for the current block's filter chain.
+      std::uint64_t memory_usage() const
       {
-        if (!fp_)
-          return traits_type::eof();
-        if (gptr() < egptr()) // buffer not exhausted
-          return traits_type::to_int_type(*gptr());
+        std::uint64_t ret = compressed_buffer_.size() + decompressed_buffer_.size();
+        if (lzma_block_decoder_.internal)
+          ret += block_memory_usage_;
+        if (lzma_index_)
+          ret += lzma_index_memused(lzma_index_);
+        return ret;
+      }
 
-        while (gptr() >= egptr() && lzma_res_ == LZMA_OK)
+    private:
+      bool decodable() const
+      {
+        return lzma_res_ == LZMA_OK;
+      }
+
+      bool good() const
+      {
+        return lzma_res_ == LZMA_OK || lzma_res_ == LZMA_STREAM_END;
+      }
+
+      std::size_t decode()
+      {
+        lzma_block_decoder_.next_out = decompressed_buffer_.data();
+        lzma_block_decoder_.avail_out = decompressed_buffer_.size();
+
+        if (at_block_boundary_)
         {
-          lzma_block_decoder_.next_out = decompressed_buffer_.data();
-          lzma_block_decoder_.avail_out = decompressed_buffer_.size();
+          std::array<std::uint8_t, LZMA_BLOCK_HEADER_SIZE_MAX> block_header;
+          if (lzma_block_decoder_.avail_in == 0 && !feof(fp_) && !ferror(fp_))
+          {
+            replenish_compressed_buffer();
+          }
+          // TODO: make sure avail_in is greater than 0;
+          std::memcpy(block_header.data(), lzma_block_decoder_.next_in, 1);
+          ++(lzma_block_decoder_.next_in);
+          --(lzma_block_decoder_.avail_in);
 
-          if (at_block_boundary_)
+          if (block_header[0] == 0x00)
+          {
+            // Index indicator found
+            lzma_res_ = LZMA_STREAM_END;
+          }
+          else
           {
-            std::vector<std::uint8_t> block_header(LZMA_BLOCK_HEADER_SIZE_MAX);
-            if (lzma_block_decoder_.avail_in == 0 && !feof(fp_) && !ferror(fp_))
+            lzma_block_.version = 1;
+            lzma_block_.check = stream_header_flags_.check;
+            lzma_block_.filters = lzma_block_filters_buf_.data();
+            lzma_block_.header_size = lzma_block_header_size_decode (block_header[0]);
+
+            std::size_t bytes_already_copied = 0;
+            if (lzma_block_decoder_.avail_in < (lzma_block_.header_size - 1))
             {
+              bytes_already_copied = lzma_block_decoder_.avail_in;
+              std::memcpy(&block_header[1], lzma_block_decoder_.next_in, bytes_already_copied);
+              lzma_block_decoder_.avail_in -= bytes_already_copied;
+              lzma_block_decoder_.next_in += bytes_already_copied;
+              assert(lzma_block_decoder_.avail_in == 0);
               replenish_compressed_buffer();
             }
-            // TODO: make sure avail_in is greater than 0;
-            std::memcpy(block_header.data(), lzma_block_decoder_.next_in, 1);
-            ++(lzma_block_decoder_.next_in);
-            --(lzma_block_decoder_.avail_in);
 
-            if (block_header[0] == 0x00)
+            // TODO: make sure avail_in is greater than (lzma_block_.header_size - 1) - bytes_already_copied.
+            std::size_t bytes_left_to_copy = (lzma_block_.header_size - 1) - bytes_already_copied;
+            std::memcpy(&block_header[1 + bytes_already_copied], lzma_block_decoder_.next_in, bytes_left_to_copy);
+            lzma_block_decoder_.avail_in -= bytes_left_to_copy;
+            lzma_block_decoder_.next_in += bytes_left_to_copy;
+
+            const lzma_allocator* header_allocator = header_scratch_.allocator(lzma_block_decoder_.allocator);
+            lzma_res_ = lzma_block_header_decode(&lzma_block_, header_allocator, block_header.data());
+            if (lzma_res_ != LZMA_OK)
             {
-              // Index indicator found
-              lzma_res_ = LZMA_STREAM_END;
+              // TODO: handle error.
             }
             else
             {
-              lzma_block_.version = 0;
-              lzma_block_.check = stream_header_flags_.check;
-              lzma_block_.filters = lzma_block_filters_buf_.data();
-              lzma_block_.header_size = lzma_block_header_size_decode (block_header[0]);
-
-              std::size_t bytes_already_copied = 0;
-              if (lzma_block_decoder_.avail_in < (lzma_block_.header_size - 1))
-              {
-                bytes_already_copied = lzma_block_decoder_.avail_in;
-                std::memcpy(&block_header[1], lzma_block_decoder_.next_in, bytes_already_copied);
-                lzma_block_decoder_.avail_in -= bytes_already_copied;
-                lzma_block_decoder_.next_in += bytes_already_copied;
-                assert(lzma_block_decoder_.avail_in == 0);
-                replenish_compressed_buffer();
-              }
-
-              // TODO: make sure avail_in is greater than (lzma_block_.header_size - 1) - bytes_already_copied.
-              std::size_t bytes_left_to_copy = (lzma_block_.header_size - 1) - bytes_already_copied;
-              std::memcpy(&block_header[1 + bytes_already_copied], lzma_block_decoder_.next_in, bytes_left_to_copy);
-              lzma_block_decoder_.avail_in -= bytes_left_to_copy;
-              lzma_block_decoder_.next_in += bytes_left_to_copy;
-
-              lzma_res_ = lzma_block_header_decode(&lzma_block_, nullptr, block_header.data());
-              if (lzma_res_ != LZMA_OK)
-              {
-                // TODO: handle error.
-              }
+              lzma_block_.ignore_check = ignore_checks_; // header decode resets this.
+              // Block decoders take no memlimit, so the filter chain is checked up front.
+              block_memory_usage_ = lzma_raw_decoder_memusage(lzma_block_filters_buf_.data());
+              if (memory_limit_ && block_memory_usage_ > memory_limit_)
+                lzma_res_ = LZMA_MEMLIMIT_ERROR;
               else
-              {
                 lzma_res_ = lzma_block_decoder(&lzma_block_decoder_, &lzma_block_);
-                // TODO: handle error.
-              }
+              // TODO: handle error.
+              for (std::size_t i = 0; lzma_block_filters_buf_[i].id != LZMA_VLI_UNKNOWN; ++i)
+                detail::free_with(header_allocator, lzma_block_filters_buf_[i].options); // copied by the decoder.
             }
-            at_block_boundary_ = false;
           }
+          at_block_boundary_ = false;
+        }
 
-          if (lzma_res_ == LZMA_OK)
+        if (lzma_res_ == LZMA_OK)
+        {
+          if (lzma_block_decoder_.avail_in == 0 && !feof(fp_) && !ferror(fp_))
           {
-            if (lzma_block_decoder_.avail_in == 0 && !feof(fp_) && !ferror(fp_))
-            {
-              replenish_compressed_buffer();
-            }
-
-            assert(lzma_block_decoder_.avail_in > 0);
-
-            lzma_ret r = lzma_code(&lzma_block_decoder_, LZMA_RUN);
-            if (r == LZMA_STREAM_END)
-            {
-              // End of block.
-              at_block_boundary_ = true;
-              r = LZMA_OK;
-            }
-            lzma_res_ = r;
+            replenish_compressed_buffer();
           }
 
-          char* start = ((char*) decompressed_buffer_.data());
-          setg(start, start, start + (decompressed_buffer_.size() - lzma_block_decoder_.avail_out));
-          decoded_position_ += (egptr() - gptr());
+          assert(lzma_block_decoder_.avail_in > 0);
 
-          if (discard_amount_ > 0)
+          lzma_ret r = lzma_code(&lzma_block_decoder_, LZMA_RUN);
+          if (r == LZMA_STREAM_END)
           {
-            std::uint64_t advance_amount = discard_amount_;
-            if ((egptr() - gptr()) < advance_amount)
-              advance_amount = (egptr() - gptr());
-            setg(start, gptr() + advance_amount, egptr());
-            discard_amount_ -= advance_amount;
+            // End of block.
+            at_block_boundary_ = true;
+            r = LZMA_OK;
           }
+          lzma_res_ = r;
         }
 
-        if (lzma_res_ == LZMA_STREAM_END && gptr() >= egptr())
-          return traits_type::eof();
-        else if (lzma_res_ != LZMA_OK && lzma_res_ != LZMA_STREAM_END)
-          return traits_type::eof();
-
-        return traits_type::to_int_type(*gptr());
+        std::size_t decoded = decompressed_buffer_.size() - lzma_block_decoder_.avail_out;
+        decoded_position_ += decoded;
+        return decoded;
       }
 
+    protected:
       virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir way, std::ios_base::openmode which)
       {
         std::uint64_t current_position = decoded_position_ - (egptr() - gptr());
@@ -210,7 +370,7 @@ namespace shrinkwrap
         return seekpos(pos, which);
       }
 
-      virtual std::streambuf::pos_type seekpos(std::streambuf::pos_type pos, std::ios_base::openmode which)
+      virtual std::streambuf::pos_type seekpos(std::streambuf::pos_type pos, std::ios_base::openmode /*which*/)
       {
         if (fp_ == 0 || sync())
           return pos_type(off_type(-1));
@@ -234,8 +394,7 @@ namespace shrinkwrap
         at_block_boundary_ = true;
         lzma_block_decoder_.next_in = nullptr;
         lzma_block_decoder_.avail_in = 0;
-        char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
-        setg(end, end, end);
+        reset_get_area();
 
         return pos;
       }
@@ -249,9 +408,7 @@ namespace shrinkwrap
         if (lzma_block_decoder_.internal)
           lzma_end(&lzma_block_decoder_);
         if (lzma_index_)
-          lzma_index_end(lzma_index_, nullptr);
-        if (fp_)
-          fclose(fp_);
+          lzma_index_end(lzma_index_, lzma_block_decoder_.allocator);
       }
 
       void move(ibuf&& src)
@@ -261,24 +418,22 @@ namespace shrinkwrap
         lzma_block_decoder_ = src.lzma_block_decoder_;
         if (src.lzma_block_decoder_.internal)
           src.lzma_block_decoder_.internal = nullptr;
+        allocator_ = src.allocator_;
+        if (lzma_block_decoder_.allocator)
+          lzma_block_decoder_.allocator = &allocator_; // the stream points at its owner's allocator.
         lzma_block_ = src.lzma_block_;
         lzma_block_filters_buf_ = src.lzma_block_filters_buf_; // TODO: handle filter.options
         lzma_index_itr_ = src.lzma_index_itr_; // lzma_index_iter_init() doesn't allocate any memory, thus there is no lzma_index_iter_end().
         stream_header_ = src.stream_header_;
-        stream_footer_ = src.stream_footer_;
-        compressed_buffer_ = src.compressed_buffer_;
-        decompressed_buffer_ = src.decompressed_buffer_;
         decoded_position_ = src.decoded_position_;
-        discard_amount_ = src.discard_amount_;
-        fp_ = src.fp_;
-        if (src.fp_)
-          src.fp_ = nullptr;
-        put_back_size_ = src.put_back_size_;
         lzma_index_ = src.lzma_index_;
         if (src.lzma_index_)
           src.lzma_index_ = nullptr;
         lzma_res_ = src.lzma_res_;
         at_block_boundary_ = src.at_block_boundary_;
+        block_memory_usage_ = src.block_memory_usage_;
+        memory_limit_ = src.memory_limit_;
+        ignore_checks_ = src.ignore_checks_;
       }
 
       void replenish_compressed_buffer()
@@ -289,23 +444,7 @@ namespace shrinkwrap
 
       bool init_index()
       {
-        if (!fp_)
-          return false;
-
-        if (fseek(fp_, -12, SEEK_END) || !fread(stream_footer_.data(), 12, 1, fp_))
-          return false;
-
-        if (lzma_stream_footer_decode(&stream_footer_flags_, stream_footer_.data()) != LZMA_OK)
-          return false;
-
-        std::vector<std::uint8_t> index_raw(stream_footer_flags_.backward_size);
-        if (fseek(fp_, -(stream_footer_flags_.backward_size + 12), SEEK_END) || !fread(index_raw.data(), index_raw.size(), 1, fp_))
-          return false;
-
-        std::uint64_t memlimit = UINT64_MAX;
-        size_t in_pos = 0;
-        auto res = lzma_index_buffer_decode(&lzma_index_, &memlimit, nullptr, index_raw.data(), &in_pos, index_raw.size());
-        if (res != LZMA_OK)
+        if (!detail::decode_index(fp_, memory_limit_ ? memory_limit_ : UINT64_MAX, stream_footer_flags_, lzma_index_, lzma_block_decoder_.allocator))
           return false;
 
         lzma_index_iter_init(&lzma_index_itr_, lzma_index_);
@@ -317,39 +456,69 @@ namespace shrinkwrap
       lzma_stream_flags stream_header_flags_;
       lzma_stream_flags stream_footer_flags_;
       lzma_stream lzma_block_decoder_;
+      lzma_allocator allocator_;
       lzma_block lzma_block_;
       std::array<lzma_filter, LZMA_FILTERS_MAX + 1> lzma_block_filters_buf_;
+      detail::header_scratch header_scratch_;
       lzma_index_iter lzma_index_itr_;
       std::array<std::uint8_t, LZMA_STREAM_HEADER_SIZE> stream_header_;
-      std::array<std::uint8_t, LZMA_STREAM_HEADER_SIZE> stream_footer_;
-      std::array<std::uint8_t, (BUFSIZ >= LZMA_BLOCK_HEADER_SIZE_MAX ? BUFSIZ : LZMA_BLOCK_HEADER_SIZE_MAX)> compressed_buffer_;
-      std::array<std::uint8_t, (BUFSIZ >= LZMA_BLOCK_HEADER_SIZE_MAX ? BUFSIZ : LZMA_BLOCK_HEADER_SIZE_MAX)> decompressed_buffer_;
       std::uint64_t decoded_position_;
-      std::uint64_t discard_amount_;
-      FILE* fp_;
-      std::size_t put_back_size_;
       lzma_index* lzma_index_;
       lzma_ret lzma_res_;
       bool at_block_boundary_;
+      std::uint64_t block_memory_usage_;
+      std::uint64_t memory_limit_;
+      bool ignore_checks_;
+    };
+
+    struct obuf_options : seek_point_options
+    {
+      // Compression level 0-9, optionally with LZMA_PRESET_EXTREME.
+      std::uint32_t preset = LZMA_PRESET_DEFAULT;
+      // Serves the stream's buffers and liblzma's state. Must outlive the stream.
+      memory_resource* resource = nullptr;
+      // Bytes the encoder may use. The preset level is lowered until it fits
+      // (level 6 needs about 94 MB, level 0 about 3 MB); if none does, writes
+      // fail with LZMA_MEMLIMIT_ERROR. 0 is unlimited.
+      std::uint64_t memory_limit = 0;
+      // Done on flush() and when the put area fills. An xz block is the unit
+      // that resets the history, so full and end_block both start a new block.
+      flush_mode on_flush = flush_mode::end_block;
+      flush_mode on_buffer_full = flush_mode::none;
+      // Filters run in this order before LZMA2, at most three: BCJ filters for
+      // executable code (LZMA_FILTER_X86, LZMA_FILTER_ARM, LZMA_FILTER_ARM64,
+      // ...) or LZMA_FILTER_DELTA for fixed-width samples.
+      std::vector<lzma_vli> filters;
+      // Distance in bytes of LZMA_FILTER_DELTA, e.g. 2 for 16-bit mono audio.
+      std::uint32_t delta_distance = 1;
+      // LZMA2 dictionary size. 0 keeps the preset's. Decoding needs as much.
+      std::uint32_t dict_size = 0;
+      // Uncompressed bytes per block. Blocks record their sizes in their
+      // headers, so every file can be seeked by block and decoded in parallel
+      // (xz -T). sync flushes end blocks too. 0 starts blocks only on flushes.
+      std::uint64_t block_size = 0;
     };
 
-    class obuf : public std::streambuf
+    class obuf : public basic_obuf<obuf, (1024 >= LZMA_BLOCK_HEADER_SIZE_MAX ? 1024 : LZMA_BLOCK_HEADER_SIZE_MAX), (1024 >= LZMA_BLOCK_HEADER_SIZE_MAX ? 1024 : LZMA_BLOCK_HEADER_SIZE_MAX)>
     {
+      typedef basic_obuf<obuf, (1024 >= LZMA_BLOCK_HEADER_SIZE_MAX ? 1024 : LZMA_BLOCK_HEADER_SIZE_MAX), (1024 >= LZMA_BLOCK_HEADER_SIZE_MAX ? 1024 : LZMA_BLOCK_HEADER_SIZE_MAX)> base_type;
+      friend base_type;
     public:
-      obuf(FILE* fp)
+      obuf(FILE* fp, const obuf_options& opts = obuf_options())
         :
-        fp_(fp)
+        base_type(fp, opts.resource),
+        lzma_stream_encoder_(LZMA_STREAM_INIT),
+        allocator_(detail::make_allocator(opts.resource)),
+        encoder_memory_(0),
+        on_flush_(opts.on_flush),
+        on_buffer_full_(opts.on_buffer_full),
+        block_size_(opts.block_size),
+        seek_points_(opts)
       {
-        if (!fp_)
-        {
-          char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
-          setp(end, end);
-        }
-        else
+        lzma_stream_encoder_.allocator = opts.resource ? &allocator_ : nullptr;
+        if (fp_)
         {
-          lzma_stream_encoder_ = LZMA_STREAM_INIT;
-
-          lzma_res_ = lzma_easy_encoder(&lzma_stream_encoder_, LZMA_PRESET_DEFAULT, LZMA_CHECK_CRC64);
+          lzma_res_ = init_encoder(opts, detail::fit_preset(opts.preset, opts.memory_limit));
           if (lzma_res_ != LZMA_OK)
           {
             // TODO: handle error.
@@ -357,18 +526,15 @@ namespace shrinkwrap
 
           lzma_stream_encoder_.next_out = compressed_buffer_.data();
           lzma_stream_encoder_.avail_out = compressed_buffer_.size();
-
-          char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
-          setp((char*) decompressed_buffer_.data(), end);
         }
       }
 
-      obuf(const std::string& file_path) : obuf(fopen(file_path.c_str(), "wb")) {}
+      obuf(const std::string& file_path, const obuf_options& opts = obuf_options()) : obuf(fopen(file_path.c_str(), "wb"), opts) {}
 
 #if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
       obuf(obuf&& src)
         :
-        std::streambuf(std::move(src))
+        base_type(std::move(src))
       {
         this->move(std::move(src));
       }
@@ -377,8 +543,8 @@ namespace shrinkwrap
       {
         if (&src != this)
         {
-          std::streambuf::operator=(std::move(src));
           this->close();
+          base_type::operator=(std::move(src));
           this->move(std::move(src));
         }
 
@@ -390,97 +556,138 @@ namespace shrinkwrap
         this->close();
       }
 
-    protected:
+      // Bytes held by the buffers and the encoder. lzma_memusage() only
+      // reports on decoders, so the encoder's share is liblzma's estimate.
+      std::uint64_t memory_usage() const
+      {
+        std::uint64_t ret = compressed_buffer_.size() + decompressed_buffer_.size();
+        if (lzma_stream_encoder_.internal)
+          ret += encoder_memory_;
+        return ret;
+      }
 
-      virtual int overflow(int c)
+    private:
+      // Presets alone keep lzma_easy_encoder(). Filter chains use the stream
+      // encoder, and a block size the multithreaded one with a single thread,
+      // which splits blocks itself and records their sizes.
+      lzma_ret init_encoder(const obuf_options& opts, std::uint32_t preset)
       {
-        if (!fp_)
-          return traits_type::eof();
+        std::uint64_t memory_limit = opts.memory_limit ? opts.memory_limit : UINT64_MAX;
+        if (opts.filters.empty() && !opts.dict_size && !opts.block_size)
+        {
+          encoder_memory_ = lzma_easy_encoder_memusage(preset);
+          if (encoder_memory_ > memory_limit)
+            return LZMA_MEMLIMIT_ERROR;
+          return lzma_easy_encoder(&lzma_stream_encoder_, preset, LZMA_CHECK_CRC64);
+        }
+
+        lzma_options_lzma lzma_options;
+        if (opts.filters.size() >= LZMA_FILTERS_MAX || lzma_lzma_preset(&lzma_options, preset))
+          return LZMA_OPTIONS_ERROR;
+        if (opts.dict_size)
+          lzma_options.dict_size = opts.dict_size;
+
+        lzma_options_delta delta_options;
+        std::memset(&delta_options, 0, sizeof(delta_options));
+        delta_options.type = LZMA_DELTA_TYPE_BYTE;
+        delta_options.dist = opts.delta_distance;
 
-        if ((epptr() - pptr()) > 0)
+        std::array<lzma_filter, LZMA_FILTERS_MAX + 1> filters;
+        std::size_t n = 0;
+        for (auto it = opts.filters.begin(); it != opts.filters.end(); ++it, ++n)
         {
-          assert(!"Put buffer not empty, this should never happen");
-          this->sputc(static_cast<char>(0xFF & c));
+          filters[n].id = *it;
+          filters[n].options = *it == LZMA_FILTER_DELTA ? &delta_options : nullptr;
         }
-        else
+        filters[n].id = LZMA_FILTER_LZMA2;
+        filters[n].options = &lzma_options;
+        filters[n + 1].id = LZMA_VLI_UNKNOWN;
+        filters[n + 1].options = nullptr;
+
+        if (!opts.block_size)
         {
-          lzma_stream_encoder_.next_in = decompressed_buffer_.data();
-          lzma_stream_encoder_.avail_in = decompressed_buffer_.size();
-          while (lzma_res_ == LZMA_OK && lzma_stream_encoder_.avail_in > 0)
-          {
-            lzma_res_ = lzma_code(&lzma_stream_encoder_, LZMA_RUN);
-            if (lzma_stream_encoder_.avail_out == 0 || lzma_res_ == LZMA_STREAM_END)
-            {
-              if (!fwrite(compressed_buffer_.data(), compressed_buffer_.size() - lzma_stream_encoder_.avail_out, 1, fp_))
-              {
-                // TODO: handle error.
-                return traits_type::eof();
-              }
-              lzma_stream_encoder_.next_out = compressed_buffer_.data();
-              lzma_stream_encoder_.avail_out = compressed_buffer_.size();
-            }
-          }
+          encoder_memory_ = lzma_raw_encoder_memusage(filters.data());
+          if (encoder_memory_ == UINT64_MAX)
+            return LZMA_OPTIONS_ERROR;
+          if (encoder_memory_ > memory_limit)
+            return LZMA_MEMLIMIT_ERROR;
+          return lzma_stream_encoder(&lzma_stream_encoder_, filters.data(), LZMA_CHECK_CRC64);
+        }
 
-          if (lzma_res_ == LZMA_STREAM_END)
-            lzma_res_ = LZMA_OK;
+        lzma_mt mt_options;
+        std::memset(&mt_options, 0, sizeof(mt_options));
+        mt_options.threads = 1;
+        mt_options.block_size = opts.block_size;
+        mt_options.filters = filters.data();
+        mt_options.check = LZMA_CHECK_CRC64;
+        encoder_memory_ = lzma_stream_encoder_mt_memusage(&mt_options);
+        if (encoder_memory_ == UINT64_MAX)
+          return LZMA_OPTIONS_ERROR;
+        if (encoder_memory_ > memory_limit)
+          return LZMA_MEMLIMIT_ERROR;
+        return lzma_stream_encoder_mt(&lzma_stream_encoder_, &mt_options);
+      }
 
-          assert(lzma_stream_encoder_.avail_in == 0);
-          decompressed_buffer_[0] = reinterpret_cast<unsigned char&>(c);
-          setp((char*) decompressed_buffer_.data() + 1, (char*) decompressed_buffer_.data() + decompressed_buffer_.size());
+      // The multithreaded encoder can't sync flush, so it ends the block.
+      lzma_action flush_action(flush_mode mode) const
+      {
+        switch (mode)
+        {
+          case flush_mode::none: return LZMA_RUN;
+          case flush_mode::sync: return block_size_ ? LZMA_FULL_FLUSH : LZMA_SYNC_FLUSH;
+          default: return LZMA_FULL_FLUSH;
         }
-
-        return (lzma_res_ == LZMA_OK ? traits_type::to_int_type(c) : traits_type::eof());
       }
 
-      virtual int sync()
+      bool encode(std::uint8_t* data, std::size_t size, bool flush)
       {
-        if (!fp_)
-          return -1;
+        return seek_points_.split(data, size, flush ? on_flush_ : on_buffer_full_, [this](std::uint8_t* piece, std::size_t piece_size, flush_mode mode)
+        {
+          return encode_piece(piece, piece_size, mode);
+        });
+      }
 
-        lzma_stream_encoder_.next_in = decompressed_buffer_.data();
-        lzma_stream_encoder_.avail_in = decompressed_buffer_.size() - (epptr() - pptr());
-        if (lzma_stream_encoder_.avail_in)
+      // Flushing actions run until liblzma reports LZMA_STREAM_END.
+      bool encode_piece(std::uint8_t* data, std::size_t size, flush_mode mode)
+      {
+        lzma_action action = flush_action(mode);
+        lzma_stream_encoder_.next_in = data;
+        lzma_stream_encoder_.avail_in = size;
+        while (lzma_res_ == LZMA_OK && (action != LZMA_RUN || lzma_stream_encoder_.avail_in > 0))
         {
-          while (lzma_res_ == LZMA_OK)
+          lzma_res_ = lzma_code(&lzma_stream_encoder_, action);
+          if (lzma_stream_encoder_.avail_out == 0 || (lzma_res_ == LZMA_STREAM_END && compressed_buffer_.size() != lzma_stream_encoder_.avail_out))
           {
-            lzma_res_ = lzma_code(&lzma_stream_encoder_, LZMA_FULL_FLUSH);
-            if (lzma_stream_encoder_.avail_out == 0 || (lzma_res_ == LZMA_STREAM_END && compressed_buffer_.size() != lzma_stream_encoder_.avail_out))
+            if (!fwrite(compressed_buffer_.data(), compressed_buffer_.size() - lzma_stream_encoder_.avail_out, 1, fp_))
             {
-              if (!fwrite(compressed_buffer_.data(), compressed_buffer_.size() - lzma_stream_encoder_.avail_out, 1, fp_))
-              {
-                // TODO: handle error.
-                return -1;
-              }
-              lzma_stream_encoder_.next_out = compressed_buffer_.data();
-              lzma_stream_encoder_.avail_out = compressed_buffer_.size();
+              // TODO: handle error.
+              return false;
             }
+            lzma_stream_encoder_.next_out = compressed_buffer_.data();
+            lzma_stream_encoder_.avail_out = compressed_buffer_.size();
           }
-
-          if (lzma_res_ == LZMA_STREAM_END)
-            lzma_res_ = LZMA_OK;
-
-          if (lzma_res_ != LZMA_OK)
-            return -1;
-
-          assert(lzma_stream_encoder_.avail_in == 0);
-          setp((char*) decompressed_buffer_.data(), (char*) decompressed_buffer_.data() + decompressed_buffer_.size());
         }
 
-        return 0;
-      }
+        if (lzma_res_ == LZMA_STREAM_END)
+          lzma_res_ = LZMA_OK;
 
-    private:
+        assert(lzma_res_ != LZMA_OK || lzma_stream_encoder_.avail_in == 0);
+        return lzma_res_ == LZMA_OK;
+      }
 
       void move(obuf&& src)
       {
-        compressed_buffer_ = src.compressed_buffer_;
-        decompressed_buffer_ = src.decompressed_buffer_;
         lzma_stream_encoder_ = src.lzma_stream_encoder_;
         if (src.lzma_stream_encoder_.internal)
           src.lzma_stream_encoder_.internal = nullptr;
-        fp_ = src.fp_;
-        if (src.fp_)
-          src.fp_ = nullptr;
+        allocator_ = src.allocator_;
+        if (lzma_stream_encoder_.allocator)
+          lzma_stream_encoder_.allocator = &allocator_; // the stream points at its owner's allocator.
+        encoder_memory_ = src.encoder_memory_;
+        on_flush_ = src.on_flush_;
+        on_buffer_full_ = src.on_buffer_full_;
+        block_size_ = src.block_size_;
+        seek_points_ = src.seek_points_;
         lzma_res_ = src.lzma_res_;
       }
 
@@ -489,7 +696,7 @@ namespace shrinkwrap
         if (lzma_stream_encoder_.internal)
         {
           lzma_stream_encoder_.next_in = decompressed_buffer_.data();
-          lzma_stream_encoder_.avail_in = decompressed_buffer_.size() - (epptr() - pptr());
+          lzma_stream_encoder_.avail_in = pending();
           while (lzma_res_ == LZMA_OK)
           {
             lzma_res_ = lzma_code(&lzma_stream_encoder_, LZMA_FINISH);
@@ -508,24 +715,27 @@ namespace shrinkwrap
 
         if (fp_)
           fclose(fp_);
+        fp_ = nullptr;
       }
 
     private:
-      static const std::size_t default_block_size = 1024; //4 * 1024 * 1024;
-      std::array<std::uint8_t, (default_block_size >= LZMA_BLOCK_HEADER_SIZE_MAX ? default_block_size : LZMA_BLOCK_HEADER_SIZE_MAX)> compressed_buffer_;
-      std::array<std::uint8_t, (default_block_size >= LZMA_BLOCK_HEADER_SIZE_MAX ? default_block_size : LZMA_BLOCK_HEADER_SIZE_MAX)> decompressed_buffer_;
       lzma_stream lzma_stream_encoder_;
-      FILE* fp_;
+      lzma_allocator allocator_;
+      std::uint64_t encoder_memory_;
+      flush_mode on_flush_;
+      flush_mode on_buffer_full_;
+      std::uint64_t block_size_;
+      ::shrinkwrap::detail::seek_point_splitter seek_points_;
       lzma_ret lzma_res_;
     };
 
     class istream : public std::istream
     {
     public:
-      istream(const std::string& file_path)
+      istream(const std::string& file_path, const ibuf_options& opts = ibuf_options())
         :
         std::istream(&sbuf_),
-        sbuf_(file_path)
+        sbuf_(file_path, opts)
       {
       }
 
@@ -547,6 +757,8 @@ namespace shrinkwrap
         return *this;
       }
 #endif
+
+      std::uint64_t memory_usage() const { return sbuf_.memory_usage(); }
     private:
       ::shrinkwrap::xz::ibuf sbuf_;
     };
@@ -554,10 +766,10 @@ namespace shrinkwrap
     class ostream : public std::ostream
     {
     public:
-      ostream(const std::string& file_path)
+      ostream(const std::string& file_path, const obuf_options& opts = obuf_options())
         :
         std::ostream(&sbuf_),
-        sbuf_(file_path)
+        sbuf_(file_path, opts)
       {
       }
 
@@ -579,6 +791,8 @@ namespace shrinkwrap
         return *this;
       }
 #endif
+
+      std::uint64_t memory_usage() const { return sbuf_.memory_usage(); }
     private:
       ::shrinkwrap::xz::obuf sbuf_;
     };
@@ -1,50 +1,436 @@
 #ifndef SHRINKWRAP_ZSTD_HPP
 #define SHRINKWRAP_ZSTD_HPP
 
-//#ifndef ZSTD_STATIC_LINKING_ONLY
-//#define ZSTD_STATIC_LINKING_ONLY
-//#endif
+// Frame headers and the advanced parameters are part of zstd's experimental
+// API, which <zstd.h> only declares with ZSTD_STATIC_LINKING_ONLY. Include
+// this header before <zstd.h> or define the macro project wide. That API is
+// only stable within a zstd release, so build against the libzstd you link.
+#ifndef ZSTD_STATIC_LINKING_ONLY
+#define ZSTD_STATIC_LINKING_ONLY
+#endif
 
 #include <zstd.h>
+#ifndef ZSTD_H_ZSTD_STATIC_LINKING_ONLY
+#error "<zstd.h> was included without ZSTD_STATIC_LINKING_ONLY; include shrinkwrap/zstd.hpp first or define ZSTD_STATIC_LINKING_ONLY"
+#endif
+#include <zstd_errors.h>
+#include <zdict.h>
 
 #include <streambuf>
 #include <stdio.h>
 #include <vector>
+#include <array>
+#include <algorithm>
+#include <assert.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "common.hpp"
+#include "basic_buf.hpp"
+#include "thread_pool.hpp"
 
 namespace shrinkwrap
 {
+  namespace detail
+  {
+    inline void* zstd_allocate(void* opaque, size_t size)
+    {
+      return codec_allocate(static_cast<memory_resource*>(opaque), size);
+    }
+
+    inline void zstd_deallocate(void* opaque, void* address)
+    {
+      codec_deallocate(static_cast<memory_resource*>(opaque), address);
+    }
+
+    // A null resource keeps zstd's malloc.
+    inline ZSTD_customMem zstd_custom_mem(memory_resource* resource)
+    {
+      ZSTD_customMem ret = {resource ? zstd_allocate : nullptr, resource ? zstd_deallocate : nullptr, resource};
+      return ret;
+    }
+
+    // Largest window whose decoding context fits in memory_limit, or the
+    // smallest window zstd allows if none does.
+    inline int zstd_window_log_max(std::uint64_t memory_limit)
+    {
+      int ret = ZSTD_WINDOWLOG_MAX;
+      while (ret > ZSTD_WINDOWLOG_MIN && ZSTD_estimateDStreamSize(std::size_t(1) << ret) > memory_limit)
+        --ret;
+      return ret;
+    }
+
+    // Limits a decoding context's window to what memory_limit allows and to
+    // 2^window_log_max. 0 leaves either unbounded, and both zstd's default.
+    inline void zstd_set_window_log_max(ZSTD_DCtx* dctx, std::uint64_t memory_limit, int window_log_max)
+    {
+      if (memory_limit)
+        window_log_max = window_log_max ? std::min(window_log_max, zstd_window_log_max(memory_limit)) : zstd_window_log_max(memory_limit);
+      if (window_log_max)
+        ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, window_log_max);
+    }
+
+    // Parameters of compression_level, with a 2^window_log window unless 0, and
+    // the window, then the hash and chain tables, shrunk until the encoder fits
+    // in memory_limit or reaches the minimum.
+    inline ZSTD_compressionParameters zstd_fit_cparams(int compression_level, std::uint64_t memory_limit, unsigned window_log = 0)
+    {
+      ZSTD_compressionParameters ret = ZSTD_getCParams(compression_level, ZSTD_CONTENTSIZE_UNKNOWN, 0);
+      if (window_log)
+      {
+        ret.windowLog = window_log;
+        ret = ZSTD_adjustCParams(ret, 0, 0);
+      }
+      while (ZSTD_estimateCStreamSize_usingCParams(ret) > memory_limit)
+      {
+        if (ret.windowLog > ZSTD_WINDOWLOG_MIN)
+          --ret.windowLog;
+        else if (ret.hashLog > ZSTD_HASHLOG_MIN || ret.chainLog > ZSTD_CHAINLOG_MIN)
+          ret.hashLog = ret.chainLog = std::max<unsigned>(ZSTD_HASHLOG_MIN, std::min(ret.hashLog, ret.chainLog) - 1);
+        else
+          break;
+        ret = ZSTD_adjustCParams(ret, 0, 0); // keeps the tables within the window.
+      }
+      return ret;
+    }
+
+    // Writes data as a zstd frame of raw blocks, which costs about a memcpy to
+    // write and to read: a single segment header recording the content size,
+    // then blocks of up to ZSTD_BLOCKSIZE_MAX bytes and no checksum. Write is
+    // called as write(const void* data, std::size_t size) and returns false on
+    // failure.
+    template <typename Write>
+    bool zstd_write_raw_frame(const std::uint8_t* data, std::size_t size, Write write)
+    {
+      assert(size <= 0xFFFFFFFF);
+      std::array<std::uint8_t, 9> header = {{0x28, 0xB5, 0x2F, 0xFD, // magic
+        0xA0, // 4-byte content size, single segment
+        std::uint8_t(size), std::uint8_t(size >> 8), std::uint8_t(size >> 16), std::uint8_t(size >> 24)}};
+      if (!write(header.data(), header.size()))
+        return false;
+
+      std::size_t pos = 0;
+      do
+      {
+        std::size_t block_size = std::min<std::size_t>(size - pos, ZSTD_BLOCKSIZE_MAX);
+        std::uint32_t bh = (pos + block_size == size ? 1 : 0) | std::uint32_t(block_size << 3); // Last_Block, Block_Type 0 (raw), Block_Size
+        std::array<std::uint8_t, 3> block_header = {{std::uint8_t(bh), std::uint8_t(bh >> 8), std::uint8_t(bh >> 16)}};
+        if (!write(block_header.data(), block_header.size()) || (block_size && !write(data + pos, block_size)))
+          return false;
+        pos += block_size;
+      } while (pos < size);
+      return true;
+    }
+
+    // Most bytes the frame in memory can decode to, from its block count: no
+    // block holds more than ZSTD_BLOCKSIZE_MAX. Unlike ZSTD_decompressBound, it
+    // does not trust the content size in the header. 0 if the block headers run
+    // past size.
+    inline std::uint64_t zstd_frame_block_bound(const std::uint8_t* src, std::size_t size, const ZSTD_frameHeader& frame_header)
+    {
+      if (frame_header.frameType == ZSTD_skippableFrame)
+        return 0;
+
+      std::uint64_t block_count = 0;
+      std::size_t pos = frame_header.headerSize;
+      while (pos + 3 <= size)
+      {
+        std::uint32_t bh = std::uint32_t(src[pos]) | (std::uint32_t(src[pos + 1]) << 8) | (std::uint32_t(src[pos + 2]) << 16);
+        ++block_count;
+        pos += 3 + (((bh >> 1) & 3) == 1 ? 1 : (bh >> 3)); // an RLE block stores one byte.
+        if (bh & 1)
+          return pos <= size ? block_count * ZSTD_BLOCKSIZE_MAX : 0;
+      }
+      return 0;
+    }
+  }
+
   namespace zstd
   {
-    class ibuf : public std::streambuf
+    // Reads the frame header at offset and walks its block headers to find the
+    // compressed size of the frame, without decompressing.
+    inline bool read_frame_header(FILE* fp, std::uint64_t offset, ZSTD_frameHeader& frame_header, std::uint64_t& frame_size)
+    {
+      std::array<std::uint8_t, ZSTD_FRAMEHEADERSIZE_MAX> header;
+      std::array<std::uint8_t, 3> block_header; // Last_Block (1 bit), Block_Type (2 bits), Block_Size (21 bits)
+      std::size_t read_size;
+      if (fseek(fp, long(offset), SEEK_SET) || (read_size = fread(header.data(), 1, header.size(), fp)) == 0)
+        return false;
+      if (ZSTD_getFrameHeader(&frame_header, header.data(), read_size) != 0)
+        return false;
+
+      frame_size = frame_header.headerSize;
+      if (frame_header.frameType == ZSTD_skippableFrame)
+      {
+        frame_size += frame_header.frameContentSize;
+        return true;
+      }
+
+      bool last_block = false;
+      while (!last_block)
+      {
+        if (fseek(fp, long(offset + frame_size), SEEK_SET) || !fread(block_header.data(), block_header.size(), 1, fp))
+          return false;
+
+        std::uint32_t bh = std::uint32_t(block_header[0]) | (std::uint32_t(block_header[1]) << 8) | (std::uint32_t(block_header[2]) << 16);
+        last_block = (bh & 1) != 0;
+        std::uint32_t block_type = (bh >> 1) & 3;
+        std::uint32_t block_size = bh >> 3;
+        if (block_type == 3) // reserved
+          return false;
+        frame_size += block_header.size() + (block_type == 1 ? 1 : block_size); // RLE blocks store a single byte.
+      }
+
+      if (frame_header.checksumFlag)
+        frame_size += 4;
+      return true;
+    }
+
+    // Walks frame and block headers from the start of the file without
+    // decompressing. Skippable frames are stepped over and not listed. The file
+    // position is left undefined.
+    inline bool scan_frames(FILE* fp, std::vector<block_info>& frames)
+    {
+      frames.clear();
+      if (!fp)
+        return false;
+
+      std::uint64_t compressed_offset = 0;
+      std::uint64_t uncompressed_offset = 0;
+      while (true)
+      {
+        ZSTD_frameHeader frame_header;
+        std::uint64_t frame_size = 0;
+        if (!read_frame_header(fp, compressed_offset, frame_header, frame_size))
+        {
+          // A clean end of file leaves nothing to read at the next frame offset.
+          std::uint8_t probe;
+          return !ferror(fp) && fseek(fp, long(compressed_offset), SEEK_SET) == 0 && fread(&probe, 1, 1, fp) == 0 && !ferror(fp);
+        }
+
+        if (frame_header.frameType != ZSTD_skippableFrame)
+        {
+          std::uint64_t content_size = block_info::unknown_size;
+          if (frame_header.frameContentSize != ZSTD_CONTENTSIZE_UNKNOWN)
+            content_size = frame_header.frameContentSize;
+          frames.push_back(block_info(compressed_offset, frame_size, uncompressed_offset, content_size));
+
+          if (content_size == block_info::unknown_size)
+            uncompressed_offset = block_info::unknown_size;
+          else if (uncompressed_offset != block_info::unknown_size)
+            uncompressed_offset += content_size;
+        }
+
+        compressed_offset += frame_size;
+      }
+    }
+
+    // Largest window that the frames of the file need, from their headers.
+    // Decoding takes about ZSTD_estimateDStreamSize(window_size) bytes, which
+    // readers can check before opening the file with a memory_limit or
+    // window_log_max. The file position is left undefined.
+    inline bool scan_window_size(FILE* fp, std::uint64_t& window_size)
+    {
+      window_size = 0;
+      if (!fp)
+        return false;
+
+      std::uint64_t compressed_offset = 0;
+      while (true)
+      {
+        ZSTD_frameHeader frame_header;
+        std::uint64_t frame_size = 0;
+        if (!read_frame_header(fp, compressed_offset, frame_header, frame_size))
+        {
+          std::uint8_t probe;
+          return !ferror(fp) && fseek(fp, long(compressed_offset), SEEK_SET) == 0 && fread(&probe, 1, 1, fp) == 0 && !ferror(fp);
+        }
+
+        if (frame_header.frameType != ZSTD_skippableFrame)
+          window_size = std::max<std::uint64_t>(window_size, frame_header.windowSize);
+        compressed_offset += frame_size;
+      }
+    }
+
+    // Trains a dictionary of at most max_size bytes on samples of the records
+    // that will be compressed with it, typically a few hundred of them. Returns
+    // false if ZDICT_trainFromBuffer fails, e.g. with too few samples.
+    inline bool train_dictionary(const std::vector<std::string>& samples, std::vector<char>& content, std::size_t max_size = 110 * 1024)
+    {
+      std::string samples_buffer;
+      std::vector<std::size_t> sample_sizes;
+      sample_sizes.reserve(samples.size());
+      for (auto it = samples.begin(); it != samples.end(); ++it)
+      {
+        samples_buffer += *it;
+        sample_sizes.push_back(it->size());
+      }
+
+      content.resize(max_size);
+      std::size_t res = ZDICT_trainFromBuffer(&content[0], content.size(), samples_buffer.data(), sample_sizes.data(), unsigned(sample_sizes.size()));
+      if (ZDICT_isError(res))
+      {
+        content.clear();
+        return false;
+      }
+      content.resize(res);
+      return true;
+    }
+
+    // A dictionary digested once for compression and decompression. Copies
+    // share the digested state, which zstd only reads, so one dictionary can
+    // serve any number of streams on any number of threads. Compression runs at
+    // the level the dictionary was digested for.
+    class dictionary
+    {
+    public:
+      dictionary() {}
+
+      dictionary(const void* content, std::size_t size, int compression_level = 3)
+        : state_(new state(content, size, compression_level))
+      {
+        if (!state_->cdict || !state_->ddict)
+          state_.reset();
+      }
+
+      dictionary(const std::vector<char>& content, int compression_level = 3) : dictionary(content.data(), content.size(), compression_level) {}
+
+      explicit operator bool() const { return state_ != nullptr; }
+
+      // 0 for empty dictionaries and raw content without a dictionary header.
+      unsigned id() const { return state_ ? ZSTD_getDictID_fromDDict(state_->ddict) : 0; }
+      int compression_level() const { return state_ ? state_->compression_level : 0; }
+      const ZSTD_CDict* cdict() const { return state_ ? state_->cdict : nullptr; }
+      const ZSTD_DDict* ddict() const { return state_ ? state_->ddict : nullptr; }
+
+    private:
+      struct state
+      {
+        state(const void* content, std::size_t size, int level)
+          :
+          cdict(ZSTD_createCDict(content, size, level)),
+          ddict(ZSTD_createDDict(content, size)),
+          compression_level(level)
+        {
+        }
+
+        state(const state&) = delete;
+        state& operator=(const state&) = delete;
+
+        ~state()
+        {
+          ZSTD_freeCDict(cdict);
+          ZSTD_freeDDict(ddict);
+        }
+
+        ZSTD_CDict* cdict;
+        ZSTD_DDict* ddict;
+        int compression_level;
+      };
+
+      std::shared_ptr<const state> state_;
+    };
+
+    // Resolves frames to dictionaries by the ID in their header. Thread safe, so
+    // dictionaries can be added while streams read through it.
+    class dictionary_registry
     {
     public:
-      ibuf(FILE* fp)
+      // Fails for dictionaries without an ID, which frames can't name.
+      bool add(const dictionary& dict)
+      {
+        if (!dict.id())
+          return false;
+        std::unique_lock<std::mutex> lk(mutex_);
+        dictionaries_[dict.id()] = dict;
+        return true;
+      }
+
+      dictionary find(unsigned id) const
+      {
+        std::unique_lock<std::mutex> lk(mutex_);
+        auto it = dictionaries_.find(id);
+        return it == dictionaries_.end() ? dictionary() : it->second;
+      }
+
+      // References the dictionary that a frame header names in dctx, and keeps
+      // it alive in held. Frames naming none decode without one; a frame naming
+      // one that registry lacks fails with dictionary_wrong.
+      static std::size_t ref_frame_dictionary(const dictionary_registry* registry, ZSTD_DCtx* dctx, const ZSTD_frameHeader& frame_header, dictionary& held)
+      {
+        held = dictionary();
+        if (frame_header.frameType == ZSTD_frame && frame_header.dictID)
+        {
+          if (registry)
+            held = registry->find(frame_header.dictID);
+          if (!held)
+            return std::size_t(-int(ZSTD_error_dictionary_wrong));
+        }
+        return ZSTD_DCtx_refDDict(dctx, held.ddict());
+      }
+
+    private:
+      mutable std::mutex mutex_;
+      std::map<unsigned, dictionary> dictionaries_;
+    };
+
+    struct ibuf_options
+    {
+      // Skips verification of frame content checksums. Only for data whose
+      // integrity is guaranteed elsewhere.
+      bool ignore_checks = false;
+      // Serves the stream's buffers and zstd's state. Must outlive the stream.
+      memory_resource* resource = nullptr;
+      // Bytes a decoding context may use, enforced through ZSTD_d_windowLogMax.
+      // Frames with larger windows fail to decode. 0 keeps zstd's default of a
+      // 128 MB window.
+      std::uint64_t memory_limit = 0;
+      // Largest window accepted, as a power of two. Frames written with a
+      // window_log above 27 need it raised. memory_limit, if set, still caps it.
+      int window_log_max = 0;
+      // Resolves frames that name a dictionary. Must outlive the stream.
+      const dictionary_registry* dictionaries = nullptr;
+    };
+
+    class ibuf : public basic_ibuf<ibuf, ZSTD_BLOCKSIZE_MAX + 3, ZSTD_BLOCKSIZE_MAX> // ZSTD_DStreamInSize(), ZSTD_DStreamOutSize()
+    {
+      typedef basic_ibuf<ibuf, ZSTD_BLOCKSIZE_MAX + 3, ZSTD_BLOCKSIZE_MAX> base_type;
+      friend base_type;
+    public:
+      ibuf(FILE* fp, const ibuf_options& opts = ibuf_options())
         :
-        strm_(ZSTD_createDStream()),
-        input_({0}),
-        compressed_buffer_(ZSTD_DStreamInSize()),
-        decompressed_buffer_(ZSTD_DStreamOutSize()),
+        base_type(fp, opts.resource),
+        strm_(ZSTD_createDStream_advanced(detail::zstd_custom_mem(opts.resource))),
+        input_(),
+        output_full_(false),
         current_block_position_(0),
-        fp_(fp)
+        dictionaries_(opts.dictionaries)
       {
         if (fp_)
         {
-          res_ = ZSTD_initDStream(strm_); // 16 for GZIP only.
+          res_ = ZSTD_initDStream(strm_);
           if (ZSTD_isError(res_))
           {
             // TODO: handle error.
           }
+#ifdef ZSTD_d_forceIgnoreChecksum
+          if (opts.ignore_checks)
+            ZSTD_DCtx_setParameter(strm_, ZSTD_d_forceIgnoreChecksum, ZSTD_d_ignoreChecksum); // survives ZSTD_initDStream().
+#endif
+          detail::zstd_set_window_log_max(strm_, opts.memory_limit, opts.window_log_max);
+          if (dictionaries_ && !ZSTD_isError(res_))
+            res_ = 0; // so that decode() selects the first frame's dictionary.
         }
-        char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
-        setg(end, end, end);
       }
 
-      ibuf(const std::string& file_path) : ibuf(fopen(file_path.c_str(), "rb")) {}
+      ibuf(const std::string& file_path, const ibuf_options& opts = ibuf_options()) : ibuf(fopen(file_path.c_str(), "rb"), opts) {}
 
 #if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
       ibuf(ibuf&& src)
         :
-        std::streambuf(std::move(src))
+        base_type(std::move(src))
       {
         this->move(std::move(src));
       }
@@ -53,8 +439,8 @@ namespace shrinkwrap
       {
         if (&src != this)
         {
-          std::streambuf::operator=(std::move(src));
           this->destroy();
+          base_type::operator=(std::move(src));
           this->move(std::move(src));
         }
 
@@ -67,30 +453,44 @@ namespace shrinkwrap
         this->destroy();
       }
 
-    private:
-      //ixzbuf(const ixzbuf& src) = delete;
-      //ixzbuf& operator=(const ixzbuf& src) = delete;
+      // Bytes held by the buffers and the decoding context.
+      std::uint64_t memory_usage() const
+      {
+        return compressed_buffer_.size() + decompressed_buffer_.size() + ZSTD_sizeof_DStream(strm_);
+      }
+
+      // Moves to an uncompressed offset from the start of the file. Frames
+      // whose headers record a content size that the target lies past are
+      // skipped by their compressed size, so only the frame holding the target
+      // is decoded. tellg() still reports compressed frame offsets afterwards.
+      bool seek_uncompressed(std::uint64_t offset)
+      {
+        return fp_ && seekpos(pos_type(off_type(0)), std::ios::in) == pos_type(off_type(0)) && skip_forward(offset);
+      }
 
+      // Discards the next count uncompressed bytes, skipping frames the same way.
+      bool skip_uncompressed(std::uint64_t count)
+      {
+        return fp_ && skip_forward(count);
+      }
+
+    private:
       void destroy()
       {
-        if (fp_)
-        {
-          ZSTD_freeDStream(strm_);
-          fclose(fp_);
-        }
+        ZSTD_freeDStream(strm_);
+        strm_ = nullptr;
       }
 
       void move(ibuf&& src)
       {
         strm_ = src.strm_;
         src.strm_ = nullptr;
-        compressed_buffer_ = std::move(src.compressed_buffer_);
-        decompressed_buffer_ = std::move(src.decompressed_buffer_);
         current_block_position_ = src.current_block_position_;
-        fp_ = src.fp_;
-        src.fp_ = nullptr;
         res_ = src.res_;
         input_ = src.input_;
+        output_full_ = src.output_full_;
+        dictionaries_ = src.dictionaries_;
+        frame_dictionary_ = std::move(src.frame_dictionary_);
       }
 
       void replenish_compressed_buffer()
@@ -98,48 +498,147 @@ namespace shrinkwrap
          input_ = {compressed_buffer_.data(), fread(compressed_buffer_.data(), 1, compressed_buffer_.size(), fp_), 0 };
       }
 
-    protected:
+      // A call that filled the output may have left decoded data in the
+      // stream, e.g. the last block before a sync flush in an unfinished frame.
+      bool decodable() const
+      {
+        return good() && (input_.pos < input_.size || output_full_ || (!feof(fp_) && !ferror(fp_)));
+      }
 
-      virtual std::streambuf::int_type underflow()
+      bool good() const
       {
-        if (!fp_)
-          return traits_type::eof();
-        if (gptr() < egptr()) // buffer not exhausted
-          return traits_type::to_int_type(*gptr());
+        return !ZSTD_isError(res_);
+      }
 
-        while (!ZSTD_isError(res_) && gptr() >= egptr() && (input_.pos < input_.size || (!feof(fp_) && !ferror(fp_))))
+      // References the dictionary named by the header of the frame starting at
+      // the input position. A header cut by the end of the buffer is moved to
+      // its front and completed from the file. Truncated headers are left for
+      // ZSTD_decompressStream to report.
+      std::size_t select_dictionary()
+      {
+        ZSTD_frameHeader frame_header;
+        std::size_t res = ZSTD_getFrameHeader(&frame_header, static_cast<const std::uint8_t*>(input_.src) + input_.pos, input_.size - input_.pos);
+        if (res != 0 && !ZSTD_isError(res) && !feof(fp_) && !ferror(fp_))
+        {
+          std::size_t remaining = input_.size - input_.pos;
+          std::memmove(compressed_buffer_.data(), static_cast<const std::uint8_t*>(input_.src) + input_.pos, remaining);
+          input_ = {compressed_buffer_.data(), remaining + fread(compressed_buffer_.data() + remaining, 1, compressed_buffer_.size() - remaining, fp_), 0};
+          res = ZSTD_getFrameHeader(&frame_header, input_.src, input_.size);
+        }
+        if (res != 0)
+          return ZSTD_isError(res) ? res : 0;
+        return dictionary_registry::ref_frame_dictionary(dictionaries_, strm_, frame_header, frame_dictionary_);
+      }
+
+      std::size_t decode()
+      {
+        if (input_.pos == input_.size && !feof(fp_) && !ferror(fp_))
         {
-          if (input_.pos == input_.size && !feof(fp_) && !ferror(fp_))
+          replenish_compressed_buffer();
+        }
+
+        if (res_ == 0 && input_.pos < input_.size)
+        {
+          res_ = ZSTD_initDStream(strm_); //ZSTD_resetDStream(strm_);
+          current_block_position_ = std::size_t(ftell(fp_)) - (input_.size - input_.pos);
+          if (dictionaries_ && !ZSTD_isError(res_))
           {
-            replenish_compressed_buffer();
+            std::size_t res = select_dictionary();
+            if (ZSTD_isError(res))
+              res_ = res;
           }
+        }
 
-          if (res_ == 0 && input_.pos < input_.size)
+        ZSTD_outBuffer output = {decompressed_buffer_.data(), decompressed_buffer_.size(), 0};
+        res_ = ZSTD_decompressStream(strm_, &output , &input_);
+        output_full_ = output.pos == output.size;
+        return ZSTD_isError(res_) ? 0 : output.pos;
+      }
+
+      // Discards the next n uncompressed bytes.
+      bool skip_forward(std::uint64_t n)
+      {
+        // Finish the current frame.
+        while (n > 0)
+        {
+          std::size_t available = static_cast<std::size_t>(egptr() - gptr());
+          if (available)
           {
-            res_ = ZSTD_initDStream(strm_); //ZSTD_resetDStream(strm_);
-            current_block_position_ = std::size_t(ftell(fp_)) - (input_.size - input_.pos);
+            std::size_t skip = static_cast<std::size_t>(std::min<std::uint64_t>(available, n));
+            gbump(static_cast<int>(skip));
+            n -= skip;
+            continue;
           }
 
-          ZSTD_outBuffer output = {decompressed_buffer_.data(), decompressed_buffer_.size(), 0};
-          res_ = ZSTD_decompressStream(strm_, &output , &input_);
+          if (res_ == 0 || input_.size == 0 || ZSTD_isError(res_))
+            break; // nothing read since opening or seekpos() is also a frame boundary.
 
-          if (!ZSTD_isError(res_))
+          if (input_.pos == input_.size)
           {
-            char* start = ((char*) decompressed_buffer_.data());
-            setg(start, start, start + output.pos);
+            replenish_compressed_buffer();
+            if (input_.size == 0)
+              return false;
           }
+
+          ZSTD_outBuffer output = {decompressed_buffer_.data(), decompressed_buffer_.size(), 0};
+          res_ = ZSTD_decompressStream(strm_, &output, &input_);
+          if (ZSTD_isError(res_))
+            return false;
+          output_full_ = output.pos == output.size;
+          char* start = ((char*) decompressed_buffer_.data());
+          setg(start, start, start + output.pos);
         }
 
+        if (n == 0)
+          return true;
         if (ZSTD_isError(res_))
-          return traits_type::eof();
-        else if (gptr() >= egptr())
-          return traits_type::eof();
+          return false;
 
-        return traits_type::to_int_type(*gptr());
+        // Step over whole frames whose content size is known.
+        std::uint64_t frame_offset = std::uint64_t(ftell(fp_)) - (input_.size - input_.pos);
+        ZSTD_frameHeader frame_header;
+        std::uint64_t frame_size = 0;
+        while (read_frame_header(fp_, frame_offset, frame_header, frame_size))
+        {
+          if (frame_header.frameType != ZSTD_skippableFrame)
+          {
+            if (frame_header.frameContentSize == ZSTD_CONTENTSIZE_UNKNOWN || frame_header.frameContentSize > n)
+              break;
+            n -= frame_header.frameContentSize;
+          }
+          frame_offset += frame_size;
+        }
+
+        if (fseek(fp_, long(frame_offset), SEEK_SET))
+          return false;
+        input_.src = nullptr;
+        input_.pos = 0;
+        input_.size = 0;
+        output_full_ = false;
+        res_ = 0;
+        reset_get_area();
+
+        // Decode into the target frame.
+        while (n > 0)
+        {
+          if (underflow() == traits_type::eof())
+            return false;
+          std::size_t skip = static_cast<std::size_t>(std::min<std::uint64_t>(egptr() - gptr(), n));
+          gbump(static_cast<int>(skip));
+          n -= skip;
+        }
+        return true;
       }
 
+    protected:
+      // Offsets are compressed, as for seekpos: seekoff(0, cur) reports the
+      // offset of the current frame and seekoff(off, beg) is seekpos(off).
+      // Uncompressed offsets go through seek_uncompressed().
       virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir way, std::ios_base::openmode which)
       {
+        if (way == std::ios::beg)
+          return seekpos(pos_type(off), which);
+
         if (off == 0 && way == std::ios::cur)
         {
           if (egptr() - gptr() == 0 && res_ == 0)
@@ -156,7 +655,7 @@ namespace shrinkwrap
         return pos_type(off_type(-1));
       }
 
-      virtual std::streambuf::pos_type seekpos(std::streambuf::pos_type pos, std::ios_base::openmode which)
+      virtual std::streambuf::pos_type seekpos(std::streambuf::pos_type pos, std::ios_base::openmode /*which*/)
       {
         std::uint64_t compressed_offset = static_cast<std::uint64_t>(pos);
 
@@ -170,60 +669,352 @@ namespace shrinkwrap
         input_.src = nullptr;
         input_.pos = 0;
         input_.size = 0;
+        output_full_ = false;
         res_ = 0;
-        char* end = egptr();
-        setg(end, end, end);
+        reset_get_area();
 
         return pos;
       }
 
     private:
-      std::vector<std::uint8_t> compressed_buffer_;
-      std::vector<std::uint8_t> decompressed_buffer_;
       ZSTD_DStream* strm_;
       ZSTD_inBuffer input_;
-      FILE* fp_;
+      bool output_full_;
       std::size_t res_;
       std::size_t current_block_position_;
+      const dictionary_registry* dictionaries_;
+      dictionary frame_dictionary_;
     };
 
-    class obuf : public std::streambuf
+    // A resource is shared by the decoding contexts of all workers, so it must
+    // be thread safe. Frame buffers stay on the heap. memory_limit applies to
+    // each decoding context and only bounds frames without a recorded content
+    // size, since the others are decoded straight into their frame buffer.
+    struct parallel_ibuf_options : ibuf_options, parallel_options
+    {
+      // Frames decoded ahead of the reader. 0 uses twice the worker count.
+      std::size_t max_frames_in_flight = 0;
+    };
+
+    // Reads multi-frame files (one frame per obuf sync(), zstd -T, pzstd) by
+    // decoding up to max_frames_in_flight frames concurrently and handing them
+    // out in order. Frame boundaries are found with ZSTD_findFrameCompressedSize
+    // and frames that record their content size are decoded in one call into a
+    // buffer of exactly that size.
+    class parallel_ibuf : public std::streambuf
     {
     public:
-      obuf(FILE* fp, int compression_level)
+      parallel_ibuf(FILE* fp, const parallel_ibuf_options& opts = parallel_ibuf_options())
         :
-        strm_(ZSTD_createCStream()),
         fp_(fp),
-        compressed_buffer_(ZSTD_CStreamOutSize()),
-        decompressed_buffer_(ZSTD_CStreamInSize()),
-        block_position_(0),
-        compression_level_(compression_level),
-        res_(0)
+        read_pos_(0),
+        pool_(opts.pool),
+        custom_mem_(detail::zstd_custom_mem(opts.resource)),
+        memory_limit_(opts.memory_limit),
+        window_log_max_(opts.window_log_max),
+        ignore_checks_(opts.ignore_checks),
+        dictionaries_(opts.dictionaries),
+        failed_(false)
+      {
+        if (!pool_)
+        {
+          owned_pool_.reset(new thread_pool(std::max<std::size_t>(1, opts.thread_count)));
+          pool_ = owned_pool_.get();
+        }
+        window_ = opts.max_frames_in_flight ? opts.max_frames_in_flight : 2 * pool_->size();
+
+        char* end = current_frame_.data() + current_frame_.size();
+        setg(end, end, end);
+      }
+
+      parallel_ibuf(const std::string& file_path, const parallel_ibuf_options& opts = parallel_ibuf_options()) : parallel_ibuf(fopen(file_path.c_str(), "rb"), opts) {}
+
+      parallel_ibuf(const parallel_ibuf&) = delete;
+      parallel_ibuf& operator=(const parallel_ibuf&) = delete;
+
+      virtual ~parallel_ibuf()
+      {
+        cancel();
+        for (auto it = idle_dctxs_.begin(); it != idle_dctxs_.end(); ++it)
+          ZSTD_freeDCtx(*it);
+        if (fp_)
+          fclose(fp_);
+      }
+
+      // True if a frame failed to decode. The stream ends at the last good frame.
+      bool failed() const { return failed_; }
+
+    private:
+      struct frame
+      {
+        std::vector<std::uint8_t> compressed;
+        std::vector<char> decompressed;
+      };
+
+      // Moves the next complete frame out of the read buffer, reading more of the
+      // file as needed.
+      bool read_frame(std::vector<std::uint8_t>& dest)
+      {
+        while (true)
+        {
+          std::size_t available = read_buffer_.size() - read_pos_;
+          if (available)
+          {
+            std::size_t frame_size = ZSTD_findFrameCompressedSize(read_buffer_.data() + read_pos_, available);
+            if (!ZSTD_isError(frame_size))
+            {
+              dest.assign(read_buffer_.begin() + read_pos_, read_buffer_.begin() + read_pos_ + frame_size);
+              read_pos_ += frame_size;
+              return true;
+            }
+          }
+
+          if (feof(fp_) || ferror(fp_))
+          {
+            if (available || ferror(fp_))
+              failed_ = true; // truncated or corrupt frame
+            return false;
+          }
+
+          read_buffer_.erase(read_buffer_.begin(), read_buffer_.begin() + read_pos_);
+          read_pos_ = 0;
+          std::size_t used = read_buffer_.size();
+          read_buffer_.resize(used + std::max(used, ZSTD_DStreamInSize() * 8));
+          read_buffer_.resize(used + fread(read_buffer_.data() + used, 1, read_buffer_.size() - used, fp_));
+        }
+      }
+
+      bool decode_frame(ZSTD_DCtx* dctx, frame& f)
+      {
+        const std::uint8_t* src = f.compressed.data();
+        std::size_t src_size = f.compressed.size();
+        unsigned long long content_size = ZSTD_getFrameContentSize(src, src_size);
+        if (content_size == ZSTD_CONTENTSIZE_ERROR)
+          return false;
+
+        ZSTD_frameHeader frame_header;
+        dictionary dict;
+        if (ZSTD_getFrameHeader(&frame_header, src, src_size) != 0
+          || ZSTD_isError(dictionary_registry::ref_frame_dictionary(dictionaries_, dctx, frame_header, dict)))
+          return false;
+
+        if (content_size != ZSTD_CONTENTSIZE_UNKNOWN)
+        {
+          // ZSTD_decompressBound returns the declared size itself, so a forged
+          // header is checked against the blocks before allocating for it.
+          if (content_size > detail::zstd_frame_block_bound(src, src_size, frame_header))
+            return false;
+          f.decompressed.resize(static_cast<std::size_t>(content_size));
+          std::size_t res = ZSTD_decompressDCtx(dctx, f.decompressed.data(), f.decompressed.size(), src, src_size);
+          return !ZSTD_isError(res) && res == f.decompressed.size();
+        }
+
+        if (ZSTD_isError(ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only)))
+          return false;
+
+        ZSTD_inBuffer input = {src, src_size, 0};
+        std::size_t used = 0;
+        std::size_t res = 1;
+        while (res != 0)
+        {
+          if (used == f.decompressed.size())
+            f.decompressed.resize(std::max(f.decompressed.size() * 2, ZSTD_DStreamOutSize()));
+          ZSTD_outBuffer output = {f.decompressed.data() + used, f.decompressed.size() - used, 0};
+          res = ZSTD_decompressStream(dctx, &output, &input);
+          if (ZSTD_isError(res) || (res != 0 && input.pos == input.size && output.pos < output.size))
+            return false;
+          used += output.pos;
+        }
+        f.decompressed.resize(used);
+        return true;
+      }
+
+      ZSTD_DCtx* acquire_dctx()
+      {
+        {
+          std::unique_lock<std::mutex> lk(dctx_mutex_);
+          if (!idle_dctxs_.empty())
+          {
+            ZSTD_DCtx* ret = idle_dctxs_.back();
+            idle_dctxs_.pop_back();
+            return ret;
+          }
+        }
+
+        ZSTD_DCtx* ret = ZSTD_createDCtx_advanced(custom_mem_);
+#ifdef ZSTD_d_forceIgnoreChecksum
+        if (ret && ignore_checks_)
+          ZSTD_DCtx_setParameter(ret, ZSTD_d_forceIgnoreChecksum, ZSTD_d_ignoreChecksum);
+#endif
+        if (ret)
+          detail::zstd_set_window_log_max(ret, memory_limit_, window_log_max_);
+        return ret;
+      }
+
+      void release_dctx(ZSTD_DCtx* dctx)
+      {
+        std::unique_lock<std::mutex> lk(dctx_mutex_);
+        idle_dctxs_.push_back(dctx);
+      }
+
+      void fill_window()
+      {
+        while (in_flight_.size() < window_ && !failed_)
+        {
+          std::shared_ptr<frame> f(new frame());
+          if (!read_frame(f->compressed))
+            break;
+
+          std::future<bool> decoded = pool_->submit([this, f]()
+          {
+            ZSTD_DCtx* dctx = acquire_dctx();
+            if (!dctx)
+              return false;
+            bool ret = decode_frame(dctx, *f);
+            release_dctx(dctx);
+            return ret;
+          });
+          in_flight_.push_back(std::make_pair(f, std::move(decoded)));
+        }
+      }
+
+      // Waits for outstanding frames, which reference this object.
+      void cancel()
+      {
+        for (auto it = in_flight_.begin(); it != in_flight_.end(); ++it)
+          it->second.wait();
+        in_flight_.clear();
+      }
+
+    protected:
+      virtual std::streambuf::int_type underflow()
       {
         if (!fp_)
+          return traits_type::eof();
+        if (gptr() < egptr()) // buffer not exhausted
+          return traits_type::to_int_type(*gptr());
+
+        while (true)
         {
-          char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
-          setp(end, end);
+          fill_window();
+          if (in_flight_.empty())
+            return traits_type::eof();
+
+          std::shared_ptr<frame> f = in_flight_.front().first;
+          bool ok = in_flight_.front().second.get();
+          in_flight_.pop_front();
+          if (!ok)
+          {
+            failed_ = true;
+            cancel();
+            return traits_type::eof();
+          }
+
+          current_frame_.swap(f->decompressed);
+          if (!current_frame_.empty())
+          {
+            setg(current_frame_.data(), current_frame_.data(), current_frame_.data() + current_frame_.size());
+            return traits_type::to_int_type(*gptr());
+          }
         }
-        else
+      }
+
+    private:
+      FILE* fp_;
+      std::vector<std::uint8_t> read_buffer_;
+      std::size_t read_pos_;
+      std::vector<char> current_frame_;
+      std::unique_ptr<thread_pool> owned_pool_;
+      thread_pool* pool_;
+      std::size_t window_;
+      std::deque<std::pair<std::shared_ptr<frame>, std::future<bool>>> in_flight_;
+      std::mutex dctx_mutex_;
+      std::vector<ZSTD_DCtx*> idle_dctxs_;
+      ZSTD_customMem custom_mem_;
+      std::uint64_t memory_limit_;
+      int window_log_max_;
+      bool ignore_checks_;
+      const dictionary_registry* dictionaries_;
+      bool failed_;
+    };
+
+    struct obuf_options : seek_point_options
+    {
+      int compression_level = 3;
+      // Moves the level between min_level and max_level so that compression
+      // keeps up with the caller. The level is revisited each time the put area
+      // is compressed, and a new one applies from the next block on.
+      bool adaptive_level = false;
+      int min_level = 1;
+      int max_level = 19;
+      // Serves the stream's buffers and zstd's state. Must outlive the stream.
+      memory_resource* resource = nullptr;
+      // Bytes the encoder may use. Each frame's window, hash and chain sizes are
+      // lowered from the level's defaults until it fits; if it can't, writes
+      // fail. 0 is unlimited.
+      std::uint64_t memory_limit = 0;
+      // Done on flush() and when the put area fills. A frame is the unit that
+      // resets the history, so full and end_block both end the frame.
+      flush_mode on_flush = flush_mode::end_block;
+      flush_mode on_buffer_full = flush_mode::none;
+      // Writes put areas that a sample shows won't compress as frames of raw
+      // blocks, which ends the current frame.
+      bool detect_incompressible = true;
+      // Compresses every frame with this dictionary, at the level it was
+      // digested for, and names it by ID in the frame headers.
+      dictionary dict;
+      // Finds matches up to a window back, however far, at a small cost in
+      // speed. Without a window_log, the window is 2^27 as with zstd --long.
+      // The incompressible probe only sees the put area, so it is skipped.
+      bool long_distance_matching = false;
+      // Window as a power of two, up to ZSTD_WINDOWLOG_MAX. 0 uses the
+      // level's. Frame headers record it, and readers need a window_log_max at
+      // least as large for windows above 2^27 (see scan_window_size).
+      int window_log = 0;
+    };
+
+    class obuf : public basic_obuf<obuf, ZSTD_COMPRESSBOUND(ZSTD_BLOCKSIZE_MAX) + 3 + 4, ZSTD_BLOCKSIZE_MAX> // ZSTD_CStreamOutSize(), ZSTD_CStreamInSize()
+    {
+      typedef basic_obuf<obuf, ZSTD_COMPRESSBOUND(ZSTD_BLOCKSIZE_MAX) + 3 + 4, ZSTD_BLOCKSIZE_MAX> base_type;
+      friend base_type;
+    public:
+      obuf(FILE* fp, const obuf_options& opts)
+        :
+        base_type(fp, opts.resource),
+        block_position_(0),
+        strm_(ZSTD_createCStream_advanced(detail::zstd_custom_mem(opts.resource))),
+        level_ctl_(opts.compression_level, opts.min_level, opts.max_level, opts.adaptive_level),
+        memory_limit_(opts.memory_limit),
+        on_flush_(opts.on_flush),
+        on_buffer_full_(opts.on_buffer_full),
+        detect_incompressible_(opts.detect_incompressible),
+        dict_(opts.dict),
+        long_distance_matching_(opts.long_distance_matching),
+        window_log_(opts.window_log ? opts.window_log : (opts.long_distance_matching ? 27 : 0)),
+        seek_points_(opts),
+        in_frame_(false),
+        res_(0)
+      {
+        if (fp_)
         {
-          res_ = ZSTD_initCStream(strm_, compression_level_);
+          res_ = init_stream();
           if (ZSTD_isError(res_))
           {
             // TODO: handle error.
           }
-
-          char* end = ((char*) decompressed_buffer_.data()) + decompressed_buffer_.size();
-          setp((char*) decompressed_buffer_.data(), end);
         }
       }
 
+      obuf(FILE* fp, int compression_level) : obuf(fp, level_options(compression_level)) {}
+
       obuf(const std::string& file_path, int compression_level = 3) : obuf(fopen(file_path.c_str(), "wb"), compression_level) {}
 
+      obuf(const std::string& file_path, const obuf_options& opts) : obuf(fopen(file_path.c_str(), "wb"), opts) {}
+
 #if !defined(__GNUC__) || defined(__clang__) || __GNUC__ > 4
       obuf(obuf&& src)
         :
-        std::streambuf(std::move(src))
+        base_type(std::move(src))
       {
         this->move(std::move(src));
       }
@@ -232,8 +1023,8 @@ namespace shrinkwrap
       {
         if (&src != this)
         {
-          std::streambuf::operator=(std::move(src));
           this->close();
+          base_type::operator=(std::move(src));
           this->move(std::move(src));
         }
 
@@ -246,132 +1037,212 @@ namespace shrinkwrap
         this->close();
       }
 
+      // Bytes held by the buffers and the encoding context.
+      std::uint64_t memory_usage() const
+      {
+        return compressed_buffer_.size() + decompressed_buffer_.size() + ZSTD_sizeof_CStream(strm_);
+      }
+
+      // Level of the blocks being compressed now; moves with adaptive_level.
+      int compression_level() const { return level_ctl_.level(); }
+
     private:
       void move(obuf&& src)
       {
-        compressed_buffer_ = std::move(src.compressed_buffer_);
-        decompressed_buffer_ = std::move(src.decompressed_buffer_);
         block_position_ = std::move(src.block_position_);
         strm_ = src.strm_;
-        fp_ = src.fp_;
-        src.fp_ = nullptr;
+        src.strm_ = nullptr;
+        level_ctl_ = src.level_ctl_;
+        memory_limit_ = src.memory_limit_;
+        on_flush_ = src.on_flush_;
+        on_buffer_full_ = src.on_buffer_full_;
+        detect_incompressible_ = src.detect_incompressible_;
+        dict_ = std::move(src.dict_);
+        long_distance_matching_ = src.long_distance_matching_;
+        window_log_ = src.window_log_;
+        seek_points_ = src.seek_points_;
+        in_frame_ = src.in_frame_;
         res_ = src.res_;
       }
 
+      // Starts a frame at the current level. Parameters set explicitly outlive
+      // ZSTD_initCStream(), so the capped ones are set again for every frame.
+      // ZSTD_initCStream() also drops the dictionary.
+      std::size_t init_stream()
+      {
+        std::size_t res = ZSTD_initCStream(strm_, level_ctl_.level());
+        if (!ZSTD_isError(res) && dict_)
+          res = ZSTD_CCtx_refCDict(strm_, dict_.cdict());
+        if (!ZSTD_isError(res) && long_distance_matching_)
+          res = ZSTD_CCtx_setParameter(strm_, ZSTD_c_enableLongDistanceMatching, 1);
+        if (ZSTD_isError(res) || (!memory_limit_ && !window_log_))
+          return res;
+
+        std::uint64_t memory_limit = memory_limit_ ? memory_limit_ : std::numeric_limits<std::uint64_t>::max();
+        ZSTD_compressionParameters params = detail::zstd_fit_cparams(level_ctl_.level(), memory_limit, unsigned(window_log_));
+        if (ZSTD_estimateCStreamSize_usingCParams(params) > memory_limit)
+          return std::size_t(-int(ZSTD_error_memory_allocation));
+        if (ZSTD_isError(res = ZSTD_CCtx_setParameter(strm_, ZSTD_c_windowLog, int(params.windowLog))))
+          return res;
+        if (ZSTD_isError(res = ZSTD_CCtx_setParameter(strm_, ZSTD_c_hashLog, int(params.hashLog))))
+          return res;
+        return ZSTD_CCtx_setParameter(strm_, ZSTD_c_chainLog, int(params.chainLog));
+      }
+
+      static obuf_options level_options(int compression_level)
+      {
+        obuf_options ret;
+        ret.compression_level = compression_level;
+        return ret;
+      }
+
       void close()
       {
         if (fp_)
         {
           sync();
-          res_ = ZSTD_freeCStream(strm_);
+          if (in_frame_)
+            end_frame();
           fclose(fp_);
           fp_ = nullptr;
         }
-      }
-    protected:
-      virtual int overflow(int c)
-      {
-        if (!fp_)
-          return traits_type::eof();
-
-        if ((epptr() - pptr()) > 0)
+        if (strm_)
         {
-          assert(!"Put buffer not empty, this should never happen");
-          this->sputc(static_cast<char>(0xFF & c));
+          res_ = ZSTD_freeCStream(strm_);
+          strm_ = nullptr;
         }
-        else
+      }
+
+      // Writes what ZSTD_flushStream or ZSTD_endStream have left.
+      template <typename Fn>
+      bool drain(Fn fn)
+      {
+        do
         {
-          ZSTD_inBuffer input = {decompressed_buffer_.data(), decompressed_buffer_.size(), 0};
-          while (!ZSTD_isError(res_) && input.pos < input.size)
+          ZSTD_outBuffer output = {compressed_buffer_.data(), compressed_buffer_.size(), 0};
+          res_ = fn(strm_, &output);
+          level_ctl_.end_compress();
+          if (output.pos && !fwrite(compressed_buffer_.data(), output.pos, 1, fp_))
           {
-            ZSTD_outBuffer output = {compressed_buffer_.data(), compressed_buffer_.size(), 0};
-            res_ = ZSTD_compressStream(strm_, &output, &input);
-
-            if (output.pos && !fwrite(compressed_buffer_.data(), output.pos, 1, fp_))
-            {
-              // TODO: handle error.
-              return traits_type::eof();
-            }
+            // TODO: handle error.
+            return false;
           }
+          level_ctl_.end_write();
+        } while (!ZSTD_isError(res_) && res_ != 0);
+        return !ZSTD_isError(res_);
+      }
 
-          decompressed_buffer_[0] = reinterpret_cast<unsigned char&>(c);
-          setp((char*) decompressed_buffer_.data() + 1, (char*) decompressed_buffer_.data() + decompressed_buffer_.size());
-        }
+      // Ends the frame, and the next one starts at the adapted level.
+      bool end_frame()
+      {
+        if (!drain(ZSTD_endStream))
+          return false;
 
-        return (!ZSTD_isError(res_) ? traits_type::to_int_type(c) : traits_type::eof());
+        in_frame_ = false;
+        level_ctl_.update();
+        res_ = init_stream(); //ZSTD_resetCStream(strm_, 0);
+        block_position_ = ftell(fp_);
+        return true;
       }
 
-      virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir way, std::ios_base::openmode which)
+      bool write_raw_frame(const std::uint8_t* data, std::size_t size)
       {
-        if (off == 0 && way == std::ios::cur)
+        if (in_frame_ && !end_frame())
+          return false;
+
+        FILE* fp = fp_;
+        if (!detail::zstd_write_raw_frame(data, size, [fp](const void* buf, std::size_t len) { return fwrite(buf, len, 1, fp) == 1; }))
         {
-          return block_position_;
+          // TODO: handle error.
+          return false;
         }
-        return pos_type(off_type(-1));
+        block_position_ = ftell(fp_);
+        return true;
       }
 
-
-      virtual int sync()
+      bool encode(std::uint8_t* data, std::size_t size, bool flush)
       {
-        if (!fp_)
-          return -1;
+        return seek_points_.split(data, size, flush ? on_flush_ : on_buffer_full_, [this](std::uint8_t* piece, std::size_t piece_size, flush_mode mode)
+        {
+          return encode_piece(piece, piece_size, mode);
+        });
+      }
 
-        ZSTD_inBuffer input = {decompressed_buffer_.data(), (decompressed_buffer_.size() - (epptr() - pptr())), 0};
+      bool encode_piece(std::uint8_t* data, std::size_t size, flush_mode mode)
+      {
+        if (!ZSTD_isError(res_) && detect_incompressible_ && !long_distance_matching_ && detail::looks_incompressible(data, size))
+          return write_raw_frame(data, size);
 
-        if (input.pos < input.size)
+        // zstd only reads the level when a frame starts, so a new level ends the
+        // open frame and the next one starts at it. A dictionary carries its own
+        // level. The idle time is booked first, or ending the frame would count
+        // it as compression.
+        level_ctl_.begin_work();
+        if (!ZSTD_isError(res_) && level_ctl_.update() && !dict_)
         {
-          while (!ZSTD_isError(res_) && input.pos < input.size)
-          {
-            ZSTD_outBuffer output = {compressed_buffer_.data(), compressed_buffer_.size(), 0};
-            res_ = ZSTD_compressStream(strm_, &output, &input);
+          if (!in_frame_)
+            res_ = init_stream();
+          else if (!end_frame())
+            return false;
+        }
 
-            if (output.pos && !fwrite(compressed_buffer_.data(), output.pos, 1, fp_))
-            {
-              // TODO: handle error.
-              return -1;
-            }
-          }
+        ZSTD_inBuffer input = {data, size, 0};
+        while (!ZSTD_isError(res_) && input.pos < input.size)
+        {
+          ZSTD_outBuffer output = {compressed_buffer_.data(), compressed_buffer_.size(), 0};
+          res_ = ZSTD_compressStream(strm_, &output, &input);
+          level_ctl_.end_compress();
 
-          while (!ZSTD_isError(res_) && res_ != 0)
+          if (output.pos && !fwrite(compressed_buffer_.data(), output.pos, 1, fp_))
           {
-            ZSTD_outBuffer output = {compressed_buffer_.data(), compressed_buffer_.size(), 0};
-            res_ = ZSTD_endStream(strm_, &output);
-            if (output.pos && !fwrite(compressed_buffer_.data(), output.pos, 1, fp_))
-            {
-              // TODO: handle error.
-              return -1;
-            }
+            // TODO: handle error.
+            return false;
           }
+          level_ctl_.end_write();
+        }
+        if (size)
+          in_frame_ = true;
 
-          if (ZSTD_isError(res_))
-            return -1;
-
-          res_ = ZSTD_initCStream(strm_, compression_level_); //ZSTD_resetCStream(strm_, 0);
+        if (ZSTD_isError(res_) || mode == flush_mode::none)
+          return !ZSTD_isError(res_);
+        if (mode == flush_mode::sync)
+          return drain(ZSTD_flushStream);
+        return end_frame();
+      }
 
-          setp((char*) decompressed_buffer_.data(), (char*) decompressed_buffer_.data() + decompressed_buffer_.size());
-          block_position_ = ftell(fp_);
+    protected:
+      virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir way, std::ios_base::openmode /*which*/)
+      {
+        if (off == 0 && way == std::ios::cur)
+        {
+          return block_position_;
         }
-
-        return 0;
+        return pos_type(off_type(-1));
       }
 
     private:
-      std::vector<std::uint8_t> compressed_buffer_;
-      std::vector<std::uint8_t> decompressed_buffer_;
       std::streambuf::pos_type block_position_;
       ZSTD_CStream* strm_;
-      FILE* fp_;
-      int compression_level_;
+      detail::level_controller level_ctl_;
+      std::uint64_t memory_limit_;
+      flush_mode on_flush_;
+      flush_mode on_buffer_full_;
+      bool detect_incompressible_;
+      dictionary dict_;
+      bool long_distance_matching_;
+      int window_log_;
+      detail::seek_point_splitter seek_points_;
+      bool in_frame_;
       std::size_t res_;
     };
 
     class istream : public std::istream
     {
     public:
-      istream(const std::string& file_path)
+      istream(const std::string& file_path, const ibuf_options& opts = ibuf_options())
         :
         std::istream(&sbuf_),
-        sbuf_(file_path)
+        sbuf_(file_path, opts)
       {
       }
 
@@ -393,19 +1264,53 @@ namespace shrinkwrap
         return *this;
       }
 #endif
+
+      std::uint64_t memory_usage() const { return sbuf_.memory_usage(); }
+
+      // Like seekg(), but with uncompressed offsets (see ibuf::seek_uncompressed).
+      istream& seek_uncompressed(std::uint64_t offset)
+      {
+        clear(rdstate() & ~std::ios::eofbit);
+        if (!fail() && !sbuf_.seek_uncompressed(offset))
+          setstate(std::ios::failbit);
+        return *this;
+      }
+
+      istream& skip_uncompressed(std::uint64_t count)
+      {
+        clear(rdstate() & ~std::ios::eofbit);
+        if (!fail() && !sbuf_.skip_uncompressed(count))
+          setstate(std::ios::failbit);
+        return *this;
+      }
     private:
       ::shrinkwrap::zstd::ibuf sbuf_;
     };
 
+    class parallel_istream : public std::istream
+    {
+    public:
+      parallel_istream(const std::string& file_path, const parallel_ibuf_options& opts = parallel_ibuf_options())
+        :
+        std::istream(&sbuf_),
+        sbuf_(file_path, opts)
+      {
+      }
+
+      bool failed() const { return sbuf_.failed(); }
+    private:
+      ::shrinkwrap::zstd::parallel_ibuf sbuf_;
+    };
+
 
 
     class ostream : public std::ostream
     {
     public:
-      ostream(const std::string& file_path)
+      ostream(const std::string& file_path, const obuf_options& opts = obuf_options())
         :
         std::ostream(&sbuf_),
-        sbuf_(file_path)
+        sbuf_(file_path, opts)
       {
       }
 
@@ -427,6 +1332,8 @@ namespace shrinkwrap
         return *this;
       }
 #endif
+
+      std::uint64_t memory_usage() const { return sbuf_.memory_usage(); }
     private:
       ::shrinkwrap::zstd::obuf sbuf_;
     };
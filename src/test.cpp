@@ -1,5 +1,14 @@
 
 #include "shrinkwrap/istream.hpp"
+#include "shrinkwrap/batch.hpp"
+#include "shrinkwrap/verify.hpp"
+#include "shrinkwrap/record_index.hpp"
+#include "shrinkwrap/transcode.hpp"
+#include "shrinkwrap/record_reader.hpp"
+#include "shrinkwrap/map_reduce.hpp"
+#include "shrinkwrap/split.hpp"
+#include "shrinkwrap/lz4.hpp"
+#include "shrinkwrap/bz2.hpp"
 
 
 #include <fstream>
@@ -12,10 +21,62 @@
 #include <iterator>
 #include <sstream>
 #include <limits>
+#include <atomic>
+#include <cstdlib>
+#include <thread>
 
 
 namespace sw = shrinkwrap;
 
+static std::string read_file(const std::string& file_path)
+{
+  std::ifstream ifs(file_path, std::ios::binary);
+  return std::string((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+}
+
+// Every operator new in the process, so that tests can check that a code path
+// does not allocate.
+static std::atomic<std::size_t> heap_allocation_count(0);
+
+void* operator new(std::size_t size)
+{
+  ++heap_allocation_count;
+  void* ret = std::malloc(size ? size : 1);
+  if (!ret)
+    throw std::bad_alloc();
+  return ret;
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+class counting_resource : public sw::memory_resource
+{
+public:
+  counting_resource() : allocations(0), outstanding(0), peak(0) {}
+
+  std::atomic<std::size_t> allocations;
+  std::atomic<std::size_t> outstanding;
+  std::atomic<std::size_t> peak;
+protected:
+  virtual void* do_allocate(std::size_t bytes, std::size_t /*alignment*/)
+  {
+    ++allocations;
+    std::size_t now = outstanding += bytes;
+    std::size_t prev = peak;
+    while (now > prev && !peak.compare_exchange_weak(prev, now)) {}
+    return ::operator new(bytes);
+  }
+
+  virtual void do_deallocate(void* p, std::size_t bytes, std::size_t /*alignment*/)
+  {
+    outstanding -= bytes;
+    ::operator delete(p);
+  }
+};
+
 template <typename InT, typename OutT>
 class test_base
 {
@@ -298,6 +359,2373 @@ private:
   }
 };
 
+class batch_test
+{
+public:
+  bool operator()()
+  {
+    std::vector<std::string> paths;
+    std::vector<std::string> expected;
+    for (std::size_t i = 0; i < 16; ++i)
+    {
+      std::stringstream content;
+      for (std::size_t j = 0; j < 512 * (i + 1); ++j)
+        content << std::setfill('0') << std::setw(3) << ((i + j) % 1000) << " ";
+      expected.push_back(content.str());
+
+      std::string file_path = "test_batch_file_" + std::to_string(i) + ".txt";
+      switch (i % 3)
+      {
+        case 0:
+          file_path += ".gz";
+          write_file<sw::gz::ostream>(file_path, expected.back());
+          break;
+        case 1:
+          file_path += ".xz";
+          write_file<sw::xz::ostream>(file_path, expected.back());
+          break;
+        default:
+          file_path += ".zst";
+          write_file<sw::zstd::ostream>(file_path, expected.back());
+      }
+      paths.push_back(file_path);
+    }
+    paths.push_back("test_batch_file_missing.txt.gz");
+
+    sw::batch_options opts;
+    opts.thread_count = 4;
+
+    std::vector<int> matched(paths.size(), 0);
+    sw::batch_decompress(paths, [&](std::size_t i, const char* data, std::size_t size, bool success)
+    {
+      matched[i] = (success && i < expected.size() && std::string(data, size) == expected[i]);
+    }, opts);
+
+    for (std::size_t i = 0; i < expected.size(); ++i)
+    {
+      if (!matched[i])
+      {
+        std::cerr << "FAILED batch decompress of " << paths[i] << std::endl;
+        return false;
+      }
+    }
+    if (matched.back())
+    {
+      std::cerr << "FAILED to report missing file." << std::endl;
+      return false;
+    }
+
+    std::vector<std::string> raw(expected.size());
+    std::vector<sw::buffer_ref> buffers;
+    for (std::size_t i = 0; i < expected.size(); ++i)
+    {
+      std::ifstream ifs(paths[i], std::ios::binary);
+      raw[i].assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+      buffers.push_back(sw::buffer_ref(raw[i].data(), raw[i].size()));
+    }
+    buffers.push_back(sw::buffer_ref("garbage", 7));
+
+    // A frame whose header claims 1 TiB for a 5 byte block.
+    const char forged[] = {'\x28', '\xb5', '\x2f', '\xfd', '\xe0', 0, 0, 0, 0, 0, 1, 0, 0, char(1 | (5 << 3)), 0, 0, 'h', 'e', 'l', 'l', 'o'};
+    buffers.push_back(sw::buffer_ref(forged, sizeof(forged)));
+
+    std::vector<std::vector<char>> outputs;
+    std::vector<std::size_t> failures = sw::batch_decompress(buffers, outputs, opts);
+    if (failures.size() != 2 || failures[0] != expected.size() || failures[1] != expected.size() + 1)
+    {
+      std::cerr << "FAILED batch decompress failure reporting." << std::endl;
+      return false;
+    }
+
+    for (std::size_t i = 0; i < expected.size(); ++i)
+    {
+      if (std::string(outputs[i].begin(), outputs[i].end()) != expected[i])
+      {
+        std::cerr << "FAILED batch decompress of buffer " << i << std::endl;
+        return false;
+      }
+    }
+
+    return true;
+  }
+private:
+  template <typename OutT>
+  static void write_file(const std::string& file_path, const std::string& content)
+  {
+    OutT ofs(file_path);
+    ofs.write(content.data(), content.size());
+  }
+};
+
+typedef bool (*scan_fn)(FILE*, std::vector<sw::block_info>&);
+
+static bool scan_xz_blocks(FILE* fp, std::vector<sw::block_info>& blocks)
+{
+  return sw::xz::scan_blocks(fp, blocks);
+}
+
+template <typename InT, typename OutT, typename OptT>
+class verify_test : public test_base<InT, OutT>
+{
+public:
+  verify_test(const std::string& file_path, std::size_t block_size, std::size_t check_size = 0, scan_fn scan = nullptr)
+    : test_base<InT, OutT>(file_path, block_size), check_size_(check_size), scan_(scan)
+  {
+  }
+
+  bool operator()()
+  {
+    if ((test_base<InT, OutT>::file_exists(this->file_) && std::remove(this->file_.c_str()) != 0) || !test_base<InT, OutT>::generate_test_file(this->file_, this->block_size_))
+    {
+      std::cerr << "FAILED to generate test file" << std::endl;
+      return false;
+    }
+
+    std::string expected = read_all(false);
+    sw::verify_options opts;
+    opts.thread_count = 4;
+    sw::verify_result res = sw::verify(this->file_, opts);
+    if (!res || res.unit_count == 0)
+    {
+      std::cerr << "FAILED to verify " << this->file_ << std::endl;
+      return false;
+    }
+
+    if (!scan_)
+      return true;
+
+    // Corrupt the check of the first unit.
+    std::vector<sw::block_info> units;
+    FILE* fp = fopen(this->file_.c_str(), "r+b");
+    if (!fp || !scan_(fp, units) || units.empty() || fseek(fp, long(units[0].compressed_offset + units[0].compressed_size - check_size_), SEEK_SET))
+    {
+      std::cerr << "FAILED to scan " << this->file_ << std::endl;
+      if (fp)
+        fclose(fp);
+      return false;
+    }
+    int c = fgetc(fp);
+    fseek(fp, -1, SEEK_CUR);
+    fputc(c ^ 0xFF, fp);
+    fclose(fp);
+
+    res = sw::verify(this->file_, opts);
+    if (res || res.error_offset != units[0].compressed_offset)
+    {
+      std::cerr << "FAILED to detect corruption in " << this->file_ << std::endl;
+      return false;
+    }
+
+    if (read_all(false) == expected || read_all(true) != expected)
+    {
+      std::cerr << "FAILED ignore_checks read of " << this->file_ << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+private:
+  std::string read_all(bool ignore_checks)
+  {
+    std::array<char, 256> buf;
+    std::string ret;
+    OptT opts;
+    opts.ignore_checks = ignore_checks;
+    InT is(this->file_, opts);
+    while (is)
+    {
+      is.read(buf.data(), buf.size());
+      ret.append(buf.data(), is.gcount());
+    }
+    return ret;
+  }
+private:
+  std::size_t check_size_;
+  scan_fn scan_;
+};
+
+class bgzf_tellp_test
+{
+public:
+  bgzf_tellp_test(const std::string& file_path) : file_(file_path) {}
+
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::vector<std::string> records;
+    std::vector<std::uint64_t> offsets;
+
+    {
+      sw::bgzf::obuf_options opts;
+      opts.write_gzi_index = true;
+      sw::bgzf::ostream os(file_, std::ios::out, opts);
+      for (std::size_t i = 0; i < 2048 && os.good(); ++i)
+      {
+        // Mix of compressible and random records so that some blocks are stored.
+        std::string record = std::to_string(i) + ":";
+        std::size_t len = rg() % 512;
+        for (std::size_t j = 0; j < len; ++j)
+          record.push_back(i % 2 ? char(rg()) : char('a' + (j % 4)));
+        record.push_back('\n');
+
+        offsets.push_back(os.tellp());
+        records.push_back(record);
+        os.write(record.data(), record.size());
+        if (rg() % 64 == 0)
+          os.flush();
+      }
+      if (!os.good())
+      {
+        std::cerr << "FAILED to write " << file_ << std::endl;
+        return false;
+      }
+    }
+
+    sw::bgzf::istream is(file_);
+    for (std::size_t k = 0; k < records.size(); ++k)
+    {
+      std::size_t i = rg() % records.size();
+      std::string record(records[i].size(), '\0');
+      is.seekg(offsets[i]);
+      is.read(&record[0], record.size());
+      if (!is.good() || record != records[i])
+      {
+        std::cerr << "FAILED tellp seek to record " << i << " (" << offsets[i] << ")" << std::endl;
+        return false;
+      }
+    }
+
+    std::vector<sw::block_info> blocks;
+    FILE* fp = fopen(file_.c_str(), "rb");
+    bool scanned = fp && sw::bgzf::scan_blocks(fp, blocks);
+    if (fp)
+      fclose(fp);
+
+    std::ifstream gzi(file_ + ".gzi", std::ios::binary);
+    std::uint64_t entry_count = read_uint64(gzi);
+    if (!scanned || blocks.size() < 3 || entry_count != blocks.size() - 2) // first and EOF blocks are not listed.
+    {
+      std::cerr << "FAILED gzi entry count" << std::endl;
+      return false;
+    }
+
+    for (std::size_t i = 1; i + 1 < blocks.size(); ++i)
+    {
+      std::uint64_t compressed_offset = read_uint64(gzi);
+      std::uint64_t uncompressed_offset = read_uint64(gzi);
+      if (!gzi || compressed_offset != blocks[i].compressed_offset || uncompressed_offset != blocks[i].uncompressed_offset)
+      {
+        std::cerr << "FAILED gzi entry " << i << std::endl;
+        return false;
+      }
+    }
+
+    return true;
+  }
+private:
+  static std::uint64_t read_uint64(std::istream& is)
+  {
+    std::array<unsigned char, 8> buf{};
+    is.read((char*) buf.data(), buf.size());
+    std::uint64_t ret = 0;
+    for (std::size_t i = buf.size(); i > 0; --i)
+      ret = (ret << 8) | buf[i - 1];
+    return ret;
+  }
+private:
+  std::string file_;
+};
+
+class record_index_test
+{
+public:
+  record_index_test(const std::string& file_path, bool sorted, bool eof_marker = true) : file_(file_path), sorted_(sorted), eof_marker_(eof_marker) {}
+
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::vector<std::pair<std::uint64_t, std::string>> records;
+
+    {
+      sw::bgzf::ostream os(file_);
+      for (std::size_t i = 0; i < 20000 && os.good(); ++i)
+      {
+        std::uint64_t key = sorted_ ? i * 3 : rg() % 60000;
+        std::string record = std::to_string(key) + "\t";
+        std::size_t len = rg() % 64;
+        for (std::size_t j = 0; j < len; ++j)
+          record.push_back(char('a' + rg() % 26));
+        records.push_back(std::make_pair(key, record));
+        os << record << "\n";
+      }
+      if (!os.good())
+      {
+        std::cerr << "FAILED to write " << file_ << std::endl;
+        return false;
+      }
+    }
+
+    if (!eof_marker_)
+    {
+      // Drops the empty block that ends BGZF files, as some writers do.
+      std::ifstream ifs(file_, std::ios::binary);
+      std::string contents((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+      ifs.close();
+      std::ofstream(file_, std::ios::binary).write(contents.data(), contents.size() - 28);
+    }
+
+    {
+      sw::bgzf::record_index<std::uint64_t> built = sw::bgzf::record_index<std::uint64_t>::build(file_, key_of);
+      if (built.sorted() != sorted_ || built.size() < 2 || !built.save(file_ + ".swi"))
+      {
+        std::cerr << "FAILED to build index for " << file_ << std::endl;
+        return false;
+      }
+    }
+
+    sw::bgzf::record_index<std::uint64_t> index = sw::bgzf::record_index<std::uint64_t>::load(file_ + ".swi");
+    for (std::size_t k = 0; k <= 64; ++k)
+    {
+      std::uint64_t lo = rg() % 60000;
+      std::uint64_t hi = lo + rg() % 600;
+      if (k == 64) // every record, including those of the last block.
+      {
+        lo = 0;
+        hi = std::numeric_limits<std::uint64_t>::max();
+      }
+      std::vector<std::string> expected;
+      for (auto it = records.begin(); it != records.end(); ++it)
+      {
+        if (it->first >= lo && it->first <= hi)
+          expected.push_back(it->second);
+      }
+
+      std::vector<std::string> found;
+      auto cur = index.query(file_, lo, hi, key_of);
+      for (auto it = cur.begin(); it != cur.end(); ++it)
+        found.push_back(*it);
+
+      if (found != expected)
+      {
+        std::cerr << "FAILED query [" << lo << ", " << hi << "] on " << file_ << ": " << found.size() << " != " << expected.size() << std::endl;
+        return false;
+      }
+    }
+
+    return true;
+  }
+private:
+  static std::uint64_t key_of(const char* data, std::size_t size)
+  {
+    std::uint64_t ret = 0;
+    for (std::size_t i = 0; i < size && data[i] != '\t'; ++i)
+      ret = ret * 10 + std::uint64_t(data[i] - '0');
+    return ret;
+  }
+private:
+  std::string file_;
+  bool sorted_;
+  bool eof_marker_;
+};
+
+class adaptive_level_test
+{
+public:
+  bool operator()()
+  {
+    typedef std::chrono::milliseconds ms;
+    sw::detail::level_controller ctl(3, 1, 5, true);
+    if (!ctl.update(ms(1), ms(10), ms(1)) || ctl.level() != 2)
+    {
+      std::cerr << "FAILED to lower level when compression is the bottleneck" << std::endl;
+      return false;
+    }
+    if (!ctl.update(ms(1), ms(10), ms(1)) || ctl.update(ms(1), ms(10), ms(1)) || ctl.level() != 1)
+    {
+      std::cerr << "FAILED to stop at min_level" << std::endl;
+      return false;
+    }
+    if (!ctl.update(ms(20), ms(1), ms(0)) || !ctl.update(ms(0), ms(1), ms(20)) || ctl.level() != 3)
+    {
+      std::cerr << "FAILED to raise level when idle or drain bound" << std::endl;
+      return false;
+    }
+    if (ctl.update(ms(3), ms(2), ms(0)) || ctl.level() != 3)
+    {
+      std::cerr << "FAILED to hold level when balanced" << std::endl;
+      return false;
+    }
+
+    sw::zstd::obuf_options zstd_opts;
+    zstd_opts.adaptive_level = true;
+    zstd_opts.max_level = 9;
+    sw::gz::obuf_options gz_opts;
+    gz_opts.adaptive_level = true;
+    sw::bgzf::obuf_options bgzf_opts;
+    bgzf_opts.adaptive_level = true;
+
+    return round_trip<sw::zstd::istream, sw::zstd::ostream>("test_adaptive_level_file.txt.zst", zstd_opts)
+      && round_trip<sw::gz::istream, sw::gz::ostream>("test_adaptive_level_file.txt.gz", gz_opts)
+      && round_trip<sw::bgzf::istream, sw::bgzf::ostream>("test_adaptive_level_file.txt.bgzf", bgzf_opts)
+      && adapts_without_flush("test_adaptive_level_unflushed_file.txt.zst");
+  }
+private:
+  // A slow producer leaves zstd idle, so the level rises without a flush.
+  static bool adapts_without_flush(const std::string& file_path)
+  {
+    std::string expected;
+    for (std::size_t i = 0; expected.size() < 16 * ZSTD_BLOCKSIZE_MAX; ++i)
+    {
+      expected += std::to_string(i * 7919 % 100000);
+      expected.push_back(i % 16 ? ' ' : '\n');
+    }
+
+    sw::zstd::obuf_options opts;
+    opts.adaptive_level = true;
+    opts.compression_level = 1;
+    opts.max_level = 9;
+    int level = 0;
+    {
+      sw::zstd::obuf buf(file_path, opts);
+      std::ostream os(&buf);
+      for (std::size_t pos = 0; pos < expected.size() && os.good(); pos += ZSTD_BLOCKSIZE_MAX / 2)
+      {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        os.write(&expected[pos], std::min<std::size_t>(ZSTD_BLOCKSIZE_MAX / 2, expected.size() - pos));
+      }
+      level = buf.compression_level();
+      if (!os.good() || level <= 1)
+      {
+        std::cerr << "FAILED to adapt the level without a flush (level " << level << ")" << std::endl;
+        return false;
+      }
+    }
+
+    sw::zstd::istream is(file_path);
+    std::string found((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    if (found != expected)
+    {
+      std::cerr << "FAILED round trip after adapting the level to " << level << std::endl;
+      return false;
+    }
+
+    // zstd sizes the window from the level: 2^19 at level 1, 2^20 at level 2
+    // and 2^21 or more above that. A level change mid-stream must start a
+    // frame with a larger window than the first one.
+    std::string compressed = read_file(file_path);
+    std::vector<std::uint64_t> windows;
+    for (std::size_t pos = 0; pos < compressed.size();)
+    {
+      ZSTD_frameHeader frame_header;
+      std::size_t frame_size = ZSTD_findFrameCompressedSize(&compressed[pos], compressed.size() - pos);
+      if (ZSTD_isError(frame_size) || ZSTD_getFrameHeader(&frame_header, &compressed[pos], compressed.size() - pos) != 0)
+      {
+        std::cerr << "FAILED to parse frame at " << pos << " of " << file_path << std::endl;
+        return false;
+      }
+      windows.push_back(frame_header.windowSize);
+      pos += frame_size;
+    }
+    if (windows.empty() || *std::max_element(windows.begin(), windows.end()) <= windows.front())
+    {
+      std::cerr << "FAILED to compress at the adapted level (" << windows.size() << " frames)" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  template <typename InT, typename OutT, typename OptT>
+  static bool round_trip(const std::string& file_path, const OptT& opts)
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string expected;
+    for (std::size_t i = 0; i < 200000; ++i)
+    {
+      expected += std::to_string(rg() % 1000);
+      expected.push_back(i % 16 ? ' ' : '\n');
+    }
+
+    {
+      OutT os(file_path, opts);
+      for (std::size_t pos = 0; pos < expected.size() && os.good(); pos += 4096)
+      {
+        os.write(&expected[pos], std::min<std::size_t>(4096, expected.size() - pos));
+        if (pos % (64 * 4096) == 0)
+          os.flush(); // zstd frame boundary
+      }
+      if (!os.good())
+      {
+        std::cerr << "FAILED to write " << file_path << std::endl;
+        return false;
+      }
+    }
+
+    InT is(file_path);
+    std::string found((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    if (found != expected)
+    {
+      std::cerr << "FAILED adaptive level round trip for " << file_path << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+class transcode_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string expected;
+    for (std::size_t i = 0; i < 400000; ++i)
+    {
+      expected += std::to_string(rg() % 10000);
+      expected.push_back(i % 8 ? '\t' : '\n');
+    }
+
+    {
+      sw::gz::ostream os("test_transcode_file.txt.gz");
+      os.write(expected.data(), expected.size());
+    }
+
+    sw::transcode_options opts;
+    opts.thread_count = 3;
+    opts.queue_depth = 2;
+    const char* chain[] = {"test_transcode_file.txt.gz", "test_transcode_file.txt.zst", "test_transcode_file.txt.bgz", "test_transcode_file.txt.xz", "test_transcode_file_2.txt.bgz", "test_transcode_file_2.txt.gz"};
+    for (std::size_t i = 1; i < sizeof(chain) / sizeof(chain[0]); ++i)
+    {
+      if (!sw::transcode(chain[i - 1], chain[i], opts))
+      {
+        std::cerr << "FAILED to transcode " << chain[i - 1] << " to " << chain[i] << std::endl;
+        return false;
+      }
+
+      sw::istream is(chain[i]);
+      std::string found((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+      if (found != expected)
+      {
+        std::cerr << "FAILED transcoded content mismatch in " << chain[i] << std::endl;
+        return false;
+      }
+    }
+
+    std::vector<sw::block_info> blocks;
+    FILE* fp = fopen("test_transcode_file.txt.bgz", "rb");
+    bool scanned = fp && sw::bgzf::scan_blocks(fp, blocks);
+    if (fp)
+      fclose(fp);
+    if (!scanned || !sw::verify("test_transcode_file.txt.bgz") || !sw::verify("test_transcode_file.txt.zst"))
+    {
+      std::cerr << "FAILED to verify transcoded output" << std::endl;
+      return false;
+    }
+
+    if (sw::transcode("test_transcode_missing_file.gz", "test_transcode_file_3.txt.zst", opts))
+      return false;
+
+    // Noise repeated at a distance the probe's samples don't span looks
+    // incompressible, but zstd finds the repeats when the probe is disabled.
+    std::string noise(200003, '\0');
+    for (auto it = noise.begin(); it != noise.end(); ++it)
+      *it = char(rg());
+    {
+      sw::gz::ostream os("test_transcode_noise_file.gz");
+      for (std::size_t i = 0; i < 5; ++i)
+        os.write(noise.data(), noise.size());
+    }
+    opts.detect_incompressible = false;
+    bool compressed = sw::transcode("test_transcode_noise_file.gz", "test_transcode_noise_file.zst", opts);
+    opts.detect_incompressible = true;
+    bool stored = sw::transcode("test_transcode_noise_file.gz", "test_transcode_noise_file_stored.zst", opts);
+    if (!compressed || !stored || file_size("test_transcode_noise_file.zst") * 2 >= file_size("test_transcode_noise_file_stored.zst"))
+    {
+      std::cerr << "FAILED to transcode without the incompressible probe" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+private:
+  static std::size_t file_size(const std::string& file_path)
+  {
+    struct stat st;
+    return stat(file_path.c_str(), &st) == 0 ? std::size_t(st.st_size) : 0;
+  }
+};
+
+class zstd_parallel_read_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string expected;
+    for (std::size_t i = 0; i < 300000; ++i)
+    {
+      expected += std::to_string(rg() % 100000);
+      expected.push_back(i % 12 ? ',' : '\n');
+    }
+
+    {
+      // Streamed frames without a content size, split on random flushes.
+      sw::zstd::ostream os("test_parallel_read_file.txt.zst");
+      for (std::size_t pos = 0; pos < expected.size() && os.good(); pos += 1000)
+      {
+        os.write(&expected[pos], std::min<std::size_t>(1000, expected.size() - pos));
+        if (rg() % 50 == 0)
+          os.flush();
+      }
+    }
+
+    sw::transcode_options transcode_opts;
+    transcode_opts.thread_count = 2;
+    if (!sw::transcode("test_parallel_read_file.txt.zst", "test_parallel_read_file_sized.txt.zst", transcode_opts)) // frames with a content size.
+    {
+      std::cerr << "FAILED to write test_parallel_read_file_sized.txt.zst" << std::endl;
+      return false;
+    }
+
+    const char* files[] = {"test_parallel_read_file.txt.zst", "test_parallel_read_file_sized.txt.zst"};
+    for (std::size_t i = 0; i < 2; ++i)
+    {
+      sw::zstd::parallel_ibuf_options opts;
+      opts.thread_count = 3;
+      opts.max_frames_in_flight = 4;
+      sw::zstd::parallel_istream is(files[i], opts);
+      std::string found((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+      if (found != expected || is.failed())
+      {
+        std::cerr << "FAILED parallel read of " << files[i] << std::endl;
+        return false;
+      }
+    }
+
+    {
+      std::ifstream src("test_parallel_read_file.txt.zst", std::ios::binary);
+      std::string contents((std::istreambuf_iterator<char>(src)), std::istreambuf_iterator<char>());
+      std::ofstream truncated("test_parallel_read_file_truncated.txt.zst", std::ios::binary);
+      truncated.write(contents.data(), contents.size() - 10);
+    }
+
+    sw::zstd::parallel_istream is("test_parallel_read_file_truncated.txt.zst");
+    std::string found((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    if (!is.failed() || found.size() >= expected.size() || expected.compare(0, found.size(), found) != 0)
+    {
+      std::cerr << "FAILED to detect truncated frame" << std::endl;
+      return false;
+    }
+
+    {
+      // A good frame, then one whose header claims 1 TiB for a 5 byte block.
+      std::string forged;
+      sw::detail::zstd_write_raw_frame(reinterpret_cast<const std::uint8_t*>("hello"), 5, [&forged](const void* data, std::size_t size) { forged.append(static_cast<const char*>(data), size); return true; });
+      const char header[] = {'\x28', '\xb5', '\x2f', '\xfd', '\xe0', 0, 0, 0, 0, 0, 1, 0, 0}; // single segment, 8 byte content size
+      forged.append(header, sizeof(header));
+      std::uint32_t bh = 1 | (5 << 3); // last raw block of 5 bytes
+      forged.push_back(char(bh));
+      forged.push_back(char(bh >> 8));
+      forged.push_back(char(bh >> 16));
+      forged += "world";
+      std::ofstream("test_parallel_read_file_forged.zst", std::ios::binary).write(forged.data(), forged.size());
+    }
+
+    sw::zstd::parallel_istream forged_is("test_parallel_read_file_forged.zst");
+    found.assign((std::istreambuf_iterator<char>(forged_is)), std::istreambuf_iterator<char>());
+    if (!forged_is.failed() || found != "hello")
+    {
+      std::cerr << "FAILED to reject a forged content size" << std::endl;
+      return false;
+    }
+
+    return true;
+  }
+};
+
+class zstd_offset_seek_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string expected;
+    for (std::size_t i = 0; i < 400000; ++i)
+    {
+      expected += std::to_string(rg() % 100000);
+      expected.push_back(i % 10 ? ' ' : '\n');
+    }
+
+    {
+      sw::zstd::ostream os("test_offset_seek_file.txt.zst");
+      for (std::size_t pos = 0; pos < expected.size() && os.good(); pos += 1000)
+      {
+        os.write(&expected[pos], std::min<std::size_t>(1000, expected.size() - pos));
+        if (rg() % 100 == 0)
+          os.flush();
+      }
+    }
+
+    // transcode() records content sizes, so its frames can be skipped.
+    if (!sw::transcode("test_offset_seek_file.txt.zst", "test_offset_seek_file_sized.txt.zst"))
+    {
+      std::cerr << "FAILED to write test_offset_seek_file_sized.txt.zst" << std::endl;
+      return false;
+    }
+
+    const char* files[] = {"test_offset_seek_file.txt.zst", "test_offset_seek_file_sized.txt.zst"};
+    for (std::size_t f = 0; f < 2; ++f)
+    {
+      sw::zstd::istream is(files[f]);
+      std::string buf(100, '\0');
+      for (std::size_t k = 0; k < 32; ++k)
+      {
+        std::size_t target = rg() % (expected.size() - buf.size());
+        is.seek_uncompressed(target);
+        is.read(&buf[0], buf.size());
+        if (!is.good() || expected.compare(target, buf.size(), buf) != 0)
+        {
+          std::cerr << "FAILED seek_uncompressed(" << target << ") in " << files[f] << std::endl;
+          return false;
+        }
+
+        // seekg() takes the compressed frame offsets that tellg() reports,
+        // with either overload.
+        std::streampos frame = is.tellg();
+        std::string by_pos(buf.size(), '\0');
+        std::string by_off(buf.size(), '\0');
+        is.seekg(frame);
+        is.read(&by_pos[0], by_pos.size());
+        is.seekg(std::streamoff(frame), std::ios::beg);
+        is.read(&by_off[0], by_off.size());
+        if (!is.good() || by_pos != by_off)
+        {
+          std::cerr << "FAILED seekg(" << std::streamoff(frame) << ", beg) to match seekg(pos) in " << files[f] << std::endl;
+          return false;
+        }
+
+        is.seek_uncompressed(target + buf.size());
+        std::size_t skip = rg() % (2 * 1024 * 1024);
+        target += buf.size() + skip;
+        is.skip_uncompressed(skip);
+        if (target + buf.size() > expected.size())
+        {
+          if (target > expected.size() && is.good())
+          {
+            std::cerr << "FAILED to reject seek past the end in " << files[f] << std::endl;
+            return false;
+          }
+          is.clear();
+          continue;
+        }
+
+        is.read(&buf[0], buf.size());
+        if (!is.good() || expected.compare(target, buf.size(), buf) != 0)
+        {
+          std::cerr << "FAILED skip_uncompressed(" << skip << ") to " << target << " in " << files[f] << std::endl;
+          return false;
+        }
+      }
+    }
+
+    return true;
+  }
+};
+
+class record_reader_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+
+    std::vector<char> haystack(300);
+    for (std::size_t k = 0; k < 2000; ++k)
+    {
+      for (auto it = haystack.begin(); it != haystack.end(); ++it)
+        *it = char('a' + rg() % 26);
+      std::size_t offset = rg() % 64;
+      std::size_t size = rg() % (haystack.size() - offset);
+      if (rg() % 2 && size)
+        haystack[offset + rg() % size] = '\n';
+      if (sw::detail::find_byte(haystack.data() + offset, size, '\n') != std::memchr(haystack.data() + offset, '\n', size))
+      {
+        std::cerr << "FAILED find_byte at offset " << offset << " size " << size << std::endl;
+        return false;
+      }
+    }
+
+    std::string contents;
+    for (std::size_t i = 0; i < 20000; ++i)
+    {
+      // Mostly short records with a few that span several buffer refills.
+      std::size_t len = rg() % 1000 == 0 ? 50000 + rg() % 100000 : rg() % 120;
+      for (std::size_t j = 0; j < len; ++j)
+        contents.push_back(j % 7 == 6 ? '\t' : char('a' + rg() % 26));
+      contents.push_back('\n');
+    }
+    contents += "unterminated";
+
+    return run<sw::gz::istream, sw::gz::ostream>("test_record_reader_file.txt.gz", contents, '\n')
+      && run<sw::bgzf::istream, sw::bgzf::ostream>("test_record_reader_file.txt.bgzf", contents, '\n')
+      && run<sw::xz::istream, sw::xz::ostream>("test_record_reader_file.txt.xz", contents, '\t')
+      && run<sw::zstd::istream, sw::zstd::ostream>("test_record_reader_file.txt.zst", contents, '\t');
+  }
+private:
+  template <typename InT, typename OutT>
+  static bool run(const std::string& file_path, const std::string& contents, char delimiter)
+  {
+    {
+      OutT os(file_path);
+      os.write(contents.data(), contents.size());
+    }
+
+    std::vector<std::string> expected;
+    {
+      std::istringstream is(contents);
+      std::string line;
+      while (std::getline(is, line, delimiter))
+        expected.push_back(line);
+    }
+
+    InT is(file_path);
+    sw::record_reader reader(is, delimiter);
+    sw::record_view rec;
+    std::size_t i = 0;
+    for ( ; reader.next(rec); ++i)
+    {
+      if (i >= expected.size() || rec.str() != expected[i])
+      {
+        std::cerr << "FAILED record " << i << " in " << file_path << std::endl;
+        return false;
+      }
+    }
+
+    if (i != expected.size())
+    {
+      std::cerr << "FAILED record count in " << file_path << ": " << i << " != " << expected.size() << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+class map_reduce_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string contents;
+    std::uint64_t record_count = 0;
+    while (contents.size() < 3 * 1024 * 1024)
+    {
+      std::size_t len = rg() % 200 == 0 ? 70000 + rg() % 70000 : rg() % 300;
+      for (std::size_t j = 0; j < len; ++j)
+        contents.push_back(char('a' + rg() % 26));
+      contents.push_back('\n');
+      ++record_count;
+    }
+    contents += "last";
+    ++record_count;
+
+    return run<sw::bgzf::ostream>("test_map_reduce_file.txt.bgzf", contents, record_count)
+      && run<sw::xz::ostream>("test_map_reduce_file.txt.xz", contents, record_count)
+      && run<sw::zstd::ostream>("test_map_reduce_file.txt.zst", contents, record_count)
+      && run<sw::gz::ostream>("test_map_reduce_file.txt.gz", contents, record_count);
+  }
+private:
+  typedef std::pair<std::uint64_t, std::uint64_t> count_pair;
+
+  template <typename OutT>
+  static bool run(const std::string& file_path, const std::string& contents, std::uint64_t record_count)
+  {
+    {
+      OutT os(file_path);
+      for (std::size_t pos = 0; pos < contents.size() && os.good(); pos += 100000)
+      {
+        os.write(&contents[pos], std::min<std::size_t>(100000, contents.size() - pos));
+        os.flush(); // new xz block / zstd frame
+      }
+    }
+
+    auto add = [](const count_pair& a, const count_pair& b) { return count_pair(a.first + b.first, a.second + b.second); };
+
+    sw::map_reduce_options opts;
+    opts.thread_count = 3;
+    count_pair raw = sw::map_reduce(file_path, count_pair(0, 0), [](const char* data, std::size_t size, std::uint64_t)
+    {
+      return count_pair(std::count(data, data + size, '\n'), size);
+    }, add, opts);
+
+    if (raw.first != record_count - 1 || raw.second != contents.size())
+    {
+      std::cerr << "FAILED raw map_reduce over " << file_path << std::endl;
+      return false;
+    }
+
+    // Every record must arrive whole, exactly once, at its uncompressed offset.
+    opts.split_records = true;
+    count_pair records = sw::map_reduce(file_path, count_pair(0, 0), [&contents](const char* data, std::size_t size, std::uint64_t offset)
+    {
+      count_pair ret(0, 0);
+      const char* end = data + size;
+      while (data < end)
+      {
+        const char* eol = std::find(data, end, '\n');
+        std::size_t len = std::size_t(eol - data) + (eol < end ? 1 : 0);
+        bool whole = (eol < end || offset + len == contents.size());
+        if (!whole || (offset != sw::block_info::unknown_size && contents.compare(offset, len, data, len) != 0))
+          return count_pair(0, 0);
+        ++ret.first;
+        ret.second += len;
+        data += len;
+        if (offset != sw::block_info::unknown_size)
+          offset += len;
+      }
+      return ret;
+    }, add, opts);
+
+    if (records.first != record_count || records.second != contents.size())
+    {
+      std::cerr << "FAILED record map_reduce over " << file_path << ": " << records.first << " != " << record_count << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+class make_splits_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string contents;
+    while (contents.size() < 2 * 1024 * 1024)
+      contents.push_back(char('a' + rg() % 26));
+
+    return run<sw::bgzf::ostream>("test_splits_file.txt.bgzf", contents, 7)
+      && run<sw::xz::ostream>("test_splits_file.txt.xz", contents, 4)
+      && run<sw::zstd::ostream>("test_splits_file.txt.zst", contents, 5)
+      && run<sw::zstd::ostream>("test_splits_file_100.txt.zst", contents, 100)
+      && run<sw::gz::ostream>("test_splits_file.txt.gz", contents, 3);
+  }
+private:
+  template <typename OutT>
+  static bool run(const std::string& file_path, const std::string& contents, std::size_t split_count)
+  {
+    {
+      OutT os(file_path);
+      for (std::size_t pos = 0; pos < contents.size() && os.good(); pos += 100000)
+      {
+        os.write(&contents[pos], std::min<std::size_t>(100000, contents.size() - pos));
+        os.flush(); // new xz block / zstd frame
+      }
+    }
+
+    std::vector<sw::block_info> splits = sw::make_splits(file_path, split_count);
+    if (splits.empty() || splits.size() > split_count)
+    {
+      std::cerr << "FAILED split count for " << file_path << ": " << splits.size() << std::endl;
+      return false;
+    }
+
+    std::string joined;
+    std::uint64_t next_compressed = splits.front().compressed_offset;
+    for (auto it = splits.begin(); it != splits.end(); ++it)
+    {
+      if (it->compressed_offset != next_compressed || (it->uncompressed_offset != sw::block_info::unknown_size && it->uncompressed_offset != joined.size()))
+      {
+        std::cerr << "FAILED split offsets for " << file_path << std::endl;
+        return false;
+      }
+      next_compressed = it->compressed_offset + it->compressed_size;
+
+      sw::split_istream is(file_path, *it);
+      std::string part((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+      if (is.failed() || (it->uncompressed_size != sw::block_info::unknown_size && it->uncompressed_size != part.size()))
+      {
+        std::cerr << "FAILED reading split at " << it->compressed_offset << " of " << file_path << std::endl;
+        return false;
+      }
+      joined += part;
+
+      sw::block_info cut = *it;
+      cut.compressed_size -= 20;
+      sw::split_istream cut_is(file_path, cut);
+      std::string cut_part((std::istreambuf_iterator<char>(cut_is)), std::istreambuf_iterator<char>());
+      if (!cut_is.failed())
+      {
+        std::cerr << "FAILED to report truncated split at " << it->compressed_offset << " of " << file_path << std::endl;
+        return false;
+      }
+    }
+
+    if (joined != contents)
+    {
+      std::cerr << "FAILED split contents for " << file_path << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+class stream_move_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string contents;
+    while (contents.size() < 512 * 1024)
+      contents.push_back(char('a' + rg() % 26));
+
+    return run<sw::gz::istream, sw::gz::ostream>("test_stream_move_file.txt.gz", contents)
+      && run<sw::bgzf::istream, sw::bgzf::ostream>("test_stream_move_file.txt.bgzf", contents)
+      && run<sw::xz::istream, sw::xz::ostream>("test_stream_move_file.txt.xz", contents)
+      && run<sw::zstd::istream, sw::zstd::ostream>("test_stream_move_file.txt.zst", contents);
+  }
+private:
+  template <typename InT, typename OutT>
+  static bool run(const std::string& file_path, const std::string& contents)
+  {
+    std::size_t half = contents.size() / 2;
+    {
+      OutT first(file_path);
+      first.write(contents.data(), half);
+      OutT moved(std::move(first));
+      OutT assigned(file_path + ".tmp");
+      assigned = std::move(moved);
+      assigned.write(contents.data() + half, contents.size() - half);
+    }
+
+    InT first(file_path);
+    std::string head(half, '\0');
+    first.read(&head[0], head.size());
+    InT moved(std::move(first));
+    InT assigned(file_path + ".tmp");
+    assigned = std::move(moved);
+    std::string tail((std::istreambuf_iterator<char>(assigned)), std::istreambuf_iterator<char>());
+
+    if (head + tail != contents)
+    {
+      std::cerr << "FAILED moving streams of " << file_path << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+class memory_resource_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string contents;
+    while (contents.size() < 512 * 1024)
+      contents.push_back(char('a' + rg() % 4));
+
+    return run<sw::gz::istream, sw::gz::ostream, sw::gz::ibuf_options, sw::gz::obuf_options>("test_memory_resource_file.txt.gz", contents)
+      && run<sw::bgzf::istream, sw::bgzf::ostream, sw::bgzf::ibuf_options, sw::bgzf::obuf_options>("test_memory_resource_file.txt.bgzf", contents)
+      && run<sw::xz::istream, sw::xz::ostream, sw::xz::ibuf_options, sw::xz::obuf_options>("test_memory_resource_file.txt.xz", contents)
+      && run<sw::zstd::istream, sw::zstd::ostream, sw::zstd::ibuf_options, sw::zstd::obuf_options>("test_memory_resource_file.txt.zst", contents)
+      && run<sw::zstd::parallel_istream, sw::zstd::ostream, sw::zstd::parallel_ibuf_options, sw::zstd::obuf_options>("test_memory_resource_file_parallel.txt.zst", contents, 0);
+  }
+private:
+  template <typename InT, typename OutT, typename InOpts, typename OutOpts>
+  static bool run(const std::string& file_path, const std::string& contents, std::size_t read_buffer_count = 2)
+  {
+    counting_resource write_resource;
+    {
+      OutOpts opts;
+      opts.resource = &write_resource;
+      OutT os(file_path, opts);
+      for (std::size_t pos = 0; pos < contents.size(); pos += 100000)
+      {
+        os.write(&contents[pos], std::min<std::size_t>(100000, contents.size() - pos));
+        os.flush();
+      }
+    }
+
+    // More than the two stream buffers means the codec allocated through it too.
+    if (write_resource.allocations <= 2 || write_resource.outstanding != 0)
+    {
+      std::cerr << "FAILED write allocations for " << file_path << ": " << write_resource.allocations << " allocations, " << write_resource.outstanding << " bytes outstanding" << std::endl;
+      return false;
+    }
+
+    counting_resource read_resource;
+    {
+      InOpts opts;
+      opts.resource = &read_resource;
+      InT is(file_path, opts);
+      std::string decoded((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+      if (decoded != contents)
+      {
+        std::cerr << "FAILED reading " << file_path << " with a memory resource" << std::endl;
+        return false;
+      }
+    }
+
+    if (read_resource.allocations <= read_buffer_count || read_resource.outstanding != 0)
+    {
+      std::cerr << "FAILED read allocations for " << file_path << ": " << read_resource.allocations << " allocations, " << read_resource.outstanding << " bytes outstanding" << std::endl;
+      return false;
+    }
+
+    counting_resource generic_resource;
+    {
+      sw::istream is(file_path, &generic_resource);
+      std::string decoded((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+      if (decoded != contents || generic_resource.allocations <= 2)
+      {
+        std::cerr << "FAILED reading " << file_path << " through the generic istream with a memory resource" << std::endl;
+        return false;
+      }
+    }
+    return generic_resource.outstanding == 0;
+  }
+};
+
+class memory_budget_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string contents;
+    while (contents.size() < 512 * 1024)
+      contents.push_back(char('a' + rg() % 4));
+
+    return xz_limits(contents) && zstd_limits(contents) && shared_budget(contents);
+  }
+private:
+  template <typename InT, typename InOpts>
+  static bool read_back(const std::string& file_path, const std::string& contents, std::uint64_t memory_limit)
+  {
+    InOpts opts;
+    opts.memory_limit = memory_limit;
+    InT is(file_path, opts);
+    std::string decoded((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    return decoded == contents;
+  }
+
+  static bool xz_limits(const std::string& contents)
+  {
+    const std::uint64_t limit = 16 * 1024 * 1024;
+    {
+      sw::xz::ostream os("test_memory_budget_file.txt.xz");
+      os.write(contents.data(), contents.size());
+      if (os.memory_usage() <= limit)
+      {
+        std::cerr << "FAILED xz default preset reports " << os.memory_usage() << " bytes" << std::endl;
+        return false;
+      }
+    }
+
+    {
+      sw::xz::obuf_options opts;
+      opts.memory_limit = limit;
+      sw::xz::ostream os("test_memory_budget_file_limited.txt.xz", opts);
+      os.write(contents.data(), contents.size());
+      if (!os.good() || os.memory_usage() > limit + 64 * 1024)
+      {
+        std::cerr << "FAILED xz encoder over its limit: " << os.memory_usage() << " bytes" << std::endl;
+        return false;
+      }
+    }
+
+    if (!read_back<sw::xz::istream, sw::xz::ibuf_options>("test_memory_budget_file_limited.txt.xz", contents, limit))
+    {
+      std::cerr << "FAILED reading xz file written under a limit" << std::endl;
+      return false;
+    }
+
+    // Preset 6 uses an 8 MiB dictionary.
+    if (read_back<sw::xz::istream, sw::xz::ibuf_options>("test_memory_budget_file.txt.xz", contents, 1024 * 1024))
+    {
+      std::cerr << "FAILED xz reader ignored its limit" << std::endl;
+      return false;
+    }
+
+    sw::xz::istream is("test_memory_budget_file.txt.xz");
+    is.get();
+    if (is.memory_usage() <= 8 * 1024 * 1024)
+    {
+      std::cerr << "FAILED xz reader reports " << is.memory_usage() << " bytes" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  static bool zstd_limits(const std::string& contents)
+  {
+    const std::uint64_t limit = 4 * 1024 * 1024;
+    {
+      sw::zstd::obuf_options opts;
+      opts.compression_level = 19;
+      sw::zstd::ostream os("test_memory_budget_file.txt.zst", opts);
+      os.write(contents.data(), contents.size());
+      if (os.memory_usage() <= limit)
+      {
+        std::cerr << "FAILED zstd level 19 reports " << os.memory_usage() << " bytes" << std::endl;
+        return false;
+      }
+    }
+
+    {
+      sw::zstd::obuf_options opts;
+      opts.compression_level = 19;
+      opts.memory_limit = limit;
+      sw::zstd::ostream os("test_memory_budget_file_limited.txt.zst", opts);
+      for (std::size_t pos = 0; pos < contents.size(); pos += 100000)
+      {
+        os.write(&contents[pos], std::min<std::size_t>(100000, contents.size() - pos));
+        os.flush();
+      }
+      if (!os.good() || os.memory_usage() > limit + 512 * 1024)
+      {
+        std::cerr << "FAILED zstd encoder over its limit: " << os.memory_usage() << " bytes" << std::endl;
+        return false;
+      }
+    }
+
+    if (!read_back<sw::zstd::istream, sw::zstd::ibuf_options>("test_memory_budget_file_limited.txt.zst", contents, limit))
+    {
+      std::cerr << "FAILED reading zstd file written under a limit" << std::endl;
+      return false;
+    }
+
+    // Level 19 uses an 8 MiB window.
+    if (read_back<sw::zstd::istream, sw::zstd::ibuf_options>("test_memory_budget_file.txt.zst", contents, limit))
+    {
+      std::cerr << "FAILED zstd reader ignored its limit" << std::endl;
+      return false;
+    }
+
+    sw::zstd::istream is("test_memory_budget_file.txt.zst");
+    is.get();
+    if (is.memory_usage() <= 2 * ZSTD_BLOCKSIZE_MAX)
+    {
+      std::cerr << "FAILED zstd reader reports " << is.memory_usage() << " bytes" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  static bool shared_budget(const std::string& contents)
+  {
+    sw::memory_budget budget(64 * 1024 * 1024);
+    {
+      sw::zstd::obuf_options opts;
+      opts.resource = &budget;
+      sw::zstd::ostream a("test_memory_budget_file_a.txt.zst", opts);
+      sw::zstd::ostream b("test_memory_budget_file_b.txt.zst", opts);
+      a.write(contents.data(), contents.size());
+      b.write(contents.data(), contents.size());
+      a.flush();
+      b.flush();
+      if (!a.good() || !b.good() || budget.in_use() < a.memory_usage() || budget.in_use() > budget.limit())
+      {
+        std::cerr << "FAILED shared budget accounting: " << budget.in_use() << " bytes in use" << std::endl;
+        return false;
+      }
+    }
+
+    if (budget.in_use() != 0 || budget.peak() == 0)
+    {
+      std::cerr << "FAILED shared budget leaves " << budget.in_use() << " bytes in use" << std::endl;
+      return false;
+    }
+
+    // Too small for the compression context, so writes fail.
+    sw::memory_budget small_budget(512 * 1024);
+    sw::zstd::obuf_options opts;
+    opts.resource = &small_budget;
+    opts.compression_level = 19;
+    try
+    {
+      sw::zstd::ostream os("test_memory_budget_file_small.txt.zst", opts);
+      os.write(contents.data(), contents.size());
+      os.flush();
+      if (os.good())
+      {
+        std::cerr << "FAILED writing past a memory budget" << std::endl;
+        return false;
+      }
+    }
+    catch (const std::bad_alloc&)
+    {
+      // The stream buffers alone did not fit.
+    }
+    return small_budget.in_use() == 0;
+  }
+};
+
+class zero_allocation_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string contents;
+    while (contents.size() < 2 * 1024 * 1024)
+      contents.push_back(char('a' + rg() % 4));
+
+    return run<sw::gz::istream, sw::gz::ostream, sw::gz::ibuf_options, sw::gz::obuf_options>("test_zero_allocation_file.txt.gz", contents)
+      && run<sw::bgzf::istream, sw::bgzf::ostream, sw::bgzf::ibuf_options, sw::bgzf::obuf_options>("test_zero_allocation_file.txt.bgzf", contents)
+      && run<sw::xz::istream, sw::xz::ostream, sw::xz::ibuf_options, sw::xz::obuf_options>("test_zero_allocation_file.txt.xz", contents)
+      && run<sw::zstd::istream, sw::zstd::ostream, sw::zstd::ibuf_options, sw::zstd::obuf_options>("test_zero_allocation_file.txt.zst", contents);
+  }
+private:
+  static const std::size_t chunk_size = 64 * 1024;
+  // Long enough for state that is set up lazily: zlib allocates its window the
+  // first time a member spans two reads of the compressed buffer.
+  static const std::size_t warm_up_chunks = 8;
+
+  // Allocations through the stream's resource (buffers and codec state) plus
+  // every other operator new.
+  static std::size_t allocation_count(const counting_resource& res)
+  {
+    return res.allocations + heap_allocation_count;
+  }
+
+  // Each flush ends a block, frame or deflate flush point, so every chunk after
+  // the warm-up runs the per-block setup again.
+  template <typename InT, typename OutT, typename InOpts, typename OutOpts>
+  static bool run(const std::string& file_path, const std::string& contents)
+  {
+    counting_resource write_resource;
+    {
+      OutOpts opts;
+      opts.resource = &write_resource;
+      OutT os(file_path, opts);
+      std::size_t before = 0;
+      for (std::size_t pos = 0; pos < contents.size(); pos += chunk_size)
+      {
+        if (pos == warm_up_chunks * chunk_size)
+          before = allocation_count(write_resource);
+        os.write(&contents[pos], std::min(chunk_size, contents.size() - pos));
+        os.flush();
+      }
+
+      if (!os.good() || allocation_count(write_resource) != before)
+      {
+        std::cerr << "FAILED " << (allocation_count(write_resource) - before) << " allocations after warm-up while writing " << file_path << std::endl;
+        return false;
+      }
+    }
+
+    counting_resource read_resource;
+    InOpts opts;
+    opts.resource = &read_resource;
+    InT is(file_path, opts);
+    std::string decoded(contents.size(), '\0');
+    is.read(&decoded[0], warm_up_chunks * chunk_size);
+    std::size_t before = allocation_count(read_resource);
+    for (std::size_t pos = warm_up_chunks * chunk_size; pos < contents.size(); pos += chunk_size)
+      is.read(&decoded[pos], std::min(chunk_size, contents.size() - pos));
+
+    if (allocation_count(read_resource) != before)
+    {
+      std::cerr << "FAILED " << (allocation_count(read_resource) - before) << " allocations after warm-up while reading " << file_path << std::endl;
+      return false;
+    }
+
+    if (!is.good() || decoded != contents)
+    {
+      std::cerr << "FAILED reading back " << file_path << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+const std::size_t zero_allocation_test::chunk_size;
+const std::size_t zero_allocation_test::warm_up_chunks;
+
+class lz4_options_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string contents;
+    while (contents.size() < 512 * 1024)
+      contents.push_back(char('a' + rg() % 4));
+
+    for (int mode = 0; mode < 4; ++mode)
+    {
+      sw::lz4::obuf_options opts;
+      opts.independent_blocks = (mode & 1) != 0;
+      opts.block_checksum = (mode & 2) != 0;
+      opts.compression_level = mode == 3 ? 9 : 0;
+      std::string file_path = "test_lz4_options_file_" + std::to_string(mode) + ".txt.lz4";
+      {
+        sw::lz4::ostream os(file_path, opts);
+        os.write(contents.data(), contents.size());
+      }
+
+      if (read(file_path, sw::lz4::ibuf_options()) != contents)
+      {
+        std::cerr << "FAILED lz4 round trip in mode " << mode << std::endl;
+        return false;
+      }
+    }
+
+    // Random bytes are stored in uncompressed blocks, so flipping one changes
+    // the content without breaking the block. The content checksum catches it
+    // unless checks are ignored.
+    const std::string file_path = "test_lz4_options_file_raw.lz4";
+    contents.clear();
+    while (contents.size() < 4096)
+      contents.push_back(char(rg()));
+    {
+      sw::lz4::ostream os(file_path);
+      os.write(contents.data(), contents.size());
+    }
+
+    {
+      std::fstream fs(file_path, std::ios::in | std::ios::out | std::ios::binary);
+      fs.seekg(-32, std::ios::end);
+      char c = char(fs.get());
+      fs.seekp(-32, std::ios::end);
+      fs.put(char(c ^ 0x01));
+    }
+
+    if (read(file_path, sw::lz4::ibuf_options()) == contents)
+    {
+      std::cerr << "FAILED lz4 content checksum did not catch corruption" << std::endl;
+      return false;
+    }
+
+    sw::lz4::ibuf_options ignore;
+    ignore.ignore_checks = true;
+    if (read(file_path, ignore).size() != contents.size())
+    {
+      std::cerr << "FAILED lz4 ignore_checks" << std::endl;
+      return false;
+    }
+    return true;
+  }
+private:
+  static std::string read(const std::string& file_path, const sw::lz4::ibuf_options& opts)
+  {
+    sw::lz4::istream is(file_path, opts);
+    return std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+  }
+};
+
+class flush_policy_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string contents;
+    for (std::size_t i = 0; contents.size() < 512 * 1024; ++i)
+    {
+      contents += std::to_string(rg() % 1000);
+      contents.push_back(i % 16 ? ' ' : '\n');
+    }
+
+    const sw::flush_mode modes[] = {sw::flush_mode::none, sw::flush_mode::sync, sw::flush_mode::full, sw::flush_mode::end_block};
+    for (std::size_t i = 0; i < 4; ++i)
+    {
+      for (std::size_t j = 0; j < 4; ++j)
+      {
+        std::string suffix = "_" + std::to_string(i) + std::to_string(j);
+        if (!round_trip<sw::gz::istream, sw::gz::ostream, sw::gz::obuf_options>("test_flush_policy_file" + suffix + ".txt.gz", contents, modes[i], modes[j])
+          || !round_trip<sw::xz::istream, sw::xz::ostream, sw::xz::obuf_options>("test_flush_policy_file" + suffix + ".txt.xz", contents, modes[i], modes[j])
+          || !round_trip<sw::zstd::istream, sw::zstd::ostream, sw::zstd::obuf_options>("test_flush_policy_file" + suffix + ".txt.zst", contents, modes[i], modes[j])
+          || !round_trip<sw::lz4::istream, sw::lz4::ostream, sw::lz4::obuf_options>("test_flush_policy_file" + suffix + ".txt.lz4", contents, modes[i], modes[j]))
+          return false;
+      }
+    }
+
+    // Sync markers on every full buffer only cost ratio.
+    if (file_size("test_flush_policy_file_00.txt.gz") >= file_size("test_flush_policy_file_01.txt.gz"))
+    {
+      std::cerr << "FAILED gz buffer-full sync flushes did not grow the file" << std::endl;
+      return false;
+    }
+
+    // LZ4F_flush keeps the history, so a full flush ends the lz4 frame.
+    if (file_size("test_flush_policy_file_02.txt.lz4") != file_size("test_flush_policy_file_03.txt.lz4"))
+    {
+      std::cerr << "FAILED lz4 full flushes did not end the frame" << std::endl;
+      return false;
+    }
+
+    return visible_after_flush<sw::gz::istream, sw::gz::ostream, sw::gz::obuf_options>("test_flush_visible_file.txt.gz", contents)
+      && visible_after_flush<sw::zstd::istream, sw::zstd::ostream, sw::zstd::obuf_options>("test_flush_visible_file.txt.zst", contents)
+      && visible_after_flush<sw::lz4::istream, sw::lz4::ostream, sw::lz4::obuf_options>("test_flush_visible_file.txt.lz4", contents);
+  }
+
+private:
+  static std::size_t file_size(const std::string& file_path)
+  {
+    struct stat st;
+    return stat(file_path.c_str(), &st) == 0 ? std::size_t(st.st_size) : 0;
+  }
+
+  template <typename InT, typename OutT, typename OptionsT>
+  static bool round_trip(const std::string& file_path, const std::string& contents, sw::flush_mode on_flush, sw::flush_mode on_buffer_full)
+  {
+    {
+      OptionsT opts;
+      opts.on_flush = on_flush;
+      opts.on_buffer_full = on_buffer_full;
+      OutT os(file_path, opts);
+      for (std::size_t pos = 0; pos < contents.size() && os.good(); pos += 10000)
+      {
+        os.write(&contents[pos], std::min<std::size_t>(10000, contents.size() - pos));
+        if (pos % 150000 == 0) // leaves room for the put area to fill in between.
+          os.flush();
+      }
+    }
+
+    InT is(file_path);
+    if (std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>()) != contents)
+    {
+      std::cerr << "FAILED flush policy round trip of " << file_path << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // After a sync flush the file decodes up to the last byte written, while the
+  // stream is still open.
+  template <typename InT, typename OutT, typename OptionsT>
+  static bool visible_after_flush(const std::string& file_path, const std::string& contents)
+  {
+    OptionsT opts;
+    opts.on_flush = sw::flush_mode::sync;
+    OutT os(file_path, opts);
+    std::size_t written = 0;
+    for (std::size_t chunk = 1000; written + chunk <= contents.size(); chunk *= 7)
+    {
+      os.write(&contents[written], chunk);
+      written += chunk;
+      os.flush();
+
+      InT is(file_path);
+      std::string found;
+      std::istreambuf_iterator<char> it(is), end;
+      while (found.size() < written && it != end)
+        found.push_back(*it++);
+      if (found != contents.substr(0, written))
+      {
+        std::cerr << "FAILED to read flushed data of " << file_path << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+class incompressible_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string noise(64 * 1024, '\0');
+    for (char& c : noise)
+      c = char(rg());
+    std::string text;
+    for (std::size_t i = 0; text.size() < 64 * 1024; ++i)
+    {
+      text += std::to_string(rg() % 1000);
+      text.push_back(i % 16 ? ' ' : '\n');
+    }
+    std::string repeated;
+    while (repeated.size() < 64 * 1024)
+      repeated += noise.substr(0, 1024);
+
+    if (!sw::detail::looks_incompressible(reinterpret_cast<const std::uint8_t*>(noise.data()), noise.size())
+      || sw::detail::looks_incompressible(reinterpret_cast<const std::uint8_t*>(text.data()), text.size())
+      || sw::detail::looks_incompressible(reinterpret_cast<const std::uint8_t*>(repeated.data()), repeated.size())
+      || sw::detail::looks_incompressible(reinterpret_cast<const std::uint8_t*>(noise.data()), 1000))
+    {
+      std::cerr << "FAILED incompressible probe" << std::endl;
+      return false;
+    }
+
+    // Random runs, each followed by text, written with flushes in between.
+    std::string contents;
+    for (std::size_t i = 0; i < 8; ++i)
+      contents += noise.substr(0, (i + 1) * 8192) + text;
+
+    return round_trip<sw::gz::istream, sw::gz::ostream>("test_incompressible_file.txt.gz", contents)
+      && round_trip<sw::bgzf::istream, sw::bgzf::ostream>("test_incompressible_file.txt.bgzf", contents)
+      && round_trip<sw::zstd::istream, sw::zstd::ostream>("test_incompressible_file.txt.zst", contents)
+      && round_trip<sw::zstd::parallel_istream, sw::zstd::ostream>("test_incompressible_file.txt.zst", contents, false)
+      && round_trip<sw::gz::istream, sw::gz::ostream>("test_incompressible_noise_file.gz", noise + noise)
+      && round_trip<sw::bgzf::istream, sw::bgzf::ostream>("test_incompressible_noise_file.bgzf", noise + noise)
+      && round_trip<sw::zstd::istream, sw::zstd::ostream>("test_incompressible_noise_file.zst", noise + noise);
+  }
+
+private:
+  template <typename InT, typename OutT>
+  static bool round_trip(const std::string& file_path, const std::string& contents, bool write = true)
+  {
+    if (write)
+    {
+      OutT os(file_path);
+      for (std::size_t pos = 0; pos < contents.size() && os.good(); pos += 50000)
+      {
+        os.write(&contents[pos], std::min<std::size_t>(50000, contents.size() - pos));
+        os.flush();
+      }
+    }
+
+    InT is(file_path);
+    if (std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>()) != contents)
+    {
+      std::cerr << "FAILED incompressible round trip of " << file_path << std::endl;
+      return false;
+    }
+
+    // Stored pieces cost a few header bytes each, on top of the input.
+    struct stat st;
+    if (stat(file_path.c_str(), &st) != 0 || std::size_t(st.st_size) > contents.size() + contents.size() / 100 + 1024)
+    {
+      std::cerr << "FAILED incompressible data grew " << file_path << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+class zstd_dictionary_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::vector<std::string> records;
+    for (std::size_t i = 0; i < 4000; ++i)
+    {
+      records.push_back("{\"id\":" + std::to_string(i) + ",\"user\":\"user" + std::to_string(rg() % 500)
+        + "\",\"status\":\"" + (rg() % 2 ? "active" : "suspended") + "\",\"score\":" + std::to_string(rg() % 10000)
+        + ",\"tags\":[\"alpha\",\"beta\"],\"region\":\"eu-west-" + std::to_string(rg() % 3) + "\"}\n");
+    }
+
+    std::vector<char> content;
+    if (!sw::zstd::train_dictionary(std::vector<std::string>(records.begin(), records.begin() + 1000), content, 16 * 1024))
+    {
+      std::cerr << "FAILED to train a dictionary" << std::endl;
+      return false;
+    }
+    sw::zstd::dictionary dict(content, 3);
+    if (!dict || !dict.id())
+    {
+      std::cerr << "FAILED to digest the dictionary" << std::endl;
+      return false;
+    }
+
+    std::string expected;
+    for (auto it = records.begin(); it != records.end(); ++it)
+      expected += *it;
+
+    // Streams on several threads share the digested dictionary.
+    std::vector<std::thread> writers;
+    for (std::size_t i = 0; i < 3; ++i)
+    {
+      writers.emplace_back([&records, &dict, i]()
+      {
+        sw::zstd::obuf_options opts;
+        opts.dict = i ? dict : sw::zstd::dictionary();
+        sw::zstd::ostream os("test_dictionary_file_" + std::to_string(i) + ".zst", opts);
+        for (auto it = records.begin(); it != records.end(); ++it)
+        {
+          os << *it;
+          os.flush(); // one frame per record.
+        }
+      });
+    }
+    for (auto it = writers.begin(); it != writers.end(); ++it)
+      it->join();
+
+    struct stat plain, with_dict;
+    if (stat("test_dictionary_file_0.zst", &plain) || stat("test_dictionary_file_1.zst", &with_dict) || with_dict.st_size >= plain.st_size)
+    {
+      std::cerr << "FAILED dictionary did not shrink small frames" << std::endl;
+      return false;
+    }
+
+    sw::zstd::dictionary_registry registry;
+    if (registry.add(sw::zstd::dictionary()) || !registry.add(dict))
+    {
+      std::cerr << "FAILED dictionary registry add" << std::endl;
+      return false;
+    }
+
+    sw::zstd::ibuf_options opts;
+    opts.dictionaries = &registry;
+    sw::zstd::parallel_ibuf_options parallel_opts;
+    parallel_opts.dictionaries = &registry;
+    parallel_opts.thread_count = 2;
+    for (std::size_t i = 0; i < 3; ++i)
+    {
+      std::string file_path = "test_dictionary_file_" + std::to_string(i) + ".zst";
+      sw::zstd::istream is(file_path, opts);
+      sw::zstd::parallel_istream pis(file_path, parallel_opts);
+      if (std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>()) != expected
+        || std::string((std::istreambuf_iterator<char>(pis)), std::istreambuf_iterator<char>()) != expected)
+      {
+        std::cerr << "FAILED to read " << file_path << " with the dictionary registry" << std::endl;
+        return false;
+      }
+    }
+
+    // Frames naming a dictionary that can't be resolved fail to decode.
+    {
+      sw::zstd::istream is("test_dictionary_file_1.zst");
+      if (std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>()) == expected)
+      {
+        std::cerr << "FAILED read dictionary frames without the dictionary" << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+class zstd_long_range_test
+{
+public:
+  bool operator()()
+  {
+    // A random chunk repeated 3 MB later, beyond the level 3 window of 2 MB.
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string chunk(3 * 1024 * 1024, '\0');
+    for (char& c : chunk)
+      c = char(rg());
+    std::string contents = chunk + chunk;
+
+    sw::zstd::obuf_options opts;
+    write("test_long_range_plain_file.zst", contents, opts);
+    opts.long_distance_matching = true;
+    opts.window_log = 23;
+    write("test_long_range_file.zst", contents, opts);
+
+    struct stat plain, ldm;
+    if (stat("test_long_range_plain_file.zst", &plain) || stat("test_long_range_file.zst", &ldm) || ldm.st_size > plain.st_size * 6 / 10)
+    {
+      std::cerr << "FAILED long distance matching missed the repeat" << std::endl;
+      return false;
+    }
+
+    std::uint64_t window_size = 0;
+    FILE* fp = fopen("test_long_range_file.zst", "rb");
+    bool scanned = sw::zstd::scan_window_size(fp, window_size);
+    if (fp)
+      fclose(fp);
+    if (!scanned || window_size != (1u << 23))
+    {
+      std::cerr << "FAILED scan_window_size reported " << window_size << std::endl;
+      return false;
+    }
+
+    sw::zstd::ibuf_options iopts;
+    if (read("test_long_range_file.zst", iopts) != contents)
+    {
+      std::cerr << "FAILED long distance round trip" << std::endl;
+      return false;
+    }
+
+    // Readers limited below the recorded window refuse the frames.
+    iopts.window_log_max = 22;
+    if (read("test_long_range_file.zst", iopts) == contents)
+    {
+      std::cerr << "FAILED window_log_max did not limit the window" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+private:
+  static void write(const std::string& file_path, const std::string& contents, const sw::zstd::obuf_options& opts)
+  {
+    sw::zstd::ostream os(file_path, opts);
+    os.write(contents.data(), contents.size());
+  }
+
+  static std::string read(const std::string& file_path, const sw::zstd::ibuf_options& opts)
+  {
+    sw::zstd::istream is(file_path, opts);
+    return std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+  }
+};
+
+class xz_options_test
+{
+public:
+  bool operator()()
+  {
+    // 16-bit samples of a random walk, which the delta filter turns into small steps.
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string samples;
+    std::int16_t v = 0;
+    for (std::size_t i = 0; i < 512 * 1024; ++i)
+    {
+      v = std::int16_t(v + int(rg() % 7) - 3);
+      samples.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    sw::xz::obuf_options opts;
+    if (!round_trip("test_xz_options_plain_file.xz", samples, opts))
+      return false;
+    opts.filters.push_back(LZMA_FILTER_DELTA);
+    opts.delta_distance = 2;
+    if (!round_trip("test_xz_options_delta_file.xz", samples, opts))
+      return false;
+
+    struct stat plain, delta;
+    if (stat("test_xz_options_plain_file.xz", &plain) || stat("test_xz_options_delta_file.xz", &delta) || delta.st_size >= plain.st_size)
+    {
+      std::cerr << "FAILED delta filter did not help 16-bit samples" << std::endl;
+      return false;
+    }
+
+    opts = sw::xz::obuf_options();
+    opts.preset = 1 | LZMA_PRESET_EXTREME;
+    opts.filters.push_back(LZMA_FILTER_X86);
+    opts.dict_size = 1 << 16;
+    if (!round_trip("test_xz_options_x86_file.xz", samples, opts))
+      return false;
+
+    // Fixed-size blocks, seekable without flushes.
+    opts = sw::xz::obuf_options();
+    opts.block_size = 64 * 1024;
+    if (!round_trip("test_xz_options_blocks_file.xz", samples, opts))
+      return false;
+
+    std::vector<sw::block_info> blocks;
+    FILE* fp = fopen("test_xz_options_blocks_file.xz", "rb");
+    bool scanned = sw::xz::scan_blocks(fp, blocks);
+    if (fp)
+      fclose(fp);
+    if (!scanned || blocks.size() != samples.size() / opts.block_size)
+    {
+      std::cerr << "FAILED xz block size gave " << blocks.size() << " blocks" << std::endl;
+      return false;
+    }
+
+    sw::xz::istream is("test_xz_options_blocks_file.xz");
+    for (std::size_t i = 0; i < 8; ++i)
+    {
+      std::size_t pos = rg() % (samples.size() - 100);
+      std::string found(100, '\0');
+      is.seekg(pos);
+      is.read(&found[0], found.size());
+      if (!is.good() || found != samples.substr(pos, found.size()))
+      {
+        std::cerr << "FAILED seek in fixed-size xz blocks" << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+private:
+  static bool round_trip(const std::string& file_path, const std::string& contents, const sw::xz::obuf_options& opts)
+  {
+    {
+      sw::xz::ostream os(file_path, opts);
+      os.write(contents.data(), contents.size());
+      os.flush(); // a sync flush, which ends a fixed-size block early.
+      if (!os.good())
+      {
+        std::cerr << "FAILED to write " << file_path << std::endl;
+        return false;
+      }
+    }
+
+    sw::xz::istream is(file_path);
+    if (std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>()) != contents)
+    {
+      std::cerr << "FAILED xz options round trip of " << file_path << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+class seek_point_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string contents;
+    for (std::size_t i = 0; contents.size() < 1024 * 1024; ++i)
+      contents += "record " + std::to_string(i) + " " + std::string(rg() % 200, char('a' + rg() % 26)) + "\n";
+
+    const std::uint64_t interval = 100000;
+    for (int delimiter : {-1, int('\n')})
+    {
+      std::string suffix = delimiter < 0 ? "" : "_records";
+      if (!check_blocks(write<sw::gz::ostream, sw::gz::obuf_options>("test_seek_point_file" + suffix + ".gz", contents, interval, delimiter, sw::flush_mode::sync), contents, interval, delimiter, "gz")
+        || !check_blocks(write<sw::xz::ostream, sw::xz::obuf_options>("test_seek_point_file" + suffix + ".xz", contents, interval, delimiter, sw::flush_mode::sync), contents, interval, delimiter, "xz")
+        || !check_blocks(write<sw::zstd::ostream, sw::zstd::obuf_options>("test_seek_point_file" + suffix + ".zst", contents, interval, delimiter, sw::flush_mode::sync), contents, interval, delimiter, "zstd"))
+        return false;
+    }
+    return true;
+  }
+
+private:
+  // Writes in odd-sized pieces, flushing now and then, and returns the
+  // decoded contents of each block.
+  template <typename OutT, typename OptionsT>
+  static std::vector<std::string> write(const std::string& file_path, const std::string& contents, std::uint64_t interval, int delimiter, sw::flush_mode on_flush)
+  {
+    {
+      OptionsT opts;
+      opts.seek_point_interval = interval;
+      opts.seek_point_delimiter = delimiter;
+      opts.on_flush = on_flush;
+      OutT os(file_path, opts);
+      for (std::size_t pos = 0; pos < contents.size() && os.good(); pos += 7777)
+      {
+        os.write(&contents[pos], std::min<std::size_t>(7777, contents.size() - pos));
+        if (pos % 233310 == 0)
+          os.flush();
+      }
+    }
+
+    std::vector<std::string> ret;
+    std::vector<sw::block_info> splits = sw::make_splits(file_path, 1000);
+    if (splits.size() == 1 && file_path.substr(file_path.size() - 3) == ".gz")
+      return gz_members(file_path);
+    for (auto it = splits.begin(); it != splits.end(); ++it)
+    {
+      sw::split_istream is(file_path, *it);
+      ret.push_back(std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>()));
+    }
+    return ret;
+  }
+
+  // Plain gzip can't be split, so its members are inflated one by one.
+  static std::vector<std::string> gz_members(const std::string& file_path)
+  {
+    std::ifstream ifs(file_path, std::ios::binary);
+    std::string compressed((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    std::vector<std::string> ret;
+    z_stream zs = z_stream();
+    if (inflateInit2(&zs, 15 | 16) != Z_OK)
+      return ret;
+    zs.next_in = (Bytef*) compressed.data();
+    zs.avail_in = uInt(compressed.size());
+    std::vector<char> buf(64 * 1024);
+    std::string member;
+    int res = Z_OK;
+    while (res == Z_OK && (zs.avail_in || !member.empty()))
+    {
+      zs.next_out = (Bytef*) buf.data();
+      zs.avail_out = uInt(buf.size());
+      res = inflate(&zs, Z_NO_FLUSH);
+      member.append(buf.data(), buf.size() - zs.avail_out);
+      if (res == Z_STREAM_END)
+      {
+        ret.push_back(member);
+        member.clear();
+        res = inflateReset(&zs);
+      }
+    }
+    inflateEnd(&zs);
+    return ret;
+  }
+
+  static bool check_blocks(const std::vector<std::string>& blocks, const std::string& contents, std::uint64_t interval, int delimiter, const std::string& name)
+  {
+    std::string joined;
+    for (std::size_t i = 0; i < blocks.size(); ++i)
+    {
+      joined += blocks[i];
+      bool last = i + 1 == blocks.size();
+      if ((!last && blocks[i].size() > interval * 2) || (delimiter >= 0 && blocks[i].back() != char(delimiter)))
+      {
+        std::cerr << "FAILED " << name << " block " << i << " of " << blocks[i].size() << " bytes" << std::endl;
+        return false;
+      }
+    }
+
+    if (joined != contents || blocks.size() < contents.size() / interval)
+    {
+      std::cerr << "FAILED " << name << " seek points gave " << blocks.size() << " blocks" << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+class gz_parallel_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    // Stored blocks copy the fake member headers into the compressed data.
+    const std::string fake_header("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\x03", 10);
+    std::string expected;
+    for (std::size_t i = 0; expected.size() < 2 * 1024 * 1024; ++i)
+    {
+      expected += std::to_string(rg() % 100000);
+      expected.push_back(i % 12 ? ',' : '\n');
+      if (i % 5000 == 0)
+        expected += fake_header;
+    }
+
+    {
+      sw::gz::obuf_options opts;
+      opts.seek_point_interval = 40000;
+      sw::gz::ostream os("test_gz_parallel_file.gz", opts);
+      os.write(expected.data(), expected.size());
+    }
+    {
+      sw::gz::obuf_options opts;
+      opts.compression_level = 0;
+      opts.detect_incompressible = false;
+      sw::gz::ostream os("test_gz_parallel_stored_file.gz", opts);
+      os.write(expected.data(), expected.size() / 2);
+    }
+    {
+      // Members appended with cat, the first one stored.
+      sw::gz::ostream os("test_gz_parallel_single_file.gz");
+      os.write(expected.data() + expected.size() / 2, expected.size() - expected.size() / 2);
+    }
+    std::string concatenated = read_file("test_gz_parallel_stored_file.gz") + read_file("test_gz_parallel_single_file.gz");
+    std::ofstream("test_gz_parallel_cat_file.gz", std::ios::binary).write(concatenated.data(), concatenated.size());
+    std::string zeros(8 * 1024 * 1024, '\0');
+    {
+      // A member that inflates far past max_chunk_output, between two others.
+      sw::gz::ostream os("test_gz_parallel_zeros_member.gz");
+      os.write(zeros.data(), zeros.size());
+    }
+    std::string with_zeros = read_file("test_gz_parallel_stored_file.gz") + read_file("test_gz_parallel_zeros_member.gz") + read_file("test_gz_parallel_single_file.gz");
+    std::ofstream("test_gz_parallel_zeros_file.gz", std::ios::binary).write(with_zeros.data(), with_zeros.size());
+    std::string expected_with_zeros = expected.substr(0, expected.size() / 2) + zeros + expected.substr(expected.size() / 2);
+
+    std::string multi_member = read_file("test_gz_parallel_file.gz");
+    std::ofstream("test_gz_parallel_truncated_file.gz", std::ios::binary).write(multi_member.data(), multi_member.size() - 100);
+    std::ofstream("test_gz_parallel_garbage_file.gz", std::ios::binary).write((multi_member + "garbage").data(), multi_member.size() + 7);
+
+    for (std::size_t chunk_size : {std::size_t(1024), std::size_t(256 * 1024)})
+    {
+      sw::gz::parallel_ibuf_options opts;
+      opts.thread_count = 3;
+      opts.chunk_size = chunk_size;
+      if (!read("test_gz_parallel_file.gz", opts, expected, false)
+        || !read("test_gz_parallel_cat_file.gz", opts, expected, false)
+        || !read("test_gz_parallel_truncated_file.gz", opts, expected, true)
+        || !read("test_gz_parallel_garbage_file.gz", opts, expected, true))
+        return false;
+
+      opts.max_chunk_output = 64 * 1024;
+      if (!read("test_gz_parallel_file.gz", opts, expected, false)
+        || !read("test_gz_parallel_zeros_file.gz", opts, expected_with_zeros, false))
+        return false;
+    }
+    return true;
+  }
+
+private:
+  // Damaged files read as a prefix of what the serial reader returns, with failed() set.
+  static bool read(const std::string& file_path, const sw::gz::parallel_ibuf_options& opts, const std::string& expected, bool damaged)
+  {
+    sw::gz::parallel_istream is(file_path, opts);
+    std::string found((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    if (damaged)
+    {
+      sw::gz::istream serial(file_path);
+      std::string serial_found((std::istreambuf_iterator<char>(serial)), std::istreambuf_iterator<char>());
+      if (!is.failed() || serial_found.compare(0, found.size(), found) != 0 || found.size() + 64 * 1024 < serial_found.size())
+      {
+        std::cerr << "FAILED damaged " << file_path << " read " << found.size() << " of " << serial_found.size() << " bytes" << std::endl;
+        return false;
+      }
+    }
+    else if (is.failed() || found != expected)
+    {
+      std::cerr << "FAILED parallel gz read of " << file_path << " (chunk size " << opts.chunk_size << ")" << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
+class gz_speculative_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::vector<std::string> words;
+    for (std::size_t i = 0; i < 2000; ++i)
+      words.push_back(std::to_string(rg()) + (i % 3 ? "abc" : "xyz"));
+
+    std::string expected;
+    for (std::size_t i = 0; expected.size() < 2 * 1024 * 1024; ++i)
+    {
+      expected += words[rg() % words.size()];
+      expected.push_back(i % 12 ? ' ' : '\n');
+    }
+    // Random runs are written as stored blocks in the middle of the member.
+    std::string mixed = expected.substr(0, expected.size() / 2);
+    for (std::size_t i = 0; i < 8; ++i)
+    {
+      for (std::size_t j = 0; j < 100 * 1024; ++j)
+        mixed.push_back(char(rg()));
+      mixed += expected.substr(i * 100 * 1024, 100 * 1024);
+    }
+
+    std::vector<std::pair<std::string, std::string>> files;
+    for (int level : {1, 6, 9})
+    {
+      sw::gz::obuf_options opts;
+      opts.compression_level = level;
+      files.emplace_back("test_gz_speculative_file_" + std::to_string(level) + ".gz", expected);
+      sw::gz::ostream os(files.back().first, opts);
+      os.write(expected.data(), expected.size());
+    }
+    {
+      files.emplace_back("test_gz_speculative_mixed_file.gz", mixed);
+      sw::gz::ostream os(files.back().first);
+      os.write(mixed.data(), mixed.size());
+    }
+    std::string concatenated = read_file(files[0].first) + read_file(files[3].first);
+    std::ofstream("test_gz_speculative_cat_file.gz", std::ios::binary).write(concatenated.data(), concatenated.size());
+    files.emplace_back("test_gz_speculative_cat_file.gz", expected + mixed);
+
+    std::string single = read_file(files[1].first);
+    std::ofstream("test_gz_speculative_truncated_file.gz", std::ios::binary).write(single.data(), single.size() - 1000);
+    std::ofstream("test_gz_speculative_garbage_file.gz", std::ios::binary).write((single + "garbage").data(), single.size() + 7);
+    single[single.size() - 6] ^= 1; // ISIZE
+    std::ofstream("test_gz_speculative_bad_size_file.gz", std::ios::binary).write(single.data(), single.size());
+
+    sw::gz::ibuf_options opts;
+    opts.speculative_threads = 3;
+    for (std::size_t chunk_size : {std::size_t(64 * 1024), std::size_t(300 * 1024)})
+    {
+      opts.speculative_chunk_size = chunk_size;
+      for (auto it = files.begin(); it != files.end(); ++it)
+      {
+        std::size_t chunks_used = 0;
+        if (read(it->first, opts, &chunks_used) != it->second || chunks_used == 0)
+        {
+          std::cerr << "FAILED speculative gz read of " << it->first << " (chunk size " << chunk_size << ", " << chunks_used << " chunks used)" << std::endl;
+          return false;
+        }
+      }
+
+      // Chunks, buffers and zlib's state come from the stream's resource.
+      counting_resource resource;
+      opts.resource = &resource;
+      bool read_ok = read(files[0].first, opts) == files[0].second;
+      opts.resource = nullptr;
+      if (!read_ok || resource.allocations < 2 * files.size() || resource.outstanding != 0)
+      {
+        std::cerr << "FAILED speculative gz read through a memory resource (" << resource.allocations << " allocations)" << std::endl;
+        return false;
+      }
+
+      // Damaged files read as a prefix of the data, at least as far as the
+      // serial reader gets; it drops its last buffer on an error.
+      for (const char* file_path : {"test_gz_speculative_truncated_file.gz", "test_gz_speculative_garbage_file.gz", "test_gz_speculative_bad_size_file.gz"})
+      {
+        std::string found = read(file_path, opts);
+        if (expected.compare(0, found.size(), found) != 0 || found.size() < read(file_path, sw::gz::ibuf_options()).size())
+        {
+          std::cerr << "FAILED damaged " << file_path << " read " << found.size() << " bytes" << std::endl;
+          return false;
+        }
+      }
+    }
+
+    // 64 MiB of zeros deflate to one 64 KiB chunk. Held as markers it would
+    // take 192 MiB, so the chunk is left to zlib and the text chunks are used.
+    std::string zeros_expected = expected.substr(0, expected.size() / 2) + std::string(64 * 1024 * 1024, '\0') + expected.substr(expected.size() / 2);
+    {
+      sw::gz::ostream os("test_gz_speculative_zeros_file.gz");
+      os.write(zeros_expected.data(), zeros_expected.size());
+    }
+    counting_resource resource;
+    opts.resource = &resource;
+    opts.speculative_chunk_size = 64 * 1024;
+    std::size_t chunks_used = 0;
+    bool zeros_ok = read("test_gz_speculative_zeros_file.gz", opts, &chunks_used) == zeros_expected;
+    if (!zeros_ok || chunks_used == 0 || resource.peak > 32 * 1024 * 1024)
+    {
+      std::cerr << "FAILED speculative gz read of a highly compressible member (" << chunks_used << " chunks used, peak " << resource.peak << " bytes)" << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+private:
+  static std::string read(const std::string& file_path, const sw::gz::ibuf_options& opts, std::size_t* chunks_used = nullptr)
+  {
+    sw::gz::ibuf sbuf(file_path, opts);
+    std::istream is(&sbuf);
+    std::string ret((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    if (chunks_used)
+      *chunks_used = sbuf.speculative_chunks_used();
+    return ret;
+  }
+};
+
+class bz2_parallel_test
+{
+public:
+  bool operator()()
+  {
+    std::mt19937 rg(std::uint32_t(std::chrono::system_clock::now().time_since_epoch().count()));
+    std::string expected;
+    for (std::size_t i = 0; i < 400000; ++i)
+    {
+      expected += std::to_string(rg() % 100000);
+      expected.push_back(i % 12 ? ',' : '\n');
+    }
+
+    {
+      // 100k chunks, so that several are compressed at once, cut short by random flushes.
+      sw::bz2::obuf_options opts;
+      opts.thread_count = 3;
+      opts.block_size = 1;
+      sw::bz2::ostream os("test_bz2_parallel_file.txt.bz2", opts);
+      for (std::size_t pos = 0; pos < expected.size() && os.good(); pos += 1000)
+      {
+        os.write(&expected[pos], std::min<std::size_t>(1000, expected.size() - pos));
+        if (rg() % 200 == 0)
+          os.flush();
+      }
+    }
+
+    {
+      // A single stream of many blocks, whose magics are not byte aligned.
+      std::vector<char> compressed(expected.size() + expected.size() / 100 + 600);
+      unsigned int compressed_size = unsigned(compressed.size());
+      if (BZ2_bzBuffToBuffCompress(compressed.data(), &compressed_size, &expected[0], unsigned(expected.size()), 1, 0, 0) != BZ_OK)
+      {
+        std::cerr << "FAILED to write test_bz2_single_stream_file.txt.bz2" << std::endl;
+        return false;
+      }
+      std::ofstream ofs("test_bz2_single_stream_file.txt.bz2", std::ios::binary);
+      ofs.write(compressed.data(), compressed_size);
+    }
+
+    const char* files[] = {"test_bz2_parallel_file.txt.bz2", "test_bz2_single_stream_file.txt.bz2"};
+    for (std::size_t i = 0; i < 2; ++i)
+    {
+      sw::bz2::ibuf_options opts;
+      opts.thread_count = 3;
+      opts.max_blocks_in_flight = 4;
+      sw::bz2::istream is(files[i], opts);
+      std::string found((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+      if (found != expected || is.failed())
+      {
+        std::cerr << "FAILED parallel read of " << files[i] << std::endl;
+        return false;
+      }
+
+      sw::istream generic_is(files[i]);
+      if (std::string((std::istreambuf_iterator<char>(generic_is)), std::istreambuf_iterator<char>()) != expected)
+      {
+        std::cerr << "FAILED generic read of " << files[i] << std::endl;
+        return false;
+      }
+    }
+
+    if (!false_magic(rg))
+      return false;
+
+    std::string contents;
+    {
+      std::ifstream src("test_bz2_single_stream_file.txt.bz2", std::ios::binary);
+      contents.assign((std::istreambuf_iterator<char>(src)), std::istreambuf_iterator<char>());
+    }
+
+    {
+      std::ofstream truncated("test_bz2_truncated_file.txt.bz2", std::ios::binary);
+      truncated.write(contents.data(), contents.size() - 10);
+    }
+
+    {
+      std::string corrupt = contents;
+      corrupt[corrupt.size() / 2] ^= 0x10;
+      std::ofstream ofs("test_bz2_corrupt_file.txt.bz2", std::ios::binary);
+      ofs.write(corrupt.data(), corrupt.size());
+    }
+
+    const char* bad_files[] = {"test_bz2_truncated_file.txt.bz2", "test_bz2_corrupt_file.txt.bz2"};
+    for (std::size_t i = 0; i < 2; ++i)
+    {
+      sw::bz2::istream is(bad_files[i]);
+      std::string found((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+      if (!is.failed() || found.size() >= expected.size() || expected.compare(0, found.size(), found) != 0)
+      {
+        std::cerr << "FAILED to detect damage in " << bad_files[i] << std::endl;
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+private:
+  // Each block's table of used byte values (16 bits of used ranges, then 16
+  // bits per used range) spells out the block magic when only these bytes
+  // occur, so every block holds a false block boundary 121 bits in.
+  static bool false_magic(std::mt19937& rg)
+  {
+    const std::uint16_t used[] = {0x3141, 0x5926, 0x5359};
+    std::vector<char> symbols;
+    for (unsigned range = 0; range < 3; ++range)
+    {
+      for (unsigned bit = 0; bit < 16; ++bit)
+      {
+        if (used[range] & (0x8000 >> bit))
+          symbols.push_back(char(range * 16 + bit));
+      }
+    }
+
+    std::string expected;
+    while (expected.size() < 300000)
+    {
+      char c = symbols[rg() % symbols.size()];
+      if (expected.empty() || c != expected.back()) // no runs, whose lengths would add byte values.
+        expected.push_back(c);
+    }
+
+    std::vector<char> compressed(expected.size() + expected.size() / 100 + 600);
+    unsigned int compressed_size = unsigned(compressed.size());
+    if (BZ2_bzBuffToBuffCompress(compressed.data(), &compressed_size, &expected[0], unsigned(expected.size()), 1, 0, 0) != BZ_OK)
+    {
+      std::cerr << "FAILED to write test_bz2_false_magic_file.bz2" << std::endl;
+      return false;
+    }
+    {
+      std::ofstream ofs("test_bz2_false_magic_file.bz2", std::ios::binary);
+      ofs.write(compressed.data(), compressed_size);
+    }
+
+    sw::bz2::ibuf_options opts;
+    opts.thread_count = 3;
+    sw::bz2::istream is("test_bz2_false_magic_file.bz2", opts);
+    std::string found((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    if (found != expected || is.failed())
+    {
+      std::cerr << "FAILED to join blocks split by a false magic" << std::endl;
+      return false;
+    }
+    return true;
+  }
+};
+
 int main(int argc, char* argv[])
 {
   int ret = -1;
@@ -314,7 +2742,11 @@ int main(int argc, char* argv[])
               && iterator_test<sw::istream, sw::gz::ostream>("test_generic_iterator_file_1024.txt.gz", 1024)()
               && iterator_test<sw::istream, sw::zstd::ostream>("test_generic_iterator_file.txt.zst")()
               && iterator_test<sw::istream, sw::zstd::ostream>("test_generic_iterator_file_512.txt.zst", 512)()
-              && iterator_test<sw::istream, sw::zstd::ostream>("test_generic_iterator_file_1024.txt.zst", 1024)());
+              && iterator_test<sw::istream, sw::zstd::ostream>("test_generic_iterator_file_1024.txt.zst", 1024)()
+              && iterator_test<sw::istream, sw::lz4::ostream>("test_generic_iterator_file.txt.lz4")()
+              && iterator_test<sw::istream, sw::lz4::ostream>("test_generic_iterator_file_512.txt.lz4", 512)()
+              && iterator_test<sw::istream, sw::bz2::ostream>("test_generic_iterator_file.txt.bz2")()
+              && iterator_test<sw::istream, sw::bz2::ostream>("test_generic_iterator_file_512.txt.bz2", 512)());
     else if (sub_command == "generic-seek")
       ret = !(seek_test<sw::istream, sw::xz::ostream>("test_generic_seek_file.txt.xz")()
               && seek_test<sw::istream, sw::xz::ostream>("test_generic_seek_file_512.txt.xz", 512)()
@@ -346,10 +2778,77 @@ int main(int argc, char* argv[])
       ret = !(iterator_test<sw::zstd::istream, sw::zstd::ostream>("test_iterator_file.txt.zst")()
               && iterator_test<sw::zstd::istream, sw::zstd::ostream>("test_iterator_file_512.txt.zst", 512)()
               && iterator_test<sw::zstd::istream, sw::zstd::ostream>("test_iterator_file_1024.txt.zst", 1024)());
+    else if (sub_command == "lz4-iter")
+      ret = !(iterator_test<sw::lz4::istream, sw::lz4::ostream>("test_iterator_file.txt.lz4")()
+              && iterator_test<sw::lz4::istream, sw::lz4::ostream>("test_iterator_file_512.txt.lz4", 512)()
+              && iterator_test<sw::lz4::istream, sw::lz4::ostream>("test_iterator_file_1024.txt.lz4", 1024)());
+    else if (sub_command == "lz4-seek")
+      ret = !(block_seek_test<sw::lz4::istream, sw::lz4::ostream>("test_seek_file.txt.lz4")()
+        && block_seek_test<sw::lz4::istream, sw::lz4::ostream>("test_seek_file_512.txt.lz4", 512)()
+        && block_seek_test<sw::lz4::istream, sw::lz4::ostream>("test_seek_file_1024.txt.lz4", 1024)());
+    else if (sub_command == "lz4-options")
+      ret = !(lz4_options_test()());
+    else if (sub_command == "flush-policy")
+      ret = !(flush_policy_test()());
+    else if (sub_command == "incompressible")
+      ret = !(incompressible_test()());
+    else if (sub_command == "zstd-dictionary")
+      ret = !(zstd_dictionary_test()());
+    else if (sub_command == "zstd-long")
+      ret = !(zstd_long_range_test()());
+    else if (sub_command == "xz-options")
+      ret = !(xz_options_test()());
+    else if (sub_command == "seek-points")
+      ret = !(seek_point_test()());
+    else if (sub_command == "gz-parallel")
+      ret = !(gz_parallel_test()());
+    else if (sub_command == "gz-speculative")
+      ret = !(gz_speculative_test()());
+    else if (sub_command == "bz2-iter")
+      ret = !(iterator_test<sw::bz2::istream, sw::bz2::ostream>("test_iterator_file.txt.bz2")()
+              && iterator_test<sw::bz2::istream, sw::bz2::ostream>("test_iterator_file_512.txt.bz2", 512)()
+              && iterator_test<sw::bz2::istream, sw::bz2::ostream>("test_iterator_file_1024.txt.bz2", 1024)());
+    else if (sub_command == "bz2-parallel")
+      ret = !(bz2_parallel_test()());
     else if (sub_command == "zstd-seek")
       ret = !(block_seek_test<sw::zstd::istream, sw::zstd::ostream>("test_seek_file.txt.zst")()
         && block_seek_test<sw::zstd::istream, sw::zstd::ostream>("test_seek_file_512.txt.zst", 512)()
         && block_seek_test<sw::zstd::istream, sw::zstd::ostream>("test_seek_file_1024.txt.zst", 1024)());
+    else if (sub_command == "batch")
+      ret = !(batch_test()());
+    else if (sub_command == "bgzf-tellp")
+      ret = !(bgzf_tellp_test("test_tellp_file.txt.bgzf")());
+    else if (sub_command == "record-index")
+      ret = !(record_index_test("test_record_index_sorted.txt.bgzf", true)()
+              && record_index_test("test_record_index_unsorted.txt.bgzf", false)()
+              && record_index_test("test_record_index_no_eof.txt.bgzf", true, false)());
+    else if (sub_command == "adaptive-level")
+      ret = !(adaptive_level_test()());
+    else if (sub_command == "transcode")
+      ret = !(transcode_test()());
+    else if (sub_command == "zstd-parallel-read")
+      ret = !(zstd_parallel_read_test()());
+    else if (sub_command == "zstd-offset-seek")
+      ret = !(zstd_offset_seek_test()());
+    else if (sub_command == "record-reader")
+      ret = !(record_reader_test()());
+    else if (sub_command == "map-reduce")
+      ret = !(map_reduce_test()());
+    else if (sub_command == "splits")
+      ret = !(make_splits_test()());
+    else if (sub_command == "stream-move")
+      ret = !(stream_move_test()());
+    else if (sub_command == "memory-resource")
+      ret = !(memory_resource_test()());
+    else if (sub_command == "memory-budget")
+      ret = !(memory_budget_test()());
+    else if (sub_command == "zero-allocation")
+      ret = !(zero_allocation_test()());
+    else if (sub_command == "verify")
+      ret = !(verify_test<sw::bgzf::istream, sw::bgzf::ostream, sw::bgzf::ibuf_options>("test_verify_file.txt.bgzf", 512, 8, sw::bgzf::scan_blocks)()
+              && verify_test<sw::xz::istream, sw::xz::ostream, sw::xz::ibuf_options>("test_verify_file.txt.xz", 512, 1, scan_xz_blocks)()
+              && verify_test<sw::zstd::istream, sw::zstd::ostream, sw::zstd::ibuf_options>("test_verify_file.txt.zst", 512)()
+              && verify_test<sw::gz::istream, sw::gz::ostream, sw::gz::ibuf_options>("test_verify_file.txt.gz", 512)());
   }
 
   return ret;